@@ -0,0 +1,1051 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include <SDL.h>
+
+#include "../crustyvm.h"
+#include "../tilemap.h"
+#include "../synth.h"
+#include "../collide.h"
+
+/* each benchmark is run once to warm up, then this many more times, timing
+ * each.  the fastest and median runs are reported. */
+#define BENCH_REPEATS (7)
+#define BENCH_FRAMES  (600)
+
+#define SURFACE_WIDTH  (640)
+#define SURFACE_HEIGHT (480)
+#define TILE_SIZE      (8)
+#define TILESET_TILES  (16) /* across and down */
+
+#define SYNTH_BUFFER_SIZE (4096)
+
+typedef int (*bench_func_t)(void *priv);
+
+static int firstResult;
+static int failed = 0;
+
+static void vprintf_cb(void *priv, const char *fmt, ...) {
+    va_list ap;
+    FILE *out = priv;
+
+    va_start(ap, fmt);
+    vfprintf(out, fmt, ap);
+    va_end(ap);
+}
+
+static void print_string(const char *str) {
+    unsigned int i;
+
+    putchar('"');
+    for(i = 0; str[i] != '\0'; i++) {
+        if(str[i] == '"' || str[i] == '\\') {
+            putchar('\\');
+        }
+        putchar(str[i]);
+    }
+    putchar('"');
+}
+
+static void begin_result() {
+    if(!firstResult) {
+        printf(",\n");
+    }
+    firstResult = 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return((x > y) - (x < y));
+}
+
+/* func does some amount of work and returns how many operations that was,
+ * ns_per_op is per whatever that means for the benchmark */
+static void run_bench(const char *name,
+                      bench_func_t func,
+                      void *priv,
+                      unsigned int iters) {
+    double result[BENCH_REPEATS];
+    unsigned long long ops = 0;
+    Uint64 start;
+    unsigned int i, j;
+    int ret;
+
+    begin_result();
+    printf("    {\"name\": ");
+    print_string(name);
+
+    if(func(priv) < 0) {
+        goto error;
+    }
+
+    for(i = 0; i < BENCH_REPEATS; i++) {
+        ops = 0;
+        start = SDL_GetPerformanceCounter();
+        for(j = 0; j < iters; j++) {
+            ret = func(priv);
+            if(ret < 0) {
+                goto error;
+            }
+            ops += ret;
+        }
+        result[i] = (double)(SDL_GetPerformanceCounter() - start) *
+                    1000000000.0 /
+                    (double)SDL_GetPerformanceFrequency();
+        if(ops > 0) {
+            result[i] /= (double)ops;
+        }
+    }
+    qsort(result, BENCH_REPEATS, sizeof(double), compare_double);
+
+    printf(", \"ops\": %llu, \"ns_per_op\": {\"min\": %f, \"median\": %f}}",
+           ops, result[0], result[BENCH_REPEATS / 2]);
+    return;
+
+error:
+    fprintf(stderr, "Benchmark %s failed.\n", name);
+    printf(", \"failed\": true}");
+    failed = 1;
+}
+
+/* VM benchmarks.  ITERS is set to the loop count when loading, and the body of
+ * each loop is OPS instructions of the class being measured, so the cost of
+ * the loop itself is spread over them. */
+#define VM_LOOP(DECLS, BODY) \
+    "proc init\n" \
+    "    local i ITERS\n" \
+    DECLS \
+    "    label top\n" \
+    BODY \
+    "        sub i 1\n" \
+    "        jumpn top\n" \
+    "ret\n"
+
+typedef struct {
+    const char *name;
+    const char *program;
+    unsigned int depth; /* calls made by a generated program, see below */
+    unsigned int iters;
+    unsigned int ops;
+} VMBench;
+
+static const VMBench VM_BENCHES[] = {
+    {
+        .name = "vm.move", .iters = 500000, .ops = 8,
+        .program = VM_LOOP(
+            "    local a 1\n"
+            "    local b 2\n",
+            "        move a b\n"
+            "        move b a\n"
+            "        move a b\n"
+            "        move b a\n"
+            "        move a b\n"
+            "        move b a\n"
+            "        move a b\n"
+            "        move b a\n")
+    }, {
+        .name = "vm.arith_int", .iters = 500000, .ops = 8,
+        .program = VM_LOOP(
+            "    local a 1000\n"
+            "    local b 5\n",
+            "        add a 7\n"
+            "        mul a 3\n"
+            "        div a 3\n"
+            "        sub a 7\n"
+            "        add b a\n"
+            "        mod b 13\n"
+            "        mul b 2\n"
+            "        sub b 1\n")
+    }, {
+        .name = "vm.arith_float", .iters = 500000, .ops = 8,
+        .program = VM_LOOP(
+            "    local f floats \"1.5\"\n"
+            "    local g floats \"0.25\"\n",
+            "        add f g\n"
+            "        mul f g\n"
+            "        div f g\n"
+            "        sub f g\n"
+            "        add f g\n"
+            "        mul f g\n"
+            "        div f g\n"
+            "        sub f g\n")
+    }, {
+        .name = "vm.bitwise", .iters = 500000, .ops = 8,
+        .program = VM_LOOP(
+            "    local a 1000\n"
+            "    local b 5\n",
+            "        xor a b\n"
+            "        and a 255\n"
+            "        or a 16\n"
+            "        shl a 2\n"
+            "        shr a 1\n"
+            "        xor a 3\n"
+            "        and a 1023\n"
+            "        shr a 1\n")
+    }, {
+        /* half taken, half not */
+        .name = "vm.cmp_jump", .iters = 500000, .ops = 8,
+        .program = VM_LOOP(
+            "    local a 1\n"
+            "    local b 2\n",
+            "        cmp a b\n"
+            "        jumpz skip1\n"
+            "        label skip1\n"
+            "        cmp a b\n"
+            "        jumpn skip2\n"
+            "        label skip2\n"
+            "        cmp a b\n"
+            "        jumpg skip3\n"
+            "        label skip3\n"
+            "        cmp a b\n"
+            "        jumpl skip4\n"
+            "        label skip4\n")
+    }, {
+        .name = "vm.index", .iters = 500000, .ops = 8,
+        .program = VM_LOOP(
+            "    local arr ints 16\n"
+            "    local j 3\n"
+            "    local k 0\n",
+            "        move arr:j j\n"
+            "        add arr:j 1\n"
+            "        move k arr:j\n"
+            "        and k 15\n"
+            "        move arr:k k\n"
+            "        add arr:k arr:j\n"
+            "        move j arr:k\n"
+            "        and j 15\n")
+    }, {
+        .name = "vm.callback", .iters = 500000, .ops = 8,
+        .program = VM_LOOP(
+            "    local a 1\n",
+            "        move sink a\n"
+            "        move a source\n"
+            "        move sink a\n"
+            "        move a source\n"
+            "        move sink a\n"
+            "        move a source\n"
+            "        move sink a\n"
+            "        move a source\n")
+    },
+    /* per call and its return.  procedures can't recurse, so these are
+     * generated */
+    {
+        .name = "vm.call_depth_1", .iters = 500000, .ops = 1, .depth = 1,
+        .program = NULL
+    }, {
+        .name = "vm.call_depth_16", .iters = 50000, .ops = 16, .depth = 16,
+        .program = NULL
+    }, {
+        .name = "vm.call_depth_128", .iters = 5000, .ops = 128, .depth = 128,
+        .program = NULL
+    },
+    /* the array ones are per element moved */
+    {
+        .name = "vm.array_element", .iters = 10000, .ops = 256,
+        .program =
+            "static a ints 256\n"
+            "static b ints 256\n"
+            VM_LOOP(
+            "    local j 0\n",
+            "        move j 0\n"
+            "        label elem\n"
+            "            move a:j b:j\n"
+            "            add j 1\n"
+            "            cmp j 256\n"
+            "            jumpl elem\n")
+    }, {
+        .name = "vm.array_copy", .iters = 100000, .ops = 256,
+        .program =
+            "static a ints 256\n"
+            "static b ints 256\n"
+            VM_LOOP("",
+            "        copy a b 256\n")
+    }, {
+        .name = "vm.array_fill", .iters = 100000, .ops = 256,
+        .program =
+            "static a ints 256\n"
+            VM_LOOP("",
+            "        fill a 7 256\n")
+    }, {
+        .name = "vm.array_vadd", .iters = 100000, .ops = 256,
+        .program =
+            "static a floats 256\n"
+            "static b floats 256\n"
+            VM_LOOP("",
+            "        vadd a b 256\n")
+    }
+};
+#define VM_BENCH_COUNT (sizeof(VM_BENCHES) / sizeof(VMBench))
+
+typedef struct {
+    CrustyVM *cvm;
+    unsigned int ops;
+} VMRun;
+
+static int vm_sink(void *priv,
+                   CrustyType type,
+                   unsigned int size,
+                   void *ptr,
+                   unsigned int index) {
+    return(0);
+}
+
+static int vm_source(void *priv, void *val, unsigned int index) {
+    *(int *)val = index;
+
+    return(0);
+}
+
+static const CrustyCallback VM_CALLBACKS[] = {
+    {
+        .name = "sink", .length = 1, .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = vm_sink, .writepriv = NULL
+    }, {
+        .name = "source", .length = 1, .readType = CRUSTY_TYPE_INT,
+        .read = vm_source, .readpriv = NULL,
+        .write = NULL, .writepriv = NULL
+    }
+};
+#define VM_CALLBACK_COUNT (sizeof(VM_CALLBACKS) / sizeof(CrustyCallback))
+
+static int vm_run(void *priv) {
+    VMRun *run = priv;
+
+    if(crustyvm_run(run->cvm, "init") < 0) {
+        crustyvm_debugtrace(run->cvm, 0);
+        return(-1);
+    }
+
+    return(run->ops);
+}
+
+/* a chain of depth procedures each calling the next, called from the loop */
+static char *call_program(unsigned int depth) {
+    char *program;
+    unsigned int len = 0;
+    unsigned int size;
+    unsigned int i;
+
+    size = (depth + 1) * 64 + strlen(VM_LOOP("", ""));
+    program = malloc(size);
+    if(program == NULL) {
+        fprintf(stderr, "Failed to allocate memory for program.\n");
+        return(NULL);
+    }
+
+    len += snprintf(&(program[len]), size - len, "proc call0\nret\n");
+    for(i = 1; i < depth; i++) {
+        len += snprintf(&(program[len]), size - len,
+                        "proc call%u\n    call call%u\nret\n", i, i - 1);
+    }
+    snprintf(&(program[len]), size - len,
+             VM_LOOP("", "        call call%u\n"), depth - 1);
+
+    return(program);
+}
+
+static void vm_bench(const VMBench *b, unsigned int flags, const char *suffix) {
+    const char *var[] = {"ITERS"};
+    const char *value[1];
+    char iters[16];
+    char name[64];
+    const char *text;
+    char *program = NULL;
+    VMRun run;
+
+    snprintf(iters, sizeof(iters), "%u", b->iters);
+    value[0] = iters;
+    snprintf(name, sizeof(name), "%s%s", b->name, suffix);
+
+    run.cvm = NULL;
+    text = b->program;
+    if(b->depth > 0) {
+        program = call_program(b->depth);
+        text = program;
+    }
+    if(text != NULL) {
+        run.cvm = crustyvm_new(b->name, NULL,
+                               text, strlen(text),
+                               flags,
+                               0,
+                               VM_CALLBACKS, VM_CALLBACK_COUNT,
+                               var, value, 1,
+                               vprintf_cb, stderr);
+    }
+    free(program);
+    if(run.cvm == NULL) {
+        begin_result();
+        printf("    {\"name\": ");
+        print_string(name);
+        printf(", \"failed\": true}");
+        fprintf(stderr, "Failed to load %s.\n", b->name);
+        failed = 1;
+        return;
+    }
+    run.ops = b->iters * b->ops;
+
+    run_bench(name, vm_run, &run, 1);
+
+    crustyvm_free(run.cvm);
+}
+
+/* tilemap benchmarks, drawn with the software renderer in to a surface so no
+ * window or video driver is needed */
+typedef enum {
+    ATTRS_NONE,
+    ATTRS_FLIP,
+    ATTRS_ROTATE,
+    ATTRS_COLORMOD,
+    ATTRS_ALL,
+    ATTRS_COUNT
+} TilemapAttrs;
+
+static const char *ATTRS_NAMES[ATTRS_COUNT] = {
+    "none", "flip", "rotate", "colormod", "all"
+};
+
+static const unsigned int TILEMAP_SIZES[] = {16, 64, 256};
+#define TILEMAP_SIZE_COUNT (sizeof(TILEMAP_SIZES) / sizeof(unsigned int))
+
+typedef struct {
+    LayerList *ll;
+    int tilemap;
+    int layer;
+    unsigned int size;
+    SDL_Renderer *renderer;
+} TilemapRun;
+
+static int make_tilemap(LayerList *ll,
+                        int tileset,
+                        unsigned int size,
+                        TilemapAttrs attrs) {
+    unsigned int *map;
+    unsigned int *flags;
+    Uint32 *colormod;
+    unsigned int x, y;
+    int tilemap;
+
+    tilemap = tilemap_add_tilemap(ll, tileset, size, size);
+    if(tilemap < 0) {
+        return(-1);
+    }
+
+    map = malloc(sizeof(unsigned int) * size * size);
+    flags = malloc(sizeof(unsigned int) * size * size);
+    colormod = malloc(sizeof(Uint32) * size * size);
+    if(map == NULL || flags == NULL || colormod == NULL) {
+        fprintf(stderr, "Failed to allocate memory for tilemap.\n");
+        goto error;
+    }
+
+    for(y = 0; y < size; y++) {
+        for(x = 0; x < size; x++) {
+            map[(y * size) + x] = (x + y) % (TILESET_TILES * TILESET_TILES);
+            switch(attrs) {
+                case ATTRS_FLIP:
+                    flags[(y * size) + x] = (x + y) &
+                        (TILEMAP_HFLIP_MASK | TILEMAP_VFLIP_MASK);
+                    break;
+                case ATTRS_ROTATE:
+                    flags[(y * size) + x] = ((x + y) << 2) &
+                        TILEMAP_ROTATE_MASK;
+                    break;
+                case ATTRS_ALL:
+                    flags[(y * size) + x] = (x * y) &
+                        (TILEMAP_HFLIP_MASK | TILEMAP_VFLIP_MASK |
+                         TILEMAP_ROTATE_MASK);
+                    break;
+                default:
+                    flags[(y * size) + x] = 0;
+                    break;
+            }
+            colormod[(y * size) + x] =
+                TILEMAP_COLOR(x & 0xFF, y & 0xFF, (x ^ y) & 0xFF, 0xFF);
+        }
+    }
+
+    if(tilemap_set_tilemap_map(ll, tilemap, 0, 0, size, size, size,
+                               map, size * size) < 0) {
+        goto error;
+    }
+    if(attrs == ATTRS_FLIP || attrs == ATTRS_ROTATE || attrs == ATTRS_ALL) {
+        if(tilemap_set_tilemap_attr_flags(ll, tilemap, 0, 0, size, size, size,
+                                          flags, size * size) < 0) {
+            goto error;
+        }
+    }
+    if(attrs == ATTRS_COLORMOD || attrs == ATTRS_ALL) {
+        if(tilemap_set_tilemap_attr_colormod(ll, tilemap,
+                                             0, 0, size, size, size,
+                                             colormod, size * size) < 0) {
+            goto error;
+        }
+    }
+
+    free(map);
+    free(flags);
+    free(colormod);
+    return(tilemap);
+
+error:
+    free(map);
+    free(flags);
+    free(colormod);
+    tilemap_free_tilemap(ll, tilemap);
+    return(-1);
+}
+
+static int tilemap_update(void *priv) {
+    TilemapRun *run = priv;
+
+    if(tilemap_update_tilemap(run->ll, run->tilemap,
+                              0, 0, run->size, run->size) < 0) {
+        return(-1);
+    }
+
+    return(run->size * run->size);
+}
+
+/* rendering may be batched until something needs it, so make sure it's done
+ * before the clock stops */
+static int tilemap_draw(void *priv) {
+    TilemapRun *run = priv;
+
+    if(tilemap_draw_layer(run->ll, run->layer) < 0) {
+        return(-1);
+    }
+    if(SDL_RenderFlush(run->renderer) < 0) {
+        return(-1);
+    }
+
+    return(1);
+}
+
+static int tilemap_benches() {
+    SDL_Surface *surface;
+    Uint32 *pixels;
+    unsigned int pitch = TILESET_TILES * TILE_SIZE;
+    unsigned int i, j;
+    int tileset;
+    TilemapRun run;
+    char name[64];
+
+    surface = SDL_CreateRGBSurfaceWithFormat(0,
+                                             SURFACE_WIDTH, SURFACE_HEIGHT,
+                                             32, SDL_PIXELFORMAT_ARGB8888);
+    if(surface == NULL) {
+        fprintf(stderr, "Failed to create surface: %s\n", SDL_GetError());
+        return(-1);
+    }
+    run.renderer = SDL_CreateSoftwareRenderer(surface);
+    if(run.renderer == NULL) {
+        fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
+        goto error_surface;
+    }
+    run.ll = layerlist_new(run.renderer, SDL_PIXELFORMAT_ARGB8888,
+                           vprintf_cb, stderr);
+    if(run.ll == NULL) {
+        fprintf(stderr, "Failed to create layerlist.\n");
+        goto error_renderer;
+    }
+
+    pixels = malloc(sizeof(Uint32) * pitch * pitch);
+    if(pixels == NULL) {
+        fprintf(stderr, "Failed to allocate memory for tileset.\n");
+        goto error_ll;
+    }
+    for(i = 0; i < pitch * pitch; i++) {
+        pixels[i] = TILEMAP_COLOR(i & 0xFF, (i >> 4) & 0xFF, (i >> 8) & 0xFF,
+                                  (i & 1) ? 0xFF : 0x80);
+    }
+    tileset = tilemap_add_tileset(run.ll, pixels, pitch, pitch,
+                                  pitch * sizeof(Uint32),
+                                  TILE_SIZE, TILE_SIZE);
+    free(pixels);
+    if(tileset < 0) {
+        goto error_ll;
+    }
+
+    /* per tile */
+    for(i = 0; i < TILEMAP_SIZE_COUNT; i++) {
+        for(j = 0; j < ATTRS_COUNT; j++) {
+            snprintf(name, sizeof(name), "tilemap.update_%ux%u_%s",
+                     TILEMAP_SIZES[i], TILEMAP_SIZES[i], ATTRS_NAMES[j]);
+            run.size = TILEMAP_SIZES[i];
+            run.tilemap = make_tilemap(run.ll, tileset, run.size, j);
+            if(run.tilemap < 0) {
+                goto error_ll;
+            }
+            run_bench(name, tilemap_update, &run,
+                      (65536 / (run.size * run.size)) + 1);
+            tilemap_free_tilemap(run.ll, run.tilemap);
+        }
+    }
+
+    /* per draw, half the surface from a tilemap wider than it */
+    run.size = 128;
+    run.tilemap = make_tilemap(run.ll, tileset, run.size, ATTRS_NONE);
+    if(run.tilemap < 0) {
+        goto error_ll;
+    }
+    if(tilemap_update_tilemap(run.ll, run.tilemap,
+                              0, 0, run.size, run.size) < 0) {
+        goto error_ll;
+    }
+    run.layer = tilemap_add_layer(run.ll, run.tilemap);
+    if(run.layer < 0) {
+        goto error_ll;
+    }
+    if(tilemap_set_layer_window(run.ll, run.layer,
+                                SURFACE_WIDTH / 2, SURFACE_HEIGHT / 2) < 0) {
+        goto error_ll;
+    }
+    run_bench("tilemap.draw_layer", tilemap_draw, &run, 1000);
+    /* right at the edges so the window is split in to 2 or 4 pieces */
+    if(tilemap_set_layer_scroll_pos(run.ll, run.layer,
+                                    (run.size * TILE_SIZE) -
+                                    (SURFACE_WIDTH / 4), 0) < 0) {
+        goto error_ll;
+    }
+    run_bench("tilemap.draw_layer_wrap_x", tilemap_draw, &run, 1000);
+    if(tilemap_set_layer_scroll_pos(run.ll, run.layer,
+                                    (run.size * TILE_SIZE) -
+                                    (SURFACE_WIDTH / 4),
+                                    (run.size * TILE_SIZE) -
+                                    (SURFACE_HEIGHT / 4)) < 0) {
+        goto error_ll;
+    }
+    run_bench("tilemap.draw_layer_wrap_xy", tilemap_draw, &run, 1000);
+
+    layerlist_free(run.ll);
+    SDL_DestroyRenderer(run.renderer);
+    SDL_FreeSurface(surface);
+
+    return(0);
+
+error_ll:
+    layerlist_free(run.ll);
+error_renderer:
+    SDL_DestroyRenderer(run.renderer);
+error_surface:
+    SDL_FreeSurface(surface);
+
+    return(-1);
+}
+
+/* synth benchmarks, per sample output */
+typedef struct {
+    const char *name;
+    SynthPlayerMode mode;
+    SynthSpeedMode speedMode;
+    SynthVolumeMode volMode;
+} SynthBench;
+
+static const SynthBench SYNTH_BENCHES[] = {
+    {"synth.once", SYNTH_MODE_ONCE,
+     SYNTH_SPEED_CONSTANT, SYNTH_VOLUME_CONSTANT},
+    {"synth.once_speed_source", SYNTH_MODE_ONCE,
+     SYNTH_SPEED_SOURCE, SYNTH_VOLUME_CONSTANT},
+    {"synth.once_volume_source", SYNTH_MODE_ONCE,
+     SYNTH_SPEED_CONSTANT, SYNTH_VOLUME_SOURCE},
+    {"synth.loop", SYNTH_MODE_LOOP,
+     SYNTH_SPEED_CONSTANT, SYNTH_VOLUME_CONSTANT},
+    {"synth.loop_speed_source", SYNTH_MODE_LOOP,
+     SYNTH_SPEED_SOURCE, SYNTH_VOLUME_CONSTANT},
+    {"synth.loop_volume_source", SYNTH_MODE_LOOP,
+     SYNTH_SPEED_CONSTANT, SYNTH_VOLUME_SOURCE},
+    {"synth.pingpong", SYNTH_MODE_PINGPONG,
+     SYNTH_SPEED_CONSTANT, SYNTH_VOLUME_CONSTANT},
+    {"synth.pingpong_speed_source", SYNTH_MODE_PINGPONG,
+     SYNTH_SPEED_SOURCE, SYNTH_VOLUME_CONSTANT},
+    {"synth.pingpong_volume_source", SYNTH_MODE_PINGPONG,
+     SYNTH_SPEED_CONSTANT, SYNTH_VOLUME_SOURCE},
+    {"synth.phase_source", SYNTH_MODE_PHASE_SOURCE,
+     SYNTH_SPEED_CONSTANT, SYNTH_VOLUME_CONSTANT},
+    {"synth.phase_source_volume_source", SYNTH_MODE_PHASE_SOURCE,
+     SYNTH_SPEED_CONSTANT, SYNTH_VOLUME_SOURCE}
+};
+#define SYNTH_BENCH_COUNT (sizeof(SYNTH_BENCHES) / sizeof(SynthBench))
+
+typedef struct {
+    Synth *s;
+    int player;
+    SynthPlayerMode mode;
+} SynthRun;
+
+static int synth_frame_cb(void *priv) {
+    return(0);
+}
+
+static int synth_run(void *priv) {
+    SynthRun *run = priv;
+
+    /* start over each time so there's always a full buffer to fill */
+    if(synth_set_player_output_buffer_pos(run->s, run->player, 0) < 0) {
+        return(-1);
+    }
+    if(run->mode == SYNTH_MODE_ONCE) {
+        if(synth_set_player_input_buffer_pos(run->s, run->player, 0.0) < 0) {
+            return(-1);
+        }
+    }
+
+    return(synth_run_player(run->s, run->player, SYNTH_BUFFER_SIZE));
+}
+
+static int synth_benches() {
+    float *data;
+    int dummy, in, out, control;
+    unsigned int i;
+    SynthRun run;
+
+    run.s = synth_new(synth_frame_cb, NULL, vprintf_cb, stderr);
+    if(run.s == NULL) {
+        return(-1);
+    }
+
+    data = malloc(sizeof(float) * SYNTH_BUFFER_SIZE);
+    if(data == NULL) {
+        fprintf(stderr, "Failed to allocate memory for synth buffer.\n");
+        goto error;
+    }
+
+    /* the first buffer can't be a player's input, because that's how a free
+     * player is marked */
+    dummy = synth_add_buffer(run.s, SYNTH_TYPE_F32, NULL, 2);
+    if(dummy < 0) {
+        goto error;
+    }
+    for(i = 0; i < SYNTH_BUFFER_SIZE; i++) {
+        data[i] = sinf((float)i * 2.0 * M_PI * 64.0 / SYNTH_BUFFER_SIZE);
+    }
+    in = synth_add_buffer(run.s, SYNTH_TYPE_F32, data, SYNTH_BUFFER_SIZE);
+    if(in < 0) {
+        goto error;
+    }
+    out = synth_add_buffer(run.s, SYNTH_TYPE_F32, NULL, SYNTH_BUFFER_SIZE);
+    if(out < 0) {
+        goto error;
+    }
+    /* a ramp works as a speed, volume or phase */
+    for(i = 0; i < SYNTH_BUFFER_SIZE; i++) {
+        data[i] = (float)i / SYNTH_BUFFER_SIZE;
+    }
+    control = synth_add_buffer(run.s, SYNTH_TYPE_F32, data,
+                               SYNTH_BUFFER_SIZE);
+    if(control < 0) {
+        goto error;
+    }
+    free(data);
+    data = NULL;
+
+    for(i = 0; i < SYNTH_BENCH_COUNT; i++) {
+        run.mode = SYNTH_BENCHES[i].mode;
+        run.player = synth_add_player(run.s, in);
+        if(run.player < 0) {
+            goto error;
+        }
+        if(synth_set_player_output_buffer(run.s, run.player, out) < 0 ||
+           synth_set_player_output_mode(run.s, run.player,
+                                        SYNTH_OUTPUT_REPLACE) < 0 ||
+           synth_set_player_mode(run.s, run.player, run.mode) < 0 ||
+           synth_set_player_loop_start(run.s, run.player,
+                                       SYNTH_BUFFER_SIZE / 4) < 0 ||
+           synth_set_player_loop_end(run.s, run.player,
+                                     SYNTH_BUFFER_SIZE * 3 / 4) < 0 ||
+           synth_set_player_speed(run.s, run.player, 0.75) < 0 ||
+           synth_set_player_speed_source(run.s, run.player, control) < 0 ||
+           synth_set_player_speed_mode(run.s, run.player,
+                                       SYNTH_BENCHES[i].speedMode) < 0 ||
+           synth_set_player_volume_source(run.s, run.player, control) < 0 ||
+           synth_set_player_volume_mode(run.s, run.player,
+                                        SYNTH_BENCHES[i].volMode) < 0 ||
+           synth_set_player_phase_source(run.s, run.player, control) < 0) {
+            goto error;
+        }
+
+        run_bench(SYNTH_BENCHES[i].name, synth_run, &run, 64);
+
+        if(synth_free_player(run.s, run.player) < 0) {
+            goto error;
+        }
+    }
+
+    synth_free(run.s);
+
+    return(0);
+
+error:
+    if(data != NULL) {
+        free(data);
+    }
+    synth_free(run.s);
+
+    return(-1);
+}
+
+/* collision benchmarks, per object, moving everything then finding what
+ * overlaps like a frame of a shooter would */
+static const unsigned int COLLIDE_SIZES[] = {1000, 4000};
+#define COLLIDE_SIZES_COUNT (sizeof(COLLIDE_SIZES) / sizeof(unsigned int))
+#define COLLIDE_PLAYERS     (8)
+#define COLLIDE_CELL_SIZE   (16)
+#define COLLIDE_RESULTS     (65536)
+
+typedef struct {
+    Collide *c;
+    int *obj;
+    unsigned int count;
+    unsigned int groups1;
+    unsigned int groups2;
+    int *results;
+} CollideRun;
+
+static int collide_run(void *priv) {
+    CollideRun *run = priv;
+    unsigned int i;
+
+    for(i = 0; i < run->count; i++) {
+        run->obj[i * COLLIDE_OBJECT_SIZE + COLLIDE_OBJECT_X] =
+            (run->obj[i * COLLIDE_OBJECT_SIZE + COLLIDE_OBJECT_X] + 1) %
+            SURFACE_WIDTH;
+    }
+    if(collide_update(run->c, 0, run->obj, run->count) < 0) {
+        return(-1);
+    }
+    if(collide_pairs(run->c, run->groups1, run->groups2,
+                     run->results, COLLIDE_RESULTS) < 0) {
+        return(-1);
+    }
+
+    return(run->count);
+}
+
+static int collide_benches() {
+    CollideRun run;
+    char name[64];
+    unsigned int i, j;
+
+    run.results = malloc(sizeof(int) * COLLIDE_RESULTS);
+    if(run.results == NULL) {
+        fprintf(stderr, "Failed to allocate memory for collision "
+                        "results.\n");
+        return(-1);
+    }
+
+    for(i = 0; i < COLLIDE_SIZES_COUNT; i++) {
+        run.count = COLLIDE_SIZES[i];
+        run.c = collide_new(run.count, COLLIDE_CELL_SIZE, vprintf_cb, stderr);
+        if(run.c == NULL) {
+            goto error;
+        }
+        run.obj = malloc(sizeof(int) * COLLIDE_OBJECT_SIZE * run.count);
+        if(run.obj == NULL) {
+            fprintf(stderr, "Failed to allocate memory for collision "
+                            "objects.\n");
+            collide_free(run.c);
+            goto error;
+        }
+        /* a few players and lots of bullets, same every time */
+        srand(i);
+        for(j = 0; j < run.count; j++) {
+            int *obj = &(run.obj[j * COLLIDE_OBJECT_SIZE]);
+            obj[COLLIDE_OBJECT_X] = rand() % SURFACE_WIDTH;
+            obj[COLLIDE_OBJECT_Y] = rand() % SURFACE_HEIGHT;
+            obj[COLLIDE_OBJECT_W] = 4 + rand() % 8;
+            obj[COLLIDE_OBJECT_H] = 4 + rand() % 8;
+            obj[COLLIDE_OBJECT_GROUPS] = j < COLLIDE_PLAYERS ? 1 : 2;
+        }
+
+        run.groups1 = 1;
+        run.groups2 = 2;
+        snprintf(name, sizeof(name), "collide.pairs_%u_players",
+                 run.count);
+        run_bench(name, collide_run, &run, 100);
+        run.groups1 = 3;
+        run.groups2 = 3;
+        snprintf(name, sizeof(name), "collide.pairs_%u_all", run.count);
+        run_bench(name, collide_run, &run, 100);
+
+        free(run.obj);
+        collide_free(run.c);
+    }
+
+    free(run.results);
+
+    return(0);
+
+error:
+    free(run.results);
+
+    return(-1);
+}
+
+/* run a script in crustygame for some frames, which prints a line of JSON of
+ * its own */
+static void game_bench(const char *game,
+                       const char *script,
+                       unsigned int frames) {
+    char command[PATH_MAX * 3];
+    char line[4096];
+    char *gamepath;
+    char *dir;
+    const char *base;
+    FILE *out;
+    int status;
+
+    begin_result();
+
+    gamepath = realpath(game, NULL);
+    base = strrchr(script, '/');
+    if(base == NULL) {
+        dir = strdup(".");
+        base = script;
+    } else {
+        dir = strndup(script, base - script);
+        base++;
+    }
+    if(gamepath == NULL || dir == NULL) {
+        fprintf(stderr, "Couldn't find %s.\n", game);
+        goto error;
+    }
+    /* it's run from the script's directory, for any files it opens */
+    if(strchr(gamepath, '\'') != NULL ||
+       strchr(dir, '\'') != NULL ||
+       strchr(base, '\'') != NULL) {
+        fprintf(stderr, "Path to %s can't be quoted.\n", script);
+        goto error;
+    }
+    snprintf(command, sizeof(command), "cd '%s' && '%s' -b %u '%s' 2>/dev/null",
+             dir, gamepath, frames, base);
+
+    out = popen(command, "r");
+    if(out == NULL) {
+        fprintf(stderr, "Failed to run %s.\n", script);
+        goto error;
+    }
+    line[0] = '\0';
+    if(fgets(line, sizeof(line), out) == NULL) {
+        line[0] = '\0';
+    }
+    status = pclose(out);
+    if(status != 0 || line[0] != '{') {
+        fprintf(stderr, "%s failed.\n", script);
+        goto error;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    printf("    %s", line);
+
+    free(gamepath);
+    free(dir);
+    return;
+
+error:
+    printf("    {\"script\": ");
+    print_string(base);
+    printf(", \"failed\": true}");
+    failed = 1;
+    free(gamepath);
+    free(dir);
+}
+
+int main(int argc, char **argv) {
+    const char *game = NULL;
+    unsigned int frames = BENCH_FRAMES;
+    char *end;
+    int i;
+    unsigned int j;
+
+    /* options, then any scripts to run */
+    for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if(strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            i++;
+            game = argv[i];
+        } else if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            frames = strtoul(argv[i], &end, 10);
+            if(end == argv[i] || *end != '\0') {
+                frames = 0;
+            }
+        } else {
+            frames = 0;
+        }
+        if(frames == 0) {
+            break;
+        }
+    }
+    if(frames == 0 || (i < argc && game == NULL)) {
+        fprintf(stderr, "USAGE: %s [-g <crustygame> [-f <frames>] <script.cvm> ...]\n", argv[0]);
+        return(EXIT_FAILURE);
+    }
+
+    /* nothing here needs a window or sound, but synth needs an audio
+     * device */
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+    if(SDL_Init(SDL_INIT_AUDIO) < 0) {
+        fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+        return(EXIT_FAILURE);
+    }
+
+    printf("{\n  \"micro\": [\n");
+    firstResult = 1;
+
+    for(j = 0; j < VM_BENCH_COUNT; j++) {
+        vm_bench(&(VM_BENCHES[j]), 0, "");
+        vm_bench(&(VM_BENCHES[j]), CRUSTY_FLAG_JIT, ".jit");
+    }
+
+    if(tilemap_benches() < 0) {
+        fprintf(stderr, "Tilemap benchmarks failed.\n");
+        failed = 1;
+    }
+
+    if(synth_benches() < 0) {
+        fprintf(stderr, "Synth benchmarks failed.\n");
+        failed = 1;
+    }
+
+    if(collide_benches() < 0) {
+        fprintf(stderr, "Collision benchmarks failed.\n");
+        failed = 1;
+    }
+
+    printf("\n  ],\n  \"macro\": [\n");
+    firstResult = 1;
+
+    for(; i < argc; i++) {
+        game_bench(game, argv[i], frames);
+    }
+
+    printf("\n  ]\n}\n");
+
+    SDL_Quit();
+
+    return(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -27,6 +27,9 @@
 #include "crustygame.h"
 #include "crustyvm.h"
 #include "tilemap.h"
+#include "perf.h"
+#include "vmath.h"
+#include "collide.h"
 /*
 #include "synth.h"
 */
@@ -104,17 +107,30 @@ int set_buffer(void *priv,
                unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
 
-    state->buffer = ptr;
-    state->size = size;
-    if(type == CRUSTY_TYPE_INT) {
-        state->size *= sizeof(int);
-    } else if(type == CRUSTY_TYPE_FLOAT) {
-        state->size *= sizeof(double);
+    if(crustyvm_span_new(state->cvm, &(state->buffer), type, size, ptr) < 0) {
+        fprintf(stderr, "Buffer must be a variable.\n");
+        return(-1);
     }
 
     return(0);
 }
 
+/* get the memory last passed to set_buffer as type, or CRUSTY_TYPE_NONE for
+ * bytes of any type, if the variable is still around */
+static void *get_buffer(CrustyGame *state,
+                        CrustyType type,
+                        unsigned int *count) {
+    void *buffer;
+
+    buffer = crustyvm_span_get(state->cvm, &(state->buffer), type, count);
+    if(buffer == NULL) {
+        fprintf(stderr, "No buffer has been assigned, the buffer went out "
+                        "of scope or it's the wrong type.\n");
+    }
+
+    return(buffer);
+}
+
 int get_return(void *priv, void *val, unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
 
@@ -130,6 +146,8 @@ int gfx_add_tileset(void *priv,
                     void *ptr,
                     unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
+    void *pixels;
+    unsigned int bufsize;
 
     int w, h, pitch, tw, th;
     /* check data type and size */
@@ -146,18 +164,18 @@ int gfx_add_tileset(void *priv,
         return(-1);
     }
 
-    if(state->buffer == NULL) {
-        fprintf(stderr, "No buffer has been assigned.\n");
+    pixels = get_buffer(state, CRUSTY_TYPE_NONE, &bufsize);
+    if(pixels == NULL) {
         return(-1);
     }
     /* check to see, given a particular dimensions and pitch, that
      * the buffer has enough space to create the entire surface */
-    if(state->size < ((unsigned int)pitch *
-                      ((unsigned int)h - 1)) + ((unsigned int)w * 4)) {
+    if(bufsize < ((unsigned int)pitch *
+                  ((unsigned int)h - 1)) + ((unsigned int)w * 4)) {
         fprintf(stderr, "Buffer too small to create requested tileset.\n");
         return(-1);
     }
-    state->ret = tilemap_add_tileset(state->ll, state->buffer,
+    state->ret = tilemap_add_tileset(state->ll, pixels,
                                      w, h, pitch, tw, th);
     if(state->ret < 0) {
         return(-1);
@@ -249,6 +267,8 @@ int gfx_set_tilemap_map(void *priv,
                         unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
     int x, y, pitch, w, h;
+    void *buffer;
+    unsigned int count;
 
     if(type != CRUSTY_TYPE_INT || size < 5) {
         fprintf(stderr, "Wrong type.\n");
@@ -264,8 +284,8 @@ int gfx_set_tilemap_map(void *priv,
         return(-1);
     }
 
-    if(state->buffer == NULL) {
-        fprintf(stderr, "No buffer has been assigned.\n");
+    buffer = get_buffer(state, CRUSTY_TYPE_INT, &count);
+    if(buffer == NULL) {
         return(-1);
     }
 
@@ -274,8 +294,7 @@ int gfx_set_tilemap_map(void *priv,
                                    x, y,
                                    pitch,
                                    w, h,
-                                   (unsigned int *)(state->buffer),
-                                   state->size / sizeof(unsigned int)));
+                                   buffer, count));
 }
 
 int gfx_set_tilemap_attr_flags(void *priv,
@@ -285,6 +304,8 @@ int gfx_set_tilemap_attr_flags(void *priv,
                                unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
     int x, y, pitch, w, h;
+    void *buffer;
+    unsigned int count;
 
     if(type != CRUSTY_TYPE_INT || size < 5) {
         fprintf(stderr, "Wrong type.\n");
@@ -300,8 +321,8 @@ int gfx_set_tilemap_attr_flags(void *priv,
         return(-1);
     }
 
-    if(state->buffer == NULL) {
-        fprintf(stderr, "No buffer has been assigned.\n");
+    buffer = get_buffer(state, CRUSTY_TYPE_INT, &count);
+    if(buffer == NULL) {
         return(-1);
     }
 
@@ -310,8 +331,7 @@ int gfx_set_tilemap_attr_flags(void *priv,
                                           x, y,
                                           pitch,
                                           w, h,
-                                          (unsigned int *)(state->buffer),
-                                          state->size / sizeof(unsigned int)));
+                                          buffer, count));
 }
 
 int gfx_set_tilemap_attr_colormod(void *priv,
@@ -321,6 +341,8 @@ int gfx_set_tilemap_attr_colormod(void *priv,
                                   unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
     int x, y, pitch, w, h;
+    void *buffer;
+    unsigned int count;
 
     if(type != CRUSTY_TYPE_INT || size < 5) {
         fprintf(stderr, "Wrong type.\n");
@@ -336,8 +358,8 @@ int gfx_set_tilemap_attr_colormod(void *priv,
         return(-1);
     }
 
-    if(state->buffer == NULL) {
-        fprintf(stderr, "No buffer has been assigned.\n");
+    buffer = get_buffer(state, CRUSTY_TYPE_INT, &count);
+    if(buffer == NULL) {
         return(-1);
     }
 
@@ -346,8 +368,7 @@ int gfx_set_tilemap_attr_colormod(void *priv,
                                              x, y,
                                              pitch,
                                              w, h,
-                                             (unsigned int *)(state->buffer),
-                                             state->size / sizeof(unsigned int)));
+                                             buffer, count));
 }
 
 int gfx_update_tilemap(void *priv,
@@ -632,6 +653,81 @@ int set_running(void *priv,
     return(0);
 }
 
+int frame_get_pending(void *priv, void *val, unsigned int index) {
+    CrustyGame *state = (CrustyGame *)priv;
+
+    *(int *)val = state->framePending;
+
+    return(0);
+}
+
+int frame_get_lag(void *priv, void *val, unsigned int index) {
+    CrustyGame *state = (CrustyGame *)priv;
+
+    *(double *)val = state->frameLag;
+
+    return(0);
+}
+
+/* performance statistics, index selects min, avg or p99 */
+static int get_perf(CrustyGame *state,
+                    PerfPhase phase,
+                    void *val,
+                    unsigned int index) {
+    if(index >= PERF_STATS) {
+        fprintf(stderr, "Performance statistic index out of range.\n");
+        return(-1);
+    }
+
+    *(int *)val = perf_get_stat(&(state->perf), phase, index);
+
+    return(0);
+}
+
+int perf_get_event_us(void *priv, void *val, unsigned int index) {
+    return(get_perf((CrustyGame *)priv, PERF_EVENT, val, index));
+}
+
+int perf_get_frame_us(void *priv, void *val, unsigned int index) {
+    return(get_perf((CrustyGame *)priv, PERF_FRAME, val, index));
+}
+
+int perf_get_tilemap_us(void *priv, void *val, unsigned int index) {
+    return(get_perf((CrustyGame *)priv, PERF_TILEMAP, val, index));
+}
+
+int perf_get_present_us(void *priv, void *val, unsigned int index) {
+    return(get_perf((CrustyGame *)priv, PERF_PRESENT, val, index));
+}
+
+int perf_get_total_us(void *priv, void *val, unsigned int index) {
+    return(get_perf((CrustyGame *)priv, PERF_TOTAL, val, index));
+}
+
+int perf_set_overlay(void *priv,
+                     CrustyType type,
+                     unsigned int size,
+                     void *ptr,
+                     unsigned int index) {
+    CrustyGame *state = (CrustyGame *)priv;
+
+    if(type != CRUSTY_TYPE_INT) {
+        fprintf(stderr, "Wrong type.\n");
+        return(-1);
+    }
+
+    if(*(int *)ptr) {
+        if(perf_overlay_enable(&(state->perf), state->ll) < 0) {
+            fprintf(stderr, "Failed to enable performance overlay.\n");
+            return(-1);
+        }
+    } else {
+        perf_overlay_disable(&(state->perf));
+    }
+
+    return(0);
+}
+
 int get_random(void *priv, void *val, unsigned int index) {
     *(int *)val = rand();
 
@@ -930,7 +1026,7 @@ int savedata_seek(void *priv,
         return(-1);
     }
 
-    if(state->savefile == NULL) {
+    if(state->savedata == NULL) {
         fprintf(stderr, "Seek in nonexistent save memory.\n");
         return(-1);
     }
@@ -941,174 +1037,199 @@ int savedata_seek(void *priv,
         return(-1);
     }
     /* save mirroring */
-    pos %= state->savesize;
-
-    if(fseek(state->savefile, pos, SEEK_SET) < 0) {
-        fprintf(stderr, "Failed to seek in save file: %s\n",
-                        strerror(errno));
-        return(-1);
-    }
+    state->savepos = pos % state->savesize;
 
     return(0);
 }
-        
+
+/* move the save position past a value, wrapping around to the start if it
+ * lands on the end */
+static void savedata_advance(CrustyGame *state, unsigned int size) {
+    state->savepos += size;
+    if(state->savepos == state->savesize) {
+        state->savepos = 0;
+    }
+}
+
 int savedata_write(void *priv,
                    CrustyType type,
                    unsigned int size,
                    void *ptr,
                    unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
-    int pos;
+    unsigned int valsize;
 
-    if(state->savefile == NULL) {
+    if(state->savedata == NULL) {
         fprintf(stderr, "Write to nonexistent save memory.\n");
         return(-1);
     }
 
-    pos = ftell(state->savefile);
-    if(pos < 0) {
-        fprintf(stderr, "Failed to get position in save file.\n");
-        return(-1);
-    }
-
     if(type == CRUSTY_TYPE_CHAR) {
-        if(fwrite((unsigned char *)ptr, 1, 1, state->savefile) < 1) {
-            fprintf(stderr, "Failed to write to savefile.\n");
-            return(-1);
-        }
-        if((unsigned int)pos + 1 == state->savesize) {
-            if(fseek(state->savefile, 0, SEEK_SET)) {
-                fprintf(stderr, "Failed to seek in save file: %s\n",
-                                strerror(errno));
-                fprintf(stderr, "Failed to seek in savefile.\n");
-                return(-1);
-            }
-        }
+        valsize = 1;
     } else if(type == CRUSTY_TYPE_INT) {
-        if((unsigned int)pos > state->savesize - sizeof(int)) {
-            fprintf(stderr, "Not enough space to write int value.\n");
-            return(-1);
-        }
-        if(fwrite((int *)ptr, 1, sizeof(int), state->savefile) < sizeof(int)) {
-            fprintf(stderr, "Failed to write to savefile.\n");
-            return(-1);
-        }
-        if((unsigned int)pos + sizeof(int) == state->savesize) {
-            if(fseek(state->savefile, 0, SEEK_SET)) {
-                fprintf(stderr, "Failed to seek in save file: %s\n",
-                                strerror(errno));
-                fprintf(stderr, "Failed to seek in savefile.\n");
-                return(-1);
-            }
-        }
+        valsize = sizeof(int);
     } else { /* FLOAT */
-        if((unsigned int)pos > state->savesize - sizeof(double)) {
-            fprintf(stderr, "Not enough space to write float value.\n");
-            return(-1);
-        }
-        if(fwrite((double *)ptr, 1, sizeof(double), state->savefile) < sizeof(double)) {
-            fprintf(stderr, "Failed to write to savefile.\n");
-            return(-1);
-        }
-        if((unsigned int)pos + sizeof(double) == state->savesize) {
-            if(fseek(state->savefile, 0, SEEK_SET)) {
-                fprintf(stderr, "Failed to seek in save file: %s\n",
-                                strerror(errno));
-                return(-1);
-            }
-        }
+        valsize = sizeof(double);
     }
 
+    /* savepos is always within savesize, so this can't wrap like adding
+     * could */
+    if(valsize > state->savesize - state->savepos) {
+        fprintf(stderr, "Not enough space to write value.\n");
+        return(-1);
+    }
+    memcpy(&(state->savedata[state->savepos]), ptr, valsize);
+    state->savedirty = 1;
+    savedata_advance(state, valsize);
+
+    return(0);
+}
+
+static int savedata_read(CrustyGame *state, void *val, unsigned int valsize) {
+    if(state->savedata == NULL) {
+        fprintf(stderr, "Read from nonexistent save memory.\n");
+        return(-1);
+    }
+
+    if(valsize > state->savesize - state->savepos) {
+        fprintf(stderr, "Not enough space to read value.\n");
+        return(-1);
+    }
+    memcpy(val, &(state->savedata[state->savepos]), valsize);
+    savedata_advance(state, valsize);
+
     return(0);
 }
 
 int savedata_read_char(void *priv, void *val, unsigned int index) {
+    return(savedata_read((CrustyGame *)priv, val, 1));
+}
+
+int savedata_read_int(void *priv, void *val, unsigned int index) {
+    return(savedata_read((CrustyGame *)priv, val, sizeof(int)));
+}
+
+int savedata_read_float(void *priv, void *val, unsigned int index) {
+    return(savedata_read((CrustyGame *)priv, val, sizeof(double)));
+}
+
+/* standard CRC-32, as used by zlib */
+static Uint32 crc32(const unsigned char *data, unsigned int size) {
+    static Uint32 table[256];
+    static int tableReady = 0;
+    Uint32 crc;
+    unsigned int i, j;
+
+    if(!tableReady) {
+        for(i = 0; i < 256; i++) {
+            crc = i;
+            for(j = 0; j < 8; j++) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+            }
+            table[i] = crc;
+        }
+        tableReady = 1;
+    }
+
+    crc = 0xFFFFFFFF;
+    for(i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return(crc ^ 0xFFFFFFFF);
+}
+
+/* blocks are the contents of the buffer followed by a CRC of it */
+int savedata_write_block(void *priv,
+                         CrustyType type,
+                         unsigned int size,
+                         void *ptr,
+                         unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
-    int pos;
+    void *buffer;
+    unsigned int bufsize;
+    Uint32 crc;
 
-    if(state->savefile == NULL) {
+    if(state->savedata == NULL) {
         fprintf(stderr, "Write to nonexistent save memory.\n");
         return(-1);
     }
 
-    pos = ftell(state->savefile);
-    if(pos < 0) {
-        fprintf(stderr, "Failed to get position in save file.\n");
+    buffer = get_buffer(state, CRUSTY_TYPE_NONE, &bufsize);
+    if(buffer == NULL) {
         return(-1);
     }
 
-    if(fread((unsigned char *)val, 1, 1, state->savefile) < 1) {
-        fprintf(stderr, "Failed to read from savefile.\n");
+    /* bufsize comes from the script, so check it alone first */
+    if(bufsize > state->savesize - state->savepos ||
+       state->savesize - state->savepos - bufsize < sizeof(Uint32)) {
+        fprintf(stderr, "Not enough space to write block.\n");
         return(-1);
     }
-    if((unsigned int)pos + 1 == state->savesize) {
-        if(fseek(state->savefile, 0, SEEK_SET)) {
-            fprintf(stderr, "Failed to seek in save file: %s\n",
-                            strerror(errno));
-            return(-1);
-        }
-    }
+
+    crc = crc32(buffer, bufsize);
+    memcpy(&(state->savedata[state->savepos]), buffer, bufsize);
+    memcpy(&(state->savedata[state->savepos + bufsize]),
+           &crc, sizeof(Uint32));
+    state->savedirty = 1;
+    savedata_advance(state, bufsize + sizeof(Uint32));
 
     return(0);
 }
 
-int savedata_read_int(void *priv, void *val, unsigned int index) {
+int savedata_read_block(void *priv, void *val, unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
-    int pos;
+    void *buffer;
+    unsigned int bufsize;
+    Uint32 crc;
 
-    if(state->savefile == NULL) {
-        fprintf(stderr, "Write to nonexistent save memory.\n");
+    if(state->savedata == NULL) {
+        fprintf(stderr, "Read from nonexistent save memory.\n");
         return(-1);
     }
 
-    pos = ftell(state->savefile);
-    if(pos < 0) {
-        fprintf(stderr, "Failed to get position in save file.\n");
+    buffer = get_buffer(state, CRUSTY_TYPE_NONE, &bufsize);
+    if(buffer == NULL) {
         return(-1);
     }
 
-    /* no need to check pos beforehand because it should fail to read anyway */
-    if(fread((int *)val, 1, sizeof(int), state->savefile) < sizeof(int)) {
-        fprintf(stderr, "Failed to read from savefile.\n");
+    /* bufsize comes from the script, so check it alone first */
+    if(bufsize > state->savesize - state->savepos ||
+       state->savesize - state->savepos - bufsize < sizeof(Uint32)) {
+        fprintf(stderr, "Not enough space to read block.\n");
         return(-1);
     }
-    if((unsigned int)pos + sizeof(int) == state->savesize) {
-        if(fseek(state->savefile, 0, SEEK_SET)) {
-            fprintf(stderr, "Failed to seek in save file: %s\n",
-                            strerror(errno));
-            return(-1);
-        }
+
+    memcpy(&crc, &(state->savedata[state->savepos + bufsize]),
+           sizeof(Uint32));
+    /* don't touch the buffer if the block is damaged */
+    if(crc32(&(state->savedata[state->savepos]), bufsize) != crc) {
+        *(int *)val = 0;
+    } else {
+        memcpy(buffer, &(state->savedata[state->savepos]), bufsize);
+        *(int *)val = 1;
     }
+    savedata_advance(state, bufsize + sizeof(Uint32));
 
     return(0);
 }
 
-int savedata_read_float(void *priv, void *val, unsigned int index) {
+int savedata_commit(void *priv,
+                    CrustyType type,
+                    unsigned int size,
+                    void *ptr,
+                    unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
-    int pos;
 
-    if(state->savefile == NULL) {
-        fprintf(stderr, "Write to nonexistent save memory.\n");
+    if(state->savedata == NULL) {
+        fprintf(stderr, "Commit of nonexistent save memory.\n");
         return(-1);
     }
 
-    pos = ftell(state->savefile);
-    if(pos < 0) {
-        fprintf(stderr, "Failed to get position in save file.\n");
-        return(-1);
-    }
-
-    if(fread((float *)val, 1, sizeof(float), state->savefile) < sizeof(float)) {
-        fprintf(stderr, "Failed to read from savefile.\n");
+    if(commit_save_file(state) < 0) {
+        fprintf(stderr, "Failed to commit save data.\n");
         return(-1);
     }
-    if((unsigned int)pos + sizeof(float) == state->savesize) {
-        if(fseek(state->savefile, 0, SEEK_SET)) {
-            fprintf(stderr, "Failed to seek in save file: %s\n",
-                            strerror(errno));
-            return(-1);
-        }
-    }
 
     return(0);
 }
@@ -1134,6 +1255,383 @@ int set_window_title(void *priv,
     return(0);
 }
 
+/* math over the whole buffer, which must be floats */
+static double *get_float_buffer(CrustyGame *state, unsigned int *count) {
+    return((double *)get_buffer(state, CRUSTY_TYPE_FLOAT, count));
+}
+
+int math_sin(void *priv,
+             CrustyType type,
+             unsigned int size,
+             void *ptr,
+             unsigned int index) {
+    double *buffer;
+    unsigned int count;
+
+    buffer = get_float_buffer((CrustyGame *)priv, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    vmath_sin(buffer, count);
+
+    return(0);
+}
+
+int math_cos(void *priv,
+             CrustyType type,
+             unsigned int size,
+             void *ptr,
+             unsigned int index) {
+    double *buffer;
+    unsigned int count;
+
+    buffer = get_float_buffer((CrustyGame *)priv, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    vmath_cos(buffer, count);
+
+    return(0);
+}
+
+int math_sqrt(void *priv,
+              CrustyType type,
+              unsigned int size,
+              void *ptr,
+              unsigned int index) {
+    double *buffer;
+    unsigned int count;
+
+    buffer = get_float_buffer((CrustyGame *)priv, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    vmath_sqrt(buffer, count);
+
+    return(0);
+}
+
+int math_exp(void *priv,
+             CrustyType type,
+             unsigned int size,
+             void *ptr,
+             unsigned int index) {
+    double *buffer;
+    unsigned int count;
+
+    buffer = get_float_buffer((CrustyGame *)priv, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    vmath_exp(buffer, count);
+
+    return(0);
+}
+
+int math_log(void *priv,
+             CrustyType type,
+             unsigned int size,
+             void *ptr,
+             unsigned int index) {
+    double *buffer;
+    unsigned int count;
+
+    buffer = get_float_buffer((CrustyGame *)priv, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    vmath_log(buffer, count);
+
+    return(0);
+}
+
+int math_pow(void *priv,
+             CrustyType type,
+             unsigned int size,
+             void *ptr,
+             unsigned int index) {
+    double *buffer;
+    unsigned int count;
+
+    if(type != CRUSTY_TYPE_FLOAT) {
+        fprintf(stderr, "Wrong type.\n");
+        return(-1);
+    }
+
+    buffer = get_float_buffer((CrustyGame *)priv, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    vmath_pow(buffer, count, *(double *)ptr);
+
+    return(0);
+}
+
+int math_lerp(void *priv,
+              CrustyType type,
+              unsigned int size,
+              void *ptr,
+              unsigned int index) {
+    double *buffer;
+    unsigned int count;
+
+    if(type != CRUSTY_TYPE_FLOAT || size < 2) {
+        fprintf(stderr, "Wrong type.\n");
+        return(-1);
+    }
+
+    buffer = get_float_buffer((CrustyGame *)priv, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    double *args = (double *)ptr;
+    vmath_lerp(buffer, count, args[0], args[1]);
+
+    return(0);
+}
+
+/* start, end and optionally the power, linear if it's not given */
+int math_curve(void *priv,
+               CrustyType type,
+               unsigned int size,
+               void *ptr,
+               unsigned int index) {
+    double *buffer;
+    unsigned int count;
+    double power = 1.0;
+
+    if(type != CRUSTY_TYPE_FLOAT || size < 2) {
+        fprintf(stderr, "Wrong type.\n");
+        return(-1);
+    }
+
+    buffer = get_float_buffer((CrustyGame *)priv, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    double *args = (double *)ptr;
+    if(size > 2) {
+        power = args[2];
+    }
+    vmath_curve(buffer, count, args[0], args[1], power);
+
+    return(0);
+}
+
+/* collision, objects are updated from and results are put in the buffer,
+ * which must be ints, and the number of results is returned */
+static Collide *get_collide(CrustyGame *state) {
+    if(state->collide == NULL) {
+        fprintf(stderr, "Collision hasn't been set up.\n");
+    }
+
+    return(state->collide);
+}
+
+/* object count and cell size, any previous objects are dropped */
+int collide_init(void *priv,
+                 CrustyType type,
+                 unsigned int size,
+                 void *ptr,
+                 unsigned int index) {
+    CrustyGame *state = (CrustyGame *)priv;
+    Collide *c;
+
+    if(type != CRUSTY_TYPE_INT || size < 2) {
+        fprintf(stderr, "Wrong type.\n");
+        return(-1);
+    }
+    int *buf = (int *)ptr;
+    if(buf[0] <= 0 || buf[1] <= 0) {
+        fprintf(stderr, "Invalid collision object count or cell size.\n");
+        return(-1);
+    }
+
+    c = collide_new(buf[0], buf[1], vprintf_cb, stderr);
+    if(c == NULL) {
+        return(-1);
+    }
+    if(state->collide != NULL) {
+        collide_free(state->collide);
+    }
+    state->collide = c;
+
+    return(0);
+}
+
+/* first object and optionally how many, otherwise as many as are in the
+ * buffer */
+int collide_set_objects(void *priv,
+                        CrustyType type,
+                        unsigned int size,
+                        void *ptr,
+                        unsigned int index) {
+    CrustyGame *state = (CrustyGame *)priv;
+    Collide *c;
+    int *buffer;
+    unsigned int count;
+
+    if(type != CRUSTY_TYPE_INT) {
+        fprintf(stderr, "Wrong type.\n");
+        return(-1);
+    }
+    int *buf = (int *)ptr;
+    if(buf[0] < 0 || (size > 1 && buf[1] < 0)) {
+        fprintf(stderr, "Invalid collision object range.\n");
+        return(-1);
+    }
+
+    c = get_collide(state);
+    if(c == NULL) {
+        return(-1);
+    }
+    buffer = get_buffer(state, CRUSTY_TYPE_INT, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+    count /= COLLIDE_OBJECT_SIZE;
+    if(size > 1) {
+        if((unsigned int)buf[1] > count) {
+            fprintf(stderr, "Buffer too small to hold collision objects.\n");
+            return(-1);
+        }
+        count = buf[1];
+    } else if((unsigned int)buf[0] <= collide_get_count(c) &&
+              count > collide_get_count(c) - (unsigned int)buf[0]) {
+        count = collide_get_count(c) - (unsigned int)buf[0];
+    }
+
+    return(collide_update(c, buf[0], buffer, count));
+}
+
+/* x, y, w, h, groups */
+int collide_get_area(void *priv,
+                     CrustyType type,
+                     unsigned int size,
+                     void *ptr,
+                     unsigned int index) {
+    CrustyGame *state = (CrustyGame *)priv;
+    Collide *c;
+    int *buffer;
+    unsigned int count;
+
+    if(type != CRUSTY_TYPE_INT || size < 5) {
+        fprintf(stderr, "Wrong type.\n");
+        return(-1);
+    }
+    int *buf = (int *)ptr;
+
+    c = get_collide(state);
+    if(c == NULL) {
+        return(-1);
+    }
+    buffer = get_buffer(state, CRUSTY_TYPE_INT, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    state->ret = collide_query(c, buf[0], buf[1], buf[2], buf[3], buf[4],
+                               buffer, count);
+    if(state->ret < 0) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* groups of the first of each pair and optionally of the second, otherwise
+ * the same */
+int collide_get_pairs(void *priv,
+                      CrustyType type,
+                      unsigned int size,
+                      void *ptr,
+                      unsigned int index) {
+    CrustyGame *state = (CrustyGame *)priv;
+    Collide *c;
+    int *buffer;
+    unsigned int count;
+
+    if(type != CRUSTY_TYPE_INT) {
+        fprintf(stderr, "Wrong type.\n");
+        return(-1);
+    }
+    int *buf = (int *)ptr;
+
+    c = get_collide(state);
+    if(c == NULL) {
+        return(-1);
+    }
+    buffer = get_buffer(state, CRUSTY_TYPE_INT, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    state->ret = collide_pairs(c, buf[0], size > 1 ? buf[1] : buf[0],
+                               buffer, count);
+    if(state->ret < 0) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* tilemap, its x and y, object groups, first and last tile, then optionally a
+ * flags mask and value */
+int collide_get_tilemap(void *priv,
+                        CrustyType type,
+                        unsigned int size,
+                        void *ptr,
+                        unsigned int index) {
+    CrustyGame *state = (CrustyGame *)priv;
+    Collide *c;
+    CollideTilemap tm;
+    int *buffer;
+    unsigned int count;
+    unsigned int flagsmask = 0, flagsvalue = 0;
+
+    if(type != CRUSTY_TYPE_INT || size < 6) {
+        fprintf(stderr, "Wrong type.\n");
+        return(-1);
+    }
+    int *buf = (int *)ptr;
+    if(size > 7) {
+        flagsmask = buf[6];
+        flagsvalue = buf[7];
+    }
+
+    c = get_collide(state);
+    if(c == NULL) {
+        return(-1);
+    }
+    if(tilemap_get_tilemap_map(state->ll, buf[0],
+                               &(tm.map), &(tm.attr_flags),
+                               &(tm.w), &(tm.h), &(tm.tw), &(tm.th)) < 0) {
+        return(-1);
+    }
+    tm.x = buf[1];
+    tm.y = buf[2];
+    buffer = get_buffer(state, CRUSTY_TYPE_INT, &count);
+    if(buffer == NULL) {
+        return(-1);
+    }
+
+    state->ret = collide_tilemap(c, &tm, buf[3], buf[4], buf[5],
+                                 flagsmask, flagsvalue, buffer, count);
+    if(state->ret < 0) {
+        return(-1);
+    }
+
+    return(0);
+}
+
 #if 0
 int audio_get_samples_needed(void *priv, void *val, unsigned int index) {
     CrustyGame *state = (CrustyGame *)priv;
@@ -1215,6 +1713,8 @@ int audio_add_buffer(void *priv,
     CrustyGame *state = (CrustyGame *)priv;
 
     int bufferType, bufferSize;
+    void *buffer;
+    unsigned int bufsize;
     /* check data type and size */
     if(type != CRUSTY_TYPE_INT || size < 2) {
         fprintf(stderr, "Wrong type.\n");
@@ -1228,35 +1728,35 @@ int audio_add_buffer(void *priv,
         return(-1);
     }
 
-    if(state->buffer == NULL) {
-        fprintf(stderr, "No buffer has been assigned.\n");
+    buffer = get_buffer(state, CRUSTY_TYPE_NONE, &bufsize);
+    if(buffer == NULL) {
         return(-1);
     }
 
     switch(bufferType) {
         case CRUSTYGAME_AUDIO_TYPE_U8:
-            if((unsigned int)bufferSize > state->size) {
+            if((unsigned int)bufferSize > bufsize) {
                 fprintf(stderr, "Buffer too small for declared size.\n");
                 return(-1);
             }
             bufferType = SYNTH_TYPE_U8;
             break;
         case CRUSTYGAME_AUDIO_TYPE_S16:
-            if((unsigned int)bufferSize * sizeof(Sint16) > state->size) {
+            if((unsigned int)bufferSize * sizeof(Sint16) > bufsize) {
                 fprintf(stderr, "Buffer too small for declared size.\n");
                 return(-1);
             }
             bufferType = SYNTH_TYPE_S16;
             break;
         case CRUSTYGAME_AUDIO_TYPE_F32:
-            if((unsigned int)bufferSize * sizeof(float) > state->size) {
+            if((unsigned int)bufferSize * sizeof(float) > bufsize) {
                 fprintf(stderr, "Buffer too small for declared size.\n");
                 return(-1);
             }
             bufferType = SYNTH_TYPE_F32;
             break;
         case CRUSTYGAME_AUDIO_TYPE_F64:
-            if((unsigned int)bufferSize * sizeof(double) > state->size) {
+            if((unsigned int)bufferSize * sizeof(double) > bufsize) {
                 fprintf(stderr, "Buffer too small for declared size.\n");
                 return(-1);
             }
@@ -1269,7 +1769,7 @@ int audio_add_buffer(void *priv,
 
     state->ret = synth_add_buffer(state->s,
                                   bufferType,
-                                  state->buffer,
+                                  buffer,
                                   bufferSize);
     if(state->ret < 0) {
         return(-1);
@@ -1934,11 +2434,155 @@ CrustyCallback cb[] = {
         .read = savedata_read_float, .readpriv = &state,
         .write = NULL, .writepriv = NULL
     },
+    {
+        .name = "savedata_write_block", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = savedata_write_block, .writepriv = &state
+    },
+    {
+        .name = "savedata_read_block", .length = 1,
+        .readType = CRUSTY_TYPE_INT,
+        .read = savedata_read_block, .readpriv = &state,
+        .write = NULL, .writepriv = NULL
+    },
+    {
+        .name = "savedata_commit", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = savedata_commit, .writepriv = &state
+    },
     {
         .name = "set_window_title", .length = 1,
         .readType = CRUSTY_TYPE_NONE,
         .read = NULL, .readpriv = NULL,
         .write = set_window_title, .writepriv = &state
+    },
+    {
+        .name = "frame_get_pending", .length = 1,
+        .readType = CRUSTY_TYPE_INT,
+        .read = frame_get_pending, .readpriv = &state,
+        .write = NULL, .writepriv = NULL
+    },
+    {
+        .name = "frame_get_lag", .length = 1,
+        .readType = CRUSTY_TYPE_FLOAT,
+        .read = frame_get_lag, .readpriv = &state,
+        .write = NULL, .writepriv = NULL
+    },
+    {
+        .name = "perf_get_event_us", .length = PERF_STATS,
+        .readType = CRUSTY_TYPE_INT,
+        .read = perf_get_event_us, .readpriv = &state,
+        .write = NULL, .writepriv = NULL
+    },
+    {
+        .name = "perf_get_frame_us", .length = PERF_STATS,
+        .readType = CRUSTY_TYPE_INT,
+        .read = perf_get_frame_us, .readpriv = &state,
+        .write = NULL, .writepriv = NULL
+    },
+    {
+        .name = "perf_get_tilemap_us", .length = PERF_STATS,
+        .readType = CRUSTY_TYPE_INT,
+        .read = perf_get_tilemap_us, .readpriv = &state,
+        .write = NULL, .writepriv = NULL
+    },
+    {
+        .name = "perf_get_present_us", .length = PERF_STATS,
+        .readType = CRUSTY_TYPE_INT,
+        .read = perf_get_present_us, .readpriv = &state,
+        .write = NULL, .writepriv = NULL
+    },
+    {
+        .name = "perf_get_total_us", .length = PERF_STATS,
+        .readType = CRUSTY_TYPE_INT,
+        .read = perf_get_total_us, .readpriv = &state,
+        .write = NULL, .writepriv = NULL
+    },
+    {
+        .name = "perf_set_overlay", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = perf_set_overlay, .writepriv = &state
+    },
+    {
+        .name = "math_sin", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = math_sin, .writepriv = &state
+    },
+    {
+        .name = "math_cos", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = math_cos, .writepriv = &state
+    },
+    {
+        .name = "math_sqrt", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = math_sqrt, .writepriv = &state
+    },
+    {
+        .name = "math_exp", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = math_exp, .writepriv = &state
+    },
+    {
+        .name = "math_log", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = math_log, .writepriv = &state
+    },
+    {
+        .name = "math_pow", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = math_pow, .writepriv = &state
+    },
+    {
+        .name = "math_lerp", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = math_lerp, .writepriv = &state
+    },
+    {
+        .name = "math_curve", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = math_curve, .writepriv = &state
+    },
+    {
+        .name = "collide_init", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = collide_init, .writepriv = &state
+    },
+    {
+        .name = "collide_set_objects", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = collide_set_objects, .writepriv = &state
+    },
+    {
+        .name = "collide_get_area", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = collide_get_area, .writepriv = &state
+    },
+    {
+        .name = "collide_get_pairs", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = collide_get_pairs, .writepriv = &state
+    },
+    {
+        .name = "collide_get_tilemap", .length = 1,
+        .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = collide_get_tilemap, .writepriv = &state
 #if 0
     },
     {
@@ -0,0 +1,565 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "collide.h"
+
+/* objects covering more cells than this aren't put in the grid, they're
+ * checked against everything instead */
+#define MAX_OBJECT_CELLS (64)
+
+#define LOG_PRINTF(C, FMT, ...) \
+    (C)->log_cb((C)->log_priv, \
+    FMT, \
+    ##__VA_ARGS__)
+
+/* cells are long long because an object's far edge, x + w - 1, may not fit
+   in an int */
+typedef struct {
+    long long cx;
+    long long cy;
+    unsigned int obj;
+} Entry;
+
+typedef struct {
+    long long x0;
+    long long y0;
+    long long x1;
+    long long y1;
+} CellRange;
+
+struct Collide_s {
+    collide_log_cb_t log_cb;
+    void *log_priv;
+
+    unsigned int cellsize;
+    unsigned int count;
+    int *obj;
+
+    /* the grid, rebuilt from obj when dirty */
+    int dirty;
+    Entry *entry; /* sorted by bucket */
+    unsigned int entries;
+    unsigned int entriesmem;
+    unsigned int *bucket; /* start of each bucket in entry, plus the end */
+    unsigned int buckets;
+    unsigned int bucketsmem;
+    unsigned int *large; /* objects too big for the grid */
+    unsigned int larges;
+};
+
+Collide *collide_new(unsigned int count,
+                     unsigned int cellsize,
+                     collide_log_cb_t log_cb,
+                     void *log_priv) {
+    Collide *c;
+
+    if(count == 0 || cellsize == 0) {
+        log_cb(log_priv, "Collision needs at least 1 object and a cell "
+                         "size.\n");
+        return(NULL);
+    }
+
+    c = malloc(sizeof(Collide));
+    if(c == NULL) {
+        log_cb(log_priv, "Failed to allocate memory for collision.\n");
+        return(NULL);
+    }
+    c->log_cb = log_cb;
+    c->log_priv = log_priv;
+    c->cellsize = cellsize;
+    c->count = count;
+    c->dirty = 1;
+    c->entry = NULL;
+    c->entries = 0;
+    c->entriesmem = 0;
+    c->bucket = NULL;
+    c->buckets = 0;
+    c->bucketsmem = 0;
+
+    c->obj = calloc(count, sizeof(int) * COLLIDE_OBJECT_SIZE);
+    if(c->obj == NULL) {
+        LOG_PRINTF(c, "Failed to allocate memory for collision objects.\n");
+        goto error;
+    }
+    c->large = malloc(sizeof(unsigned int) * count);
+    if(c->large == NULL) {
+        LOG_PRINTF(c, "Failed to allocate memory for collision objects.\n");
+        goto error_obj;
+    }
+    c->larges = 0;
+
+    return(c);
+
+error_obj:
+    free(c->obj);
+error:
+    free(c);
+
+    return(NULL);
+}
+
+void collide_free(Collide *c) {
+    if(c->entry != NULL) {
+        free(c->entry);
+    }
+    if(c->bucket != NULL) {
+        free(c->bucket);
+    }
+    free(c->large);
+    free(c->obj);
+    free(c);
+}
+
+unsigned int collide_get_count(Collide *c) {
+    return(c->count);
+}
+
+int collide_update(Collide *c,
+                   unsigned int first,
+                   const int *obj,
+                   unsigned int count) {
+    if(first > c->count || count > c->count - first) {
+        LOG_PRINTF(c, "Collision objects out of range: %u->%u\n",
+                      first, count);
+        return(-1);
+    }
+
+    memcpy(&(c->obj[first * COLLIDE_OBJECT_SIZE]), obj,
+           sizeof(int) * COLLIDE_OBJECT_SIZE * count);
+    c->dirty = 1;
+
+    return(0);
+}
+
+static int is_active(const int *obj) {
+    return(obj[COLLIDE_OBJECT_GROUPS] != 0 &&
+           obj[COLLIDE_OBJECT_W] > 0 &&
+           obj[COLLIDE_OBJECT_H] > 0);
+}
+
+static int overlaps(const int *a, int x, int y, int w, int h) {
+    return((long long)a[COLLIDE_OBJECT_X] < (long long)x + w &&
+           (long long)x < (long long)a[COLLIDE_OBJECT_X] +
+                          a[COLLIDE_OBJECT_W] &&
+           (long long)a[COLLIDE_OBJECT_Y] < (long long)y + h &&
+           (long long)y < (long long)a[COLLIDE_OBJECT_Y] +
+                          a[COLLIDE_OBJECT_H]);
+}
+
+/* rounds towards negative infinity */
+static long long floor_div(long long val, unsigned int div) {
+    if(val >= 0) {
+        return(val / div);
+    }
+    return(-((-val + div - 1) / div));
+}
+
+static void get_range(Collide *c,
+                      long long x, long long y,
+                      long long w, long long h,
+                      CellRange *r) {
+    r->x0 = floor_div(x, c->cellsize);
+    r->y0 = floor_div(y, c->cellsize);
+    r->x1 = floor_div(x + w - 1, c->cellsize);
+    r->y1 = floor_div(y + h - 1, c->cellsize);
+}
+
+/* either side is at most about 2^33 cells, so anything over UINT_MAX is just
+   reported as more than could ever be used rather than overflowing */
+static unsigned long long range_cells(const CellRange *r) {
+    unsigned long long w = r->x1 - r->x0 + 1;
+    unsigned long long h = r->y1 - r->y0 + 1;
+
+    if(w > UINT_MAX || h > UINT_MAX) {
+        return(ULLONG_MAX);
+    }
+
+    return(w * h);
+}
+
+static unsigned int hash_cell(Collide *c, long long cx, long long cy) {
+    unsigned int hash = ((unsigned int)cx * 0x9E3779B1u) ^
+                        ((unsigned int)cy * 0x85EBCA77u);
+
+    return((hash ^ (hash >> 16)) & (c->buckets - 1));
+}
+
+static int rebuild(Collide *c) {
+    unsigned int i, entries = 0;
+    unsigned int buckets;
+    long long cx, cy;
+    CellRange r;
+    int *obj;
+
+    if(!c->dirty) {
+        return(0);
+    }
+
+    /* count how much space is needed */
+    c->larges = 0;
+    for(i = 0; i < c->count; i++) {
+        obj = &(c->obj[i * COLLIDE_OBJECT_SIZE]);
+        if(!is_active(obj)) {
+            continue;
+        }
+        get_range(c, obj[COLLIDE_OBJECT_X], obj[COLLIDE_OBJECT_Y],
+                  obj[COLLIDE_OBJECT_W], obj[COLLIDE_OBJECT_H], &r);
+        if(range_cells(&r) > MAX_OBJECT_CELLS) {
+            c->large[c->larges] = i;
+            c->larges++;
+            continue;
+        }
+        entries += range_cells(&r);
+    }
+
+    if(entries > c->entriesmem) {
+        Entry *temp = realloc(c->entry, sizeof(Entry) * entries);
+        if(temp == NULL) {
+            LOG_PRINTF(c, "Failed to allocate memory for collision grid.\n");
+            return(-1);
+        }
+        c->entry = temp;
+        c->entriesmem = entries;
+    }
+    for(buckets = 1; buckets < entries; buckets *= 2);
+    if(buckets + 1 > c->bucketsmem) {
+        unsigned int *temp = realloc(c->bucket,
+                                     sizeof(unsigned int) * (buckets + 1));
+        if(temp == NULL) {
+            LOG_PRINTF(c, "Failed to allocate memory for collision grid.\n");
+            return(-1);
+        }
+        c->bucket = temp;
+        c->bucketsmem = buckets + 1;
+    }
+    c->buckets = buckets;
+    c->entries = entries;
+
+    /* counting sort in to buckets.  count each bucket's entries in the slot
+     * after it so the running total is where each starts, then place entries
+     * moving each bucket's start along, which leaves it where the next
+     * starts. */
+    memset(c->bucket, 0, sizeof(unsigned int) * (buckets + 1));
+    for(i = 0; i < c->count; i++) {
+        obj = &(c->obj[i * COLLIDE_OBJECT_SIZE]);
+        if(!is_active(obj)) {
+            continue;
+        }
+        get_range(c, obj[COLLIDE_OBJECT_X], obj[COLLIDE_OBJECT_Y],
+                  obj[COLLIDE_OBJECT_W], obj[COLLIDE_OBJECT_H], &r);
+        if(range_cells(&r) > MAX_OBJECT_CELLS) {
+            continue;
+        }
+        for(cy = r.y0; cy <= r.y1; cy++) {
+            for(cx = r.x0; cx <= r.x1; cx++) {
+                c->bucket[hash_cell(c, cx, cy) + 1]++;
+            }
+        }
+    }
+    for(i = 1; i <= buckets; i++) {
+        c->bucket[i] += c->bucket[i - 1];
+    }
+    for(i = 0; i < c->count; i++) {
+        obj = &(c->obj[i * COLLIDE_OBJECT_SIZE]);
+        if(!is_active(obj)) {
+            continue;
+        }
+        get_range(c, obj[COLLIDE_OBJECT_X], obj[COLLIDE_OBJECT_Y],
+                  obj[COLLIDE_OBJECT_W], obj[COLLIDE_OBJECT_H], &r);
+        if(range_cells(&r) > MAX_OBJECT_CELLS) {
+            continue;
+        }
+        for(cy = r.y0; cy <= r.y1; cy++) {
+            for(cx = r.x0; cx <= r.x1; cx++) {
+                unsigned int b = hash_cell(c, cx, cy);
+                Entry *e = &(c->entry[c->bucket[b]]);
+                e->cx = cx;
+                e->cy = cy;
+                e->obj = i;
+                c->bucket[b]++;
+            }
+        }
+    }
+    /* each bucket's start is now where the next one starts */
+    memmove(&(c->bucket[1]), &(c->bucket[0]), sizeof(unsigned int) * buckets);
+    c->bucket[0] = 0;
+
+    c->dirty = 0;
+    return(0);
+}
+
+/* a pair or result is only reported from the cell the top left of the
+ * overlap is in, so it's found once even if both are in more than one cell */
+static int is_first_cell(Collide *c, const Entry *e, long long x, long long y) {
+    return(floor_div(x, c->cellsize) == e->cx &&
+           floor_div(y, c->cellsize) == e->cy);
+}
+
+static long long max_ll(long long a, long long b) {
+    return(a > b ? a : b);
+}
+
+static unsigned int add_result(int *out,
+                               unsigned int outsize,
+                               unsigned int found,
+                               unsigned int size,
+                               int a, int b, int d) {
+    if((found + 1) * size <= outsize) {
+        out[found * size] = a;
+        if(size > 1) {
+            out[found * size + 1] = b;
+        }
+        if(size > 2) {
+            out[found * size + 2] = d;
+        }
+    }
+
+    return(found + 1);
+}
+
+int collide_query(Collide *c,
+                  int x,
+                  int y,
+                  int w,
+                  int h,
+                  unsigned int groups,
+                  int *out,
+                  unsigned int outsize) {
+    unsigned int found = 0;
+    unsigned int i, j;
+    long long cx, cy;
+    CellRange r;
+    int *obj;
+
+    if(w <= 0 || h <= 0) {
+        return(0);
+    }
+    if(rebuild(c) < 0) {
+        return(-1);
+    }
+
+    get_range(c, x, y, w, h, &r);
+    if(range_cells(&r) > c->entries) {
+        /* a big area would check more cells than there are objects */
+        for(i = 0; i < c->count; i++) {
+            obj = &(c->obj[i * COLLIDE_OBJECT_SIZE]);
+            if(is_active(obj) &&
+               (obj[COLLIDE_OBJECT_GROUPS] & groups) &&
+               overlaps(obj, x, y, w, h)) {
+                found = add_result(out, outsize, found, 1, i, 0, 0);
+            }
+        }
+        return(found);
+    }
+
+    for(cy = r.y0; cy <= r.y1; cy++) {
+        for(cx = r.x0; cx <= r.x1; cx++) {
+            unsigned int b = hash_cell(c, cx, cy);
+            for(j = c->bucket[b]; j < c->bucket[b + 1]; j++) {
+                Entry *e = &(c->entry[j]);
+                if(e->cx != cx || e->cy != cy) {
+                    continue;
+                }
+                obj = &(c->obj[e->obj * COLLIDE_OBJECT_SIZE]);
+                if((obj[COLLIDE_OBJECT_GROUPS] & groups) &&
+                   overlaps(obj, x, y, w, h) &&
+                   is_first_cell(c, e,
+                                 max_ll(x, obj[COLLIDE_OBJECT_X]),
+                                 max_ll(y, obj[COLLIDE_OBJECT_Y]))) {
+                    found = add_result(out, outsize, found, 1, e->obj, 0, 0);
+                }
+            }
+        }
+    }
+    for(i = 0; i < c->larges; i++) {
+        obj = &(c->obj[c->large[i] * COLLIDE_OBJECT_SIZE]);
+        if((obj[COLLIDE_OBJECT_GROUPS] & groups) &&
+           overlaps(obj, x, y, w, h)) {
+            found = add_result(out, outsize, found, 1, c->large[i], 0, 0);
+        }
+    }
+
+    return(found);
+}
+
+/* add a and b as a pair if they're from the right groups, either way
+ * around */
+static unsigned int add_pair(Collide *c,
+                             unsigned int a,
+                             unsigned int b,
+                             unsigned int groups1,
+                             unsigned int groups2,
+                             int *out,
+                             unsigned int outsize,
+                             unsigned int found) {
+    unsigned int ga = c->obj[a * COLLIDE_OBJECT_SIZE + COLLIDE_OBJECT_GROUPS];
+    unsigned int gb = c->obj[b * COLLIDE_OBJECT_SIZE + COLLIDE_OBJECT_GROUPS];
+
+    if((ga & groups1) && (gb & groups2)) {
+        return(add_result(out, outsize, found, 2, a, b, 0));
+    } else if((gb & groups1) && (ga & groups2)) {
+        return(add_result(out, outsize, found, 2, b, a, 0));
+    }
+
+    return(found);
+}
+
+int collide_pairs(Collide *c,
+                  unsigned int groups1,
+                  unsigned int groups2,
+                  int *out,
+                  unsigned int outsize) {
+    unsigned int found = 0;
+    unsigned int b, i, j;
+    int *obj1, *obj2;
+
+    if(rebuild(c) < 0) {
+        return(-1);
+    }
+
+    for(b = 0; b < c->buckets; b++) {
+        for(i = c->bucket[b]; i < c->bucket[b + 1]; i++) {
+            Entry *e1 = &(c->entry[i]);
+            obj1 = &(c->obj[e1->obj * COLLIDE_OBJECT_SIZE]);
+            if(!(obj1[COLLIDE_OBJECT_GROUPS] & (groups1 | groups2))) {
+                continue;
+            }
+            for(j = i + 1; j < c->bucket[b + 1]; j++) {
+                Entry *e2 = &(c->entry[j]);
+                if(e2->cx != e1->cx || e2->cy != e1->cy) {
+                    continue;
+                }
+                obj2 = &(c->obj[e2->obj * COLLIDE_OBJECT_SIZE]);
+                if(overlaps(obj1,
+                            obj2[COLLIDE_OBJECT_X], obj2[COLLIDE_OBJECT_Y],
+                            obj2[COLLIDE_OBJECT_W], obj2[COLLIDE_OBJECT_H]) &&
+                   is_first_cell(c, e1,
+                                 max_ll(obj1[COLLIDE_OBJECT_X],
+                                        obj2[COLLIDE_OBJECT_X]),
+                                 max_ll(obj1[COLLIDE_OBJECT_Y],
+                                        obj2[COLLIDE_OBJECT_Y]))) {
+                    found = add_pair(c, e1->obj, e2->obj, groups1, groups2,
+                                     out, outsize, found);
+                }
+            }
+        }
+    }
+
+    /* large objects against everything, large pairs only once */
+    for(i = 0; i < c->larges; i++) {
+        obj1 = &(c->obj[c->large[i] * COLLIDE_OBJECT_SIZE]);
+        if(!(obj1[COLLIDE_OBJECT_GROUPS] & (groups1 | groups2))) {
+            continue;
+        }
+        for(j = 0; j < c->count; j++) {
+            obj2 = &(c->obj[j * COLLIDE_OBJECT_SIZE]);
+            if(j == c->large[i] || !is_active(obj2)) {
+                continue;
+            }
+            if(overlaps(obj1,
+                        obj2[COLLIDE_OBJECT_X], obj2[COLLIDE_OBJECT_Y],
+                        obj2[COLLIDE_OBJECT_W], obj2[COLLIDE_OBJECT_H])) {
+                CellRange r;
+                get_range(c, obj2[COLLIDE_OBJECT_X], obj2[COLLIDE_OBJECT_Y],
+                          obj2[COLLIDE_OBJECT_W], obj2[COLLIDE_OBJECT_H], &r);
+                if(range_cells(&r) > MAX_OBJECT_CELLS && j < c->large[i]) {
+                    continue;
+                }
+                found = add_pair(c, c->large[i], j, groups1, groups2,
+                                 out, outsize, found);
+            }
+        }
+    }
+
+    return(found);
+}
+
+int collide_tilemap(Collide *c,
+                    const CollideTilemap *tm,
+                    unsigned int groups,
+                    unsigned int first,
+                    unsigned int last,
+                    unsigned int flagsmask,
+                    unsigned int flagsvalue,
+                    int *out,
+                    unsigned int outsize) {
+    unsigned int found = 0;
+    unsigned int i;
+    long long tx, ty;
+    long long tx0, ty0, tx1, ty1;
+    unsigned int tile, flags;
+    int *obj;
+
+    if(tm->tw == 0 || tm->th == 0) {
+        LOG_PRINTF(c, "Tilemap has no tile size.\n");
+        return(-1);
+    }
+
+    for(i = 0; i < c->count; i++) {
+        obj = &(c->obj[i * COLLIDE_OBJECT_SIZE]);
+        if(!is_active(obj) || !(obj[COLLIDE_OBJECT_GROUPS] & groups)) {
+            continue;
+        }
+
+        tx0 = floor_div((long long)obj[COLLIDE_OBJECT_X] - tm->x, tm->tw);
+        ty0 = floor_div((long long)obj[COLLIDE_OBJECT_Y] - tm->y, tm->th);
+        tx1 = floor_div((long long)obj[COLLIDE_OBJECT_X] +
+                        obj[COLLIDE_OBJECT_W] - 1 - tm->x, tm->tw);
+        ty1 = floor_div((long long)obj[COLLIDE_OBJECT_Y] +
+                        obj[COLLIDE_OBJECT_H] - 1 - tm->y, tm->th);
+        if(tx1 < 0 || ty1 < 0 ||
+           tx0 >= tm->w || ty0 >= tm->h) {
+            continue;
+        }
+        if(tx0 < 0) {
+            tx0 = 0;
+        }
+        if(ty0 < 0) {
+            ty0 = 0;
+        }
+        if(tx1 >= tm->w) {
+            tx1 = (long long)tm->w - 1;
+        }
+        if(ty1 >= tm->h) {
+            ty1 = (long long)tm->h - 1;
+        }
+
+        for(ty = ty0; ty <= ty1; ty++) {
+            for(tx = tx0; tx <= tx1; tx++) {
+                tile = tm->map[tm->w * ty + tx];
+                if(tile < first || tile > last) {
+                    continue;
+                }
+                flags = 0;
+                if(tm->attr_flags != NULL) {
+                    flags = tm->attr_flags[tm->w * ty + tx];
+                }
+                if((flags & flagsmask) == flagsvalue) {
+                    found = add_result(out, outsize, found, 3, i, tx, ty);
+                }
+            }
+        }
+    }
+
+    return(found);
+}
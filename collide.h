@@ -0,0 +1,101 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _COLLIDE_H
+#define _COLLIDE_H
+
+/* broad and narrow phase collision for lots of axis aligned boxes, like
+ * bullets.  objects are in a uniform grid, hashed so the world needn't have
+ * any bounds, which is rebuilt the first time it's looked at after any
+ * update. */
+
+/* each object is this many ints, x, y, w and h are the box and groups is a
+ * bitmask for filtering, an object with no groups or no area is inactive */
+#define COLLIDE_OBJECT_X      (0)
+#define COLLIDE_OBJECT_Y      (1)
+#define COLLIDE_OBJECT_W      (2)
+#define COLLIDE_OBJECT_H      (3)
+#define COLLIDE_OBJECT_GROUPS (4)
+#define COLLIDE_OBJECT_SIZE   (5)
+
+typedef struct Collide_s Collide;
+typedef void (*collide_log_cb_t)(void *priv, const char *fmt, ...);
+
+/* a tilemap as far as collision is concerned */
+typedef struct {
+    const unsigned int *map;
+    const unsigned int *attr_flags; /* may be NULL if none were ever set */
+    unsigned int w;
+    unsigned int h;
+    unsigned int tw;
+    unsigned int th;
+    int x; /* where the top left of the map is */
+    int y;
+} CollideTilemap;
+
+/* count objects, all inactive to start with.  cellsize should be around the
+ * size of the more common objects. */
+Collide *collide_new(unsigned int count,
+                     unsigned int cellsize,
+                     collide_log_cb_t log_cb,
+                     void *log_priv);
+void collide_free(Collide *c);
+unsigned int collide_get_count(Collide *c);
+/* copy count objects in, starting at first */
+int collide_update(Collide *c,
+                   unsigned int first,
+                   const int *obj,
+                   unsigned int count);
+
+/* the queries all return how many results were found, only as many as fit
+ * are written to out, which is outsize ints long. */
+
+/* objects in any of groups overlapping the box, 1 int per result, the
+ * object */
+int collide_query(Collide *c,
+                  int x,
+                  int y,
+                  int w,
+                  int h,
+                  unsigned int groups,
+                  int *out,
+                  unsigned int outsize);
+/* overlapping objects, one from groups1 and the other from groups2, 2 ints
+ * per result, the first always being the one from groups1.  each pair is
+ * only reported once. */
+int collide_pairs(Collide *c,
+                  unsigned int groups1,
+                  unsigned int groups2,
+                  int *out,
+                  unsigned int outsize);
+/* objects in any of groups overlapping tiles with values from first to last
+ * and with (flags & flagsmask) == flagsvalue, 3 ints per result, the object
+ * then the x and y of the tile */
+int collide_tilemap(Collide *c,
+                    const CollideTilemap *tm,
+                    unsigned int groups,
+                    unsigned int first,
+                    unsigned int last,
+                    unsigned int flagsmask,
+                    unsigned int flagsvalue,
+                    int *out,
+                    unsigned int outsize);
+
+#endif
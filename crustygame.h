@@ -23,6 +23,8 @@
 #include <SDL.h>
 #include "crustyvm.h"
 #include "tilemap.h"
+#include "perf.h"
+#include "collide.h"
 /*
 #include "synth.h"
 */
@@ -100,16 +102,44 @@ typedef struct {
 */
     int running;
 
-    void *buffer;
-    unsigned int size;
+    CrustySpan buffer;
     int ret;
 
     int mouseCaptured;
     int mouseReleaseCombo;
 
     unsigned int savesize;
-    FILE *savefile;
+    char *savename;
+    unsigned char *savedata; /* mapped save file */
+    size_t savemapsize;
+    unsigned int savepos;
+    int savedirty;
+
+    /* fixed logic rate scheduling, rate of 0 means run once per vsync */
+    unsigned int rate;
+    Uint64 period;
+    /* the counter frequency rarely divides evenly by rate, so the remainder is
+     * added up in deadlineFrac, in 1/rate counts, to keep ticks from drifting */
+    Uint64 periodRem;
+    Uint64 deadline;
+    Uint64 deadlineFrac;
+    unsigned int framePending;
+    double frameLag;
+    unsigned long ticks;
+    unsigned long lateTicks;
+    unsigned long droppedTicks;
+    /* microseconds init or frame may run for at once, if it isn't done by
+     * then or it yields, it's continued on the next tick */
+    unsigned int slice;
+    int suspended;
+
+    Perf perf;
+
+    Collide *collide;
 } CrustyGame;
 
 extern CrustyGame state;
+
+int commit_save_file(CrustyGame *state);
+void vprintf_cb(void *priv, const char *fmt, ...);
 #endif
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CRUSTYPLUGIN_H
+#define _CRUSTYPLUGIN_H
+
+/*
+ * Interface for plugins, shared objects which add callbacks to a script.  A
+ * script lists the plugins it wants in its metadata line, see README, and each
+ * is loaded from the script's directory before the script is.
+ *
+ * A plugin exports a function named by CRUSTY_PLUGIN_ENTRY of the type
+ * crusty_plugin_init_func_t.  It's given a CrustyPluginHost describing the
+ * game and returns a CrustyPlugin listing its callbacks, or NULL if it failed
+ * or doesn't support the host's ABI.  Both the host and plugin say which ABI
+ * they were built for, and a plugin is only used if the two are the same.
+ *
+ * CRUSTY_PLUGIN_ABI is bumped whenever anything here, or CrustyCallback,
+ * CrustyType or the callback function types in crustyvm.h change in a way
+ * that'd break a plugin built against the old ones.  The only exception is
+ * that members may be added to the end of CrustyPluginHost without bumping it.
+ * The game sets size to how big its CrustyPluginHost is, and a plugin must
+ * check any member it uses from after log_priv is within size first, like
+ * host->size >= offsetof(CrustyPluginHost, member) + sizeof(host->member).
+ */
+
+#include "crustyvm.h"
+
+#define CRUSTY_PLUGIN_ABI   (2)
+#define CRUSTY_PLUGIN_ENTRY "crusty_plugin_init"
+
+typedef struct {
+    unsigned int abi; /* CRUSTY_PLUGIN_ABI the game was built with */
+    unsigned int size; /* sizeof(CrustyPluginHost) the game was built with */
+
+    /* for printing any messages, as given to crustyvm_new() */
+    void (*log_cb)(void *priv, const char *fmt, ...);
+    void *log_priv;
+} CrustyPluginHost;
+
+typedef struct {
+    unsigned int abi; /* CRUSTY_PLUGIN_ABI the plugin was built with */
+    const char *name;
+
+    /* callbacks are added after the game's own, their names must be different
+     * to those and any other plugin's.  everything pointed to must remain
+     * valid until free is called. */
+    const CrustyCallback *cb;
+    unsigned int cbcount;
+
+    /* called once everything using the plugin is gone, before it's unloaded,
+     * may be NULL */
+    void (*free)(void);
+} CrustyPlugin;
+
+typedef const CrustyPlugin *(*crusty_plugin_init_func_t)(
+    const CrustyPluginHost *host);
+
+#endif
@@ -24,6 +24,9 @@
 #include <stddef.h>
 #include <math.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 #ifdef CRUSTY_TEST
 #include <stdarg.h>
@@ -31,28 +34,41 @@
 
 #include "crustyvm.h"
 
+#ifdef CRUSTY_JIT
+#include <sys/mman.h>
+#endif
+
 #define DEBUG_MAX_PRINT (256)
 #define MAX_SYMBOL_LEN (32)
 #define MACRO_STACK_SIZE (32)
-#define MAX_PASSES (16)
 #define MAX_INCLUDE_DEPTH (16)
+#define TOKENIZE_THREADS (4) /* most threads to load includes on */
 #define DEFAULT_CALLSTACK_SIZE (256)
+#define TOKENMEM_INITIAL_SIZE (4096)
+#define TOKENHASH_INITIAL_SIZE (1024) /* must be a power of 2 */
+#define INLINE_MAX_INSTRUCTIONS (16) /* largest procedure body to inline */
+#define INLINE_MAX_GROWTH (2) /* most the code may grow by inlining, times */
+#define RESUME_SLICE (4096) /* instructions run between checking the time */
+#define SNAPSHOT_PAGE_SIZE (256) /* granularity memory is compared at */
+#define SNAPSHOT_PAGES_INITIAL_SIZE (16)
 
 #define ALIGNMENT (sizeof(int))
+/* frames and the global area are padded to this so they all start aligned */
+#define FRAME_ALIGNMENT (sizeof(double))
 #define FIND_ALIGNMENT_VALUE(VALUE) \
     if((VALUE) % ALIGNMENT != 0) \
         (VALUE) += (ALIGNMENT - ((VALUE) % ALIGNMENT));
 
-#define TOKENLEN(OFFSET) (*((int *)&(cvm->tokenmem[OFFSET])))
-#define TOKENVAL(OFFSET) (&(cvm->tokenmem[OFFSET + sizeof(unsigned int)]))
+#define TOKENLEN(OFFSET) (*((int *)&(cvm->prog->tokenmem[OFFSET])))
+#define TOKENVAL(OFFSET) (&(cvm->prog->tokenmem[OFFSET + sizeof(unsigned int)]))
 
 #define LOG_PRINTF(CVM, FMT, ...) \
     (CVM)->log_cb((CVM)->log_priv, "%s: " FMT, (CVM)->stage, ##__VA_ARGS__)
 #define LOG_PRINTF_LINE(CVM, FMT, ...) \
     (CVM)->log_cb((CVM)->log_priv, "%s:%s:%u: " FMT, \
         (CVM)->stage, \
-        TOKENVAL((CVM)->line[(CVM)->logline].moduleOffset), \
-        (CVM)->line[(CVM)->logline].line, \
+        TOKENVAL((CVM)->prog->line[(CVM)->logline].moduleOffset), \
+        (CVM)->prog->line[(CVM)->logline].line, \
         ##__VA_ARGS__)
 #define LOG_PRINTF_BARE(CVM, FMT, ...) \
     (CVM)->log_cb((CVM)->log_priv, FMT, ##__VA_ARGS__)
@@ -60,6 +76,7 @@
 typedef struct {
     unsigned int ip;
     unsigned int proc;
+    unsigned int generation; /* unique to each call, for validating spans */
 } CrustyCallStackArg;
 
 typedef struct {
@@ -77,8 +94,15 @@ typedef struct {
     unsigned int line;
 
     unsigned int instruction;
+    int inlined; /* procedure the instruction was inlined from or -1 */
 } CrustyLine;
 
+typedef struct {
+    unsigned int start; /* from the bottom of the frame */
+    unsigned int length;
+    int zero; /* initializer is all 0 so it can just be cleared */
+} CrustyInitRange;
+
 typedef struct CrustyProcedure_s CrustyProcedure;
 
 typedef struct {
@@ -96,11 +120,8 @@ typedef struct {
                             position of reference in local stack if reference
                             position in global stack (from 0) if global */
 
-    /* callbacks for IO, both NULL if not IO */
-    crusty_io_read_func_t read;
-    void *readpriv;
-    crusty_io_write_func_t write;
-    void *writepriv;
+    /* index in to the VM's callbacks for IO, -1 if not IO */
+    int callback;
 } CrustyVariable;
 
 typedef struct {
@@ -123,6 +144,9 @@ typedef struct CrustyProcedure_s {
 
     unsigned int stackneeded;
     unsigned char *initializer;
+    /* parts of the initializer which need to be copied on a call */
+    CrustyInitRange *init;
+    unsigned int inits;
 
     CrustyLabel *label;
     unsigned int labels;
@@ -147,7 +171,14 @@ typedef enum {
     CRUSTY_INSTRUCTION_TYPE_JUMPL,
     CRUSTY_INSTRUCTION_TYPE_JUMPG,
     CRUSTY_INSTRUCTION_TYPE_CALL,
-    CRUSTY_INSTRUCTION_TYPE_RET
+    CRUSTY_INSTRUCTION_TYPE_RET,
+    CRUSTY_INSTRUCTION_TYPE_YIELD,
+    CRUSTY_INSTRUCTION_TYPE_COPY,
+    CRUSTY_INSTRUCTION_TYPE_FILL,
+    CRUSTY_INSTRUCTION_TYPE_VADD,
+    CRUSTY_INSTRUCTION_TYPE_VMUL,
+    CRUSTY_INSTRUCTION_TYPE_VAND,
+    CRUSTY_INSTRUCTION_TYPE_VOR
 } CrustyInstructionType;
 
 #define MOVE_DEST_FLAGS (1)
@@ -180,23 +211,35 @@ typedef enum {
 
 #define RET_ARGS (0)
 
-typedef struct CrustyVM_s {
-    void (*log_cb)(void *priv, const char *fmt, ...);
-    void *log_priv;
-
-    unsigned int flags;
+#define YIELD_ARGS (0)
 
-/* compile-time data */
+/* bulk array instructions are a move with a count of elements after */
+#define BULK_COUNT_FLAGS (7)
+#define BULK_COUNT_VAL   (8)
+#define BULK_COUNT_INDEX (9)
+#define BULK_ARGS BULK_COUNT_INDEX
 
-/* logging things */
-    unsigned int logline;
-    const char *stage;
+/* compiled program, read only once loaded and shared by every VM made from it
+   with crustyvm_instance() */
+typedef struct {
+    unsigned int refs;
+    pthread_mutex_t lock;
 
     CrustyLine *line;
     unsigned int lines;
 
     char *tokenmem;
     int tokenmemlen;
+    int tokenmemsize;
+    /* intern table so each distinct token is stored once and tokens can be
+       compared by offset */
+    long *tokenhash;
+    unsigned int tokenhashsize;
+    unsigned int tokenhashcount;
+
+    /* each file included, by the token it was included with */
+    long *include;
+    unsigned int includes;
 
     CrustyVariable *var;
     unsigned int vars;
@@ -211,23 +254,172 @@ typedef struct CrustyVM_s {
     unsigned int initialstack;
     unsigned char *initializer;
 
+#ifdef CRUSTY_JIT
+    unsigned char *jitmem; /* native code, NULL if not translated */
+    size_t jitmemsize;
+    unsigned int *jitoffset; /* offset in to jitmem for each instruction */
+#endif
+} CrustyProgram;
+
+/* flight recorder entry, see crustyvm_record() */
+typedef struct {
+    unsigned int ip;
+    /* procedure the instruction is in, or RECORD_CALLBACK() of a callback
+       variable it called */
+    int proc;
+} CrustyRecord;
+
+#define RECORD_EMPTY (UINT_MAX)
+/* also turns it back in to the variable */
+#define RECORD_CALLBACK(VAR) (-1 - (int)(VAR))
+
+typedef struct CrustyVM_s {
+    void (*log_cb)(void *priv, const char *fmt, ...);
+    void *log_priv;
+
+    unsigned int flags;
+
+/* logging things */
+    unsigned int logline;
+    const char *stage;
+
+    CrustyProgram *prog;
+
+    /* callbacks, which each instance may have its own of */
+    CrustyCallback *cb;
+    unsigned int cbs;
+
     unsigned int callstacksize;
 
+    const CrustyNativeProgram *native; /* from crustyvm_transpile() */
+
     /* runtime data */
     unsigned char *stack; /* runtime stack */
     CrustyCallStackArg *cstack; /* call stack */
     unsigned int sp; /* stack pointer */
     unsigned int csp; /* callstack pointer */
     unsigned int ip; /* instruction pointer */
+    unsigned int generation; /* last call generation */
     /* result of last operation, for conditional jumps */
     CrustyType resulttype;
     double floatresult;
     int intresult;
     CrustyStatus status;
+    /* instructions which may be run before returning to the host, native code
+       charges a whole loop at once so it may go below 0 */
+    int budget;
+    int yielded; /* set by yield */
+
+    /* ring of what was run last, NULL if not recording */
+    CrustyRecord *record;
+    unsigned int recordmask; /* entries - 1, always a power of 2 */
+    unsigned int recordpos; /* next entry to write, so also the oldest */
 } CrustyVM;
 
+/* a couple stores, cheap enough to leave on everywhere */
+#define RECORD(CVM, PROC) \
+    if((CVM)->record != NULL) { \
+        (CVM)->record[(CVM)->recordpos].ip = (CVM)->ip; \
+        (CVM)->record[(CVM)->recordpos].proc = (PROC); \
+        (CVM)->recordpos = ((CVM)->recordpos + 1) & (CVM)->recordmask; \
+    }
+
+/* runtime state saved by crustyvm_snapshot() */
+typedef struct {
+    unsigned int sp;
+    unsigned int csp;
+    unsigned int ip;
+    CrustyType resulttype;
+    double floatresult;
+    int intresult;
+    CrustyStatus status;
+    CrustyCallStackArg *cstack;
+
+    /* memory as it was at this snapshot, only for pages which changed before
+       the next snapshot was taken */
+    unsigned int *page;
+    unsigned char *pagemem;
+    unsigned int pages;
+    unsigned int pagessize;
+} CrustySnapshotEntry;
+
+typedef struct CrustySnapshot_s {
+    CrustyProgram *prog;
+    unsigned int callstacksize;
+
+    unsigned char *stack; /* memory as it was at the newest snapshot */
+    CrustySnapshotEntry *entry; /* ring of snapshots */
+    unsigned int entries;
+    unsigned int first; /* oldest snapshot */
+    unsigned int count; /* snapshots held */
+} CrustySnapshot;
+
+#define SNAPSHOT_ENTRY(SNAP, INDEX) \
+    (&((SNAP)->entry[((SNAP)->first + (INDEX)) % (SNAP)->entries]))
+
+/* callback functions for a variable, NULL if it has none */
+#define VAR_CB(VAR) (&(cvm->cb[(VAR)->callback]))
+#define VAR_READ(VAR) ((VAR)->callback < 0 ? NULL : VAR_CB(VAR)->read)
+#define VAR_WRITE(VAR) ((VAR)->callback < 0 ? NULL : VAR_CB(VAR)->write)
+
 /* compile-time stuff */
 
+/* a token found in a module which hasn't been added to token memory yet */
+typedef struct {
+    unsigned long start;
+    unsigned long len;
+    int quoted;
+} CrustyTokenSpan;
+
+typedef enum {
+    CRUSTY_MODULE_QUEUED,
+    CRUSTY_MODULE_RUNNING,
+    CRUSTY_MODULE_DONE
+} CrustyModuleState;
+
+typedef enum {
+    CRUSTY_MODULE_OK = 0,
+    CRUSTY_MODULE_OPEN_FAILED,
+    CRUSTY_MODULE_SEEK_FAILED,
+    CRUSTY_MODULE_SIZE_FAILED,
+    CRUSTY_MODULE_ALLOC_FAILED,
+    CRUSTY_MODULE_READ_FAILED,
+    CRUSTY_MODULE_UNTERMINATED_STRING,
+    CRUSTY_MODULE_SCAN_ALLOC_FAILED
+} CrustyModuleError;
+
+/* a file read in and split in to lines and token spans, which may happen on
+   another thread before tokenize() gets to the include */
+typedef struct CrustyModule_s {
+    char *name;
+    const char *data;
+    unsigned long len;
+    int owned; /* data was read in and should be freed */
+
+    /* token count of each line, including blank lines */
+    unsigned int *linetokens;
+    unsigned int lines;
+    unsigned int linesmem;
+    CrustyTokenSpan *span;
+    unsigned int spans;
+    unsigned int spansmem;
+
+    CrustyModuleState state;
+    CrustyModuleError error;
+
+    struct CrustyModule_s *next;
+} CrustyModule;
+
+typedef struct {
+    CrustyModule *first;
+    CrustyModule *last;
+    int quit;
+    char *safepath;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} CrustyModuleList;
+
 typedef struct {
     long nameOffset;
     unsigned int start;
@@ -343,67 +535,148 @@ static CrustyVM *init() {
         return(NULL);
     }
 
+    cvm->prog = malloc(sizeof(CrustyProgram));
+    if(cvm->prog == NULL) {
+        free(cvm);
+        return(NULL);
+    }
+
+    if(pthread_mutex_init(&(cvm->prog->lock), NULL) != 0) {
+        free(cvm->prog);
+        free(cvm);
+        return(NULL);
+    }
+
     cvm->log_cb = NULL;
     cvm->log_priv = NULL;
     cvm->stage = NULL;
-    cvm->line = NULL;
-    cvm->lines = 0;
-    cvm->tokenmem = NULL;
-    cvm->tokenmemlen = 0;
-    cvm->var = NULL;
-    cvm->vars = 0;
-    cvm->proc = NULL;
-    cvm->procs = 0;
-    cvm->inst = NULL;
-    cvm->insts = 0;
+    cvm->prog->refs = 1;
+    cvm->prog->line = NULL;
+    cvm->prog->lines = 0;
+    cvm->prog->tokenmem = NULL;
+    cvm->prog->tokenmemlen = 0;
+    cvm->prog->tokenmemsize = 0;
+    cvm->prog->tokenhash = NULL;
+    cvm->prog->tokenhashsize = 0;
+    cvm->prog->tokenhashcount = 0;
+    cvm->prog->include = NULL;
+    cvm->prog->includes = 0;
+    cvm->prog->var = NULL;
+    cvm->prog->vars = 0;
+    cvm->prog->proc = NULL;
+    cvm->prog->procs = 0;
+    cvm->prog->inst = NULL;
+    cvm->prog->insts = 0;
+    cvm->cb = NULL;
+    cvm->cbs = 0;
     cvm->stack = NULL;
     cvm->cstack = NULL;
-    cvm->initialstack = 0;
-    cvm->initializer = NULL;
+    cvm->prog->initialstack = 0;
+    cvm->prog->initializer = NULL;
+    cvm->generation = 0;
+    cvm->native = NULL;
+    cvm->budget = 0;
+    cvm->yielded = 0;
+    cvm->record = NULL;
+    cvm->recordmask = 0;
+    cvm->recordpos = 0;
+#ifdef CRUSTY_JIT
+    cvm->prog->jitmem = NULL;
+    cvm->prog->jitoffset = NULL;
+#endif
 
     return(cvm);
 }
 
-void crustyvm_free(CrustyVM *cvm) {
+static void free_program(CrustyProgram *prog) {
     unsigned int i;
 
-    if(cvm->line != NULL) {
-        for(i = 0; i < cvm->lines; i++) {
-            if(cvm->line[i].offset != NULL) {
-                free(cvm->line[i].offset);
+    if(prog->line != NULL) {
+        for(i = 0; i < prog->lines; i++) {
+            if(prog->line[i].offset != NULL) {
+                free(prog->line[i].offset);
             }
         }
-        free(cvm->line);
+        free(prog->line);
+    }
+
+    if(prog->tokenmem != NULL) {
+        free(prog->tokenmem);
     }
 
-    if(cvm->tokenmem != NULL) {
-        free(cvm->tokenmem);
+    if(prog->tokenhash != NULL) {
+        free(prog->tokenhash);
     }
 
-    if(cvm->proc != NULL) {
-        for(i = 0; i < cvm->procs; i++) {
-            if(cvm->proc[i].varIndex != NULL) {
-                free(cvm->proc[i].varIndex);
+    if(prog->include != NULL) {
+        free(prog->include);
+    }
+
+    if(prog->proc != NULL) {
+        for(i = 0; i < prog->procs; i++) {
+            if(prog->proc[i].varIndex != NULL) {
+                free(prog->proc[i].varIndex);
             }
-            if(cvm->proc[i].var != NULL) {
-                free(cvm->proc[i].var);
+            if(prog->proc[i].var != NULL) {
+                free(prog->proc[i].var);
             }
-            if(cvm->proc[i].label != NULL) {
-                free(cvm->proc[i].label);
+            if(prog->proc[i].label != NULL) {
+                free(prog->proc[i].label);
             }
-            if(cvm->proc[i].initializer != NULL) {
-                free(cvm->proc[i].initializer);
+            if(prog->proc[i].initializer != NULL) {
+                free(prog->proc[i].initializer);
+            }
+            if(prog->proc[i].init != NULL) {
+                free(prog->proc[i].init);
             }
         }
-        free(cvm->proc);
+        free(prog->proc);
+    }
+
+    if(prog->var != NULL) {
+        free(prog->var);
+    }
+
+    if(prog->inst != NULL) {
+        free(prog->inst);
+    }
+
+    if(prog->initializer != NULL) {
+        free(prog->initializer);
+    }
+
+#ifdef CRUSTY_JIT
+    if(prog->jitmem != NULL) {
+        munmap(prog->jitmem, prog->jitmemsize);
+    }
+
+    if(prog->jitoffset != NULL) {
+        free(prog->jitoffset);
     }
+#endif
+
+    pthread_mutex_destroy(&(prog->lock));
+    free(prog);
+}
 
-    if(cvm->var != NULL) {
-        free(cvm->var);
+/* the last VM or snapshot using a program frees it */
+static void release_program(CrustyProgram *prog) {
+    unsigned int refs;
+
+    pthread_mutex_lock(&(prog->lock));
+    prog->refs--;
+    refs = prog->refs;
+    pthread_mutex_unlock(&(prog->lock));
+    if(refs == 0) {
+        free_program(prog);
     }
+}
+
+void crustyvm_free(CrustyVM *cvm) {
+    release_program(cvm->prog);
 
-    if(cvm->inst != NULL) {
-        free(cvm->inst);
+    if(cvm->cb != NULL) {
+        free(cvm->cb);
     }
 
     if(cvm->stack != NULL) {
@@ -414,13 +687,138 @@ void crustyvm_free(CrustyVM *cvm) {
         free(cvm->cstack);
     }
 
-    if(cvm->initializer != NULL) {
-        free(cvm->initializer);
+    if(cvm->record != NULL) {
+        free(cvm->record);
     }
 
     free(cvm);
 }
 
+static unsigned int token_hash(const char *str, unsigned long len) {
+    unsigned int hash = 2166136261u;
+    unsigned long i;
+
+    /* FNV-1a */
+    for(i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+
+    return(hash);
+}
+
+/* find an existing token, returns its offset or -1 if there isn't one */
+static long find_token(CrustyVM *cvm, const char *str, unsigned long len) {
+    unsigned int i;
+
+    if(cvm->prog->tokenhash == NULL) {
+        return(-1);
+    }
+
+    for(i = token_hash(str, len) & (cvm->prog->tokenhashsize - 1);
+        cvm->prog->tokenhash[i] >= 0;
+        i = (i + 1) & (cvm->prog->tokenhashsize - 1)) {
+        if((unsigned long)TOKENLEN(cvm->prog->tokenhash[i]) == len &&
+           memcmp(TOKENVAL(cvm->prog->tokenhash[i]), str, len) == 0) {
+            return(cvm->prog->tokenhash[i]);
+        }
+    }
+
+    return(-1);
+}
+
+static int insert_token(CrustyVM *cvm, long offset) {
+    long *temp;
+    unsigned int size;
+    unsigned int i, j;
+
+    /* keep it at most half full */
+    if((cvm->prog->tokenhashcount + 1) * 2 > cvm->prog->tokenhashsize) {
+        size = cvm->prog->tokenhashsize == 0 ?
+               TOKENHASH_INITIAL_SIZE :
+               cvm->prog->tokenhashsize * 2;
+        temp = malloc(sizeof(long) * size);
+        if(temp == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for token table.\n");
+            return(-1);
+        }
+        for(i = 0; i < size; i++) {
+            temp[i] = -1;
+        }
+
+        for(i = 0; i < cvm->prog->tokenhashsize; i++) {
+            if(cvm->prog->tokenhash[i] < 0) {
+                continue;
+            }
+
+            for(j = token_hash(TOKENVAL(cvm->prog->tokenhash[i]),
+                               TOKENLEN(cvm->prog->tokenhash[i])) & (size - 1);
+                temp[j] >= 0;
+                j = (j + 1) & (size - 1));
+            temp[j] = cvm->prog->tokenhash[i];
+        }
+
+        if(cvm->prog->tokenhash != NULL) {
+            free(cvm->prog->tokenhash);
+        }
+        cvm->prog->tokenhash = temp;
+        cvm->prog->tokenhashsize = size;
+    }
+
+    for(i = token_hash(TOKENVAL(offset), TOKENLEN(offset)) &
+            (cvm->prog->tokenhashsize - 1);
+        cvm->prog->tokenhash[i] >= 0;
+        i = (i + 1) & (cvm->prog->tokenhashsize - 1));
+    cvm->prog->tokenhash[i] = offset;
+    cvm->prog->tokenhashcount++;
+
+    return(0);
+}
+
+/* token memory grows geometrically so adding a token is usually just a copy */
+static int reserve_token_mem(CrustyVM *cvm, unsigned long len) {
+    char *temp;
+    unsigned long size;
+
+    if(len <= (unsigned long)cvm->prog->tokenmemsize) {
+        return(0);
+    }
+
+    size = cvm->prog->tokenmemsize == 0 ?
+           TOKENMEM_INITIAL_SIZE :
+           (unsigned long)cvm->prog->tokenmemsize;
+    while(size < len) {
+        size *= 2;
+    }
+
+    temp = realloc(cvm->prog->tokenmem, size);
+    if(temp == NULL) {
+        return(-1);
+    }
+    cvm->prog->tokenmem = temp;
+    cvm->prog->tokenmemsize = size;
+
+    return(0);
+}
+
+/* a token which was just added and filled in is dropped if it's already
+   known, returns the offset of the one to use */
+static long intern_token(CrustyVM *cvm, long offset) {
+    long found;
+
+    found = find_token(cvm, TOKENVAL(offset), TOKENLEN(offset));
+    if(found >= 0) {
+        cvm->prog->tokenmemlen = offset;
+        return(found);
+    }
+
+    if(insert_token(cvm, offset) < 0) {
+        return(-1);
+    }
+
+    return(offset);
+}
+
 static long add_token(CrustyVM *cvm,
                      const char *token,
                      unsigned long len,
@@ -433,22 +831,29 @@ static long add_token(CrustyVM *cvm,
     char *end;
     unsigned char value;
     unsigned long newlen;
+    long found;
+
+    if(token != NULL && !quoted) {
+        found = find_token(cvm, token, len);
+        if(found >= 0) {
+            return(found);
+        }
+    }
 
-    oldlen = cvm->tokenmemlen;
+    oldlen = cvm->prog->tokenmemlen;
     /* original memory + new length tag + new string + null terminator for the
      * cases where a string may be printed. */
-    newlen = sizeof(unsigned int) + cvm->tokenmemlen + len + 1;
+    newlen = sizeof(unsigned int) + cvm->prog->tokenmemlen + len + 1;
     FIND_ALIGNMENT_VALUE(newlen)
-    temp = realloc(cvm->tokenmem, newlen);
-    if(temp == NULL) {
+    if(reserve_token_mem(cvm, newlen) < 0) {
         return(-1);
     }
-    cvm->tokenmem = temp;
-    temp = TOKENVAL(cvm->tokenmemlen);
+    temp = TOKENVAL(cvm->prog->tokenmemlen);
 
-    if(token == NULL) { /* just allocate the space and return it */
-        TOKENLEN(cvm->tokenmemlen) = len;
-        cvm->tokenmemlen += sizeof(unsigned int) + len + 1;
+    if(token == NULL) { /* just allocate the space and return it, the caller
+                           fills it in and passes it to intern_token() */
+        TOKENLEN(cvm->prog->tokenmemlen) = len;
+        cvm->prog->tokenmemlen = newlen;
         TOKENVAL(oldlen)[len] = '\0';
     } else {
         if(quoted) { /* much slower method and uncommonly used */
@@ -528,22 +933,22 @@ static long add_token(CrustyVM *cvm,
             }
             temp[destpos] = '\0';
             if(destpos < len) {
-                newlen = cvm->tokenmemlen + sizeof(unsigned int) + destpos + 1;
+                newlen = cvm->prog->tokenmemlen + sizeof(unsigned int) + destpos + 1;
                 FIND_ALIGNMENT_VALUE(newlen)
-                temp = realloc(cvm->tokenmem, newlen);
-                if(temp == NULL) {
-                    LOG_PRINTF(cvm, "Failed to trim tokenmem.\n");
-                    return(-1);
-                }
-                cvm->tokenmem = temp;
             }
-            TOKENLEN(cvm->tokenmemlen) = destpos;
-            cvm->tokenmemlen = newlen;
+            TOKENLEN(cvm->prog->tokenmemlen) = destpos;
+            cvm->prog->tokenmemlen = newlen;
+
+            return(intern_token(cvm, oldlen));
         } else {
             memcpy(temp, token, len);
             temp[len] = '\0';
-            TOKENLEN(cvm->tokenmemlen) = len;
-            cvm->tokenmemlen = newlen;
+            TOKENLEN(cvm->prog->tokenmemlen) = len;
+            cvm->prog->tokenmemlen = newlen;
+
+            if(insert_token(cvm, oldlen) < 0) {
+                return(-1);
+            }
         }
     }
 
@@ -563,17 +968,14 @@ static int compare_token_and_string(CrustyVM *cvm,
     return(memcmp(TOKENVAL(offset), str, len));
 }
 
+/* tokens are interned so the same offset means the same token */
 static int compare_token_and_token(CrustyVM *cvm,
                                    long offset1,
                                    long offset2) {
-    if(TOKENLEN(offset1) != TOKENLEN(offset2)) {
-        return(-1);
-    }
-
-    return(memcmp(TOKENVAL(offset1), TOKENVAL(offset2), TOKENLEN(offset1)));
+    return(offset1 == offset2 ? 0 : -1);
 }
 
-#define GET_TOKEN_OFFSET(LINE, TOKEN) (cvm->line[LINE].offset[TOKEN])
+#define GET_TOKEN_OFFSET(LINE, TOKEN) (cvm->prog->line[LINE].offset[TOKEN])
 #define GET_TOKEN(LINE, TOKEN) TOKENVAL(GET_TOKEN_OFFSET(LINE, TOKEN))
 
 #define ISJUNK(X) ((X) == ' ' || \
@@ -582,11 +984,11 @@ static int compare_token_and_token(CrustyVM *cvm,
                    (X) == '\n' || \
                    (X) == ';')
 
-#define PROGRAM (includestack[includestackptr])
-#define LEN (includesize[includestackptr])
+#define SCAN (includestack[includestackptr])
 #define MODULE (includemodule[includestackptr])
 #define LINE (includeline[includestackptr])
 #define POS (includepos[includestackptr])
+#define SPAN (includespan[includestackptr])
 
 /* this is before a bunch of stuff is guaranteed to be set up, so just fetch
    the same information from local state */
@@ -597,127 +999,164 @@ static int compare_token_and_token(CrustyVM *cvm,
         LINE, \
         ##__VA_ARGS__)
 
-static int tokenize(CrustyVM *cvm,
-                    const char *modulename,
-                    char *safepath,
-                    const char *programdata,
-                    unsigned long programdatalen) {
-    unsigned int i, j;
-    CrustyLine *temp;
-    unsigned long linelen, lineend;
-    unsigned long cursor;
-    int scanningjunk;
-    int quotedstring;
-    long tokenstart;
-    unsigned int linesmem;
+static void quiet_log(void *priv, const char *fmt, ...) {
+}
+
+static CrustyModuleError load_module(CrustyModule *mod,
+                                     char **safepath,
+                                     void (*log_cb)(void *priv,
+                                                    const char *fmt, ...),
+                                     void *log_priv) {
+    FILE *in;
     long filelen;
+    char *data;
 
-    /* data to read from */
-    const char *includestack[MAX_INCLUDE_DEPTH];
-    /* length of module */
-    unsigned long includesize[MAX_INCLUDE_DEPTH];
-    /* name of module */
-    long includemodule[MAX_INCLUDE_DEPTH];
-    /* line within current module, for line metadata */
-    unsigned int includeline[MAX_INCLUDE_DEPTH];
-    /* byte in current module */
-    unsigned long includepos[MAX_INCLUDE_DEPTH];
-    unsigned int includestackptr = 0;
+    in = crustyvm_open_file(mod->name, safepath, log_cb, log_priv);
+    if(in == NULL) {
+        return(CRUSTY_MODULE_OPEN_FAILED);
+    }
 
-    PROGRAM = programdata;
-    LEN = programdatalen;
-    tokenstart = add_token(cvm, modulename, strlen(modulename), 0, NULL);
-    if(tokenstart < 0) {
-        LOG_PRINTF(cvm, "Failed to allocate memory for module name.\n");
-        return(-1);
+    if(fseek(in, 0, SEEK_END) < 0) {
+        fclose(in);
+        return(CRUSTY_MODULE_SEEK_FAILED);
     }
-    MODULE = tokenstart;
-    LINE = 0;
-    POS = 0;
 
-    cvm->lines = 0; /* current line */
-    linesmem = 0; /* actual size of array */
+    filelen = ftell(in);
+    if(filelen < 0) {
+        fclose(in);
+        return(CRUSTY_MODULE_SIZE_FAILED);
+    }
+
+    data = malloc(filelen);
+    if(data == NULL) {
+        fclose(in);
+        return(CRUSTY_MODULE_ALLOC_FAILED);
+    }
+
+    /* read the contents in to memory */
+    rewind(in);
+    if(fread(data, 1, filelen, in) < (unsigned long)filelen) {
+        free(data);
+        fclose(in);
+        return(CRUSTY_MODULE_READ_FAILED);
+    }
+    fclose(in);
+
+    mod->data = data;
+    mod->len = filelen;
+    mod->owned = 1;
+
+    return(CRUSTY_MODULE_OK);
+}
+
+static int add_span(CrustyModule *mod,
+                    unsigned long start,
+                    unsigned long len,
+                    int quoted) {
+    CrustyTokenSpan *temp;
+    unsigned int mem;
+
+    if(mod->spans == mod->spansmem) {
+        mem = mod->spansmem == 0 ? 256 : mod->spansmem * 2;
+        temp = realloc(mod->span, sizeof(CrustyTokenSpan) * mem);
+        if(temp == NULL) {
+            return(-1);
+        }
+        mod->span = temp;
+        mod->spansmem = mem;
+    }
+
+    mod->span[mod->spans].start = start;
+    mod->span[mod->spans].len = len;
+    mod->span[mod->spans].quoted = quoted;
+    mod->spans++;
+
+    return(0);
+}
+
+/* split a module in to lines and find where the tokens are.  Nothing here
+   touches the VM so it can be done on any thread, tokens are added to token
+   memory later, in order, by tokenize(). */
+static CrustyModuleError scan_module(CrustyModule *mod) {
+    unsigned int *temp;
+    unsigned long linelen, lineend;
+    unsigned long cursor;
+    unsigned long pos;
+    unsigned long tokenstart = 0;
+    unsigned int tokencount;
+    unsigned int mem;
+    int scanningjunk;
+    int quotedstring;
+    int commented;
+
+    pos = 0;
     for(;;) {
-        LINE++;
         /* find the end of meaningful line contents and total size of line up to
            the start of the next line */
         lineend = 0;
-        for(linelen = 0; POS + linelen < LEN; linelen++) {
-            if(PROGRAM[POS + linelen] == '\r') {
+        commented = 0;
+        for(linelen = 0; pos + linelen < mod->len; linelen++) {
+            if(mod->data[pos + linelen] == '\r') {
                 linelen++;
                 /* mark this character as the end of the line, unless a comment
                    was previously found, then that is the real line end, so
                    don't overwrite it */
-                if(lineend == 0 && PROGRAM[POS] != ';') {
+                if(!commented) {
                     lineend = linelen;
                 }
-                if(POS + linelen < LEN - 1 &&
-                   PROGRAM[POS + linelen] == '\n') {
+                if(pos + linelen < mod->len - 1 &&
+                   mod->data[pos + linelen] == '\n') {
                     linelen++;
                 }
                 break;
-            } else if(PROGRAM[POS + linelen] == '\n') {
+            } else if(mod->data[pos + linelen] == '\n') {
                 linelen++;
                 /* same as above */
-                if(lineend == 0 && PROGRAM[POS] != ';') {
+                if(!commented) {
                     lineend = linelen;
                 }
-                if(POS + linelen < LEN - 1 &&
-                   PROGRAM[POS + linelen] == '\r') {
+                if(pos + linelen < mod->len - 1 &&
+                   mod->data[pos + linelen] == '\r') {
                     linelen++;
                 }
                 break;
-            } else if(PROGRAM[POS + linelen] == '"') {
+            } else if(mod->data[pos + linelen] == '"') {
                 /* allow quoted strings to span lines by scanning until the next
                    quote (or end of file) is found */
 
                 /* ignore quoted strings in comments */
-                if(lineend == 0) {
-                    while(POS + linelen < LEN - 1) {
+                if(!commented) {
+                    while(pos + linelen < mod->len - 1) {
                         linelen++;
-                        if(PROGRAM[POS + linelen] == '"' &&
-                           PROGRAM[POS + linelen - 1] != '\\') {
+                        if(mod->data[pos + linelen] == '"' &&
+                           mod->data[pos + linelen - 1] != '\\') {
                             break;
                         }
                     }
-                    if(POS + linelen == LEN - 1 && PROGRAM[POS + linelen] != '"') {
-                        LOG_PRINTF_TOK(cvm, "Quoted string reached end of file.\n");
-                        return(-1);
+                    if(pos + linelen == mod->len - 1 &&
+                       mod->data[pos + linelen] != '"') {
+                        return(CRUSTY_MODULE_UNTERMINATED_STRING);
                     }
                 }
-            } else if(PROGRAM[POS + linelen] == ';') { /* comments */
+            } else if(mod->data[pos + linelen] == ';') { /* comments */
                 /* only count the first found comment */
-                if(lineend == 0) {
+                if(!commented) {
                     lineend = linelen;
+                    commented = 1;
                 }
             }
         }
         /* scanning reached the end of file without hitting a newline, so the
            line length is just the rest of the file */
-        if(POS + linelen == LEN) {
+        if(pos + linelen == mod->len && !commented) {
             lineend = linelen;
         }
 
-        /* allocate memory for a new line if needed */
-        if(cvm->lines + 1 > linesmem) {
-            temp = realloc(cvm->line, sizeof(CrustyLine) * (linesmem + 1));
-            if(temp == NULL) {
-                LOG_PRINTF_TOK(cvm, "Failed to allocate memory for lines list.\n");
-                return(-1);
-            }
-            cvm->line = temp;
-            linesmem++;
-        }
-
-        cvm->line[cvm->lines].tokencount = 0;
-        cvm->line[cvm->lines].offset = NULL;
-        cvm->line[cvm->lines].moduleOffset = MODULE;
-        cvm->line[cvm->lines].line = LINE;
-
-        /* find starts and ends of tokens and insert them in to the line entry
+        /* find starts and ends of tokens
 
            assume we'll start with junk so if there is no junk at the start
            of the line, the first token will be marked at 0 */
+        tokencount = 0;
         scanningjunk = 1;
         quotedstring = 0;
         for(cursor = 0; cursor < lineend; cursor++) {
@@ -725,28 +1164,17 @@ static int tokenize(CrustyVM *cvm,
                 if(scanningjunk) {
                     /* if we're scanning for junk and there's still junk,
                        nothing more to do. */
-                    if(ISJUNK(PROGRAM[POS + cursor])) {
+                    if(ISJUNK(mod->data[pos + cursor])) {
                         continue;
                     }
 
-                    /* no longer junk, so create a space for the offset in to
-                       token memory. */
-                    cvm->line[cvm->lines].offset =
-                        realloc(cvm->line[cvm->lines].offset,
-                                sizeof(unsigned long) *
-                                (cvm->line[cvm->lines].tokencount + 1));
-                    if(cvm->line[cvm->lines].offset == NULL) {
-                        LOG_PRINTF_TOK(cvm, "Couldn't allocate memory for offsets.\n");
-                        return(-1);
-                    }
-
                     /* check if at the start of a quoted string */
-                    if(PROGRAM[POS + cursor] == '"') {
+                    if(mod->data[pos + cursor] == '"') {
                         /* point the start to the next character, which will
                            for sure exist because a quote at the end of the line
                            is previously checked for */
                         cursor++;
-                        tokenstart = POS + cursor;
+                        tokenstart = pos + cursor;
                         quotedstring = 1;
                         /* don't reset junk scanning because there could be junk
                            directly following a quoted string */
@@ -754,31 +1182,22 @@ static int tokenize(CrustyVM *cvm,
                     }
 
                     /* start scanning non-junk */
-                    tokenstart = POS + cursor;
+                    tokenstart = pos + cursor;
                     scanningjunk = 0;
 
                     continue;
                 }
 
                 /* if junk wasn't found, continue scanning */
-                if(!ISJUNK(PROGRAM[POS + cursor])) {
+                if(!ISJUNK(mod->data[pos + cursor])) {
                     continue;
                 }
 
-                /* transition from not junk to junk by adding the token to token
-                   memory, then pointing the current offset to the token */
-                tokenstart = add_token(cvm,
-                                       &(PROGRAM[tokenstart]),
-                                       POS + cursor - tokenstart,
-                                       0,
-                                       NULL);
-                if(tokenstart < 0) {
-                    LOG_PRINTF_TOK(cvm, "Couldn't create token.\n");
-                    return(-1);
+                /* transition from not junk to junk */
+                if(add_span(mod, tokenstart, pos + cursor - tokenstart, 0) < 0) {
+                    return(CRUSTY_MODULE_SCAN_ALLOC_FAILED);
                 }
-                cvm->line[cvm->lines].offset[cvm->line[cvm->lines].tokencount] =
-                    tokenstart;
-                cvm->line[cvm->lines].tokencount++;
+                tokencount++;
 
                 scanningjunk = 1;
             } else {
@@ -788,21 +1207,16 @@ static int tokenize(CrustyVM *cvm,
                  * found and the cursor pointer was advanced one, so there is
                  * at least a quote there before here.  this allows for
                  * quotation marks to appear in strings at all. */
-                if(PROGRAM[POS + cursor] == '"' &&
-                   PROGRAM[POS + cursor - 1] != '\\') {
+                if(mod->data[pos + cursor] == '"' &&
+                   mod->data[pos + cursor - 1] != '\\') {
                     /* transition from quoted string to junk. Same as above. */
-                    tokenstart = add_token(cvm,
-                                           &(PROGRAM[tokenstart]),
-                                           POS + cursor - tokenstart,
-                                           1, /* quoted */
-                                           &(LINE));
-                    if(tokenstart < 0) {
-                        LOG_PRINTF_TOK(cvm, "Couldn't create token.\n");
-                        return(-1);
+                    if(add_span(mod,
+                                tokenstart,
+                                pos + cursor - tokenstart,
+                                1) < 0) {
+                        return(CRUSTY_MODULE_SCAN_ALLOC_FAILED);
                     }
-                    cvm->line[cvm->lines].offset[cvm->line[cvm->lines].tokencount] =
-                        tokenstart;
-                    cvm->line[cvm->lines].tokencount++;
+                    tokencount++;
 
                     scanningjunk = 1;
                     quotedstring = 0;
@@ -810,145 +1224,531 @@ static int tokenize(CrustyVM *cvm,
             }
         }
 
-        /* check for includes */
-        if(cvm->line[cvm->lines].tokencount > 0) {
-            if(compare_token_and_string(cvm,
-                                        GET_TOKEN_OFFSET(cvm->lines, 0),
-                                        "include") == 0) {
-                if(cvm->line[cvm->lines].tokencount != 2) {
-                    LOG_PRINTF_TOK(cvm, "include takes a single filename");
-                    return(-1);
-                }
-
-                if(includestackptr == MAX_INCLUDE_DEPTH) {
-                    LOG_PRINTF_TOK(cvm, "Includes too deep.\n");
-                    return(-1);
-                }
+        if(mod->lines == mod->linesmem) {
+            mem = mod->linesmem == 0 ? 256 : mod->linesmem * 2;
+            temp = realloc(mod->linetokens, sizeof(unsigned int) * mem);
+            if(temp == NULL) {
+                return(CRUSTY_MODULE_SCAN_ALLOC_FAILED);
+            }
+            mod->linetokens = temp;
+            mod->linesmem = mem;
+        }
+        mod->linetokens[mod->lines] = tokencount;
+        mod->lines++;
 
-                /* make sure the same file isn't included from cyclicly */
-                for(i = 0; i <= includestackptr; i++) {
-                    if(compare_token_and_token(cvm,
-                                               GET_TOKEN_OFFSET(cvm->lines, 1),
-                                               includemodule[i]) == 0) {
-                        LOG_PRINTF_TOK(cvm, "Circular includes.\n");
-                        LOG_PRINTF_TOK(cvm, "%s\n", TOKENVAL(includemodule[0]));
-                        for(j = 1; j <= includestackptr; j++) {
-                            LOG_PRINTF_TOK(cvm, "-> %d include %s\n",
-                                                includeline[j],
-                                                TOKENVAL(includemodule[j]));
-                        }
-                        LOG_PRINTF_TOK(cvm, "!! %d include %s\n",
-                                            cvm->lines,
-                                            GET_TOKEN(cvm->lines, 1));
-                        return(-1);
-                    }
-                }
+        pos += linelen;
+        if(pos == mod->len) {
+            break;
+        }
+    }
 
-                /* load the file in to program memory.  Can't use any of the
-                   convenience macros though so log messages point to the right
-                   line/module */
-                FILE *in;
-                in = crustyvm_open_file(GET_TOKEN(cvm->lines, 1),
-                                        &safepath,
-                                        cvm->log_cb,
-                                        cvm->log_priv);
-                if(in == NULL) {
-                    LOG_PRINTF_TOK(cvm, "Failed to open include file %s.\n",
-                                        GET_TOKEN(cvm->lines, 1));
-                    return(-1);
-                }
+    return(CRUSTY_MODULE_OK);
+}
 
-                if(fseek(in, 0, SEEK_END) < 0) {
-                    LOG_PRINTF_TOK(cvm, "Failed to seek include file.\n");
-                    return(-1);
-                }
+static void init_module(CrustyModule *mod) {
+    mod->name = NULL;
+    mod->data = NULL;
+    mod->len = 0;
+    mod->owned = 0;
+    mod->linetokens = NULL;
+    mod->lines = 0;
+    mod->linesmem = 0;
+    mod->span = NULL;
+    mod->spans = 0;
+    mod->spansmem = 0;
+    mod->state = CRUSTY_MODULE_QUEUED;
+    mod->error = CRUSTY_MODULE_OK;
+    mod->next = NULL;
+}
 
-                filelen = ftell(in);
-                if(filelen < 0) {
-                    LOG_PRINTF_TOK(cvm, "Failed to get include file size.\n");
-                    return(-1);
-                }
-                includesize[includestackptr+1] = (unsigned long)filelen;
+static void free_module(CrustyModule *mod) {
+    if(mod->name != NULL) {
+        free(mod->name);
+    }
+    if(mod->owned) {
+        free((char *)(mod->data));
+    }
+    if(mod->linetokens != NULL) {
+        free(mod->linetokens);
+    }
+    if(mod->span != NULL) {
+        free(mod->span);
+    }
+}
 
-                includestack[includestackptr+1] = malloc(includesize[includestackptr+1]);
-                if(includestack[includestackptr+1] == NULL) {
-                    LOG_PRINTF_TOK(cvm, "Failed to allocate memory for include.\n");
-                    return(-1);
-                }
+/* should be called with the list locked */
+static CrustyModule *find_module(CrustyModuleList *list,
+                                 const char *name,
+                                 unsigned long len) {
+    CrustyModule *mod;
 
-                /* read the contents in to memory */
-                rewind(in);
-                /* needs to be made non-const so this buffer can be read in to,
-                   but the array is of const char ** because the 0th entry is
-                   always the const char passed in to the function, which is
-                   never modified. */
-                if(fread((char *)(includestack[includestackptr+1]),
-                         1,
-                         includesize[includestackptr+1],
-                         in) < includesize[includestackptr+1]) {
-                    LOG_PRINTF_TOK(cvm, "Failed to read include file.\n");
-                    return(-1);
-                }
-                fclose(in);
+    for(mod = list->first; mod != NULL; mod = mod->next) {
+        if(strlen(mod->name) == len && memcmp(mod->name, name, len) == 0) {
+            return(mod);
+        }
+    }
 
-                /* go past the include line */
-                POS += linelen;
+    return(NULL);
+}
 
-                /* add the module name */
-                includestackptr++;
-                MODULE = cvm->line[cvm->lines].offset[1];
-                LINE = 0;
-                POS = 0;
+/* should be called with the list locked */
+static CrustyModule *add_module(CrustyModuleList *list,
+                                const char *name,
+                                unsigned long len) {
+    CrustyModule *mod;
+
+    mod = malloc(sizeof(CrustyModule));
+    if(mod == NULL) {
+        return(NULL);
+    }
+    init_module(mod);
 
-                /* we're done with this line and it won't end up in the line
-                   list so free its offsets and it will be reused, tokencount
-                   will be reset later */
-                free(cvm->lines[cvm->line].offset);
-                cvm->lines[cvm->line].offset = NULL;
+    mod->name = malloc(len + 1);
+    if(mod->name == NULL) {
+        free(mod);
+        return(NULL);
+    }
+    memcpy(mod->name, name, len);
+    mod->name[len] = '\0';
 
-                /* don't advance line count */
-                continue;
-            } else { /* no include, so just advance things normal */
-                POS += linelen;
-                cvm->lines++;
+    if(list->last == NULL) {
+        list->first = mod;
+    } else {
+        list->last->next = mod;
+    }
+    list->last = mod;
+
+    return(mod);
+}
+
+/* queue up anything the module includes to be loaded, returns how many new
+   modules were queued.  Includes with quoted names are left to be loaded when
+   they're reached.  Should be called with the list locked. */
+static unsigned int queue_includes(CrustyModuleList *list, CrustyModule *mod) {
+    unsigned int i;
+    unsigned int span;
+    CrustyTokenSpan *token;
+    unsigned int queued = 0;
+
+    span = 0;
+    for(i = 0; i < mod->lines; i++) {
+        token = &(mod->span[span]);
+        span += mod->linetokens[i];
+
+        if(mod->linetokens[i] != 2 ||
+           token[0].quoted || token[1].quoted ||
+           token[0].len != 7 ||
+           memcmp(&(mod->data[token[0].start]), "include", 7) != 0) {
+            continue;
+        }
+
+        if(find_module(list,
+                       &(mod->data[token[1].start]),
+                       token[1].len) != NULL) {
+            continue;
+        }
+
+        /* it's only a prefetch so if this fails, it'll be tried again when
+           the include is reached */
+        if(add_module(list,
+                      &(mod->data[token[1].start]),
+                      token[1].len) != NULL) {
+            queued++;
+        }
+    }
+
+    return(queued);
+}
+
+/* load and scan a module, should be called with the list locked and
+   returns with it locked */
+static void run_module(CrustyModuleList *list, CrustyModule *mod) {
+    mod->state = CRUSTY_MODULE_RUNNING;
+    pthread_mutex_unlock(&(list->lock));
+
+    /* nothing is logged here because this might be happening on another
+       thread and ahead of where tokenize() is, if it failed, it'll be loaded
+       again when the include is reached so the reason can be logged */
+    mod->error = load_module(mod, &(list->safepath), quiet_log, NULL);
+    if(mod->error == CRUSTY_MODULE_OK) {
+        mod->error = scan_module(mod);
+    }
+
+    pthread_mutex_lock(&(list->lock));
+    mod->state = CRUSTY_MODULE_DONE;
+    queue_includes(list, mod);
+    pthread_cond_broadcast(&(list->cond));
+}
+
+static void *tokenize_thread(void *priv) {
+    CrustyModuleList *list = (CrustyModuleList *)priv;
+    CrustyModule *mod;
+
+    pthread_mutex_lock(&(list->lock));
+    while(!list->quit) {
+        for(mod = list->first; mod != NULL; mod = mod->next) {
+            if(mod->state == CRUSTY_MODULE_QUEUED) {
+                break;
             }
-        } else { /* don't have lines increment if it's a blank line */
-            /* no need to free offset because no token was ever found */
-            POS += linelen;
         }
 
+        if(mod == NULL) {
+            pthread_cond_wait(&(list->cond), &(list->lock));
+            continue;
+        }
+
+        run_module(list, mod);
+    }
+    pthread_mutex_unlock(&(list->lock));
+
+    return(NULL);
+}
+
+/* get a module which is ready to be added, loading it here if no other thread
+   has gotten to it yet */
+static CrustyModule *get_module(CrustyModuleList *list, const char *name) {
+    CrustyModule *mod;
+
+    pthread_mutex_lock(&(list->lock));
+    mod = find_module(list, name, strlen(name));
+    if(mod == NULL) {
+        mod = add_module(list, name, strlen(name));
+        if(mod == NULL) {
+            pthread_mutex_unlock(&(list->lock));
+            return(NULL);
+        }
+    }
+
+    if(mod->state == CRUSTY_MODULE_QUEUED) {
+        run_module(list, mod);
+    }
+    while(mod->state != CRUSTY_MODULE_DONE) {
+        pthread_cond_wait(&(list->cond), &(list->lock));
+    }
+    pthread_mutex_unlock(&(list->lock));
+
+    return(mod);
+}
+
+static int tokenize(CrustyVM *cvm,
+                    const char *modulename,
+                    char *safepath,
+                    const char *programdata,
+                    unsigned long programdatalen) {
+    unsigned int i, j;
+    CrustyLine *temp;
+    long *include;
+    unsigned int inc;
+    long tokenstart;
+    unsigned int linesmem;
+    unsigned int tokencount;
+    int ret = -1;
+
+    CrustyModuleList list;
+    CrustyModule program;
+    CrustyModule *mod;
+    pthread_t thread[TOKENIZE_THREADS];
+    unsigned int threads = 0;
+    unsigned int queued;
+
+    /* module to read from */
+    CrustyModule *includestack[MAX_INCLUDE_DEPTH];
+    /* name of module */
+    long includemodule[MAX_INCLUDE_DEPTH];
+    /* line within current module, for line metadata */
+    unsigned int includeline[MAX_INCLUDE_DEPTH];
+    /* scanned line in current module */
+    unsigned int includepos[MAX_INCLUDE_DEPTH];
+    /* next token span in current module */
+    unsigned int includespan[MAX_INCLUDE_DEPTH];
+    unsigned int includestackptr = 0;
+
+    list.first = NULL;
+    list.last = NULL;
+    list.quit = 0;
+    list.safepath = safepath;
+    if(pthread_mutex_init(&(list.lock), NULL) != 0) {
+        LOG_PRINTF(cvm, "Failed to create include list lock.\n");
+        return(-1);
+    }
+    if(pthread_cond_init(&(list.cond), NULL) != 0) {
+        LOG_PRINTF(cvm, "Failed to create include list condition.\n");
+        pthread_mutex_destroy(&(list.lock));
+        return(-1);
+    }
+
+    init_module(&program);
+    program.data = programdata;
+    program.len = programdatalen;
+    program.state = CRUSTY_MODULE_DONE;
+    /* any error is reported when the line it happened on is reached */
+    program.error = scan_module(&program);
+
+    tokenstart = add_token(cvm, modulename, strlen(modulename), 0, NULL);
+    if(tokenstart < 0) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for module name.\n");
+        goto error;
+    }
+    MODULE = tokenstart;
+    SCAN = &program;
+    LINE = 0;
+    POS = 0;
+    SPAN = 0;
+
+    /* start loading anything the program includes while the program is being
+       tokenized.  Without a safe path, the first include decides it so
+       everything has to be loaded in order. */
+    pthread_mutex_lock(&(list.lock));
+    queued = queue_includes(&list, &program);
+    pthread_mutex_unlock(&(list.lock));
+    if(safepath != NULL) {
+        for(threads = 0;
+            threads < TOKENIZE_THREADS && threads < queued;
+            threads++) {
+            if(pthread_create(&(thread[threads]),
+                              NULL,
+                              tokenize_thread,
+                              &list) != 0) {
+                /* whatever isn't loaded will just be loaded here */
+                break;
+            }
+        }
+    }
+
+    cvm->prog->lines = 0; /* current line */
+    linesmem = 0; /* actual size of array */
+    for(;;) {
         /* reached the end, so pop it off, if already at the bottom, tokenizing
            is done */
-        if(POS == LEN) {
+        if(POS == SCAN->lines) {
+            if(SCAN->error == CRUSTY_MODULE_UNTERMINATED_STRING) {
+                LINE++;
+                LOG_PRINTF_TOK(cvm, "Quoted string reached end of file.\n");
+                goto error;
+            } else if(SCAN->error == CRUSTY_MODULE_SCAN_ALLOC_FAILED) {
+                LINE++;
+                LOG_PRINTF_TOK(cvm, "Failed to allocate memory for lines list.\n");
+                goto error;
+            }
+
             if(includestackptr == 0) {
                 break;
             }
-            /* see comment above before fread() */
-            free((char *)PROGRAM);
             includestackptr--;
+            continue;
+        }
+
+        LINE++;
+        tokencount = SCAN->linetokens[POS];
+        POS++;
+        /* don't have lines increment if it's a blank line */
+        if(tokencount == 0) {
+            continue;
+        }
+
+        /* allocate memory for a new line if needed */
+        if(cvm->prog->lines + 1 > linesmem) {
+            temp = realloc(cvm->prog->line, sizeof(CrustyLine) *
+                                      (linesmem == 0 ? 256 : linesmem * 2));
+            if(temp == NULL) {
+                LOG_PRINTF_TOK(cvm, "Failed to allocate memory for lines list.\n");
+                goto error;
+            }
+            cvm->prog->line = temp;
+            linesmem = linesmem == 0 ? 256 : linesmem * 2;
+        }
+
+        cvm->prog->line[cvm->prog->lines].tokencount = 0;
+        cvm->prog->line[cvm->prog->lines].moduleOffset = MODULE;
+        cvm->prog->line[cvm->prog->lines].line = LINE;
+        cvm->prog->line[cvm->prog->lines].offset = malloc(sizeof(unsigned long) *
+                                              tokencount);
+        if(cvm->prog->line[cvm->prog->lines].offset == NULL) {
+            LOG_PRINTF_TOK(cvm, "Couldn't allocate memory for offsets.\n");
+            goto error;
+        }
+        /* count it now so it's freed if anything fails */
+        cvm->prog->lines++;
+
+        /* add the tokens to token memory */
+        for(i = 0; i < tokencount; i++) {
+            tokenstart = add_token(cvm,
+                                   &(SCAN->data[SCAN->span[SPAN].start]),
+                                   SCAN->span[SPAN].len,
+                                   SCAN->span[SPAN].quoted,
+                                   &(LINE));
+            if(tokenstart < 0) {
+                LOG_PRINTF_TOK(cvm, "Couldn't create token.\n");
+                goto error;
+            }
+            SPAN++;
+            cvm->prog->line[cvm->prog->lines - 1].offset[i] = tokenstart;
+            cvm->prog->line[cvm->prog->lines - 1].tokencount++;
+        }
+
+        /* check for includes */
+        if(compare_token_and_string(cvm,
+                                    GET_TOKEN_OFFSET(cvm->prog->lines - 1, 0),
+                                    "include") == 0) {
+            /* the include line won't end up in the line list */
+            cvm->prog->lines--;
+
+            if(cvm->prog->line[cvm->prog->lines].tokencount != 2) {
+                LOG_PRINTF_TOK(cvm, "include takes a single filename");
+                free(cvm->prog->line[cvm->prog->lines].offset);
+                goto error;
+            }
+
+            if(includestackptr == MAX_INCLUDE_DEPTH - 1) {
+                LOG_PRINTF_TOK(cvm, "Includes too deep.\n");
+                free(cvm->prog->line[cvm->prog->lines].offset);
+                goto error;
+            }
+
+            /* make sure the same file isn't included from cyclicly */
+            for(i = 0; i <= includestackptr; i++) {
+                if(compare_token_and_token(cvm,
+                                           GET_TOKEN_OFFSET(cvm->prog->lines, 1),
+                                           includemodule[i]) == 0) {
+                    LOG_PRINTF_TOK(cvm, "Circular includes.\n");
+                    LOG_PRINTF_TOK(cvm, "%s\n", TOKENVAL(includemodule[0]));
+                    for(j = 1; j <= includestackptr; j++) {
+                        LOG_PRINTF_TOK(cvm, "-> %d include %s\n",
+                                            includeline[j],
+                                            TOKENVAL(includemodule[j]));
+                    }
+                    LOG_PRINTF_TOK(cvm, "!! %d include %s\n",
+                                        cvm->prog->lines,
+                                        GET_TOKEN(cvm->prog->lines, 1));
+                    free(cvm->prog->line[cvm->prog->lines].offset);
+                    goto error;
+                }
+            }
+
+            mod = get_module(&list, GET_TOKEN(cvm->prog->lines, 1));
+            if(mod == NULL) {
+                LOG_PRINTF_TOK(cvm, "Failed to allocate memory for include.\n");
+                free(cvm->prog->line[cvm->prog->lines].offset);
+                goto error;
+            }
+
+            /* load it again if it failed so the reason is logged.  Can't use
+               any of the convenience macros though so log messages point to
+               the right line/module */
+            if(mod->error != CRUSTY_MODULE_OK &&
+               mod->error != CRUSTY_MODULE_UNTERMINATED_STRING &&
+               mod->error != CRUSTY_MODULE_SCAN_ALLOC_FAILED) {
+                mod->error = load_module(mod,
+                                         &(list.safepath),
+                                         cvm->log_cb,
+                                         cvm->log_priv);
+                if(mod->error == CRUSTY_MODULE_OK) {
+                    mod->error = scan_module(mod);
+                }
+            }
+
+            switch(mod->error) {
+                case CRUSTY_MODULE_OPEN_FAILED:
+                    LOG_PRINTF_TOK(cvm, "Failed to open include file %s.\n",
+                                        GET_TOKEN(cvm->prog->lines, 1));
+                    break;
+                case CRUSTY_MODULE_SEEK_FAILED:
+                    LOG_PRINTF_TOK(cvm, "Failed to seek include file.\n");
+                    break;
+                case CRUSTY_MODULE_SIZE_FAILED:
+                    LOG_PRINTF_TOK(cvm, "Failed to get include file size.\n");
+                    break;
+                case CRUSTY_MODULE_ALLOC_FAILED:
+                    LOG_PRINTF_TOK(cvm, "Failed to allocate memory for include.\n");
+                    break;
+                case CRUSTY_MODULE_READ_FAILED:
+                    LOG_PRINTF_TOK(cvm, "Failed to read include file.\n");
+                    break;
+                default:
+                    /* scanning errors are reported when they're reached */
+                    break;
+            }
+            if(mod->error >= CRUSTY_MODULE_OPEN_FAILED &&
+               mod->error <= CRUSTY_MODULE_READ_FAILED) {
+                free(cvm->prog->line[cvm->prog->lines].offset);
+                goto error;
+            }
+
+            /* names are interned, so a file included again has the same one */
+            for(inc = 0; inc < cvm->prog->includes; inc++) {
+                if(cvm->prog->include[inc] ==
+                   (long)cvm->prog->line[cvm->prog->lines].offset[1]) {
+                    break;
+                }
+            }
+            if(inc == cvm->prog->includes) {
+                include = realloc(cvm->prog->include,
+                                  sizeof(long) * (cvm->prog->includes + 1));
+                if(include == NULL) {
+                    LOG_PRINTF_TOK(cvm, "Failed to allocate memory for include list.\n");
+                    free(cvm->prog->line[cvm->prog->lines].offset);
+                    goto error;
+                }
+                cvm->prog->include = include;
+                cvm->prog->include[cvm->prog->includes] =
+                    cvm->prog->line[cvm->prog->lines].offset[1];
+                cvm->prog->includes++;
+            }
+
+            /* add the module name */
+            includestackptr++;
+            SCAN = mod;
+            MODULE = cvm->prog->line[cvm->prog->lines].offset[1];
+            LINE = 0;
+            POS = 0;
+            SPAN = 0;
+
+            /* we're done with this line so free its offsets */
+            free(cvm->prog->line[cvm->prog->lines].offset);
         }
     }
 
-    return(0);
+    ret = 0;
+
+error:
+    pthread_mutex_lock(&(list.lock));
+    list.quit = 1;
+    pthread_cond_broadcast(&(list.cond));
+    pthread_mutex_unlock(&(list.lock));
+    for(i = 0; i < threads; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    pthread_cond_destroy(&(list.cond));
+    pthread_mutex_destroy(&(list.lock));
+
+    while(list.first != NULL) {
+        mod = list.first;
+        list.first = mod->next;
+        free_module(mod);
+        free(mod);
+    }
+    free_module(&program);
+
+    return(ret);
 }
 
 #undef LOG_PRINTF_TOK
 #undef LINE
 #undef MODULE
-#undef LEN
-#undef PROGRAM
+#undef SCAN
+#undef SPAN
 #undef ISJUNK
 
 static CrustyMacro *find_macro(CrustyVM *cvm,
                                CrustyMacro *macro,
                                unsigned int count,
-                               const char *name) {
+                               long nameOffset) {
     unsigned int i;
 
     for(i = 0; i < count; i++) {
-        if(compare_token_and_string(cvm,
-                                    macro[i].nameOffset,
-                                    name) == 0) {
+        if(compare_token_and_token(cvm,
+                                   macro[i].nameOffset,
+                                   nameOffset) == 0) {
             return(&(macro[i]));
         }
     }
@@ -1041,7 +1841,7 @@ static long string_replace(CrustyVM *cvm,
     /* see if there's anything after the last macro replacement to copy over */
     memcpy(&(temp[dstpos]), &(token[srcpos]), newlen - dstpos);
 
-    return(tokenstart);
+    return(intern_token(cvm, tokenstart));
 }
 
 /* I wrote this kinda crappily, and when adding a bunch more operators it got
@@ -1770,7 +2570,7 @@ static long evaluate_expr(CrustyVM *cvm,
     }
     free(expr);
 
-    return(tokenstart);
+    return(intern_token(cvm, tokenstart));
 error:
     if(expr != NULL) {
         free(expr);
@@ -1781,7 +2581,7 @@ error:
 
 #undef ISJUNK
 
-#define INSTRUCTION_COUNT (26)
+#define INSTRUCTION_COUNT (33)
 
 static int valid_instruction(const char *name) {
     int i;
@@ -1812,6 +2612,13 @@ static int valid_instruction(const char *name) {
         "jumpz",
         "jumpl",
         "jumpg",
+        "yield",
+        "copy",
+        "fill",
+        "vadd",
+        "vmul",
+        "vand",
+        "vor",
         "binclude"
     };  
 
@@ -1839,6 +2646,8 @@ static int preprocess(CrustyVM *cvm,
     char *temp;
 
     CrustyLine active;
+    unsigned int activemem;
+    int rewritten;
     active.offset = NULL;
 
     CrustyMacro *macro = NULL;
@@ -1849,30 +2658,36 @@ static int preprocess(CrustyVM *cvm,
     CrustyMacro *macrostack[MACRO_STACK_SIZE];
     long *macroargs[MACRO_STACK_SIZE];
     int macrostackptr = -1;
+    int depth;
 
     long *vars = NULL;
     long *values = NULL;
     unsigned int varcount = 0;
 
-    int foundmacro = 0;
-
     long tokenstart;
 
     mem = 0; /* actual memory allocated for line */
     lines = 0; /* size of initialized array */
+    activemem = 0;
 
+    /* everything is done in a single pass.  Macro calls push the line to
+       return to and continue from the start of the macro body so expanded lines
+       are evaluated as they're output, and evaluated ifs are rewritten in place
+       and looked at again. */
     cvm->logline = 0; /* line being evaluated */
-    while(cvm->logline < cvm->lines) {
+    while(cvm->logline < cvm->prog->lines) {
         /* no need to check if tokencount > 0 because those lines were filtered
            out previously */
 
-        if(active.offset != NULL) {
-            free(active.offset);
-        }
-        active.offset = malloc(sizeof(long) * cvm->line[cvm->logline].tokencount);
-        if(active.offset == NULL) {
-            LOG_PRINTF_LINE(cvm, "Failed to allocate memory for active token arguments.");
-            goto failure;
+        if(cvm->prog->line[cvm->logline].tokencount > activemem) {
+            temp = realloc(active.offset,
+                           sizeof(long) * cvm->prog->line[cvm->logline].tokencount);
+            if(temp == NULL) {
+                LOG_PRINTF_LINE(cvm, "Failed to allocate memory for active token arguments.");
+                goto failure;
+            }
+            active.offset = (unsigned long *)temp;
+            activemem = cvm->prog->line[cvm->logline].tokencount;
         }
 
 #ifdef CRUSTY_TEST
@@ -1880,21 +2695,22 @@ static int preprocess(CrustyVM *cvm,
         if(macrostackptr >= 0) {
             LOG_PRINTF_BARE(cvm, "%s ", TOKENVAL(macrostack[macrostackptr]->nameOffset);
         }
-        for(i = 0; i < cvm->line[cvm->logline].tokencount; i++) {
-            LOG_PRINTF_BARE(cvm, "%s ", TOKENVAL(cvm->line[cvm->logline].offset[i]);
+        for(i = 0; i < cvm->prog->line[cvm->logline].tokencount; i++) {
+            LOG_PRINTF_BARE(cvm, "%s ", TOKENVAL(cvm->prog->line[cvm->logline].offset[i]);
         }
         LOG_PRINTF_BARE(cvm, "\n");
 #endif
 
         /* make mutable active line */
-        active.tokencount = cvm->line[cvm->logline].tokencount;
-        active.moduleOffset = cvm->line[cvm->logline].moduleOffset;
-        active.line = cvm->line[cvm->logline].line;
+        active.tokencount = cvm->prog->line[cvm->logline].tokencount;
+        active.moduleOffset = cvm->prog->line[cvm->logline].moduleOffset;
+        active.line = cvm->prog->line[cvm->logline].line;
 
         /* replace any tokens with tokens containing any possible macro
            replacement values */
+        rewritten = 0;
         for(i = 0; i < active.tokencount; i++) {
-            active.offset[i] = cvm->line[cvm->logline].offset[i];
+            active.offset[i] = cvm->prog->line[cvm->logline].offset[i];
             /* don't rewrite the line at all if it's ending the current
              * macro. */
             if(!(macrostackptr >= 0 && i == 1 &&
@@ -1955,6 +2771,9 @@ static int preprocess(CrustyVM *cvm,
                     active.offset[i] = tokenstart;
                 }
             }
+            if(active.offset[i] != cvm->prog->line[cvm->logline].offset[i]) {
+                rewritten = 1;
+            }
         }
 
 #ifdef CRUSTY_TEST
@@ -1977,7 +2796,7 @@ static int preprocess(CrustyVM *cvm,
 
                 /* if the macro wasn't found, allocate space for it, otherwise
                    override previous declaration */
-                curmacro = find_macro(cvm, macro, macrocount, GET_ACTIVE(1));
+                curmacro = find_macro(cvm, macro, macrocount, active.offset[1]);
                 if(curmacro == NULL) {
                     curmacro = realloc(macro, sizeof(CrustyMacro) * (macrocount + 1));
                     if(curmacro == NULL) {
@@ -2007,8 +2826,6 @@ static int preprocess(CrustyVM *cvm,
 
                 /* suppress copying evaluated macro in to destination */
                 goto skip_copy;
-            } else {
-                foundmacro = 1;
             }
         } else if(compare_token_and_string(cvm,
                                            active.offset[0],
@@ -2085,10 +2902,10 @@ static int preprocess(CrustyVM *cvm,
                 if(dothing) {
                     /* move everything over 2 */
                     for(j = 2; j < active.tokencount; j++) {
-                        cvm->line[cvm->logline].offset[j - 2] =
-                            cvm->line[cvm->logline].offset[j];
+                        cvm->prog->line[cvm->logline].offset[j - 2] =
+                            cvm->prog->line[cvm->logline].offset[j];
                     }
-                    cvm->line[cvm->logline].tokencount -= 2;
+                    cvm->prog->line[cvm->logline].tokencount -= 2;
 
                     continue; /* don't copy but reevaluate */
                 }
@@ -2131,8 +2948,6 @@ static int preprocess(CrustyVM *cvm,
                varcount++;
 
                goto skip_copy;
-           } else {
-               foundmacro = 1;
            }
         } else if(!valid_instruction(GET_ACTIVE(0))) {
             /* don't evaluate macro calls while reading in a macro, only
@@ -2140,22 +2955,25 @@ static int preprocess(CrustyVM *cvm,
             if(curmacro == NULL) {
                 if(macrostackptr == MACRO_STACK_SIZE - 1) {
                     LOG_PRINTF_LINE(cvm, "Macro stack filled.\n");
+                    goto failure;
                 }
 
                 macrostack[macrostackptr + 1] = find_macro(cvm,
                                                            macro,
                                                            macrocount,
-                                                           GET_ACTIVE(0));
+                                                           active.offset[0]);
                 if(macrostack[macrostackptr + 1] == NULL) {
                     LOG_PRINTF_LINE(cvm, "Invalid keyword or macro not found: %s.\n",
                                         GET_ACTIVE(0));
                     goto failure;
                 }
 
-                if(macrostack[macrostackptr + 1] == curmacro) {
-                    LOG_PRINTF_LINE(cvm, "Macro called recursively: %s.\n",
-                                        TOKENVAL(curmacro->nameOffset));
-                    goto failure;
+                for(depth = 0; depth <= macrostackptr; depth++) {
+                    if(macrostack[macrostackptr + 1] == macrostack[depth]) {
+                        LOG_PRINTF_LINE(cvm, "Macro called recursively: %s.\n",
+                                            TOKENVAL(macrostack[depth]->nameOffset));
+                        goto failure;
+                    }
                 }
                 if(active.tokencount - 1 !=
                    macrostack[macrostackptr + 1]->argcount) {
@@ -2181,33 +2999,38 @@ static int preprocess(CrustyVM *cvm,
 
                 /* don't copy the next line but make sure it's still evaluated */
                 continue;
-            } else {
-                foundmacro = 1;
             }
         }
 
         /* don't actually output a macro being read in */
         if(curmacro == NULL) {
             if(lines == mem) {
-                temp = realloc(new, sizeof(CrustyLine) * (mem + 1));
+                mem = mem == 0 ? cvm->prog->lines : mem * 2;
+                temp = realloc(new, sizeof(CrustyLine) * mem);
                 if(temp == NULL) {
                     LOG_PRINTF_LINE(cvm, "Failed to allocate memory for line copy.\n");
                     goto failure;
                 }
                 new = (CrustyLine *)temp;
-                mem++;
             }
 
             new[lines].tokencount = active.tokencount;
             new[lines].moduleOffset = active.moduleOffset;
             new[lines].line = active.line;
-            new[lines].offset = malloc(sizeof(long) * new[lines].tokencount);
-            if(new[lines].offset == NULL) {
-                LOG_PRINTF_LINE(cvm, "Failed to allocate memory for line offsets copy.\n");
-                goto failure;
-            }
-            for(i = 0; i < new[lines].tokencount; i++) {
-                new[lines].offset[i] = active.offset[i];
+            if(macrostackptr < 0 && !rewritten) {
+                /* lines outside of a macro are never visited again, so if
+                   nothing changed, the line can just be moved over */
+                new[lines].offset = cvm->prog->line[cvm->logline].offset;
+                cvm->prog->line[cvm->logline].offset = NULL;
+            } else {
+                new[lines].offset = malloc(sizeof(long) * new[lines].tokencount);
+                if(new[lines].offset == NULL) {
+                    LOG_PRINTF_LINE(cvm, "Failed to allocate memory for line offsets copy.\n");
+                    goto failure;
+                }
+                for(i = 0; i < new[lines].tokencount; i++) {
+                    new[lines].offset[i] = active.offset[i];
+                }
             }
 
             lines++;
@@ -2220,17 +3043,19 @@ skip_copy:
     if(curmacro != NULL) {
         LOG_PRINTF(cvm, "Macro without endmacro: %s@%s:%u.\n",
                         TOKENVAL(curmacro->nameOffset),
-                        TOKENVAL(cvm->line[curmacro->start].moduleOffset),
-                        cvm->line[curmacro->start].line);
+                        TOKENVAL(cvm->prog->line[curmacro->start].moduleOffset),
+                        cvm->prog->line[curmacro->start].line);
         goto failure;
     }
 
-    for(i = 0; i < cvm->lines; i++) {
-        free(cvm->line[i].offset);
+    for(i = 0; i < cvm->prog->lines; i++) {
+        if(cvm->prog->line[i].offset != NULL) {
+            free(cvm->prog->line[i].offset);
+        }
     }
-    free(cvm->line);
-    cvm->line = new;
-    cvm->lines = lines;
+    free(cvm->prog->line);
+    cvm->prog->line = new;
+    cvm->prog->lines = lines;
 
     if(macro != NULL) {
         for(i = 0; i < macrocount; i++) {
@@ -2252,7 +3077,7 @@ skip_copy:
         free(values);
     }
 
-    return(foundmacro);
+    return(0);
 
 failure:
     if(new != NULL) {
@@ -2292,11 +3117,16 @@ failure:
 static int find_procedure(CrustyVM *cvm,
                           const char *name) {
     unsigned int i;
+    long nameOffset;
 
-    for(i = 0; i < cvm->procs; i++) {
-        if(compare_token_and_string(cvm,
-                                    cvm->proc[i].nameOffset,
-                                    name) == 0) {
+    /* a name which was never seen can't be anything */
+    nameOffset = find_token(cvm, name, strlen(name));
+    if(nameOffset < 0) {
+        return(-1);
+    }
+
+    for(i = 0; i < cvm->prog->procs; i++) {
+        if(cvm->prog->proc[i].nameOffset == nameOffset) {
             return(i);
         }
     }
@@ -2313,7 +3143,7 @@ static int variable_is_argument(CrustyVariable *var) {
 }
 
 static int variable_is_callback(CrustyVariable *var) {
-    return(var->read != NULL || var->write != NULL);
+    return(var->callback >= 0);
 }
 
 /* this function is used while proc->var and var->proc are invalid and the only
@@ -2323,26 +3153,27 @@ static int find_variable(CrustyVM *cvm,
                          CrustyProcedure *proc,
                          const char *name) {
     unsigned int i;
+    long nameOffset;
+
+    nameOffset = find_token(cvm, name, strlen(name));
+    if(nameOffset < 0) {
+        return(-1);
+    }
 
     if(proc != NULL) {
         /* scan local */
         for(i = 0; i < proc->vars; i++) {
-            if(compare_token_and_string(cvm,
-                                        cvm->var[proc->varIndex[i]].nameOffset,
-                                        name) == 0) {
+            if(cvm->prog->var[proc->varIndex[i]].nameOffset == nameOffset) {
                 return(proc->varIndex[i]);
             }
         }
     }
     /* scan global */
 
-    for(i = 0; i < cvm->vars; i++) {
-        if(variable_is_global(&(cvm->var[i]))) {
-            if(compare_token_and_string(cvm,
-                                        cvm->var[i].nameOffset,
-                                        name) == 0) {
-                return(i);
-            }
+    for(i = 0; i < cvm->prog->vars; i++) {
+        if(variable_is_global(&(cvm->prog->var[i])) &&
+           cvm->prog->var[i].nameOffset == nameOffset) {
+            return(i);
         }
     }
 
@@ -2354,7 +3185,7 @@ static int new_variable(CrustyVM *cvm,
                         CrustyType type,
                         unsigned int length,
                         void *initializer,
-                        const CrustyCallback *cb,
+                        int callback,
                         int procIndex) {
     int varIndex;
     unsigned char *temp;
@@ -2362,31 +3193,31 @@ static int new_variable(CrustyVM *cvm,
     CrustyProcedure *proc = NULL;
 
     if(procIndex >= 0) {
-        proc = &(cvm->proc[procIndex]);
+        proc = &(cvm->prog->proc[procIndex]);
     }
 
     varIndex = find_variable(cvm, proc, TOKENVAL(nameOffset));
     if(varIndex >= 0) {
-        if(cb != NULL) {
+        if(callback >= 0) {
             LOG_PRINTF(cvm, "Redeclaration of callback variable: %s\n",
-                       TOKENVAL(cvm->var[varIndex].nameOffset));
-        } else if(cvm->var[varIndex].procIndex == -1) {
+                       TOKENVAL(cvm->prog->var[varIndex].nameOffset));
+        } else if(cvm->prog->var[varIndex].procIndex == -1) {
             LOG_PRINTF(cvm, "Redeclaration of static variable: %s\n",
-                       TOKENVAL(cvm->var[varIndex].nameOffset));
+                       TOKENVAL(cvm->prog->var[varIndex].nameOffset));
         } else {
             LOG_PRINTF(cvm, "Redeclaration of local variable: %s\n",
-                       TOKENVAL(cvm->var[varIndex].nameOffset));
+                       TOKENVAL(cvm->prog->var[varIndex].nameOffset));
         }
         return(-1);
     }
 
-    temp = realloc(cvm->var, sizeof(CrustyVariable) * (cvm->vars + 1));
+    temp = realloc(cvm->prog->var, sizeof(CrustyVariable) * (cvm->prog->vars + 1));
     if(temp == NULL) {
         LOG_PRINTF(cvm, "Failed to allocate memory for variable.\n");
         return(-1);
     }
-    cvm->var = (CrustyVariable *)temp;
-    var = &(cvm->var[cvm->vars]);
+    cvm->prog->var = (CrustyVariable *)temp;
+    var = &(cvm->prog->var[cvm->prog->vars]);
 
     var->nameOffset = nameOffset;
     var->length = length;
@@ -2395,8 +3226,7 @@ static int new_variable(CrustyVM *cvm,
 
     /* local */
     if(proc != NULL) {
-        var->read = NULL;
-        var->write = NULL;
+        var->callback = -1;
 
         temp = realloc(proc->varIndex, sizeof(int) * (proc->vars + 1));
         if(temp == NULL) {
@@ -2404,7 +3234,7 @@ static int new_variable(CrustyVM *cvm,
             return(-1);
         }
         proc->varIndex = (int *)temp;
-        proc->varIndex[proc->vars] = cvm->vars;
+        proc->varIndex[proc->vars] = cvm->prog->vars;
         proc->vars++;
 
         /* local variable locations are updated first, then applied because
@@ -2481,93 +3311,261 @@ static int new_variable(CrustyVM *cvm,
             memcpy(proc->initializer, initializer, length);
         }
     } else { /* global */
-        if(cb == NULL) {
-            var->read = NULL;
-            var->write = NULL;
+        if(callback < 0) {
+            var->callback = -1;
  
-            var->offset = cvm->initialstack;
+            var->offset = cvm->prog->initialstack;
             if(type == CRUSTY_TYPE_INT) {
-                cvm->initialstack += (length * sizeof(int));
+                cvm->prog->initialstack += (length * sizeof(int));
                 /* the initial stack isn't as silly and grows upwards, so less
                  * special things to do. */
-                temp = realloc(cvm->initializer, cvm->initialstack);
+                temp = realloc(cvm->prog->initializer, cvm->prog->initialstack);
                 if(temp == NULL) {
                     LOG_PRINTF(cvm, "Failed to expand procedure initializer.\n");
                     return(-1);
                 }
-                cvm->initializer = temp;
+                cvm->prog->initializer = temp;
 
-                memcpy(&(cvm->initializer[var->offset]),
+                memcpy(&(cvm->prog->initializer[var->offset]),
                        initializer,
                        length * sizeof(int));
             } else if(type == CRUSTY_TYPE_FLOAT) {
-                cvm->initialstack += (length * sizeof(double));
+                cvm->prog->initialstack += (length * sizeof(double));
 
-                temp = realloc(cvm->initializer, cvm->initialstack);
+                temp = realloc(cvm->prog->initializer, cvm->prog->initialstack);
                 if(temp == NULL) {
                     LOG_PRINTF(cvm, "Failed to expand procedure initializer.\n");
                     return(-1);
                 }
-                cvm->initializer = temp;
+                cvm->prog->initializer = temp;
 
-                memcpy(&(cvm->initializer[var->offset]),
+                memcpy(&(cvm->prog->initializer[var->offset]),
                        initializer,
                        length * sizeof(double));
             } else { /* CHAR */
-                cvm->initialstack += length;
+                cvm->prog->initialstack += length;
                 /* make things aligned */
-                FIND_ALIGNMENT_VALUE(cvm->initialstack)
+                FIND_ALIGNMENT_VALUE(cvm->prog->initialstack)
 
-                temp = realloc(cvm->initializer, cvm->initialstack);
+                temp = realloc(cvm->prog->initializer, cvm->prog->initialstack);
                 if(temp == NULL) {
                     LOG_PRINTF(cvm, "Failed to expand procedure initializer.\n");
                     return(-1);
                 }
-                cvm->initializer = temp;
+                cvm->prog->initializer = temp;
 
-                memcpy(&(cvm->initializer[var->offset]),
+                memcpy(&(cvm->prog->initializer[var->offset]),
                        initializer,
                        length);
             }
         } else {
-            var->read = cb->read;
-            var->write = cb->write;
-            var->readpriv = cb->readpriv;
-            var->writepriv = cb->writepriv;
+            var->callback = callback;
         }
     }
 
-    cvm->vars++;
+    cvm->prog->vars++;
 
     return(0);
 }
 
-#define ISJUNK(X) ((X) == ' ' || \
-                   (X) == '\t')
+static unsigned int variable_size(CrustyVariable *var) {
+    if(var->type == CRUSTY_TYPE_INT) {
+        return(var->length * sizeof(int));
+    } else if(var->type == CRUSTY_TYPE_FLOAT) {
+        return(var->length * sizeof(double));
+    }
 
-static int number_list_ints(const char *list,
-                            unsigned int len,
-                            int **buffer) {
-    int count = 0;
-    int cur;
-    unsigned int i;
-    char *end;
+    return(var->length);
+}
 
-    /* count numbers found in list */
-    for(i = 0; i < len; i++) {
-        if(!ISJUNK(list[i])) {
-            strtol(&(list[i]), &end, 0);
+static unsigned int variable_alignment(CrustyVariable *var) {
+    if(var->type == CRUSTY_TYPE_INT) {
+        return(sizeof(int));
+    } else if(var->type == CRUSTY_TYPE_FLOAT) {
+        return(sizeof(double));
+    }
 
-            if(end == &(list[i]) ||
-               !ISJUNK(*end)) {
-                if(*end == '\0') {
-                    /* number found at end of string, nothing more to do */
-                    count++;
-                    break;
-                }
-                /* separator ended with something not a number and number ended on
-                   something not a separator */
-                return(0);
+    return(1);
+}
+
+/* scalars go first so the values most instructions touch are packed together,
+   then arrays, each from largest to smallest alignment so nothing needs
+   padding between them */
+static unsigned int layout_rank(CrustyVariable *var) {
+    unsigned int rank = var->length > 1 ? 3 : 0;
+
+    if(var->type == CRUSTY_TYPE_INT) {
+        rank += 1;
+    } else if(var->type == CRUSTY_TYPE_CHAR) {
+        rank += 2;
+    }
+
+    return(rank);
+}
+
+/* Lay out the locals of procedure p, or the globals if p is -1, so every int
+ * and float is naturally aligned.  new_variable() just stacks them up in the
+ * order they're declared, this sorts them by layout_rank() and moves their
+ * initializers along with them.  The frame or global area is padded out to
+ * FRAME_ALIGNMENT so whatever comes after it is aligned as well, the stack
+ * itself is from malloc() so it's aligned for anything.  Arguments are left
+ * at the top of the frame where call() puts them.  Can be run again after
+ * more locals are added. */
+static int layout_variables(CrustyVM *cvm, int p) {
+    CrustyProcedure *proc = NULL;
+    CrustyVariable *var;
+    unsigned char *initializer = NULL;
+    unsigned char *oldinitializer;
+    int *order = NULL;
+    unsigned int *pos = NULL;
+    unsigned int vars = 0;
+    unsigned int oldsize, size, align;
+    unsigned int i, j;
+    int temp;
+    int result = -1;
+
+    if(p >= 0) {
+        proc = &(cvm->prog->proc[p]);
+        oldsize = proc->stackneeded;
+        oldinitializer = proc->initializer;
+    } else {
+        oldsize = cvm->prog->initialstack;
+        oldinitializer = cvm->prog->initializer;
+    }
+
+    /* extra 1 so there's always something to allocate */
+    order = malloc(sizeof(int) * (cvm->prog->vars + 1));
+    pos = malloc(sizeof(unsigned int) * (cvm->prog->vars + 1));
+    if(order == NULL || pos == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for variable layout.\n");
+        goto cleanup;
+    }
+
+    if(proc != NULL) {
+        for(i = 0; i < proc->vars; i++) {
+            if(!variable_is_argument(&(cvm->prog->var[proc->varIndex[i]]))) {
+                order[vars] = proc->varIndex[i];
+                vars++;
+            }
+        }
+    } else {
+        for(i = 0; i < cvm->prog->vars; i++) {
+            if(variable_is_global(&(cvm->prog->var[i])) &&
+               !variable_is_callback(&(cvm->prog->var[i]))) {
+                order[vars] = i;
+                vars++;
+            }
+        }
+    }
+
+    /* insertion sort, so variables of the same rank stay in the order they
+       were declared */
+    for(i = 1; i < vars; i++) {
+        temp = order[i];
+        for(j = i;
+            j > 0 &&
+            layout_rank(&(cvm->prog->var[order[j - 1]])) >
+            layout_rank(&(cvm->prog->var[temp]));
+            j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = temp;
+    }
+
+    size = 0;
+    for(i = 0; i < vars; i++) {
+        var = &(cvm->prog->var[order[i]]);
+        align = variable_alignment(var);
+        if(size % align != 0) {
+            size += align - (size % align);
+        }
+        pos[i] = size;
+        size += variable_size(var);
+    }
+    if(size % FRAME_ALIGNMENT != 0) {
+        size += FRAME_ALIGNMENT - (size % FRAME_ALIGNMENT);
+    }
+    if(proc != NULL) {
+        size += proc->args * sizeof(CrustyStackArg);
+    }
+
+    if(size > 0) {
+        initializer = malloc(size);
+        if(initializer == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for variable layout.\n");
+            goto cleanup;
+        }
+        memset(initializer, 0, size);
+    }
+
+    for(i = 0; i < vars; i++) {
+        var = &(cvm->prog->var[order[i]]);
+        /* locals are indexed from the top of the frame */
+        if(proc != NULL) {
+            memcpy(&(initializer[pos[i]]),
+                   &(oldinitializer[oldsize - var->offset]),
+                   variable_size(var));
+            var->offset = size - pos[i];
+        } else {
+            memcpy(&(initializer[pos[i]]),
+                   &(oldinitializer[var->offset]),
+                   variable_size(var));
+            var->offset = pos[i];
+        }
+    }
+
+    if(oldinitializer != NULL) {
+        free(oldinitializer);
+    }
+    if(proc != NULL) {
+        proc->initializer = initializer;
+        proc->stackneeded = size;
+    } else {
+        cvm->prog->initializer = initializer;
+        cvm->prog->initialstack = size;
+    }
+    /* the stack was already sized for the old layout */
+    cvm->prog->stacksize = cvm->prog->stacksize - oldsize + size;
+
+    result = 0;
+
+cleanup:
+    if(order != NULL) {
+        free(order);
+    }
+    if(pos != NULL) {
+        free(pos);
+    }
+
+    return(result);
+}
+
+#define ISJUNK(X) ((X) == ' ' || \
+                   (X) == '\t')
+
+static int number_list_ints(const char *list,
+                            unsigned int len,
+                            int **buffer) {
+    int count = 0;
+    int cur;
+    unsigned int i;
+    char *end;
+
+    /* count numbers found in list */
+    for(i = 0; i < len; i++) {
+        if(!ISJUNK(list[i])) {
+            strtol(&(list[i]), &end, 0);
+
+            if(end == &(list[i]) ||
+               !ISJUNK(*end)) {
+                if(*end == '\0') {
+                    /* number found at end of string, nothing more to do */
+                    count++;
+                    break;
+                }
+                /* separator ended with something not a number and number ended on
+                   something not a separator */
+                return(0);
             }
 
             /* more gross pointery stuff */
@@ -2786,7 +3784,7 @@ static int variable_declaration(CrustyVM *cvm,
                     type,
                     length,
                     initializer,
-                    NULL,
+                    -1,
                     procIndex) < 0) {
         /* print an error so the user can get a line number. */
         LOG_PRINTF_LINE(cvm, "Error from new_variable().\n");
@@ -2814,16 +3812,16 @@ static int symbols_scan(CrustyVM *cvm,
     char *temp;
     unsigned int lines;
 
-    new = malloc(sizeof(CrustyLine) * cvm->lines);
+    new = malloc(sizeof(CrustyLine) * cvm->prog->lines);
     if(new == NULL) {
         LOG_PRINTF(cvm, "Failed to allocate memory for lines\n");
         return(-1);
     }
 
-    cvm->stacksize = 0;
+    cvm->prog->stacksize = 0;
 
     lines = 0;
-    for(cvm->logline = 0; cvm->logline < cvm->lines; cvm->logline++) {
+    for(cvm->logline = 0; cvm->logline < cvm->prog->lines; cvm->logline++) {
         if(curProc != NULL) {
             curProc->length++;
         }
@@ -2832,7 +3830,7 @@ static int symbols_scan(CrustyVM *cvm,
         if(compare_token_and_string(cvm,
                                     GET_TOKEN_OFFSET(cvm->logline, 0),
                                     "proc") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2) {
+            if(cvm->prog->line[cvm->logline].tokencount < 2) {
                 LOG_PRINTF_LINE(cvm, "proc takes a name as argument.\n");
                 goto failure;
             }
@@ -2847,21 +3845,23 @@ static int symbols_scan(CrustyVM *cvm,
                 goto failure;
             }
 
-            curProc = realloc(cvm->proc, sizeof(CrustyProcedure) * (cvm->procs + 1));
+            curProc = realloc(cvm->prog->proc, sizeof(CrustyProcedure) * (cvm->prog->procs + 1));
             if(curProc == NULL) {
                 LOG_PRINTF_LINE(cvm, "Couldn't allocate memory for procedure.\n");
                 goto failure;
             }
-            cvm->proc = curProc;
-            curProcIndex = cvm->procs;
-            curProc = &(cvm->proc[curProcIndex]);
-            cvm->procs++;
+            cvm->prog->proc = curProc;
+            curProcIndex = cvm->prog->procs;
+            curProc = &(cvm->prog->proc[curProcIndex]);
+            cvm->prog->procs++;
 
-            curProc->nameOffset = cvm->line[cvm->logline].offset[1];
+            curProc->nameOffset = cvm->prog->line[cvm->logline].offset[1];
             curProc->start = lines;
             curProc->length = 0;
             curProc->stackneeded = 0;
             curProc->initializer = NULL;
+            curProc->init = NULL;
+            curProc->inits = 0;
             curProc->args = 0; 
             curProc->var = NULL;
             curProc->varIndex = NULL;
@@ -2869,17 +3869,17 @@ static int symbols_scan(CrustyVM *cvm,
             curProc->label = NULL;
             curProc->labels = 0;
 
-            unsigned int args = cvm->line[cvm->logline].tokencount - 2;
+            unsigned int args = cvm->prog->line[cvm->logline].tokencount - 2;
             /* add arguments as local variables */
             for(i = 0; i < args; i++) {
                 /* argument variables have 0 length and no initializers and no
                    read or write functions but obviously is a local variable */
                 if(new_variable(cvm,
-                                cvm->line[cvm->logline].offset[i + 2],
+                                cvm->prog->line[cvm->logline].offset[i + 2],
                                 CRUSTY_TYPE_NONE,
                                 0,
                                 NULL,
-                                NULL,
+                                -1,
                                 curProcIndex) < 0) {
                                     /* print an error so the user can get a line
                                      * number. */
@@ -2898,7 +3898,7 @@ static int symbols_scan(CrustyVM *cvm,
                 goto failure;
             }
 
-            cvm->stacksize += curProc->stackneeded;
+            cvm->prog->stacksize += curProc->stackneeded;
             curProc = NULL;
             curProcIndex = -1;
 
@@ -2906,12 +3906,12 @@ static int symbols_scan(CrustyVM *cvm,
         } else if(compare_token_and_string(cvm,
                                            GET_TOKEN_OFFSET(cvm->logline, 0),
                                            "static") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2) {
+            if(cvm->prog->line[cvm->logline].tokencount < 2) {
                 LOG_PRINTF_LINE(cvm, "static takes a name as argument.\n");
                 goto failure;
             }
 
-            if(variable_declaration(cvm, &(cvm->line[cvm->logline]), -1) < 0) {
+            if(variable_declaration(cvm, &(cvm->prog->line[cvm->logline]), -1) < 0) {
                 goto failure;
             }
 
@@ -2919,7 +3919,7 @@ static int symbols_scan(CrustyVM *cvm,
         } else if(compare_token_and_string(cvm,
                                            GET_TOKEN_OFFSET(cvm->logline, 0),
                                            "local") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2) {
+            if(cvm->prog->line[cvm->logline].tokencount < 2) {
                 LOG_PRINTF_LINE(cvm, "local takes a name as argument.\n");
                 goto failure;
             }
@@ -2929,7 +3929,7 @@ static int symbols_scan(CrustyVM *cvm,
                 goto failure;
             }
 
-            if(variable_declaration(cvm, &(cvm->line[cvm->logline]), curProcIndex) < 0) {
+            if(variable_declaration(cvm, &(cvm->prog->line[cvm->logline]), curProcIndex) < 0) {
                 goto failure;
             }
 
@@ -2937,14 +3937,14 @@ static int symbols_scan(CrustyVM *cvm,
         } else if(compare_token_and_string(cvm,
                                            GET_TOKEN_OFFSET(cvm->logline, 0),
                                            "stack") == 0) {
-            if(cvm->line[cvm->logline].tokencount != 2) {
+            if(cvm->prog->line[cvm->logline].tokencount != 2) {
                 LOG_PRINTF_LINE(cvm, "stack takes a number as argument.\n");
                 goto failure;
             }
 
             long stack = strtol(GET_TOKEN(cvm->logline, 1), &temp, 0);
             if(temp - GET_TOKEN(cvm->logline, 1) == TOKENLEN(GET_TOKEN_OFFSET(cvm->logline, 1))) {
-                cvm->stacksize += stack;
+                cvm->prog->stacksize += stack;
             } else {
                 LOG_PRINTF_LINE(cvm, "stack takes a number as argument.\n");
                 goto failure;
@@ -2954,7 +3954,7 @@ static int symbols_scan(CrustyVM *cvm,
         } else if(compare_token_and_string(cvm,
                                            GET_TOKEN_OFFSET(cvm->logline, 0),
                                            "label") == 0) {
-            if(cvm->line[cvm->logline].tokencount != 2) {
+            if(cvm->prog->line[cvm->logline].tokencount != 2) {
                 LOG_PRINTF_LINE(cvm, "label takes a name as argument.\n");
                 goto failure;
             }
@@ -2981,7 +3981,7 @@ static int symbols_scan(CrustyVM *cvm,
             }
             curProc->label = (CrustyLabel *)temp;
             curProc->label[curProc->labels].nameOffset =
-                cvm->line[cvm->logline].offset[1];
+                cvm->prog->line[cvm->logline].offset[1];
             curProc->label[curProc->labels].line = lines;
             curProc->labels++;
 
@@ -2989,8 +3989,8 @@ static int symbols_scan(CrustyVM *cvm,
         } else if(compare_token_and_string(cvm,
                                            GET_TOKEN_OFFSET(cvm->logline, 0),
                                            "binclude") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 4 ||
-               cvm->line[cvm->logline].tokencount > 6) {
+            if(cvm->prog->line[cvm->logline].tokencount < 4 ||
+               cvm->prog->line[cvm->logline].tokencount > 6) {
                 LOG_PRINTF_LINE(cvm, "binclude takes at least a symbol name, "
                                     "type and filename and optionally a "
                                     "start and length.\n");
@@ -3000,7 +4000,7 @@ static int symbols_scan(CrustyVM *cvm,
             unsigned long fileStart = 0;
             long fileLength = 0;
 
-            if(cvm->line[cvm->logline].tokencount >= 5) {
+            if(cvm->prog->line[cvm->logline].tokencount >= 5) {
                 fileStart = strtoul(GET_TOKEN(cvm->logline, 4), &temp, 0);
                 if(temp - GET_TOKEN(cvm->logline, 4) != TOKENLEN(GET_TOKEN_OFFSET(cvm->logline, 4))) {
                     LOG_PRINTF_LINE(cvm, "binclude start field must be a "
@@ -3008,7 +4008,7 @@ static int symbols_scan(CrustyVM *cvm,
                     goto failure;
                 }
             }
-            if(cvm->line[cvm->logline].tokencount == 6) {
+            if(cvm->prog->line[cvm->logline].tokencount == 6) {
                 fileLength = strtoul(GET_TOKEN(cvm->logline, 5), &temp, 0);
                 if(temp - GET_TOKEN(cvm->logline, 5) != TOKENLEN(GET_TOKEN_OFFSET(cvm->logline, 5))) {
                     LOG_PRINTF_LINE(cvm, "binclude start field must be a "
@@ -3095,33 +4095,33 @@ static int symbols_scan(CrustyVM *cvm,
 
             if(type == CRUSTY_TYPE_CHAR) {
                 if(new_variable(cvm,
-                                cvm->line[cvm->logline].offset[1],
+                                cvm->prog->line[cvm->logline].offset[1],
                                 CRUSTY_TYPE_CHAR,
                                 fileLength,
                                 buf,
-                                NULL,
+                                -1,
                                 curProcIndex) < 0) {
                     free(buf);
                     goto failure;
                 }
             } else if(type == CRUSTY_TYPE_INT) {
                 if(new_variable(cvm,
-                                cvm->line[cvm->logline].offset[1],
+                                cvm->prog->line[cvm->logline].offset[1],
                                 CRUSTY_TYPE_INT,
                                 fileLength / sizeof(int),
                                 buf,
-                                NULL,
+                                -1,
                                 curProcIndex) < 0) {
                     free(buf);
                     goto failure;
                 }
             } else if(type == CRUSTY_TYPE_FLOAT) {
                 if(new_variable(cvm,
-                                cvm->line[cvm->logline].offset[1],
+                                cvm->prog->line[cvm->logline].offset[1],
                                 CRUSTY_TYPE_FLOAT,
                                 fileLength / sizeof(double),
                                 buf,
-                                NULL,
+                                -1,
                                 curProcIndex) < 0) {
                     free(buf);
                     goto failure;
@@ -3132,16 +4132,16 @@ static int symbols_scan(CrustyVM *cvm,
             continue;
         }
 
-        new[lines].tokencount = cvm->line[cvm->logline].tokencount;
-        new[lines].moduleOffset = cvm->line[cvm->logline].moduleOffset;
-        new[lines].line = cvm->line[cvm->logline].line;
+        new[lines].tokencount = cvm->prog->line[cvm->logline].tokencount;
+        new[lines].moduleOffset = cvm->prog->line[cvm->logline].moduleOffset;
+        new[lines].line = cvm->prog->line[cvm->logline].line;
         new[lines].offset = malloc(sizeof(long) * new[lines].tokencount);
         if(new[lines].offset == NULL) {
             LOG_PRINTF_LINE(cvm, "Failed to allocate memory for line copy.\n");
             goto failure;
         }
         for(i = 0; i < new[lines].tokencount; i++) {
-            new[lines].offset[i] = cvm->line[cvm->logline].offset[i];
+            new[lines].offset[i] = cvm->prog->line[cvm->logline].offset[i];
         }
         lines++;
     }
@@ -3152,20 +4152,20 @@ static int symbols_scan(CrustyVM *cvm,
     }
 
     /* point CrustyVariables in CrustyProcedures and vise versa */
-    for(i = 0; i < cvm->vars; i++) {
-        cvm->var[i].proc = NULL;
+    for(i = 0; i < cvm->prog->vars; i++) {
+        cvm->prog->var[i].proc = NULL;
     }
 
-    for(i = 0; i < cvm->procs; i++) {
-        cvm->proc[i].var = malloc(sizeof(CrustyVariable *) * cvm->proc[i].vars);
-        if(cvm->proc[i].var == NULL) {
+    for(i = 0; i < cvm->prog->procs; i++) {
+        cvm->prog->proc[i].var = malloc(sizeof(CrustyVariable *) * cvm->prog->proc[i].vars);
+        if(cvm->prog->proc[i].var == NULL) {
             LOG_PRINTF(cvm, "Failed to allocate memory for procedure variable pointer list.\n");
             goto failure;
         }
 
-        for(j = 0; j < cvm->proc[i].vars; j++) {
-            cvm->proc[i].var[j] = &(cvm->var[cvm->proc[i].varIndex[j]]);
-            cvm->proc[i].var[j]->proc = &(cvm->proc[i]);
+        for(j = 0; j < cvm->prog->proc[i].vars; j++) {
+            cvm->prog->proc[i].var[j] = &(cvm->prog->var[cvm->prog->proc[i].varIndex[j]]);
+            cvm->prog->proc[i].var[j]->proc = &(cvm->prog->proc[i]);
         }
     }
 
@@ -3175,14 +4175,14 @@ static int symbols_scan(CrustyVM *cvm,
         goto failure;
     }
 
-    for(i = 0; i < cvm->lines; i++) {
-        free(cvm->line[i].offset);
+    for(i = 0; i < cvm->prog->lines; i++) {
+        free(cvm->prog->line[i].offset);
     }
-    free(cvm->line);
-    cvm->line = (CrustyLine *)temp;
-    cvm->lines = lines;
+    free(cvm->prog->line);
+    cvm->prog->line = (CrustyLine *)temp;
+    cvm->prog->lines = lines;
 
-    cvm->stacksize += cvm->initialstack;
+    cvm->prog->stacksize += cvm->prog->initialstack;
 
     return(0);
 
@@ -3206,160 +4206,160 @@ static int symbols_verify(CrustyVM *cvm) {
     unsigned int leni, lenj, offi, offj;
     int ret = 0;
 
-    for(i = 0; i < cvm->vars; i++) {
-        if(variable_is_global(&(cvm->var[i]))) {
-            if(cvm->var[i].length == 0) {
-                LOG_PRINTF(cvm, "Global variable %s has 0 length.\n", cvm->var[i].name);
+    for(i = 0; i < cvm->prog->vars; i++) {
+        if(variable_is_global(&(cvm->prog->var[i]))) {
+            if(cvm->prog->var[i].length == 0) {
+                LOG_PRINTF(cvm, "Global variable %s has 0 length.\n", cvm->prog->var[i].name);
                 ret = -1;
             }
 
-            if(cvm->var[i].read == NULL && cvm->var[i].write == NULL) {
-                if(cvm->var[i].type != CRUSTY_TYPE_INT &&
-                   cvm->var[i].type != CRUSTY_TYPE_FLOAT &&
-                   cvm->var[i].type != CRUSTY_TYPE_CHAR) {
+            if(!variable_is_callback(&(cvm->prog->var[i]))) {
+                if(cvm->prog->var[i].type != CRUSTY_TYPE_INT &&
+                   cvm->prog->var[i].type != CRUSTY_TYPE_FLOAT &&
+                   cvm->prog->var[i].type != CRUSTY_TYPE_CHAR) {
                     LOG_PRINTF(cvm, "Non-callback variable with invalid type.\n");
                     continue;
                 }
 
-                if(cvm->var[i].type == CRUSTY_TYPE_INT) {
-                    leni = cvm->var[i].length * sizeof(int);
-                } else if(cvm->var[i].type == CRUSTY_TYPE_FLOAT) {
-                    leni = cvm->var[i].length * sizeof(double);
+                if(cvm->prog->var[i].type == CRUSTY_TYPE_INT) {
+                    leni = cvm->prog->var[i].length * sizeof(int);
+                } else if(cvm->prog->var[i].type == CRUSTY_TYPE_FLOAT) {
+                    leni = cvm->prog->var[i].length * sizeof(double);
                 } else {
-                    leni = cvm->var[i].length;
+                    leni = cvm->prog->var[i].length;
                 }
-                if(cvm->var[i].offset + leni > cvm->initialstack) {
+                if(cvm->prog->var[i].offset + leni > cvm->prog->initialstack) {
                     LOG_PRINTF(cvm, "Global variable %s exceeds initial stack: "
                                     "%u + %u = %u > %u\n",
-                                    cvm->var[i].name,
-                                    cvm->var[i].offset,
+                                    cvm->prog->var[i].name,
+                                    cvm->prog->var[i].offset,
                                     leni,
-                                    cvm->var[i].offset + leni,
-                                    cvm->initialstack);
+                                    cvm->prog->var[i].offset + leni,
+                                    cvm->prog->initialstack);
                     ret = -1;
                 }
-                for(j = i + 1; j < cvm->vars; j++) {
-                    if(variable_is_global(&(cvm->var[j]))) {
-                        if(cvm->var[i].type == CRUSTY_TYPE_INT) {
-                            lenj = cvm->var[j].length * sizeof(int);
-                        } else if(cvm->var[i].type == CRUSTY_TYPE_FLOAT) {
-                            lenj = cvm->var[j].length * sizeof(double);
+                for(j = i + 1; j < cvm->prog->vars; j++) {
+                    if(variable_is_global(&(cvm->prog->var[j]))) {
+                        if(cvm->prog->var[i].type == CRUSTY_TYPE_INT) {
+                            lenj = cvm->prog->var[j].length * sizeof(int);
+                        } else if(cvm->prog->var[i].type == CRUSTY_TYPE_FLOAT) {
+                            lenj = cvm->prog->var[j].length * sizeof(double);
                         } else {
-                            lenj = cvm->var[j].length;
+                            lenj = cvm->prog->var[j].length;
                         }
-                        if((cvm->var[j].offset > cvm->var[i].offset &&
-                            cvm->var[j].offset < cvm->var[i].offset + leni - 1) ||
-                           (cvm->var[j].offset + lenj - 1 > cvm->var[i].offset &&
-                            cvm->var[j].offset + lenj - 1 < cvm->var[i].offset + leni - 1)) {
+                        if((cvm->prog->var[j].offset > cvm->prog->var[i].offset &&
+                            cvm->prog->var[j].offset < cvm->prog->var[i].offset + leni - 1) ||
+                           (cvm->prog->var[j].offset + lenj - 1 > cvm->prog->var[i].offset &&
+                            cvm->prog->var[j].offset + lenj - 1 < cvm->prog->var[i].offset + leni - 1)) {
                             LOG_PRINTF(cvm, "Global variables %s and %s overlap: "
                                             "(%u -> %u) (%u -> %u)\n",
-                                       cvm->var[i].name, cvm->var[j].name,
-                                       cvm->var[i].offset,
-                                       cvm->var[i].offset + leni - 1,
-                                       cvm->var[j].offset,
-                                       cvm->var[j].offset + lenj - 1);
+                                       cvm->prog->var[i].name, cvm->prog->var[j].name,
+                                       cvm->prog->var[i].offset,
+                                       cvm->prog->var[i].offset + leni - 1,
+                                       cvm->prog->var[j].offset,
+                                       cvm->prog->var[j].offset + lenj - 1);
                             ret = -1;
                         }
                     }
                 }
             }
         } else { /* locals */
-            if(variable_is_callback(&(cvm->var[i]))) {
-                LOG_PRINTF(cvm, "Local variable %s with callback.\n", cvm->var[i].name);
+            if(variable_is_callback(&(cvm->prog->var[i]))) {
+                LOG_PRINTF(cvm, "Local variable %s with callback.\n", cvm->prog->var[i].name);
                 ret = -1;
             }
 
-            for(j = 0; j < cvm->var[i].proc->vars; j++) {
-                if(cvm->var[i].proc == cvm->var[i].proc->var[j]->proc) {
+            for(j = 0; j < cvm->prog->var[i].proc->vars; j++) {
+                if(cvm->prog->var[i].proc == cvm->prog->var[i].proc->var[j]->proc) {
                     break;
                 }
             }
-            if(j == cvm->var[i].proc->vars) {
+            if(j == cvm->prog->var[i].proc->vars) {
                 LOG_PRINTF(cvm, "Couldn't find variable in procedure %s "
                                 "referenced by variable %s.\n",
-                           cvm->var[i].proc->name, cvm->var[i].name);
+                           cvm->prog->var[i].proc->name, cvm->prog->var[i].name);
                 ret = -1;
             }
         }
     }
 
-    for(i = 0; i < cvm->procs; i++) {
-        for(j = 0; j < cvm->proc[i].vars; j++) {
-            if(cvm->proc[i].var[j]->proc != &(cvm->proc[i])) {
+    for(i = 0; i < cvm->prog->procs; i++) {
+        for(j = 0; j < cvm->prog->proc[i].vars; j++) {
+            if(cvm->prog->proc[i].var[j]->proc != &(cvm->prog->proc[i])) {
                 LOG_PRINTF(cvm, "Mispointed variable %s points to procedure %s "
                                 "but pointed to by procedure %s.\n",
-                           cvm->proc[i].var[j]->name,
-                           cvm->proc[i].var[j]->proc->name,
-                           cvm->proc[i].name);
+                           cvm->prog->proc[i].var[j]->name,
+                           cvm->prog->proc[i].var[j]->proc->name,
+                           cvm->prog->proc[i].name);
                 ret = -1;
             }
 
-            if(cvm->proc[i].var[j]->length == 0) {
-                if(j > cvm->proc[i].args) {
+            if(cvm->prog->proc[i].var[j]->length == 0) {
+                if(j > cvm->prog->proc[i].args) {
                     LOG_PRINTF(cvm, "Variable %s in proc %s has 0 length but "
                                     "index greater than args. (%u > %u)\n",
-                               cvm->proc[i].var[j]->name,
-                               cvm->proc[i].name,
-                               j, cvm->proc[i].args);
+                               cvm->prog->proc[i].var[j]->name,
+                               cvm->prog->proc[i].name,
+                               j, cvm->prog->proc[i].args);
                     ret = -1;
                 }
-                if(cvm->proc[i].var[j]->offset > cvm->proc[i].args) {
+                if(cvm->prog->proc[i].var[j]->offset > cvm->prog->proc[i].args) {
                     LOG_PRINTF(cvm, "Variable %s in proc %s is argument but "
                                     "stack offset greater than args. (%u > %u)\n",
-                               cvm->proc[i].var[j]->name,
-                               cvm->proc[i].name,
-                               cvm->proc[i].var[j]->offset,
-                               cvm->proc[i].args);
+                               cvm->prog->proc[i].var[j]->name,
+                               cvm->prog->proc[i].name,
+                               cvm->prog->proc[i].var[j]->offset,
+                               cvm->prog->proc[i].args);
                     ret = -1;
                 }
             }
 
-            if(!variable_is_argument(cvm->proc[i].var[j])) {
-                if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_INT) {
-                    lenj = cvm->proc[i].var[j]->length * sizeof(int);
-                    offj = cvm->proc[i].var[j]->offset;
+            if(!variable_is_argument(cvm->prog->proc[i].var[j])) {
+                if(cvm->prog->proc[i].var[j]->type == CRUSTY_TYPE_INT) {
+                    lenj = cvm->prog->proc[i].var[j]->length * sizeof(int);
+                    offj = cvm->prog->proc[i].var[j]->offset;
                     offj -= lenj; /* stack is indexed from top */
-                } else if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_FLOAT) {
-                    lenj = cvm->proc[i].var[j]->length * sizeof(double);
-                    offj = cvm->proc[i].var[j]->offset;
+                } else if(cvm->prog->proc[i].var[j]->type == CRUSTY_TYPE_FLOAT) {
+                    lenj = cvm->prog->proc[i].var[j]->length * sizeof(double);
+                    offj = cvm->prog->proc[i].var[j]->offset;
                     offj -= lenj; /* stack is indexed from top */
                 } else { /* CHAR */
-                    lenj = cvm->proc[i].var[j]->length;
-                    offj = cvm->proc[i].var[j]->offset;
+                    lenj = cvm->prog->proc[i].var[j]->length;
+                    offj = cvm->prog->proc[i].var[j]->offset;
                     offj -= lenj;
                 }
             } else {
                 lenj = sizeof(CrustyStackArg);
-                offj = cvm->proc[i].var[j]->offset * sizeof(CrustyStackArg);
+                offj = cvm->prog->proc[i].var[j]->offset * sizeof(CrustyStackArg);
                 offj -= lenj;
             }
-            if(offj > cvm->proc[i].stackneeded) {
+            if(offj > cvm->prog->proc[i].stackneeded) {
                 LOG_PRINTF(cvm, "Variable %s from procedure %s exceeds "
                                 "needed stack: %u > %u\n",
-                                cvm->proc[i].var[j]->name,
-                                cvm->proc[i].name,
+                                cvm->prog->proc[i].var[j]->name,
+                                cvm->prog->proc[i].name,
                                 offj,
-                                cvm->proc[i].stackneeded);
+                                cvm->prog->proc[i].stackneeded);
                 ret = -1;
             }
-            for(k = j + 1; k < cvm->proc[i].vars; k++) {
-                if(!variable_is_argument(cvm->proc[i].var[k])) {
-                    if(cvm->proc[i].var[k]->type == CRUSTY_TYPE_INT) {
-                        leni = cvm->proc[i].var[k]->length * sizeof(int);
-                        offi = cvm->proc[i].var[k]->offset;
+            for(k = j + 1; k < cvm->prog->proc[i].vars; k++) {
+                if(!variable_is_argument(cvm->prog->proc[i].var[k])) {
+                    if(cvm->prog->proc[i].var[k]->type == CRUSTY_TYPE_INT) {
+                        leni = cvm->prog->proc[i].var[k]->length * sizeof(int);
+                        offi = cvm->prog->proc[i].var[k]->offset;
                         offi -= leni; /* stack is indexed from top */
-                    } else if(cvm->proc[i].var[k]->type == CRUSTY_TYPE_FLOAT) {
-                        leni = cvm->proc[i].var[k]->length * sizeof(double);
-                        offi = cvm->proc[i].var[k]->offset;
+                    } else if(cvm->prog->proc[i].var[k]->type == CRUSTY_TYPE_FLOAT) {
+                        leni = cvm->prog->proc[i].var[k]->length * sizeof(double);
+                        offi = cvm->prog->proc[i].var[k]->offset;
                         offi -= leni; /* stack is indexed from top */
                     } else { /* CHAR */
-                        leni = cvm->proc[i].var[k]->length;
-                        offi = cvm->proc[i].var[k]->offset;
+                        leni = cvm->prog->proc[i].var[k]->length;
+                        offi = cvm->prog->proc[i].var[k]->offset;
                         offi -= leni;
                     }
                 } else {
                     leni = sizeof(CrustyStackArg);
-                    offi = cvm->proc[i].var[k]->offset * sizeof(CrustyStackArg);
+                    offi = cvm->prog->proc[i].var[k]->offset * sizeof(CrustyStackArg);
                     offi -= leni;
                 }
                 if((offi > offj &&
@@ -3368,9 +4368,9 @@ static int symbols_verify(CrustyVM *cvm) {
                     offi + leni - 1 < offj + lenj - 1)) {
                     LOG_PRINTF(cvm, "Variables %s and %s from procedure %s "
                                     "overlap: (%u -> %u) (%u -> %u)\n",
-                               cvm->proc[i].var[j]->name,
-                               cvm->proc[i].var[k]->name,
-                               cvm->proc[i].name,
+                               cvm->prog->proc[i].var[j]->name,
+                               cvm->prog->proc[i].var[k]->name,
+                               cvm->prog->proc[i].name,
                                offj, offj + lenj - 1,
                                offi, offi + leni - 1);
                     ret = -1;
@@ -3425,16 +4425,16 @@ static int populate_var(CrustyVM *cvm,
         LOG_PRINTF_LINE(cvm, "Variable %s not found.\n", name);
         goto failure;
     }
-    varObj = &(cvm->var[*var]);
+    varObj = &(cvm->prog->var[*var]);
 
     if(writable) {
-        if(varObj->read != NULL && varObj->write == NULL) {
+        if(VAR_READ(varObj) != NULL && VAR_WRITE(varObj) == NULL) {
             LOG_PRINTF_LINE(cvm, "%s isn't a writable callback.\n", name);
             goto failure;
         }
     }
     if(readable) {
-        if(varObj->write != NULL && varObj->read == NULL) {
+        if(VAR_WRITE(varObj) != NULL && VAR_READ(varObj) == NULL) {
             LOG_PRINTF_LINE(cvm, "%s isn't a readable callback.\n", name);
             goto failure;
         }
@@ -3469,10 +4469,10 @@ static int populate_var(CrustyVM *cvm,
                     LOG_PRINTF_LINE(cvm, "Array index variable %s not found.\n", vararray);
                     goto failure;
                 }
-                indexObj = &(cvm->var[*index]);
+                indexObj = &(cvm->prog->var[*index]);
 
-                if(indexObj->write != NULL &&
-                   indexObj->read == NULL) {
+                if(VAR_WRITE(indexObj) != NULL &&
+                   VAR_READ(indexObj) == NULL) {
                     LOG_PRINTF_LINE(cvm, "%s isn't a readable callback.\n", vararray);
                     goto failure;
                 }
@@ -3501,14 +4501,14 @@ failure:
 static int *new_instruction(CrustyVM *cvm, unsigned int args) {
     int *temp;
 
-    temp = realloc(cvm->inst, sizeof(int) * (cvm->insts + args + 1));
+    temp = realloc(cvm->prog->inst, sizeof(int) * (cvm->prog->insts + args + 1));
     if(temp == NULL) {
         LOG_PRINTF_LINE(cvm, "Failed to allocate memory for instructions.\n");
         return(NULL);
     }
-    cvm->inst = temp;
-    temp = &(cvm->inst[cvm->insts]);
-    cvm->insts += (args + 1);
+    cvm->prog->inst = temp;
+    temp = &(cvm->prog->inst[cvm->prog->insts]);
+    cvm->prog->insts += (args + 1);
 
     return(temp);
 }
@@ -3529,7 +4529,7 @@ static int find_label(CrustyProcedure *proc, const char *name) {
     else if(compare_token_and_string(cvm, \
                                      GET_TOKEN_OFFSET(cvm->logline, 0), \
                                      NAME) == 0) { \
-        if(cvm->line[cvm->logline].tokencount != 3) { \
+        if(cvm->prog->line[cvm->logline].tokencount != 3) { \
             LOG_PRINTF_LINE(cvm, NAME " takes two operands.\n"); \
             return(-1); \
         } \
@@ -3565,7 +4565,7 @@ static int find_label(CrustyProcedure *proc, const char *name) {
     else if(compare_token_and_string(cvm, \
                                      GET_TOKEN_OFFSET(cvm->logline, 0), \
                                      NAME) == 0) { \
-        if(cvm->line[cvm->logline].tokencount != 2) { \
+        if(cvm->prog->line[cvm->logline].tokencount != 2) { \
             LOG_PRINTF_LINE(cvm, NAME " takes a label.\n"); \
             return(-1); \
         } \
@@ -3584,17 +4584,63 @@ static int find_label(CrustyProcedure *proc, const char *name) {
             return(-1); \
         }
 
+#define BULK_INSTRUCTION(NAME, ENUM, READDEST) \
+    else if(compare_token_and_string(cvm, \
+                                     GET_TOKEN_OFFSET(cvm->logline, 0), \
+                                     NAME) == 0) { \
+        if(cvm->prog->line[cvm->logline].tokencount != 4) { \
+            LOG_PRINTF_LINE(cvm, NAME " takes a destination, source and count.\n"); \
+            return(-1); \
+        } \
+    \
+        inst = new_instruction(cvm, BULK_ARGS); \
+        if(inst == NULL) { \
+            return(-1); \
+        } \
+    \
+        inst[0] = ENUM; \
+    \
+        if(populate_var(cvm, \
+                        GET_TOKEN(cvm->logline, 1), \
+                        curproc, \
+                        (READDEST), 1, \
+                        &(inst[MOVE_DEST_FLAGS]), \
+                        &(inst[MOVE_DEST_VAL]), \
+                        &(inst[MOVE_DEST_INDEX])) < 0) { \
+            return(-1); \
+        } \
+    \
+        if(populate_var(cvm, \
+                        GET_TOKEN(cvm->logline, 2), \
+                        curproc, \
+                        1, 0, \
+                        &(inst[MOVE_SRC_FLAGS]), \
+                        &(inst[MOVE_SRC_VAL]), \
+                        &(inst[MOVE_SRC_INDEX])) < 0) { \
+            return(-1); \
+        } \
+    \
+        if(populate_var(cvm, \
+                        GET_TOKEN(cvm->logline, 3), \
+                        curproc, \
+                        1, 0, \
+                        &(inst[BULK_COUNT_FLAGS]), \
+                        &(inst[BULK_COUNT_VAL]), \
+                        &(inst[BULK_COUNT_INDEX])) < 0) { \
+            return(-1); \
+        }
+
 static int codegen(CrustyVM *cvm) {
     CrustyProcedure *curproc = NULL;
     int procnum = 0;
     int *inst;
     unsigned int j;
 
-    for(cvm->logline = 0; cvm->logline < cvm->lines; cvm->logline++) {
+    for(cvm->logline = 0; cvm->logline < cvm->prog->lines; cvm->logline++) {
         if(curproc == NULL) {
-            if(cvm->logline == cvm->proc[procnum].start) {
-                curproc = &(cvm->proc[procnum]);
-                curproc->instruction = cvm->insts;
+            if(cvm->logline == cvm->prog->proc[procnum].start) {
+                curproc = &(cvm->prog->proc[procnum]);
+                curproc->instruction = cvm->prog->insts;
             }
         }
 
@@ -3603,12 +4649,13 @@ static int codegen(CrustyVM *cvm) {
             return(-1);
         }
 
-        cvm->line[cvm->logline].instruction = cvm->insts;
+        cvm->prog->line[cvm->logline].instruction = cvm->prog->insts;
+        cvm->prog->line[cvm->logline].inlined = -1;
 
         if(compare_token_and_string(cvm,
                                     GET_TOKEN_OFFSET(cvm->logline, 0),
                                     "move") == 0) {
-            if(cvm->line[cvm->logline].tokencount != 3) {
+            if(cvm->prog->line[cvm->logline].tokencount != 3) {
                 LOG_PRINTF_LINE(cvm, "move takes a destination and source.\n");
                 return(-1);
             }
@@ -3652,8 +4699,8 @@ static int codegen(CrustyVM *cvm) {
         } else if(compare_token_and_string(cvm,
                                            GET_TOKEN_OFFSET(cvm->logline, 0),
                                            "cmp") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2 ||
-               cvm->line[cvm->logline].tokencount > 3) {
+            if(cvm->prog->line[cvm->logline].tokencount < 2 ||
+               cvm->prog->line[cvm->logline].tokencount > 3) {
                 LOG_PRINTF_LINE(cvm, "cmp takes one or two operands.\n");
                 return(-1);
             }
@@ -3675,7 +4722,7 @@ static int codegen(CrustyVM *cvm) {
                 return(-1);
             }
 
-            if(cvm->line[cvm->logline].tokencount == 3) {
+            if(cvm->prog->line[cvm->logline].tokencount == 3) {
                 if(populate_var(cvm,
                                 GET_TOKEN(cvm->logline, 2),
                                 curproc,
@@ -3698,12 +4745,12 @@ static int codegen(CrustyVM *cvm) {
         } else if(compare_token_and_string(cvm,
                                            GET_TOKEN_OFFSET(cvm->logline, 0),
                                            "call") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2) {
+            if(cvm->prog->line[cvm->logline].tokencount < 2) {
                 LOG_PRINTF_LINE(cvm, "call takes a procedure and possible arguments.\n");
                 return(-1);
             }
 
-            unsigned int args = cvm->line[cvm->logline].tokencount - 2;
+            unsigned int args = cvm->prog->line[cvm->logline].tokencount - 2;
             unsigned int i;
 
             inst = new_instruction(cvm, (args * 3) + 1);
@@ -3721,10 +4768,10 @@ static int codegen(CrustyVM *cvm) {
                 return(-1);
             }
 
-            if(args != cvm->proc[inst[1]].args) {
+            if(args != cvm->prog->proc[inst[1]].args) {
                 LOG_PRINTF_LINE(cvm, "Procedure %s takes %u args, %u given.\n",
-                                cvm->proc[inst[1]].name,
-                                cvm->proc[inst[1]].args,
+                                cvm->prog->proc[inst[1]].name,
+                                cvm->prog->proc[inst[1]].args,
                                 args);
                 return(-1);
             }
@@ -3744,7 +4791,7 @@ static int codegen(CrustyVM *cvm) {
         } else if(compare_token_and_string(cvm,
                                            GET_TOKEN_OFFSET(cvm->logline, 0),
                                            "ret") == 0) {
-            if(cvm->line[cvm->logline].tokencount != 1) {
+            if(cvm->prog->line[cvm->logline].tokencount != 1) {
                 LOG_PRINTF_LINE(cvm, "ret takes no arguments.\n");
                 return(-1);
             }
@@ -3758,6 +4805,26 @@ static int codegen(CrustyVM *cvm) {
 
             procnum++;
             curproc = NULL;
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "yield") == 0) {
+            if(cvm->prog->line[cvm->logline].tokencount != 1) {
+                LOG_PRINTF_LINE(cvm, "yield takes no arguments.\n");
+                return(-1);
+            }
+
+            inst = new_instruction(cvm, 0);
+            if(inst == NULL) {
+                return(-1);
+            }
+
+            inst[0] = CRUSTY_INSTRUCTION_TYPE_YIELD;
+        } BULK_INSTRUCTION("copy", CRUSTY_INSTRUCTION_TYPE_COPY, 0)
+        } BULK_INSTRUCTION("fill", CRUSTY_INSTRUCTION_TYPE_FILL, 0)
+        } BULK_INSTRUCTION("vadd", CRUSTY_INSTRUCTION_TYPE_VADD, 1)
+        } BULK_INSTRUCTION("vmul", CRUSTY_INSTRUCTION_TYPE_VMUL, 1)
+        } BULK_INSTRUCTION("vand", CRUSTY_INSTRUCTION_TYPE_VAND, 1)
+        } BULK_INSTRUCTION("vor",  CRUSTY_INSTRUCTION_TYPE_VOR,  1)
         } else {
             LOG_PRINTF_LINE(cvm, "Invalid instruction mnemonic: %s\n",
                                  GET_TOKEN(cvm->logline, 0));
@@ -3766,15 +4833,15 @@ static int codegen(CrustyVM *cvm) {
     }
 
     /* convert jump arguments from line to ip */
-    for(j = 0; j < cvm->lines; j++) {
-        switch(cvm->inst[cvm->line[j].instruction]) {
+    for(j = 0; j < cvm->prog->lines; j++) {
+        switch(cvm->prog->inst[cvm->prog->line[j].instruction]) {
             case CRUSTY_INSTRUCTION_TYPE_JUMP:
             case CRUSTY_INSTRUCTION_TYPE_JUMPN:
             case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
             case CRUSTY_INSTRUCTION_TYPE_JUMPL:
             case CRUSTY_INSTRUCTION_TYPE_JUMPG:
-                cvm->inst[cvm->line[j].instruction + JUMP_LOCATION] =
-                cvm->line[cvm->inst[cvm->line[j].instruction + JUMP_LOCATION]].instruction;
+                cvm->prog->inst[cvm->prog->line[j].instruction + JUMP_LOCATION] =
+                cvm->prog->line[cvm->prog->inst[cvm->prog->line[j].instruction + JUMP_LOCATION]].instruction;
             default:
                 break;
         }
@@ -3783,6 +4850,7 @@ static int codegen(CrustyVM *cvm) {
     return(0);
 }
 
+#undef BULK_INSTRUCTION
 #undef JUMP_INSTRUCTION
 #undef MATH_INSTRUCTION
 
@@ -3808,16 +4876,16 @@ static int check_move_arg(CrustyVM *cvm,
             return(-1);
         }
 
-        if(val < 0 || val > (int)(cvm->vars) - 1) {
+        if(val < 0 || val > (int)(cvm->prog->vars) - 1) {
             LOG_PRINTF_LINE(cvm, "Var out of range (%d).\n", val);
             return(-1);
         }
 
 #ifdef CRUSTY_TEST
-        LOG_PRINTF_BARE(cvm, "%d(%s):", val, cvm->var[val].name);
+        LOG_PRINTF_BARE(cvm, "%d(%s):", val, cvm->prog->var[val].name);
 #endif
     } else if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-        if(val < 0 || val > (int)(cvm->vars) - 1) {
+        if(val < 0 || val > (int)(cvm->prog->vars) - 1) {
             LOG_PRINTF_LINE(cvm, "Var out of range (%d).\n", val);
             return(-1);
         }
@@ -3828,46 +4896,49 @@ static int check_move_arg(CrustyVM *cvm,
         }
 
         if(dest) {
-            if(cvm->var[val].read != NULL && cvm->var[val].write == NULL) {
+            if(VAR_READ(&(cvm->prog->var[val])) != NULL &&
+               VAR_WRITE(&(cvm->prog->var[val])) == NULL) {
                 LOG_PRINTF_LINE(cvm, "Read only callback variable as "
-                                     "destination (%s).\n", cvm->var[val].name);
+                                     "destination (%s).\n", cvm->prog->var[val].name);
                 return(-1);
             }
         } else {
-            if(cvm->var[val].write != NULL && cvm->var[val].read == NULL) {
+            if(VAR_WRITE(&(cvm->prog->var[val])) != NULL &&
+               VAR_READ(&(cvm->prog->var[val])) == NULL) {
                 LOG_PRINTF_LINE(cvm, "Write only callback variable as "
-                                     "source (%s).\n", cvm->var[val].name);
+                                     "source (%s).\n", cvm->prog->var[val].name);
                 return(-1);
             }
         }
 
         if((flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-            if(index < 0 || index > (int)(cvm->vars) - 1) {
+            if(index < 0 || index > (int)(cvm->prog->vars) - 1) {
                 LOG_PRINTF_LINE(cvm, "Index var out of range (%d).\n", index);
                 return(-1);
             }
 
-            if(cvm->var[index].write != NULL && cvm->var[index].read == NULL) {
+            if(VAR_WRITE(&(cvm->prog->var[index])) != NULL &&
+               VAR_READ(&(cvm->prog->var[index])) == NULL) {
                 LOG_PRINTF_LINE(cvm, "Write only callback variable "
-                                     "as index (%s).\n", cvm->var[val].name);
+                                     "as index (%s).\n", cvm->prog->var[val].name);
                 return(-1);
             }
 
 #ifdef CRUSTY_TEST
             LOG_PRINTF_BARE(cvm, "%d(%s):%d(%s)",
-                            val, cvm->var[val].name,
-                            index, cvm->var[index].name);
+                            val, cvm->prog->var[val].name,
+                            index, cvm->prog->var[index].name);
 #endif
         } else if((flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_IMMEDIATE) {
             if(index < 0 ||
-               (cvm->var[val].length > 0 &&
-                index > (int)(cvm->var[val].length) - 1)) {
+               (cvm->prog->var[val].length > 0 &&
+                index > (int)(cvm->prog->var[val].length) - 1)) {
                 LOG_PRINTF_LINE(cvm, "Index out of range %d.\n", index);
                 return(-1);
             }
 
 #ifdef CRUSTY_TEST
-            LOG_PRINTF_BARE(cvm, "%d(%s):%d", val, cvm->var[val].name, index);
+            LOG_PRINTF_BARE(cvm, "%d(%s):%d", val, cvm->prog->var[val].name, index);
 #endif
         }
     } else {
@@ -3882,7 +4953,7 @@ static int check_math_instruction(CrustyVM *cvm,
                                   const char *name,
                                   unsigned int i,
                                   unsigned int notcmp) {
-    if(i + MOVE_ARGS > cvm->insts - 1) {
+    if(i + MOVE_ARGS > cvm->prog->insts - 1) {
         LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
                              "of %s instruction.\n", name);
         return(-1);
@@ -3893,9 +4964,9 @@ static int check_math_instruction(CrustyVM *cvm,
 #endif
     if(check_move_arg(cvm,
                       notcmp,
-                      cvm->inst[i+MOVE_DEST_FLAGS],
-                      cvm->inst[i+MOVE_DEST_VAL],
-                      cvm->inst[i+MOVE_DEST_INDEX]) < 0) {
+                      cvm->prog->inst[i+MOVE_DEST_FLAGS],
+                      cvm->prog->inst[i+MOVE_DEST_VAL],
+                      cvm->prog->inst[i+MOVE_DEST_INDEX]) < 0) {
         return(-1);
     }
 #ifdef CRUSTY_TEST
@@ -3903,9 +4974,9 @@ static int check_math_instruction(CrustyVM *cvm,
 #endif
     if(check_move_arg(cvm,
                       0,
-                      cvm->inst[i+MOVE_SRC_FLAGS],
-                      cvm->inst[i+MOVE_SRC_VAL],
-                      cvm->inst[i+MOVE_SRC_INDEX]) < 0) {
+                      cvm->prog->inst[i+MOVE_SRC_FLAGS],
+                      cvm->prog->inst[i+MOVE_SRC_VAL],
+                      cvm->prog->inst[i+MOVE_SRC_INDEX]) < 0) {
         return(-1);
     }
 #ifdef CRUSTY_TEST
@@ -3919,6 +4990,56 @@ static int check_math_instruction(CrustyVM *cvm,
         return(-1); \
     }
 
+static int check_bulk_instruction(CrustyVM *cvm,
+                                  const char *name,
+                                  unsigned int i) {
+    if(i + BULK_ARGS > cvm->prog->insts - 1) {
+        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
+                             "of %s instruction.\n", name);
+        return(-1);
+    }
+
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "%s ", name);
+#endif
+    if(check_move_arg(cvm,
+                      1,
+                      cvm->prog->inst[i+MOVE_DEST_FLAGS],
+                      cvm->prog->inst[i+MOVE_DEST_VAL],
+                      cvm->prog->inst[i+MOVE_DEST_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, " ");
+#endif
+    if(check_move_arg(cvm,
+                      0,
+                      cvm->prog->inst[i+MOVE_SRC_FLAGS],
+                      cvm->prog->inst[i+MOVE_SRC_VAL],
+                      cvm->prog->inst[i+MOVE_SRC_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, " ");
+#endif
+    if(check_move_arg(cvm,
+                      0,
+                      cvm->prog->inst[i+BULK_COUNT_FLAGS],
+                      cvm->prog->inst[i+BULK_COUNT_VAL],
+                      cvm->prog->inst[i+BULK_COUNT_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "\n");
+#endif
+    return(0);
+}
+
+#define BULK_INSTRUCTION(NAME) \
+    if(check_bulk_instruction(cvm, NAME, i) < 0) { \
+        return(-1); \
+    }
+
 static int check_jump_instruction(CrustyVM *cvm,
                                   const char *name,
                                   CrustyProcedure *proc,
@@ -3927,20 +5048,20 @@ static int check_jump_instruction(CrustyVM *cvm,
     unsigned int line;
     unsigned int found;
 
-    if(i + JUMP_ARGS > cvm->insts - 1) {
+    if(i + JUMP_ARGS > cvm->prog->insts - 1) {
         LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
                              "of %s instruction.\n", name);
         return(-1);
     }
 
     found = 0;
-    for(j = 0; j < cvm->lines; j++) {
-        if(cvm->inst[i+JUMP_LOCATION] < 0 ) {
+    for(j = 0; j < cvm->prog->lines; j++) {
+        if(cvm->prog->inst[i+JUMP_LOCATION] < 0 ) {
             LOG_PRINTF_LINE(cvm, "Negative jump pointer?\n");
             return(-1);
         }
 
-        if((unsigned int)(cvm->inst[i+JUMP_LOCATION]) == cvm->line[j].instruction) {
+        if((unsigned int)(cvm->prog->inst[i+JUMP_LOCATION]) == cvm->prog->line[j].instruction) {
             line = j;
             found = 1;
             break;
@@ -3960,7 +5081,7 @@ static int check_jump_instruction(CrustyVM *cvm,
     }
 
 #ifdef CRUSTY_TEST
-    LOG_PRINTF_BARE(cvm, "%s %d\n", name, cvm->inst[i+JUMP_LOCATION]);
+    LOG_PRINTF_BARE(cvm, "%s %d\n", name, cvm->prog->inst[i+JUMP_LOCATION]);
 #endif
     return(0);
 }
@@ -3982,7 +5103,7 @@ static int check_instruction(CrustyVM *cvm,
 #ifdef CRUSTY_TEST
     LOG_PRINTF(cvm, "%d: ", i);
 #endif
-    switch(cvm->inst[i]) {
+    switch(cvm->prog->inst[i]) {
         case CRUSTY_INSTRUCTION_TYPE_MOVE:
             MATH_INSTRUCTION("move", 1)
             return(MOVE_ARGS + 1);
@@ -4035,23 +5156,23 @@ static int check_instruction(CrustyVM *cvm,
             JUMP_INSTRUCTION("jumpg")
             return(JUMP_ARGS + 1);
         case CRUSTY_INSTRUCTION_TYPE_CALL:
-            if(i + JUMP_ARGS > cvm->insts - 1) {
+            if(i + JUMP_ARGS > cvm->prog->insts - 1) {
                 LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
                                      "of call instruction.\n");
                 return(-1);
             }
 
-            if(cvm->inst[i+CALL_PROCEDURE] < 0 ||
-               cvm->inst[i+CALL_PROCEDURE] > (int)(cvm->procs) - 1) {
+            if(cvm->prog->inst[i+CALL_PROCEDURE] < 0 ||
+               cvm->prog->inst[i+CALL_PROCEDURE] > (int)(cvm->prog->procs) - 1) {
                 LOG_PRINTF_LINE(cvm, "Call to procedure out of range.\n");
                 return(-1);
             }
 
-            CrustyProcedure *callProc = &(cvm->proc[cvm->inst[i+CALL_PROCEDURE]]);
+            CrustyProcedure *callProc = &(cvm->prog->proc[cvm->prog->inst[i+CALL_PROCEDURE]]);
             unsigned int j;
 
 #ifdef CRUSTY_TEST
-            LOG_PRINTF_BARE(cvm, "call %d(%s)", cvm->inst[i+CALL_PROCEDURE],
+            LOG_PRINTF_BARE(cvm, "call %d(%s)", cvm->prog->inst[i+CALL_PROCEDURE],
                             callProc->name);
 #endif
 
@@ -4061,9 +5182,9 @@ static int check_instruction(CrustyVM *cvm,
 #endif
                 if(check_move_arg(cvm,
                                   0,
-                                  cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_FLAGS],
-                                  cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_VAL],
-                                  cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_INDEX]) < 0) {
+                                  cvm->prog->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_FLAGS],
+                                  cvm->prog->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_VAL],
+                                  cvm->prog->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_INDEX]) < 0) {
                     return(-1);
                 }
             }
@@ -4083,12 +5204,36 @@ static int check_instruction(CrustyVM *cvm,
             }
 
             return(RET_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_YIELD:
+#ifdef CRUSTY_TEST
+            LOG_PRINTF_BARE(cvm, "yield\n");
+#endif
+            return(YIELD_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_COPY:
+            BULK_INSTRUCTION("copy")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_FILL:
+            BULK_INSTRUCTION("fill")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VADD:
+            BULK_INSTRUCTION("vadd")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VMUL:
+            BULK_INSTRUCTION("vmul")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VAND:
+            BULK_INSTRUCTION("vand")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VOR:
+            BULK_INSTRUCTION("vor")
+            return(BULK_ARGS + 1);
         default:
-            LOG_PRINTF_LINE(cvm, "Invalid instruction %u.\n", cvm->inst[i]);
+            LOG_PRINTF_LINE(cvm, "Invalid instruction %u.\n", cvm->prog->inst[i]);
             return(-1);
     }
 }
 
+#undef BULK_INSTRUCTION
 #undef JUMP_INSTRUCTION
 #undef MATH_INSTRUCTION
 
@@ -4099,10 +5244,10 @@ static int codeverify(CrustyVM *cvm) {
     unsigned int i = 0;
     cvm->logline = 0;
 
-    while(i < cvm->insts) {
+    while(i < cvm->prog->insts) {
         if(curproc == NULL) {
-            if(cvm->logline == cvm->proc[procnum].start) {
-                curproc = &(cvm->proc[procnum]);
+            if(cvm->logline == cvm->prog->proc[procnum].start) {
+                curproc = &(cvm->prog->proc[procnum]);
                 procnum++;
 #ifdef CRUSTY_TEST
                 LOG_PRINTF(cvm, "proc %s\n", curproc->name);
@@ -4131,83 +5276,1947 @@ static int codeverify(CrustyVM *cvm) {
     return(0);
 }
 
-int crustyvm_reset(CrustyVM *cvm) {
-    const char *temp = cvm->stage;
-
-    cvm->stage = "reset";
-#ifdef CRUSTY_TEST
-    LOG_PRINTF(cvm, "Start\n");
-#endif
+/* operands which native code (JIT or translated C) can access directly, being
+ * immediates, or int or char memory at a constant index.  disp is from the
+ * start of the stack for globals or from the stack pointer for locals */
+typedef struct {
+    int imm;
+    int val;
+    CrustyType type;
+    int local;
+    int disp;
+} NativeOperand;
 
-    memcpy(cvm->stack, cvm->initializer, cvm->initialstack);
+static int native_operand(CrustyVM *cvm,
+                          int flags,
+                          int val,
+                          int index,
+                          NativeOperand *op) {
+    CrustyVariable *var;
 
-    cvm->status = CRUSTY_STATUS_READY;
-    cvm->stage = temp;
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_IMMEDIATE) {
+        op->imm = 1;
+        op->val = val;
+        return(0);
+    } else if((flags & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR &&
+              (flags & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_LENGTH) {
+        return(-1);
+    }
 
-    return(0);
-}
+    var = &(cvm->prog->var[val]);
+    if(variable_is_argument(var) || variable_is_callback(var)) {
+        return(-1);
+    }
 
-#ifdef CRUSTY_TEST
-static int write_lines(CrustyVM *cvm, const char *name) {
-    FILE *out;
-    unsigned int i, j;
-    char *temp;
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+        op->imm = 1;
+        op->val = var->length;
+        return(0);
+    }
 
-    out = fopen(name, "wb");
-    if(out == NULL) {
-        LOG_PRINTF(cvm, "Couldn't open file %s for writing.\n", name);
+    if((flags & MOVE_FLAG_INDEX_TYPE_MASK) != MOVE_FLAG_INDEX_IMMEDIATE ||
+       var->type == CRUSTY_TYPE_FLOAT ||
+       index < 0 || index > (int)(var->length - 1)) {
         return(-1);
     }
 
-    for(i = 0; i < cvm->lines; i++) {
-        for(j = 0; j < cvm->line[i].tokencount; j++) {
-            if(fprintf(out, "%s", GET_TOKEN(i, j)) < 0) {
-                LOG_PRINTF(cvm, "Couldn't write to file.\n");
-                return(-1);
-            }
-            if(j < cvm->line[i].tokencount - 1) {
-                if(fprintf(out, " ") < 0) {
-                    LOG_PRINTF(cvm, "Couldn't write to file.\n");
-                    return(-1);
-                }
-            }
-        }
-        if(fprintf(out, "\n") < 0) {
-            LOG_PRINTF(cvm, "Couldn't write to file.\n");
-            return(-1);
-        }
+    op->imm = 0;
+    op->type = var->type;
+    if(var->type == CRUSTY_TYPE_INT) {
+        index *= sizeof(int);
+    }
+    if(variable_is_global(var)) {
+        op->local = 0;
+        op->disp = var->offset + index;
+    } else {
+        op->local = 1;
+        op->disp = index - var->offset;
     }
-
-    fclose(out);
 
     return(0);
 }
-#endif
 
-CrustyVM *crustyvm_new(const char *name,
-                       char *safepath,
-                       const char *program,
-                       long len,
-                       unsigned int flags,
-                       unsigned int callstacksize,
-                       const CrustyCallback *cb,
-                       unsigned int cbcount,
-                       const char **var,
-                       const char **value,
-                       unsigned int vars,
-                       void (*log_cb)(void *priv, const char *fmt, ...),
-                       void *log_priv) {
-    CrustyVM *cvm;
-    int foundmacro;
-    unsigned int i, j;
-    char namebuffer[] = "preprocess###.cvm";
-    long tokenstart;
-    unsigned long *varOffset;
-    unsigned long *valueOffset;
+static unsigned int instruction_size(CrustyVM *cvm, unsigned int ip) {
+    switch(cvm->prog->inst[ip]) {
+        case CRUSTY_INSTRUCTION_TYPE_JUMP:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPG:
+            return(JUMP_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_CALL:
+            return(CALL_START_ARGS +
+                   (cvm->prog->proc[cvm->prog->inst[ip + CALL_PROCEDURE]].args *
+                    CALL_ARG_SIZE));
+        case CRUSTY_INSTRUCTION_TYPE_RET:
+            return(RET_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_YIELD:
+            return(YIELD_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_COPY:
+        case CRUSTY_INSTRUCTION_TYPE_FILL:
+        case CRUSTY_INSTRUCTION_TYPE_VADD:
+        case CRUSTY_INSTRUCTION_TYPE_VMUL:
+        case CRUSTY_INSTRUCTION_TYPE_VAND:
+        case CRUSTY_INSTRUCTION_TYPE_VOR:
+            return(BULK_ARGS + 1);
+        default:
+            return(MOVE_ARGS + 1);
+    }
+}
 
-#ifdef CRUSTY_TEST
-    unsigned int k;
-#endif
+static int is_jump(int inst) {
+    return(inst >= CRUSTY_INSTRUCTION_TYPE_JUMP &&
+           inst <= CRUSTY_INSTRUCTION_TYPE_JUMPG);
+}
+
+static int is_bulk(int inst) {
+    return(inst >= CRUSTY_INSTRUCTION_TYPE_COPY &&
+           inst <= CRUSTY_INSTRUCTION_TYPE_VOR);
+}
+
+/* instructions run going around a loop which jumps back from ip to target,
+   charged against the budget all at once by native code which doesn't count
+   each one */
+static int loop_cost(CrustyVM *cvm, unsigned int target, unsigned int ip) {
+    unsigned int i;
+    int count = 1;
+
+    for(i = target; i < ip; i += instruction_size(cvm, i)) {
+        count++;
+    }
+
+    return(count);
+}
+
+#ifdef CRUSTY_JIT
+/* Baseline template compiler.  Moves, arithmetic and compares whose operands
+ * are plain int or char memory at a constant index (or immediates) are
+ * translated directly, as are jumps.  Anything else (floats, callbacks,
+ * arguments, division, calls and returns) is emitted as a call back in to
+ * crustyvm_step() for that one instruction, so range checks, stack overflow
+ * checks and error statuses all come from the interpreter.
+ *
+ * While native code is running, rbx holds the CrustyVM and r12 the stack
+ * memory.  cvm->ip is only kept up to date when leaving native code. */
+
+#define JIT_NONE (UINT_MAX)
+#define JIT_EXIT (0)
+#define JIT_ENTRY (5)
+
+typedef void (*jit_entry_func_t)(CrustyVM *cvm, void *code);
+
+typedef struct {
+    unsigned char *buf;
+    unsigned int len;
+    unsigned int size;
+
+    /* positions of jump operands which need the native address of an
+       instruction */
+    unsigned int *fixup;
+    unsigned int *fixupip;
+    unsigned int fixups;
+    unsigned int fixupsize;
+
+    int failed;
+} JitBuffer;
+
+static void jit_emit(JitBuffer *jb, const unsigned char *data, unsigned int len) {
+    unsigned char *temp;
+    unsigned int newsize;
+
+    if(jb->failed) {
+        return;
+    }
+
+    if(jb->len + len > jb->size) {
+        newsize = jb->size * 2;
+        while(jb->len + len > newsize) {
+            newsize *= 2;
+        }
+        temp = realloc(jb->buf, newsize);
+        if(temp == NULL) {
+            jb->failed = 1;
+            return;
+        }
+        jb->buf = temp;
+        jb->size = newsize;
+    }
+
+    memcpy(&(jb->buf[jb->len]), data, len);
+    jb->len += len;
+}
+
+static void jit_emit8(JitBuffer *jb, unsigned int val) {
+    unsigned char byte = val;
+
+    jit_emit(jb, &byte, 1);
+}
+
+static void jit_emit32(JitBuffer *jb, unsigned int val) {
+    unsigned char bytes[4];
+    unsigned int i;
+
+    for(i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = val >> (i * 8);
+    }
+
+    jit_emit(jb, bytes, sizeof(bytes));
+}
+
+static void jit_emit64(JitBuffer *jb, unsigned long long val) {
+    jit_emit32(jb, val);
+    jit_emit32(jb, val >> 32);
+}
+
+/* emit a rel32 operand to be pointed at instruction ip once everything is
+   emitted */
+static void jit_emit_fixup(JitBuffer *jb, unsigned int ip) {
+    unsigned int *temp;
+
+    if(jb->failed) {
+        return;
+    }
+
+    if(jb->fixups == jb->fixupsize) {
+        temp = realloc(jb->fixup, sizeof(unsigned int) * jb->fixupsize * 2);
+        if(temp == NULL) {
+            jb->failed = 1;
+            return;
+        }
+        jb->fixup = temp;
+        temp = realloc(jb->fixupip, sizeof(unsigned int) * jb->fixupsize * 2);
+        if(temp == NULL) {
+            jb->failed = 1;
+            return;
+        }
+        jb->fixupip = temp;
+        jb->fixupsize *= 2;
+    }
+
+    jb->fixup[jb->fixups] = jb->len;
+    jb->fixupip[jb->fixups] = ip;
+    jb->fixups++;
+    jit_emit32(jb, 0);
+}
+
+/* opcode with a [rbx + field] operand */
+static void jit_emit_field(JitBuffer *jb,
+                           unsigned int opcode,
+                           unsigned int reg,
+                           size_t field) {
+    jit_emit8(jb, opcode);
+    jit_emit8(jb, 0x83 | (reg << 3));
+    jit_emit32(jb, field);
+}
+
+/* opcode with a [r12 + disp] or [r12 + rdx + disp] operand, rdx being loaded
+   with the stack pointer for locals */
+static void jit_emit_mem(JitBuffer *jb,
+                         const unsigned char *opcode,
+                         unsigned int len,
+                         unsigned int reg,
+                         NativeOperand *op) {
+    jit_emit8(jb, 0x41); /* REX.B for r12 */
+    jit_emit(jb, opcode, len);
+    jit_emit8(jb, 0x84 | (reg << 3));
+    jit_emit8(jb, op->local ? 0x14 : 0x24);
+    jit_emit32(jb, op->disp);
+}
+
+static void jit_emit_load(JitBuffer *jb, unsigned int reg, NativeOperand *op) {
+    const unsigned char movzx[] = {0x0F, 0xB6};
+    const unsigned char mov[] = {0x8B};
+
+    if(op->imm) {
+        jit_emit8(jb, 0xB8 + reg);
+        jit_emit32(jb, op->val);
+    } else if(op->type == CRUSTY_TYPE_CHAR) {
+        jit_emit_mem(jb, movzx, sizeof(movzx), reg, op);
+    } else {
+        jit_emit_mem(jb, mov, sizeof(mov), reg, op);
+    }
+}
+
+/* store eax */
+static void jit_emit_store(JitBuffer *jb, NativeOperand *op) {
+    const unsigned char mov8[] = {0x88};
+    const unsigned char mov[] = {0x89};
+
+    if(op->type == CRUSTY_TYPE_CHAR) {
+        jit_emit_mem(jb, mov8, sizeof(mov8), 0, op);
+    } else {
+        jit_emit_mem(jb, mov, sizeof(mov), 0, op);
+    }
+}
+
+static void *jit_step(CrustyVM *cvm) {
+    cvm->budget--;
+    if(crustyvm_step(cvm) != CRUSTY_STATUS_ACTIVE ||
+       cvm->budget <= 0 ||
+       cvm->prog->jitoffset[cvm->ip] == JIT_NONE) {
+        return(NULL);
+    }
+
+    return(&(cvm->prog->jitmem[cvm->prog->jitoffset[cvm->ip]]));
+}
+
+/* run instruction ip in the interpreter then continue at wherever it left ip,
+   or leave native code if it stopped */
+static void jit_emit_step(JitBuffer *jb, unsigned int ip) {
+    const unsigned char call[] = {
+        0x48, 0x89, 0xDF, /* mov rdi, rbx */
+        0x48, 0xB8        /* mov rax, imm64 */
+    };
+    const unsigned char test[] = {
+        0xFF, 0xD0,       /* call rax */
+        0x48, 0x85, 0xC0, /* test rax, rax */
+        0x0F, 0x84        /* jz rel32 */
+    };
+
+    jit_emit_field(jb, 0xC7, 0, offsetof(CrustyVM, ip));
+    jit_emit32(jb, ip);
+    jit_emit(jb, call, sizeof(call));
+    jit_emit64(jb, (unsigned long long)(uintptr_t)jit_step);
+    jit_emit(jb, test, sizeof(test));
+    jit_emit32(jb, JIT_EXIT - (jb->len + 4));
+    jit_emit8(jb, 0xFF); /* jmp rax */
+    jit_emit8(jb, 0xE0);
+}
+
+/* returns 1 if translated, 0 if it should be stepped */
+static int jit_emit_math(CrustyVM *cvm, JitBuffer *jb, unsigned int ip) {
+    NativeOperand dest, src;
+    int type = cvm->prog->inst[ip];
+
+    if(native_operand(cvm,
+                      cvm->prog->inst[ip + MOVE_DEST_FLAGS],
+                      cvm->prog->inst[ip + MOVE_DEST_VAL],
+                      cvm->prog->inst[ip + MOVE_DEST_INDEX],
+                      &dest) < 0 ||
+       native_operand(cvm,
+                      cvm->prog->inst[ip + MOVE_SRC_FLAGS],
+                      cvm->prog->inst[ip + MOVE_SRC_VAL],
+                      cvm->prog->inst[ip + MOVE_SRC_INDEX],
+                      &src) < 0) {
+        return(0);
+    }
+    /* cmp is the only one where the destination may be an immediate, but in
+       one of those cases the interpreter doesn't update the result type, so
+       just leave it to the interpreter */
+    if(dest.imm) {
+        return(0);
+    }
+
+    if(dest.local || (!src.imm && src.local)) {
+        jit_emit_field(jb, 0x8B, 2, offsetof(CrustyVM, sp)); /* mov edx */
+    }
+
+    if(type == CRUSTY_INSTRUCTION_TYPE_MOVE) {
+        /* same type moves don't touch the result type */
+        jit_emit_load(jb, 0, &src);
+        jit_emit_field(jb, 0x89, 0, offsetof(CrustyVM, intresult));
+        jit_emit_store(jb, &dest);
+        return(1);
+    }
+
+    jit_emit_load(jb, 0, &dest);
+    jit_emit_load(jb, 1, &src);
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_ADD:
+            jit_emit8(jb, 0x01); /* add eax, ecx */
+            jit_emit8(jb, 0xC8);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_SUB:
+        case CRUSTY_INSTRUCTION_TYPE_CMP:
+            jit_emit8(jb, 0x29); /* sub eax, ecx */
+            jit_emit8(jb, 0xC8);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_MUL:
+            jit_emit8(jb, 0x0F); /* imul eax, ecx */
+            jit_emit8(jb, 0xAF);
+            jit_emit8(jb, 0xC1);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_AND:
+            jit_emit8(jb, 0x21); /* and eax, ecx */
+            jit_emit8(jb, 0xC8);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_OR:
+            jit_emit8(jb, 0x09); /* or eax, ecx */
+            jit_emit8(jb, 0xC8);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_XOR:
+            jit_emit8(jb, 0x31); /* xor eax, ecx */
+            jit_emit8(jb, 0xC8);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_SHR:
+            jit_emit8(jb, 0xD3); /* sar eax, cl */
+            jit_emit8(jb, 0xF8);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_SHL:
+            jit_emit8(jb, 0xD3); /* shl eax, cl */
+            jit_emit8(jb, 0xE0);
+            break;
+    }
+    jit_emit_field(jb, 0x89, 0, offsetof(CrustyVM, intresult));
+    jit_emit_field(jb, 0xC7, 0, offsetof(CrustyVM, resulttype));
+    jit_emit32(jb, CRUSTY_TYPE_INT);
+    if(type != CRUSTY_INSTRUCTION_TYPE_CMP) {
+        jit_emit_store(jb, &dest);
+    }
+
+    return(1);
+}
+
+static int jit_emit_jump(CrustyVM *cvm, JitBuffer *jb, unsigned int ip) {
+    unsigned int target = cvm->prog->inst[ip + JUMP_LOCATION];
+    unsigned int cc;
+
+    /* jump to self ends execution, so let the interpreter do that */
+    if(target == ip) {
+        return(0);
+    }
+
+    /* going back around a loop is charged against the budget, and once it
+       runs out the interpreter takes the jump and returns to the host */
+    if(target < ip) {
+        jit_emit_field(jb, 0x81, 5, offsetof(CrustyVM, budget)); /* sub */
+        jit_emit32(jb, loop_cost(cvm, target, ip));
+        jit_emit8(jb, 0x0F); /* jle to the step */
+        jit_emit8(jb, 0x8E);
+        if(cvm->prog->inst[ip] == CRUSTY_INSTRUCTION_TYPE_JUMP) {
+            jit_emit32(jb, 5);
+        } else {
+            jit_emit32(jb, 7 + 6 + 7 + 6 + 5);
+        }
+    }
+
+    switch(cvm->prog->inst[ip]) {
+        case CRUSTY_INSTRUCTION_TYPE_JUMP:
+            jit_emit8(jb, 0xE9);
+            jit_emit_fixup(jb, target);
+            if(target < ip) {
+                jit_emit_step(jb, ip);
+            }
+            return(1);
+        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+            cc = 0x85;
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+            cc = 0x84;
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+            cc = 0x8C;
+            break;
+        default: /* JUMPG */
+            cc = 0x8F;
+    }
+
+    /* integer results are tested here, float results go to the interpreter
+       which follows this */
+    jit_emit_field(jb, 0x83, 7, offsetof(CrustyVM, resulttype));
+    jit_emit8(jb, CRUSTY_TYPE_INT);
+    jit_emit8(jb, 0x0F); /* jne to the step */
+    jit_emit8(jb, 0x85);
+    jit_emit32(jb, 7 + 6 + 5);
+    jit_emit_field(jb, 0x83, 7, offsetof(CrustyVM, intresult));
+    jit_emit8(jb, 0);
+    jit_emit8(jb, 0x0F);
+    jit_emit8(jb, cc);
+    jit_emit_fixup(jb, target);
+    jit_emit8(jb, 0xE9);
+    jit_emit_fixup(jb, ip + JUMP_ARGS + 1);
+    jit_emit_step(jb, ip);
+
+    return(1);
+}
+
+static void jit_free(CrustyVM *cvm) {
+    if(cvm->prog->jitmem != NULL) {
+        munmap(cvm->prog->jitmem, cvm->prog->jitmemsize);
+        cvm->prog->jitmem = NULL;
+    }
+
+    if(cvm->prog->jitoffset != NULL) {
+        free(cvm->prog->jitoffset);
+        cvm->prog->jitoffset = NULL;
+    }
+}
+
+static int jit_compile(CrustyVM *cvm) {
+    const unsigned char stub[] = {
+        /* JIT_EXIT */
+        0x41, 0x5C,             /* pop r12 */
+        0x5B,                   /* pop rbx */
+        0x5D,                   /* pop rbp */
+        0xC3,                   /* ret */
+        /* JIT_ENTRY, the extra push keeps the stack aligned for calls */
+        0x55,                   /* push rbp */
+        0x53,                   /* push rbx */
+        0x41, 0x54,             /* push r12 */
+        0x48, 0x89, 0xFB,       /* mov rbx, rdi */
+        0x4C, 0x8B, 0xA3        /* mov r12, [rbx + stack] */
+    };
+    JitBuffer jb;
+    unsigned int i, j;
+    unsigned int instsize;
+    unsigned int count = 0;
+    unsigned int native = 0;
+    int result = -1;
+    int rel;
+
+    jb.buf = NULL;
+    jb.fixup = NULL;
+    jb.fixupip = NULL;
+    jb.len = 0;
+    jb.size = 4096;
+    jb.fixups = 0;
+    jb.fixupsize = 256;
+    jb.failed = 0;
+
+    cvm->prog->jitoffset = malloc(sizeof(unsigned int) * cvm->prog->insts);
+    jb.buf = malloc(jb.size);
+    jb.fixup = malloc(sizeof(unsigned int) * jb.fixupsize);
+    jb.fixupip = malloc(sizeof(unsigned int) * jb.fixupsize);
+    if(cvm->prog->jitoffset == NULL || jb.buf == NULL ||
+       jb.fixup == NULL || jb.fixupip == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for native code.\n");
+        goto cleanup;
+    }
+    for(i = 0; i < cvm->prog->insts; i++) {
+        cvm->prog->jitoffset[i] = JIT_NONE;
+    }
+
+    jit_emit(&jb, stub, sizeof(stub));
+    jit_emit32(&jb, offsetof(CrustyVM, stack));
+    jit_emit8(&jb, 0xFF); /* jmp rsi */
+    jit_emit8(&jb, 0xE6);
+
+    i = 0;
+    while(i < cvm->prog->insts) {
+        cvm->prog->jitoffset[i] = jb.len;
+
+        switch(cvm->prog->inst[i]) {
+            case CRUSTY_INSTRUCTION_TYPE_MOVE:
+            case CRUSTY_INSTRUCTION_TYPE_ADD:
+            case CRUSTY_INSTRUCTION_TYPE_SUB:
+            case CRUSTY_INSTRUCTION_TYPE_MUL:
+            case CRUSTY_INSTRUCTION_TYPE_AND:
+            case CRUSTY_INSTRUCTION_TYPE_OR:
+            case CRUSTY_INSTRUCTION_TYPE_XOR:
+            case CRUSTY_INSTRUCTION_TYPE_SHR:
+            case CRUSTY_INSTRUCTION_TYPE_SHL:
+            case CRUSTY_INSTRUCTION_TYPE_CMP:
+                if(jit_emit_math(cvm, &jb, i)) {
+                    native++;
+                } else {
+                    jit_emit_step(&jb, i);
+                }
+                instsize = MOVE_ARGS + 1;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_DIV:
+            case CRUSTY_INSTRUCTION_TYPE_MOD:
+                /* division by zero and float results are left to the
+                   interpreter */
+                jit_emit_step(&jb, i);
+                instsize = MOVE_ARGS + 1;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_JUMP:
+            case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+            case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+            case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+            case CRUSTY_INSTRUCTION_TYPE_JUMPG:
+                if(jit_emit_jump(cvm, &jb, i)) {
+                    native++;
+                } else {
+                    jit_emit_step(&jb, i);
+                }
+                instsize = JUMP_ARGS + 1;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_CALL:
+                /* argument setup and the stack overflow checks */
+                jit_emit_step(&jb, i);
+                instsize = CALL_START_ARGS +
+                           (cvm->prog->proc[cvm->prog->inst[i + CALL_PROCEDURE]].args *
+                            CALL_ARG_SIZE);
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_RET:
+                jit_emit_step(&jb, i);
+                instsize = RET_ARGS + 1;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_YIELD:
+                jit_emit_step(&jb, i);
+                instsize = YIELD_ARGS + 1;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_COPY:
+            case CRUSTY_INSTRUCTION_TYPE_FILL:
+            case CRUSTY_INSTRUCTION_TYPE_VADD:
+            case CRUSTY_INSTRUCTION_TYPE_VMUL:
+            case CRUSTY_INSTRUCTION_TYPE_VAND:
+            case CRUSTY_INSTRUCTION_TYPE_VOR:
+                /* the loop is already in the interpreter */
+                jit_emit_step(&jb, i);
+                instsize = BULK_ARGS + 1;
+                break;
+            default:
+                LOG_PRINTF(cvm, "BUG: Invalid instruction %u at %u.\n",
+                                cvm->prog->inst[i], i);
+                goto cleanup;
+        }
+
+        i += instsize;
+        count++;
+    }
+
+    if(jb.failed) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for native code.\n");
+        goto cleanup;
+    }
+
+    for(j = 0; j < jb.fixups; j++) {
+        if(jb.fixupip[j] >= cvm->prog->insts ||
+           cvm->prog->jitoffset[jb.fixupip[j]] == JIT_NONE) {
+            LOG_PRINTF(cvm, "BUG: Jump to %u is not to an instruction.\n",
+                            jb.fixupip[j]);
+            goto cleanup;
+        }
+        rel = cvm->prog->jitoffset[jb.fixupip[j]] - (jb.fixup[j] + 4);
+        memcpy(&(jb.buf[jb.fixup[j]]), &rel, sizeof(int));
+    }
+
+    cvm->prog->jitmemsize = jb.len;
+    cvm->prog->jitmem = mmap(NULL, cvm->prog->jitmemsize,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+    if(cvm->prog->jitmem == MAP_FAILED) {
+        cvm->prog->jitmem = NULL;
+        LOG_PRINTF(cvm, "Failed to map memory for native code.\n");
+        goto cleanup;
+    }
+    memcpy(cvm->prog->jitmem, jb.buf, jb.len);
+    if(mprotect(cvm->prog->jitmem, cvm->prog->jitmemsize, PROT_READ | PROT_EXEC) < 0) {
+        LOG_PRINTF(cvm, "Failed to make native code executable.\n");
+        goto cleanup;
+    }
+
+    LOG_PRINTF(cvm, "%u of %u instructions translated, %u bytes.\n",
+                    native, count, jb.len);
+    result = 0;
+
+cleanup:
+    if(result < 0) {
+        jit_free(cvm);
+    }
+    if(jb.buf != NULL) {
+        free(jb.buf);
+    }
+    if(jb.fixup != NULL) {
+        free(jb.fixup);
+    }
+    if(jb.fixupip != NULL) {
+        free(jb.fixupip);
+    }
+
+    return(result);
+}
+
+static void jit_run(CrustyVM *cvm) {
+    jit_entry_func_t entry = (jit_entry_func_t)(&(cvm->prog->jitmem[JIT_ENTRY]));
+
+    while(cvm->status == CRUSTY_STATUS_ACTIVE && cvm->budget > 0) {
+        if(cvm->prog->jitoffset[cvm->ip] == JIT_NONE) {
+            cvm->budget--;
+            crustyvm_step(cvm);
+        } else {
+            /* only where native code was entered is recorded */
+            RECORD(cvm, cvm->cstack[cvm->csp - 1].proc)
+            entry(cvm, &(cvm->prog->jitmem[cvm->prog->jitoffset[cvm->ip]]));
+        }
+    }
+}
+#endif
+
+
+/* the variable of an operand, or -1 if it's an immediate */
+static int operand_var(int flags, int val) {
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR ||
+       (flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+        return(val);
+    }
+
+    return(-1);
+}
+
+/* the variable an operand's index is read from, or -1 */
+static int operand_index_var(int flags, int index) {
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR &&
+       (flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
+        return(index);
+    }
+
+    return(-1);
+}
+
+/* plain int scalars in memory which immediates can be tracked through */
+static int optimize_trackable(CrustyVM *cvm, int flags, int val, int index) {
+    CrustyVariable *var;
+
+    if((flags & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR ||
+       (flags & MOVE_FLAG_INDEX_TYPE_MASK) != MOVE_FLAG_INDEX_IMMEDIATE ||
+       index != 0) {
+        return(0);
+    }
+
+    var = &(cvm->prog->var[val]);
+    return(!variable_is_argument(var) &&
+           !variable_is_callback(var) &&
+           var->type == CRUSTY_TYPE_INT &&
+           var->length == 1);
+}
+
+/* whether an instruction might change memory other than its destination,
+   through a callback (which may write to a set_buffer span) or through a
+   reference */
+static int optimize_clobbers(CrustyVM *cvm, unsigned int ip) {
+    int vars[4];
+    unsigned int i;
+
+    vars[0] = operand_var(cvm->prog->inst[ip + MOVE_DEST_FLAGS],
+                          cvm->prog->inst[ip + MOVE_DEST_VAL]);
+    vars[1] = operand_index_var(cvm->prog->inst[ip + MOVE_DEST_FLAGS],
+                                cvm->prog->inst[ip + MOVE_DEST_INDEX]);
+    vars[2] = operand_var(cvm->prog->inst[ip + MOVE_SRC_FLAGS],
+                          cvm->prog->inst[ip + MOVE_SRC_VAL]);
+    vars[3] = operand_index_var(cvm->prog->inst[ip + MOVE_SRC_FLAGS],
+                                cvm->prog->inst[ip + MOVE_SRC_INDEX]);
+
+    for(i = 0; i < 4; i++) {
+        if(vars[i] >= 0 && variable_is_callback(&(cvm->prog->var[vars[i]]))) {
+            return(1);
+        }
+    }
+
+    if(cvm->prog->inst[ip] != CRUSTY_INSTRUCTION_TYPE_CMP &&
+       vars[0] >= 0 && variable_is_argument(&(cvm->prog->var[vars[0]]))) {
+        return(1);
+    }
+
+    return(0);
+}
+
+/* a source operand which can be skipped without losing any side effect or
+   error, and its type */
+static int optimize_plain_src(CrustyVM *cvm,
+                              int flags,
+                              int val,
+                              int index,
+                              CrustyType *type) {
+    CrustyVariable *var;
+
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_IMMEDIATE) {
+        *type = CRUSTY_TYPE_INT;
+        return(1);
+    }
+
+    var = &(cvm->prog->var[val]);
+    if(variable_is_argument(var) || variable_is_callback(var)) {
+        return(0);
+    }
+
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+        *type = CRUSTY_TYPE_INT;
+        return(1);
+    }
+
+    if((flags & MOVE_FLAG_INDEX_TYPE_MASK) != MOVE_FLAG_INDEX_IMMEDIATE ||
+       index < 0 || index > (int)(var->length - 1)) {
+        return(0);
+    }
+
+    *type = var->type;
+    return(1);
+}
+
+static unsigned int next_live(CrustyVM *cvm,
+                              unsigned char *dead,
+                              unsigned int ip,
+                              unsigned int end) {
+    while(ip < end && dead[ip]) {
+        ip += instruction_size(cvm, ip);
+    }
+
+    return(ip);
+}
+
+static unsigned int procedure_end(CrustyVM *cvm, unsigned int p) {
+    return(p + 1 < cvm->prog->procs ? cvm->prog->proc[p + 1].instruction : cvm->prog->insts);
+}
+
+/* the value an int scalar local starts at on each call */
+static int local_initializer(CrustyVM *cvm, int local) {
+    CrustyProcedure *proc = &(cvm->prog->proc[cvm->prog->var[local].procIndex]);
+    int value;
+
+    memcpy(&value,
+           &(proc->initializer[proc->stackneeded - cvm->prog->var[local].offset]),
+           sizeof(int));
+
+    return(value);
+}
+
+/* whether a procedure is small and simple enough to be spliced in to its
+   callers: no calls, no callbacks, and only int scalar locals which can be
+   reinitialized with a move each */
+static int inline_candidate(CrustyVM *cvm, unsigned int p) {
+    CrustyProcedure *proc = &(cvm->prog->proc[p]);
+    unsigned int start, end;
+    unsigned int i, j, count;
+    int vars[4];
+    CrustyVariable *var;
+
+    start = proc->instruction;
+    end = procedure_end(cvm, p);
+    if(cvm->prog->inst[end - 1] != CRUSTY_INSTRUCTION_TYPE_RET) {
+        return(0);
+    }
+
+    count = 0;
+    for(i = start; i < end - 1; i += instruction_size(cvm, i)) {
+        count++;
+        if(cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_CALL ||
+           cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_YIELD ||
+           is_bulk(cvm->prog->inst[i]) ||
+           count > INLINE_MAX_INSTRUCTIONS) {
+            return(0);
+        }
+        if(is_jump(cvm->prog->inst[i])) {
+            continue;
+        }
+
+        vars[0] = operand_var(cvm->prog->inst[i + MOVE_DEST_FLAGS],
+                              cvm->prog->inst[i + MOVE_DEST_VAL]);
+        vars[1] = operand_index_var(cvm->prog->inst[i + MOVE_DEST_FLAGS],
+                                    cvm->prog->inst[i + MOVE_DEST_INDEX]);
+        vars[2] = operand_var(cvm->prog->inst[i + MOVE_SRC_FLAGS],
+                              cvm->prog->inst[i + MOVE_SRC_VAL]);
+        vars[3] = operand_index_var(cvm->prog->inst[i + MOVE_SRC_FLAGS],
+                                    cvm->prog->inst[i + MOVE_SRC_INDEX]);
+        for(j = 0; j < 4; j++) {
+            if(vars[j] >= 0 && variable_is_callback(&(cvm->prog->var[vars[j]]))) {
+                return(0);
+            }
+        }
+    }
+
+    for(i = proc->args; i < proc->vars; i++) {
+        var = &(cvm->prog->var[proc->varIndex[i]]);
+        if(var->type != CRUSTY_TYPE_INT || var->length != 1) {
+            return(0);
+        }
+    }
+
+    return(1);
+}
+
+/* whether the arguments of a call can stand in for the callee's arguments
+   directly, which is when evaluating them can't fail and they don't depend
+   on a variable index which is only read once when the call is made */
+static int inline_args_ok(CrustyVM *cvm, const int *args, unsigned int count) {
+    unsigned int i;
+    const int *arg;
+    CrustyVariable *var;
+
+    for(i = 0; i < count; i++) {
+        arg = &(args[i * CALL_ARG_SIZE]);
+        if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_IMMEDIATE) {
+            continue;
+        }
+
+        var = &(cvm->prog->var[arg[CALL_ARG_VAL]]);
+        if(variable_is_callback(var)) {
+            return(0);
+        }
+        if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+            continue;
+        }
+
+        if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_INDEX_TYPE_MASK) ==
+           MOVE_FLAG_INDEX_VAR) {
+            return(0);
+        }
+        if(variable_is_argument(var)) {
+            if(arg[CALL_ARG_INDEX] != 0) {
+                return(0);
+            }
+        } else if(arg[CALL_ARG_INDEX] < 0 ||
+                  arg[CALL_ARG_INDEX] > (int)(var->length - 1)) {
+            return(0);
+        }
+    }
+
+    return(1);
+}
+
+/* rewrite an operand of a procedure being inlined in terms of its caller.
+   args points to the call's arguments and localmap gives the caller's copies
+   of the callee's locals.  returns -1 if it can't be expressed. */
+static int inline_operand(CrustyVM *cvm,
+                          const int *args,
+                          const int *localmap,
+                          int dest,
+                          int *flags,
+                          int *val,
+                          int *index) {
+    CrustyVariable *var;
+    const int *arg;
+    int indextype = *flags & MOVE_FLAG_INDEX_TYPE_MASK;
+    int idx = *index;
+
+    if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_IMMEDIATE) {
+        return(0);
+    }
+
+    if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR &&
+       indextype == MOVE_FLAG_INDEX_VAR) {
+        var = &(cvm->prog->var[idx]);
+        if(variable_is_argument(var)) {
+            arg = &(args[(var->offset - 1) * CALL_ARG_SIZE]);
+            if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) ==
+               MOVE_FLAG_IMMEDIATE) {
+                indextype = MOVE_FLAG_INDEX_IMMEDIATE;
+                idx = arg[CALL_ARG_VAL];
+            } else if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) ==
+                      MOVE_FLAG_VAR &&
+                      arg[CALL_ARG_INDEX] == 0) {
+                idx = arg[CALL_ARG_VAL];
+            } else {
+                return(-1);
+            }
+        } else if(!variable_is_global(var)) {
+            idx = localmap[idx];
+        }
+    }
+
+    var = &(cvm->prog->var[*val]);
+    if(!variable_is_argument(var)) {
+        if(!variable_is_global(var)) {
+            *val = localmap[*val];
+        }
+        *flags = (*flags & MOVE_FLAG_TYPE_MASK) | indextype;
+        *index = idx;
+        return(0);
+    }
+
+    arg = &(args[(var->offset - 1) * CALL_ARG_SIZE]);
+    if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+        if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR) {
+            *flags = MOVE_FLAG_IMMEDIATE;
+            *val = 1;
+        } else if(!variable_is_argument(&(cvm->prog->var[arg[CALL_ARG_VAL]]))) {
+            *flags = MOVE_FLAG_IMMEDIATE;
+            *val = cvm->prog->var[arg[CALL_ARG_VAL]].length - arg[CALL_ARG_INDEX];
+        } else {
+            /* a caller's argument is only ever passed with index 0 */
+            *flags = MOVE_FLAG_LENGTH;
+            *val = arg[CALL_ARG_VAL];
+        }
+        *index = 0;
+        return(0);
+    }
+
+    /* immediates and lengths can only be read as they are */
+    if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR) {
+        if(dest || indextype != MOVE_FLAG_INDEX_IMMEDIATE || idx != 0) {
+            return(-1);
+        }
+        *flags = arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK;
+        *val = arg[CALL_ARG_VAL];
+        *index = 0;
+        return(0);
+    }
+
+    /* if the caller's argument was passed an immediate, the caller's copy of
+       it would be written instead of the callee's */
+    if(dest && variable_is_argument(&(cvm->prog->var[arg[CALL_ARG_VAL]]))) {
+        return(-1);
+    }
+
+    if(indextype == MOVE_FLAG_INDEX_IMMEDIATE) {
+        if(idx < 0) {
+            return(-1);
+        }
+        idx += arg[CALL_ARG_INDEX];
+    } else if(arg[CALL_ARG_INDEX] != 0) {
+        return(-1);
+    }
+    *flags = MOVE_FLAG_VAR | indextype;
+    *val = arg[CALL_ARG_VAL];
+    *index = idx;
+
+    return(0);
+}
+
+/* rewrite a whole instruction of a procedure being inlined, in place */
+static int inline_instruction(CrustyVM *cvm,
+                              int *inst,
+                              const int *args,
+                              const int *localmap) {
+    if(inline_operand(cvm, args, localmap,
+                      inst[0] != CRUSTY_INSTRUCTION_TYPE_CMP,
+                      &(inst[MOVE_DEST_FLAGS]),
+                      &(inst[MOVE_DEST_VAL]),
+                      &(inst[MOVE_DEST_INDEX])) < 0 ||
+       inline_operand(cvm, args, localmap, 0,
+                      &(inst[MOVE_SRC_FLAGS]),
+                      &(inst[MOVE_SRC_VAL]),
+                      &(inst[MOVE_SRC_INDEX])) < 0) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* give a caller its own copy of a local of a procedure inlined in to it */
+static int inline_local(CrustyVM *cvm, unsigned int p, int local) {
+    CrustyProcedure *proc = &(cvm->prog->proc[p]);
+    unsigned int lastSize = proc->stackneeded;
+    int value = local_initializer(cvm, local);
+    void *temp;
+
+    temp = realloc(cvm->prog->var, sizeof(CrustyVariable) * (cvm->prog->vars + 1));
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for variable.\n");
+        return(-1);
+    }
+    cvm->prog->var = (CrustyVariable *)temp;
+
+    temp = realloc(proc->varIndex, sizeof(int) * (proc->vars + 1));
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for local variable list.\n");
+        return(-1);
+    }
+    proc->varIndex = (int *)temp;
+
+    temp = realloc(proc->initializer, proc->stackneeded + sizeof(int));
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to expand procedure initializer.\n");
+        return(-1);
+    }
+    proc->initializer = temp;
+
+    /* same as new_variable(), the new local goes on the bottom */
+    cvm->prog->var[cvm->prog->vars] = cvm->prog->var[local];
+    cvm->prog->var[cvm->prog->vars].procIndex = p;
+    cvm->prog->var[cvm->prog->vars].proc = proc;
+    proc->stackneeded += sizeof(int);
+    cvm->prog->var[cvm->prog->vars].offset = proc->stackneeded;
+    memmove(&(proc->initializer[sizeof(int)]), proc->initializer, lastSize);
+    memcpy(proc->initializer, &value, sizeof(int));
+    proc->varIndex[proc->vars] = cvm->prog->vars;
+    proc->vars++;
+    /* the stack is sized for every procedure being called at once */
+    cvm->prog->stacksize += sizeof(int);
+
+    cvm->prog->vars++;
+    return(cvm->prog->vars - 1);
+}
+
+/* how much code a call grows to once inlined */
+static unsigned int inline_size(CrustyVM *cvm, unsigned int p) {
+    return(((cvm->prog->proc[p].vars - cvm->prog->proc[p].args) * (MOVE_ARGS + 1)) +
+           (procedure_end(cvm, p) - 1 - cvm->prog->proc[p].instruction));
+}
+
+/* Splice small procedures in to the procedures which call them.  Arguments
+ * are replaced with what was passed in and the callee's locals get copies in
+ * the caller's frame which are reset by moves where the call was.  The
+ * callee's lines are copied along and marked with where they came from, so
+ * traces still point at the right source. */
+static int inline_procedures(CrustyVM *cvm) {
+    unsigned char *candidate = NULL;
+    int *site = NULL;
+    int *localmap = NULL;
+    int *mapped = NULL;
+    unsigned int *newpos = NULL;
+    int *inst = NULL;
+    int copy[MOVE_ARGS + 1];
+    void *temp;
+    unsigned int p, q, i, j, k;
+    unsigned int start, end, next, lines;
+    unsigned int calls, totalcalls = 0;
+    unsigned int before = 0, after = 0;
+    int grown, local;
+    int result = -1;
+
+    candidate = malloc(cvm->prog->procs);
+    site = malloc(sizeof(int) * cvm->prog->insts);
+    localmap = malloc(sizeof(int) * cvm->prog->vars);
+    mapped = malloc(sizeof(int) * cvm->prog->procs);
+    newpos = malloc(sizeof(unsigned int) * (cvm->prog->insts + 1));
+    if(candidate == NULL || site == NULL || localmap == NULL ||
+       mapped == NULL || newpos == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for inlining.\n");
+        goto cleanup;
+    }
+
+    for(p = 0; p < cvm->prog->procs; p++) {
+        candidate[p] = inline_candidate(cvm, p);
+        mapped[p] = -1;
+    }
+    /* trial rewrites leave locals as they are */
+    for(i = 0; i < cvm->prog->vars; i++) {
+        localmap[i] = i;
+    }
+
+    /* pick out the calls to inline */
+    grown = 0;
+    lines = 0;
+    for(i = 0; i < cvm->prog->insts; i += instruction_size(cvm, i)) {
+        site[i] = -1;
+        before++;
+        if(cvm->prog->inst[i] != CRUSTY_INSTRUCTION_TYPE_CALL) {
+            continue;
+        }
+
+        q = cvm->prog->inst[i + CALL_PROCEDURE];
+        if(!candidate[q] ||
+           !inline_args_ok(cvm,
+                           &(cvm->prog->inst[i + CALL_START_ARGS]),
+                           cvm->prog->proc[q].args) ||
+           grown + (int)inline_size(cvm, q) - (int)instruction_size(cvm, i) >
+           (int)(cvm->prog->insts * (INLINE_MAX_GROWTH - 1))) {
+            continue;
+        }
+
+        start = cvm->prog->proc[q].instruction;
+        end = procedure_end(cvm, q) - 1;
+        for(j = start; j < end; j += instruction_size(cvm, j)) {
+            if(is_jump(cvm->prog->inst[j])) {
+                continue;
+            }
+
+            memcpy(copy, &(cvm->prog->inst[j]), sizeof(copy));
+            if(inline_instruction(cvm,
+                                  copy,
+                                  &(cvm->prog->inst[i + CALL_START_ARGS]),
+                                  localmap) < 0) {
+                break;
+            }
+        }
+        if(j < end) {
+            continue;
+        }
+
+        site[i] = q;
+        grown += (int)inline_size(cvm, q) - (int)instruction_size(cvm, i);
+        for(j = start; j < end; j += instruction_size(cvm, j)) {
+            lines++;
+        }
+    }
+
+    next = 0;
+    for(i = 0; i < cvm->prog->insts; i += instruction_size(cvm, i)) {
+        newpos[i] = next;
+        if(site[i] >= 0) {
+            next += inline_size(cvm, site[i]);
+        } else {
+            next += instruction_size(cvm, i);
+        }
+    }
+    newpos[cvm->prog->insts] = next;
+
+    inst = malloc(sizeof(int) * next);
+    if(inst == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for instructions.\n");
+        goto cleanup;
+    }
+    temp = realloc(cvm->prog->line, sizeof(CrustyLine) * (cvm->prog->lines + lines));
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for lines.\n");
+        goto cleanup;
+    }
+    cvm->prog->line = (CrustyLine *)temp;
+    lines = cvm->prog->lines;
+
+    for(p = 0; p < cvm->prog->procs; p++) {
+        calls = 0;
+        for(i = cvm->prog->proc[p].instruction;
+            i < procedure_end(cvm, p);
+            i += instruction_size(cvm, i)) {
+            next = newpos[i];
+            if(site[i] < 0) {
+                memcpy(&(inst[next]),
+                       &(cvm->prog->inst[i]),
+                       sizeof(int) * instruction_size(cvm, i));
+                if(is_jump(cvm->prog->inst[i])) {
+                    inst[next + JUMP_LOCATION] =
+                        newpos[cvm->prog->inst[i + JUMP_LOCATION]];
+                }
+                after++;
+                continue;
+            }
+
+            q = site[i];
+            if(mapped[q] != (int)p) {
+                for(j = cvm->prog->proc[q].args; j < cvm->prog->proc[q].vars; j++) {
+                    local = inline_local(cvm, p, cvm->prog->proc[q].varIndex[j]);
+                    if(local < 0) {
+                        goto cleanup;
+                    }
+                    localmap[cvm->prog->proc[q].varIndex[j]] = local;
+                }
+                mapped[q] = p;
+            }
+
+            /* set the locals up like call() would */
+            for(j = cvm->prog->proc[q].args; j < cvm->prog->proc[q].vars; j++) {
+                inst[next] = CRUSTY_INSTRUCTION_TYPE_MOVE;
+                inst[next + MOVE_DEST_FLAGS] = MOVE_FLAG_VAR |
+                                               MOVE_FLAG_INDEX_IMMEDIATE;
+                inst[next + MOVE_DEST_VAL] =
+                    localmap[cvm->prog->proc[q].varIndex[j]];
+                inst[next + MOVE_DEST_INDEX] = 0;
+                inst[next + MOVE_SRC_FLAGS] = MOVE_FLAG_IMMEDIATE;
+                inst[next + MOVE_SRC_VAL] =
+                    local_initializer(cvm, cvm->prog->proc[q].varIndex[j]);
+                inst[next + MOVE_SRC_INDEX] = 0;
+                next += MOVE_ARGS + 1;
+                after++;
+            }
+
+            start = cvm->prog->proc[q].instruction;
+            end = procedure_end(cvm, q) - 1;
+            for(j = start; j < end; j += instruction_size(cvm, j)) {
+                k = next + (j - start);
+                memcpy(&(inst[k]),
+                       &(cvm->prog->inst[j]),
+                       sizeof(int) * instruction_size(cvm, j));
+                if(is_jump(cvm->prog->inst[j])) {
+                    /* jumps to the ret land just past the end */
+                    inst[k + JUMP_LOCATION] =
+                        next + (cvm->prog->inst[j + JUMP_LOCATION] - start);
+                } else if(inline_instruction(cvm,
+                                             &(inst[k]),
+                                             &(cvm->prog->inst[i + CALL_START_ARGS]),
+                                             localmap) < 0) {
+                    LOG_PRINTF(cvm, "BUG: Failed to rewrite inlined "
+                                    "instruction.\n");
+                    goto cleanup;
+                }
+                after++;
+            }
+
+            for(k = 0; k < lines; k++) {
+                if(cvm->prog->line[k].instruction >= start &&
+                   cvm->prog->line[k].instruction < end) {
+                    cvm->prog->line[cvm->prog->lines] = cvm->prog->line[k];
+                    cvm->prog->line[cvm->prog->lines].offset = NULL;
+                    cvm->prog->line[cvm->prog->lines].tokencount = 0;
+                    cvm->prog->line[cvm->prog->lines].instruction =
+                        next + (cvm->prog->line[k].instruction - start);
+                    cvm->prog->line[cvm->prog->lines].inlined = q;
+                    cvm->prog->lines++;
+                }
+            }
+
+            calls++;
+        }
+
+        if(calls > 0) {
+            LOG_PRINTF(cvm, "%s: %u calls inlined\n", cvm->prog->proc[p].name, calls);
+        }
+        totalcalls += calls;
+    }
+
+    /* a call line stays with the moves setting up locals, otherwise it has
+       nothing left to point to */
+    for(k = 0; k < lines; k++) {
+        i = cvm->prog->line[k].instruction;
+        if(site[i] >= 0 &&
+           cvm->prog->proc[site[i]].vars == cvm->prog->proc[site[i]].args) {
+            cvm->prog->line[k].instruction = UINT_MAX;
+        } else {
+            cvm->prog->line[k].instruction = newpos[i];
+        }
+    }
+
+    for(p = 0; p < cvm->prog->procs; p++) {
+        cvm->prog->proc[p].instruction = newpos[cvm->prog->proc[p].instruction];
+    }
+
+    free(cvm->prog->inst);
+    cvm->prog->inst = inst;
+    inst = NULL;
+    cvm->prog->insts = newpos[cvm->prog->insts];
+
+    if(totalcalls > 0) {
+        LOG_PRINTF(cvm, "%u calls inlined, %u -> %u instructions\n",
+                        totalcalls, before, after);
+    }
+
+    /* inline_local() just put the new locals on the bottom */
+    for(p = 0; p < cvm->prog->procs; p++) {
+        if(layout_variables(cvm, p) < 0) {
+            goto cleanup;
+        }
+    }
+
+    result = 0;
+
+cleanup:
+    /* new locals may have moved the variables */
+    for(p = 0; p < cvm->prog->procs; p++) {
+        if(cvm->prog->proc[p].vars == 0) {
+            continue;
+        }
+
+        temp = realloc(cvm->prog->proc[p].var,
+                       sizeof(CrustyVariable *) * cvm->prog->proc[p].vars);
+        if(temp == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for procedure variable pointer list.\n");
+            result = -1;
+            break;
+        }
+        cvm->prog->proc[p].var = (CrustyVariable **)temp;
+
+        for(j = 0; j < cvm->prog->proc[p].vars; j++) {
+            cvm->prog->proc[p].var[j] = &(cvm->prog->var[cvm->prog->proc[p].varIndex[j]]);
+            cvm->prog->proc[p].var[j]->proc = &(cvm->prog->proc[p]);
+        }
+    }
+
+    if(candidate != NULL) {
+        free(candidate);
+    }
+    if(site != NULL) {
+        free(site);
+    }
+    if(localmap != NULL) {
+        free(localmap);
+    }
+    if(mapped != NULL) {
+        free(mapped);
+    }
+    if(newpos != NULL) {
+        free(newpos);
+    }
+    if(inst != NULL) {
+        free(inst);
+    }
+
+    return(result);
+}
+
+/* Bytecode optimizations, run on verified code.  Everything is kept within a
+ * procedure and any point which is jumped to is treated as unknown.
+ *  - immediates moved in to int scalars are substituted for later reads of
+ *    them, until anything which may write memory behind the instruction's
+ *    back (calls, callbacks, writes through references)
+ *  - stores to locals which are never read are removed where the result of
+ *    the store can't be observed by a following conditional jump
+ *  - code after an unconditional jump is removed up to the next point which
+ *    is jumped to
+ *  - jumps to the next instruction are removed
+ * ret is never removed, since it marks the end of a procedure. */
+static int optimize(CrustyVM *cvm) {
+    unsigned char *target = NULL;
+    unsigned char *dead = NULL;
+    unsigned char *known = NULL;
+    unsigned char *read = NULL;
+    int *value = NULL;
+    unsigned int *newpos = NULL;
+    unsigned int p, i, j;
+    unsigned int start, end, next;
+    unsigned int before, after;
+    unsigned int totalbefore = 0, totalafter = 0;
+    int var, dest;
+    CrustyType desttype, srctype;
+    int result = -1;
+
+    target = malloc(cvm->prog->insts);
+    dead = malloc(cvm->prog->insts);
+    known = malloc(cvm->prog->vars);
+    read = malloc(cvm->prog->vars);
+    value = malloc(sizeof(int) * cvm->prog->vars);
+    newpos = malloc(sizeof(unsigned int) * (cvm->prog->insts + 1));
+    if(target == NULL || dead == NULL || known == NULL ||
+       read == NULL || value == NULL || newpos == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for optimization.\n");
+        goto cleanup;
+    }
+    memset(target, 0, cvm->prog->insts);
+    memset(dead, 0, cvm->prog->insts);
+
+    for(i = 0; i < cvm->prog->insts; i += instruction_size(cvm, i)) {
+        if(is_jump(cvm->prog->inst[i])) {
+            target[cvm->prog->inst[i + JUMP_LOCATION]] = 1;
+        }
+    }
+
+    for(p = 0; p < cvm->prog->procs; p++) {
+        start = cvm->prog->proc[p].instruction;
+        end = p + 1 < cvm->prog->procs ? cvm->prog->proc[p + 1].instruction : cvm->prog->insts;
+
+        /* propagate immediates */
+        memset(known, 0, cvm->prog->vars);
+        for(i = start; i < end; i += instruction_size(cvm, i)) {
+            if(target[i]) {
+                memset(known, 0, cvm->prog->vars);
+            }
+
+            /* the host may do anything while the program is yielded, and
+               bulk instructions may write any of a range */
+            if(cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_CALL ||
+               cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_YIELD ||
+               is_bulk(cvm->prog->inst[i])) {
+                memset(known, 0, cvm->prog->vars);
+                continue;
+            } else if(is_jump(cvm->prog->inst[i]) ||
+                      cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_RET) {
+                continue;
+            }
+
+            if(optimize_clobbers(cvm, i)) {
+                memset(known, 0, cvm->prog->vars);
+                continue;
+            }
+
+            /* cmp with an immediate destination and a variable source
+               doesn't set the result type, so leave those be */
+            if(optimize_trackable(cvm,
+                                  cvm->prog->inst[i + MOVE_SRC_FLAGS],
+                                  cvm->prog->inst[i + MOVE_SRC_VAL],
+                                  cvm->prog->inst[i + MOVE_SRC_INDEX]) &&
+               known[cvm->prog->inst[i + MOVE_SRC_VAL]] &&
+               (cvm->prog->inst[i] != CRUSTY_INSTRUCTION_TYPE_CMP ||
+                (cvm->prog->inst[i + MOVE_DEST_FLAGS] & MOVE_FLAG_TYPE_MASK) ==
+                MOVE_FLAG_VAR)) {
+                cvm->prog->inst[i + MOVE_SRC_FLAGS] = MOVE_FLAG_IMMEDIATE;
+                cvm->prog->inst[i + MOVE_SRC_VAL] =
+                    value[cvm->prog->inst[i + MOVE_SRC_VAL]];
+                cvm->prog->inst[i + MOVE_SRC_INDEX] = 0;
+            }
+
+            if(cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_CMP) {
+                continue;
+            }
+
+            dest = cvm->prog->inst[i + MOVE_DEST_VAL];
+            if(optimize_trackable(cvm,
+                                  cvm->prog->inst[i + MOVE_DEST_FLAGS],
+                                  dest,
+                                  cvm->prog->inst[i + MOVE_DEST_INDEX])) {
+                if(cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_MOVE &&
+                   (cvm->prog->inst[i + MOVE_SRC_FLAGS] & MOVE_FLAG_TYPE_MASK) ==
+                   MOVE_FLAG_IMMEDIATE) {
+                    known[dest] = 1;
+                    value[dest] = cvm->prog->inst[i + MOVE_SRC_VAL];
+                } else {
+                    known[dest] = 0;
+                }
+            } else if((cvm->prog->inst[i + MOVE_DEST_FLAGS] & MOVE_FLAG_TYPE_MASK) ==
+                      MOVE_FLAG_VAR) {
+                /* a scalar written with a variable index */
+                known[dest] = 0;
+            }
+        }
+
+        /* find which locals are ever read, math reads its destination too */
+        memset(read, 0, cvm->prog->vars);
+        for(i = start; i < end; i += instruction_size(cvm, i)) {
+            if(cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_CALL) {
+                for(j = 0; j < cvm->prog->proc[cvm->prog->inst[i + CALL_PROCEDURE]].args;
+                    j++) {
+                    next = i + CALL_START_ARGS + (j * CALL_ARG_SIZE);
+                    var = operand_var(cvm->prog->inst[next + CALL_ARG_FLAGS],
+                                      cvm->prog->inst[next + CALL_ARG_VAL]);
+                    if(var >= 0) {
+                        read[var] = 1;
+                    }
+                    var = operand_index_var(cvm->prog->inst[next + CALL_ARG_FLAGS],
+                                            cvm->prog->inst[next + CALL_ARG_INDEX]);
+                    if(var >= 0) {
+                        read[var] = 1;
+                    }
+                }
+                continue;
+            } else if(is_jump(cvm->prog->inst[i]) ||
+                      cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_RET ||
+                      cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_YIELD) {
+                continue;
+            } else if(is_bulk(cvm->prog->inst[i])) {
+                var = operand_var(cvm->prog->inst[i + BULK_COUNT_FLAGS],
+                                  cvm->prog->inst[i + BULK_COUNT_VAL]);
+                if(var >= 0) {
+                    read[var] = 1;
+                }
+                var = operand_index_var(cvm->prog->inst[i + BULK_COUNT_FLAGS],
+                                        cvm->prog->inst[i + BULK_COUNT_INDEX]);
+                if(var >= 0) {
+                    read[var] = 1;
+                }
+            }
+
+            var = operand_var(cvm->prog->inst[i + MOVE_SRC_FLAGS],
+                              cvm->prog->inst[i + MOVE_SRC_VAL]);
+            if(var >= 0) {
+                read[var] = 1;
+            }
+            var = operand_index_var(cvm->prog->inst[i + MOVE_SRC_FLAGS],
+                                    cvm->prog->inst[i + MOVE_SRC_INDEX]);
+            if(var >= 0) {
+                read[var] = 1;
+            }
+            var = operand_index_var(cvm->prog->inst[i + MOVE_DEST_FLAGS],
+                                    cvm->prog->inst[i + MOVE_DEST_INDEX]);
+            if(var >= 0) {
+                read[var] = 1;
+            }
+            if(cvm->prog->inst[i] != CRUSTY_INSTRUCTION_TYPE_MOVE &&
+               cvm->prog->inst[i] != CRUSTY_INSTRUCTION_TYPE_COPY &&
+               cvm->prog->inst[i] != CRUSTY_INSTRUCTION_TYPE_FILL) {
+                var = operand_var(cvm->prog->inst[i + MOVE_DEST_FLAGS],
+                                  cvm->prog->inst[i + MOVE_DEST_VAL]);
+                if(var >= 0) {
+                    read[var] = 1;
+                }
+            }
+        }
+
+        /* remove dead stores, going backwards so a run of them can all be
+           removed if what follows sets the result.  newpos isn't needed yet
+           so use it for the list of instructions to go back through. */
+        j = 0;
+        for(i = start; i < end; i += instruction_size(cvm, i)) {
+            newpos[j] = i;
+            j++;
+        }
+        while(j > 0) {
+            j--;
+            i = newpos[j];
+
+            if(cvm->prog->inst[i] < CRUSTY_INSTRUCTION_TYPE_MOVE ||
+               cvm->prog->inst[i] > CRUSTY_INSTRUCTION_TYPE_SHL ||
+               cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_DIV ||
+               cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_MOD) {
+                continue;
+            }
+
+            if((cvm->prog->inst[i + MOVE_DEST_FLAGS] & MOVE_FLAG_TYPE_MASK) !=
+               MOVE_FLAG_VAR) {
+                continue;
+            }
+            dest = cvm->prog->inst[i + MOVE_DEST_VAL];
+            if(cvm->prog->var[dest].procIndex != (int)p ||
+               variable_is_argument(&(cvm->prog->var[dest])) ||
+               variable_is_callback(&(cvm->prog->var[dest])) ||
+               read[dest]) {
+                continue;
+            }
+
+            if(!optimize_plain_src(cvm,
+                                   cvm->prog->inst[i + MOVE_DEST_FLAGS],
+                                   dest,
+                                   cvm->prog->inst[i + MOVE_DEST_INDEX],
+                                   &desttype) ||
+               !optimize_plain_src(cvm,
+                                   cvm->prog->inst[i + MOVE_SRC_FLAGS],
+                                   cvm->prog->inst[i + MOVE_SRC_VAL],
+                                   cvm->prog->inst[i + MOVE_SRC_INDEX],
+                                   &srctype)) {
+                continue;
+            }
+            /* conversions set the result type */
+            if((desttype == CRUSTY_TYPE_FLOAT) !=
+               (srctype == CRUSTY_TYPE_FLOAT)) {
+                continue;
+            }
+
+            /* the next instruction has to replace the result, so a
+               following conditional jump can't tell the difference */
+            next = next_live(cvm, dead, i + instruction_size(cvm, i), end);
+            if(next >= end ||
+               cvm->prog->inst[next] < CRUSTY_INSTRUCTION_TYPE_ADD ||
+               cvm->prog->inst[next] > CRUSTY_INSTRUCTION_TYPE_CMP) {
+                continue;
+            }
+
+            dead[i] = 1;
+        }
+
+        /* remove unreachable code */
+        for(i = start; i < end; i += instruction_size(cvm, i)) {
+            if(dead[i] || cvm->prog->inst[i] != CRUSTY_INSTRUCTION_TYPE_JUMP) {
+                continue;
+            }
+
+            for(j = i + instruction_size(cvm, i);
+                j < end &&
+                !target[j] &&
+                cvm->prog->inst[j] != CRUSTY_INSTRUCTION_TYPE_RET;
+                j += instruction_size(cvm, j)) {
+                dead[j] = 1;
+            }
+        }
+
+        /* remove jumps to the next instruction */
+        for(i = start; i < end; i += instruction_size(cvm, i)) {
+            if(dead[i] || !is_jump(cvm->prog->inst[i])) {
+                continue;
+            }
+
+            if(next_live(cvm, dead, cvm->prog->inst[i + JUMP_LOCATION], end) ==
+               next_live(cvm, dead, i + instruction_size(cvm, i), end)) {
+                dead[i] = 1;
+            }
+        }
+
+        before = 0;
+        after = 0;
+        for(i = start; i < end; i += instruction_size(cvm, i)) {
+            before++;
+            if(!dead[i]) {
+                after++;
+            }
+        }
+        if(after < before) {
+            LOG_PRINTF(cvm, "%s: %u -> %u instructions\n",
+                            cvm->prog->proc[p].name, before, after);
+        }
+        totalbefore += before;
+        totalafter += after;
+    }
+
+    /* pack the remaining instructions together */
+    next = 0;
+    for(i = 0; i < cvm->prog->insts; i += instruction_size(cvm, i)) {
+        newpos[i] = next;
+        if(!dead[i]) {
+            next += instruction_size(cvm, i);
+        }
+    }
+    newpos[cvm->prog->insts] = next;
+
+    for(i = 0; i < cvm->prog->insts; i += j) {
+        j = instruction_size(cvm, i);
+        if(dead[i]) {
+            continue;
+        }
+
+        if(is_jump(cvm->prog->inst[i])) {
+            cvm->prog->inst[i + JUMP_LOCATION] =
+                newpos[cvm->prog->inst[i + JUMP_LOCATION]];
+        }
+        memmove(&(cvm->prog->inst[newpos[i]]),
+                &(cvm->prog->inst[i]),
+                sizeof(int) * j);
+    }
+
+    for(i = 0; i < cvm->prog->procs; i++) {
+        cvm->prog->proc[i].instruction = newpos[cvm->prog->proc[i].instruction];
+    }
+
+    /* removed lines are left pointing nowhere so traces find the right one */
+    for(i = 0; i < cvm->prog->lines; i++) {
+        if(cvm->prog->line[i].instruction == UINT_MAX) {
+            continue;
+        } else if(dead[cvm->prog->line[i].instruction]) {
+            cvm->prog->line[i].instruction = UINT_MAX;
+        } else {
+            cvm->prog->line[i].instruction = newpos[cvm->prog->line[i].instruction];
+        }
+    }
+
+    cvm->prog->insts = newpos[cvm->prog->insts];
+
+    if(totalafter < totalbefore) {
+        LOG_PRINTF(cvm, "%u -> %u instructions\n", totalbefore, totalafter);
+    }
+    result = 0;
+
+cleanup:
+    if(target != NULL) {
+        free(target);
+    }
+    if(dead != NULL) {
+        free(dead);
+    }
+    if(known != NULL) {
+        free(known);
+    }
+    if(read != NULL) {
+        free(read);
+    }
+    if(value != NULL) {
+        free(value);
+    }
+    if(newpos != NULL) {
+        free(newpos);
+    }
+
+    return(result);
+}
+
+/* whether an instruction might read a variable, anything passed to a
+   procedure counts since it could be read there */
+static int reads_var(CrustyVM *cvm, unsigned int ip, int var) {
+    unsigned int i, arg;
+
+    if(cvm->prog->inst[ip] == CRUSTY_INSTRUCTION_TYPE_CALL) {
+        for(i = 0; i < cvm->prog->proc[cvm->prog->inst[ip + CALL_PROCEDURE]].args; i++) {
+            arg = ip + CALL_START_ARGS + (i * CALL_ARG_SIZE);
+            if(operand_var(cvm->prog->inst[arg + CALL_ARG_FLAGS],
+                           cvm->prog->inst[arg + CALL_ARG_VAL]) == var ||
+               operand_index_var(cvm->prog->inst[arg + CALL_ARG_FLAGS],
+                                 cvm->prog->inst[arg + CALL_ARG_INDEX]) == var) {
+                return(1);
+            }
+        }
+        return(0);
+    } else if(is_jump(cvm->prog->inst[ip]) ||
+              cvm->prog->inst[ip] == CRUSTY_INSTRUCTION_TYPE_RET ||
+              cvm->prog->inst[ip] == CRUSTY_INSTRUCTION_TYPE_YIELD) {
+        return(0);
+    } else if(is_bulk(cvm->prog->inst[ip]) &&
+              (operand_var(cvm->prog->inst[ip + BULK_COUNT_FLAGS],
+                           cvm->prog->inst[ip + BULK_COUNT_VAL]) == var ||
+               operand_index_var(cvm->prog->inst[ip + BULK_COUNT_FLAGS],
+                                 cvm->prog->inst[ip + BULK_COUNT_INDEX]) == var)) {
+        return(1);
+    }
+
+    if(operand_var(cvm->prog->inst[ip + MOVE_SRC_FLAGS],
+                   cvm->prog->inst[ip + MOVE_SRC_VAL]) == var ||
+       operand_index_var(cvm->prog->inst[ip + MOVE_SRC_FLAGS],
+                         cvm->prog->inst[ip + MOVE_SRC_INDEX]) == var ||
+       operand_index_var(cvm->prog->inst[ip + MOVE_DEST_FLAGS],
+                         cvm->prog->inst[ip + MOVE_DEST_INDEX]) == var) {
+        return(1);
+    }
+
+    /* everything but move, copy and fill reads its destination first */
+    return(cvm->prog->inst[ip] != CRUSTY_INSTRUCTION_TYPE_MOVE &&
+           cvm->prog->inst[ip] != CRUSTY_INSTRUCTION_TYPE_COPY &&
+           cvm->prog->inst[ip] != CRUSTY_INSTRUCTION_TYPE_FILL &&
+           operand_var(cvm->prog->inst[ip + MOVE_DEST_FLAGS],
+                       cvm->prog->inst[ip + MOVE_DEST_VAL]) == var);
+}
+
+/* Find which locals of each procedure can be read before they're set, so a
+ * call only has to initialize those.  A scalar is set on entry to an
+ * instruction if every path there passes a move in to it, arrays are only
+ * ever partly set so any which are read at all are initialized.  Arguments
+ * are filled in by call() and never need it. */
+static int plan_local_init(CrustyVM *cvm) {
+    unsigned char *set = NULL;
+    unsigned char *need = NULL;
+    CrustyInitRange *init;
+    CrustyVariable *var;
+    unsigned int p, v, i, j, next;
+    unsigned int start, end, size;
+    int changed, out, read;
+    int result = -1;
+
+    set = malloc(cvm->prog->insts);
+    if(set == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for local analysis.\n");
+        goto cleanup;
+    }
+
+    for(p = 0; p < cvm->prog->procs; p++) {
+        if(cvm->prog->proc[p].stackneeded == 0) {
+            continue;
+        }
+
+        need = malloc(cvm->prog->proc[p].stackneeded);
+        if(need == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for local analysis.\n");
+            goto cleanup;
+        }
+        memset(need, 0, cvm->prog->proc[p].stackneeded);
+
+        start = cvm->prog->proc[p].instruction;
+        end = procedure_end(cvm, p);
+        for(v = cvm->prog->proc[p].args; v < cvm->prog->proc[p].vars; v++) {
+            var = &(cvm->prog->var[cvm->prog->proc[p].varIndex[v]]);
+
+            if(var->length == 1) {
+                /* assume everything is set and clear it where it isn't until
+                   nothing changes */
+                memset(&(set[start]), 1, end - start);
+                set[start] = 0;
+                do {
+                    changed = 0;
+                    for(i = start; i < end; i += instruction_size(cvm, i)) {
+                        out = set[i] ||
+                              (cvm->prog->inst[i] == CRUSTY_INSTRUCTION_TYPE_MOVE &&
+                               operand_var(cvm->prog->inst[i + MOVE_DEST_FLAGS],
+                                           cvm->prog->inst[i + MOVE_DEST_VAL]) ==
+                               cvm->prog->proc[p].varIndex[v]);
+                        if(out) {
+                            continue;
+                        }
+
+                        next = i + instruction_size(cvm, i);
+                        if(next < end &&
+                           cvm->prog->inst[i] != CRUSTY_INSTRUCTION_TYPE_JUMP &&
+                           cvm->prog->inst[i] != CRUSTY_INSTRUCTION_TYPE_RET &&
+                           set[next]) {
+                            set[next] = 0;
+                            changed = 1;
+                        }
+                        if(is_jump(cvm->prog->inst[i]) &&
+                           set[cvm->prog->inst[i + JUMP_LOCATION]]) {
+                            set[cvm->prog->inst[i + JUMP_LOCATION]] = 0;
+                            changed = 1;
+                        }
+                    }
+                } while(changed);
+            } else {
+                memset(&(set[start]), 0, end - start);
+            }
+
+            read = 0;
+            for(i = start; i < end; i += instruction_size(cvm, i)) {
+                if(!set[i] && reads_var(cvm, i, cvm->prog->proc[p].varIndex[v])) {
+                    read = 1;
+                    break;
+                }
+            }
+            if(!read) {
+                continue;
+            }
+
+            if(var->type == CRUSTY_TYPE_INT) {
+                size = var->length * sizeof(int);
+            } else if(var->type == CRUSTY_TYPE_FLOAT) {
+                size = var->length * sizeof(double);
+            } else { /* CHAR */
+                size = var->length;
+            }
+            memset(&(need[cvm->prog->proc[p].stackneeded - var->offset]), 1, size);
+        }
+
+        /* gather up runs of bytes which need initializing */
+        for(i = 0; i < cvm->prog->proc[p].stackneeded; i = j) {
+            if(!need[i]) {
+                j = i + 1;
+                continue;
+            }
+
+            init = realloc(cvm->prog->proc[p].init,
+                           sizeof(CrustyInitRange) * (cvm->prog->proc[p].inits + 1));
+            if(init == NULL) {
+                LOG_PRINTF(cvm, "Failed to allocate memory for procedure "
+                                "initializer ranges.\n");
+                goto cleanup;
+            }
+            cvm->prog->proc[p].init = init;
+            init = &(cvm->prog->proc[p].init[cvm->prog->proc[p].inits]);
+            cvm->prog->proc[p].inits++;
+
+            init->start = i;
+            init->zero = 1;
+            for(j = i; j < cvm->prog->proc[p].stackneeded && need[j]; j++) {
+                if(cvm->prog->proc[p].initializer[j] != 0) {
+                    init->zero = 0;
+                }
+            }
+            init->length = j - i;
+        }
+
+        free(need);
+        need = NULL;
+    }
+
+    result = 0;
+
+cleanup:
+    if(set != NULL) {
+        free(set);
+    }
+    if(need != NULL) {
+        free(need);
+    }
+
+    return(result);
+}
+
+int crustyvm_reset(CrustyVM *cvm) {
+    const char *temp = cvm->stage;
+
+    cvm->stage = "reset";
+#ifdef CRUSTY_TEST
+    LOG_PRINTF(cvm, "Start\n");
+#endif
+
+    memcpy(cvm->stack, cvm->prog->initializer, cvm->prog->initialstack);
+
+    cvm->status = CRUSTY_STATUS_READY;
+    cvm->stage = temp;
+
+    return(0);
+}
+
+#ifdef CRUSTY_TEST
+static int write_lines(CrustyVM *cvm, const char *name) {
+    FILE *out;
+    unsigned int i, j;
+    char *temp;
+
+    out = fopen(name, "wb");
+    if(out == NULL) {
+        LOG_PRINTF(cvm, "Couldn't open file %s for writing.\n", name);
+        return(-1);
+    }
+
+    for(i = 0; i < cvm->prog->lines; i++) {
+        for(j = 0; j < cvm->prog->line[i].tokencount; j++) {
+            if(fprintf(out, "%s", GET_TOKEN(i, j)) < 0) {
+                LOG_PRINTF(cvm, "Couldn't write to file.\n");
+                return(-1);
+            }
+            if(j < cvm->prog->line[i].tokencount - 1) {
+                if(fprintf(out, " ") < 0) {
+                    LOG_PRINTF(cvm, "Couldn't write to file.\n");
+                    return(-1);
+                }
+            }
+        }
+        if(fprintf(out, "\n") < 0) {
+            LOG_PRINTF(cvm, "Couldn't write to file.\n");
+            return(-1);
+        }
+    }
+
+    fclose(out);
+
+    return(0);
+}
+#endif
+
+CrustyVM *crustyvm_new(const char *name,
+                       char *safepath,
+                       const char *program,
+                       long len,
+                       unsigned int flags,
+                       unsigned int callstacksize,
+                       const CrustyCallback *cb,
+                       unsigned int cbcount,
+                       const char **var,
+                       const char **value,
+                       unsigned int vars,
+                       void (*log_cb)(void *priv, const char *fmt, ...),
+                       void *log_priv) {
+    CrustyVM *cvm;
+    unsigned int i, j;
+    long tokenstart;
+    unsigned long *varOffset;
+    unsigned long *valueOffset;
+
+#ifdef CRUSTY_TEST
+    unsigned int k;
+#endif
 
     if(name == NULL) {
         /* nothing is defined yet so don't use the macro */
@@ -4247,8 +7256,8 @@ CrustyVM *crustyvm_new(const char *name,
             return(NULL);
         }
 
-        if(fwrite(cvm->tokenmem, 1, cvm->tokenmemlen, out) <
-           (unsigned long)cvm->tokenmemlen) {
+        if(fwrite(cvm->prog->tokenmem, 1, cvm->prog->tokenmemlen, out) <
+           (unsigned long)cvm->prog->tokenmemlen) {
             LOG_PRINTF(cvm, "Failed to write tokenizer output.\n");
             crustyvm_free(cvm);
             return(NULL);
@@ -4257,7 +7266,7 @@ CrustyVM *crustyvm_new(const char *name,
     }
 #endif
 
-    if(cvm->lines == 0) {
+    if(cvm->prog->lines == 0) {
         LOG_PRINTF(cvm, "No lines remain after pass.\n");
         crustyvm_free(cvm);
         return(NULL);
@@ -4273,13 +7282,13 @@ CrustyVM *crustyvm_new(const char *name,
             return(NULL);
         }
 
-        for(i = 0; i < cvm->lines; i++) {
+        for(i = 0; i < cvm->prog->lines; i++) {
             fprintf(out, "%s %04u ",
-                    TOKENVAL(cvm->line[i].moduleOffset),
-                    cvm->line[i].line);
-            for(j = 0; j < cvm->line[i].tokencount; j++) {
+                    TOKENVAL(cvm->prog->line[i].moduleOffset),
+                    cvm->prog->line[i].line);
+            for(j = 0; j < cvm->prog->line[i].tokencount; j++) {
                 fprintf(out, "%s", GET_TOKEN(i, j));
-                if(j < cvm->line[i].tokencount - 1) {
+                if(j < cvm->prog->line[i].tokencount - 1) {
                     fprintf(out, " ");
                 }
             }
@@ -4340,54 +7349,53 @@ CrustyVM *crustyvm_new(const char *name,
     }
 #endif
 
-    for(i = 0; i < MAX_PASSES; i++) {
-        snprintf(namebuffer, sizeof(namebuffer), "preprocess %d", i + 1);
-        cvm->stage = namebuffer;
-#ifdef CRUSTY_TEST
-        LOG_PRINTF(cvm, "Start\n", i);
-#endif
-
-        foundmacro = preprocess(cvm, varOffset, valueOffset, vars);
-        if(foundmacro < 0) {
-            LOG_PRINTF(cvm, "Failed preprocess at pass %d.\n", i + 1);
-            crustyvm_free(cvm);
-            return(NULL);
-        }
-
-        if(cvm->lines == 0) {
-            LOG_PRINTF(cvm, "No lines remain after pass.\n");
-            crustyvm_free(cvm);
-            return(NULL);
-        }
-
+    cvm->stage = "preprocess";
 #ifdef CRUSTY_TEST
-        if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
-            snprintf(namebuffer, sizeof(namebuffer), "preprocess%03d.cvm", i + 1);
-            if(write_lines(cvm, namebuffer, 1) < 0) {
-                LOG_PRINTF(cvm, "Failed to write pass %d.\n", i + 1);
-                crustyvm_free(cvm);
-                return(NULL);
-            }
-        }
+    LOG_PRINTF(cvm, "Start\n");
 #endif
 
-        if(foundmacro == 0) {
-            break;
-        }
+    if(preprocess(cvm, varOffset, valueOffset, vars) < 0) {
+        LOG_PRINTF(cvm, "Failed preprocess.\n");
+        free(varOffset);
+        free(valueOffset);
+        crustyvm_free(cvm);
+        return(NULL);
     }
     free(varOffset);
     free(valueOffset);
-    if(i == MAX_PASSES) {
-        LOG_PRINTF(cvm, "Preprocess passes exceeded.\n");
+
+    if(cvm->prog->lines == 0) {
+        LOG_PRINTF(cvm, "No lines remain after pass.\n");
         crustyvm_free(cvm);
         return(NULL);
     }
 
+#ifdef CRUSTY_TEST
+    if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
+        if(write_lines(cvm, "preprocess.cvm", 1) < 0) {
+            LOG_PRINTF(cvm, "Failed to write preprocess pass.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+    }
+#endif
+
     cvm->stage = "adding callbacks";
 #ifdef CRUSTY_TEST
     LOG_PRINTF(cvm, "Start\n");
 #endif
 
+    if(cbcount > 0) {
+        cvm->cb = malloc(sizeof(CrustyCallback) * cbcount);
+        if(cvm->cb == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for callbacks.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+        memcpy(cvm->cb, cb, sizeof(CrustyCallback) * cbcount);
+        cvm->cbs = cbcount;
+    }
+
     for(i = 0; i < cbcount; i++) {
         if(cb[i].read == NULL && cb[i].write == NULL) {
             LOG_PRINTF(cvm, "Callback variables must have a non-NULL read and/or write function.\n");
@@ -4407,7 +7415,7 @@ CrustyVM *crustyvm_new(const char *name,
                         cb[i].readType,
                         cb[i].length,
                         NULL,
-                        &(cb[i]),
+                        i,
                         -1) < 0) {
             /* reason will have already been printed */
             crustyvm_free(cvm);
@@ -4426,22 +7434,38 @@ CrustyVM *crustyvm_new(const char *name,
         return(NULL);
     }
 
-    if(cvm->lines == 0) {
+    if(cvm->prog->lines == 0) {
         LOG_PRINTF(cvm, "No lines remain after pass.\n");
         crustyvm_free(cvm);
         return(NULL);
     }
 
-    for(i = 0; i < cvm->procs; i++) {
-        cvm->proc[i].name = TOKENVAL(cvm->proc[i].nameOffset);
-        for(j = 0; j < cvm->proc[i].labels; j++) {
-            cvm->proc[i].label[j].name =
-                TOKENVAL(cvm->proc[i].label[j].nameOffset);
+    cvm->stage = "frame layout";
+#ifdef CRUSTY_TEST
+    LOG_PRINTF(cvm, "Start\n");
+#endif
+
+    if(layout_variables(cvm, -1) < 0) {
+        crustyvm_free(cvm);
+        return(NULL);
+    }
+    for(i = 0; i < cvm->prog->procs; i++) {
+        if(layout_variables(cvm, i) < 0) {
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+    }
+
+    for(i = 0; i < cvm->prog->procs; i++) {
+        cvm->prog->proc[i].name = TOKENVAL(cvm->prog->proc[i].nameOffset);
+        for(j = 0; j < cvm->prog->proc[i].labels; j++) {
+            cvm->prog->proc[i].label[j].name =
+                TOKENVAL(cvm->prog->proc[i].label[j].nameOffset);
         }
     }
 
-    for(i = 0; i < cvm->vars; i++) {
-        cvm->var[i].name = TOKENVAL(cvm->var[i].nameOffset);
+    for(i = 0; i < cvm->prog->vars; i++) {
+        cvm->prog->var[i].name = TOKENVAL(cvm->prog->var[i].nameOffset);
     }
 
 #ifdef CRUSTY_TEST
@@ -4456,93 +7480,93 @@ CrustyVM *crustyvm_new(const char *name,
 
     cvm->stage = "symbols list";
     LOG_PRINTF(cvm, "Global Variables:\n");
-    for(i = 0; i < cvm->vars; i++) {
-        if(variable_is_global(&(cvm->var[i]))) {
-            LOG_PRINTF(cvm, " %s", cvm->var[i].name);
-            if(cvm->var[i].read != NULL) {
+    for(i = 0; i < cvm->prog->vars; i++) {
+        if(variable_is_global(&(cvm->prog->var[i]))) {
+            LOG_PRINTF(cvm, " %s", cvm->prog->var[i].name);
+            if(VAR_READ(&(cvm->prog->var[i])) != NULL) {
                 LOG_PRINTF_BARE(cvm, " r");
             }
-            if(cvm->var[i].write != NULL) {
+            if(VAR_WRITE(&(cvm->prog->var[i])) != NULL) {
                 LOG_PRINTF_BARE(cvm, " w");
             }
             LOG_PRINTF_BARE(cvm, "\n");
-            if(cvm->var[i].length > 0) {
-                if(cvm->var[i].type == CRUSTY_TYPE_CHAR) {
+            if(cvm->prog->var[i].length > 0) {
+                if(cvm->prog->var[i].type == CRUSTY_TYPE_CHAR) {
                     LOG_PRINTF(cvm, "  String initializer: \"");
-                    for(j = 0; j < cvm->var[i].length; j++) {
+                    for(j = 0; j < cvm->prog->var[i].length; j++) {
                         LOG_PRINTF_BARE(cvm, "%c",
-                            ((char *)&(cvm->initializer[cvm->var[i].offset]))[j]);
+                            ((char *)&(cvm->prog->initializer[cvm->prog->var[i].offset]))[j]);
                     }
                     LOG_PRINTF_BARE(cvm, "\"");
                 }
-                if(cvm->var[i].type == CRUSTY_TYPE_INT) {
+                if(cvm->prog->var[i].type == CRUSTY_TYPE_INT) {
                     LOG_PRINTF(cvm, "  Integer initializer:");
-                    for(j = 0; j < cvm->var[i].length; j++) {
+                    for(j = 0; j < cvm->prog->var[i].length; j++) {
                         LOG_PRINTF_BARE(cvm, " %d",
-                            ((int *)&(cvm->initializer[cvm->var[i].offset]))[j]);
+                            ((int *)&(cvm->prog->initializer[cvm->prog->var[i].offset]))[j]);
                     }
                 }
-                if(cvm->var[i].type == CRUSTY_TYPE_FLOAT) {
+                if(cvm->prog->var[i].type == CRUSTY_TYPE_FLOAT) {
                     LOG_PRINTF(cvm, "  Float initializer:");
-                    for(j = 0; j < cvm->var[i].length; j++) {
+                    for(j = 0; j < cvm->prog->var[i].length; j++) {
                         LOG_PRINTF_BARE(cvm, " %g",
-                            ((double *)&(cvm->initializer[cvm->var[i].offset]))[j]);
+                            ((double *)&(cvm->prog->initializer[cvm->prog->var[i].offset]))[j]);
                     }
                 }
                 LOG_PRINTF_BARE(cvm, "\n");
             }
         }
     }
-    for(i = 0; i < cvm->procs; i++) {
-        LOG_PRINTF(cvm, "Procedure: %s @%u, %u, args: %u\n", cvm->proc[i].name,
-                                                             cvm->proc[i].start,
-                                                             cvm->proc[i].length,
-                                                             cvm->proc[i].args);
-        if(cvm->proc[i].vars > 0) {
+    for(i = 0; i < cvm->prog->procs; i++) {
+        LOG_PRINTF(cvm, "Procedure: %s @%u, %u, args: %u\n", cvm->prog->proc[i].name,
+                                                             cvm->prog->proc[i].start,
+                                                             cvm->prog->proc[i].length,
+                                                             cvm->prog->proc[i].args);
+        if(cvm->prog->proc[i].vars > 0) {
             LOG_PRINTF(cvm, " Variables:\n");
-            for(j = 0; j < cvm->proc[i].vars; j++) {
-                LOG_PRINTF(cvm, "  %s", cvm->proc[i].var[j]->name);
-                if(j < cvm->proc[i].args) {
+            for(j = 0; j < cvm->prog->proc[i].vars; j++) {
+                LOG_PRINTF(cvm, "  %s", cvm->prog->proc[i].var[j]->name);
+                if(j < cvm->prog->proc[i].args) {
                     LOG_PRINTF_BARE(cvm, " arg %u\n", j);
                 } else {
                     LOG_PRINTF_BARE(cvm, "\n");
                 }
-                if(cvm->proc[i].var[j]->length > 0) {
-                    if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_CHAR) {
+                if(cvm->prog->proc[i].var[j]->length > 0) {
+                    if(cvm->prog->proc[i].var[j]->type == CRUSTY_TYPE_CHAR) {
                         LOG_PRINTF(cvm, "   String initializer: \"");
-                        for(k = 0; k < cvm->proc[i].var[j]->length; k++) {
+                        for(k = 0; k < cvm->prog->proc[i].var[j]->length; k++) {
                             LOG_PRINTF_BARE(cvm, "%c",
-                                ((char *)&(cvm->initializer[cvm->proc[i].var[j].offset]))[k]);
+                                ((char *)&(cvm->prog->initializer[cvm->prog->proc[i].var[j].offset]))[k]);
                         }
                         LOG_PRINTF_BARE(cvm, "\"");
                     }
-                    if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_INT) {
+                    if(cvm->prog->proc[i].var[j]->type == CRUSTY_TYPE_INT) {
                         LOG_PRINTF(cvm, "   Integer initializer:");
-                        for(k = 0; k < cvm->proc[i].var[j]->length; k++) {
+                        for(k = 0; k < cvm->prog->proc[i].var[j]->length; k++) {
                             LOG_PRINTF_BARE(cvm, "%c",
-                                ((int *)&(cvm->initializer[cvm->proc[i].var[j].offset]))[k]);
+                                ((int *)&(cvm->prog->initializer[cvm->prog->proc[i].var[j].offset]))[k]);
                         }
                     }
-                    if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_FLOAT) {
+                    if(cvm->prog->proc[i].var[j]->type == CRUSTY_TYPE_FLOAT) {
                         LOG_PRINTF(cvm, "   Float initializer:");
-                        for(k = 0; k < cvm->proc[i].var[j]->length; k++) {
+                        for(k = 0; k < cvm->prog->proc[i].var[j]->length; k++) {
                             LOG_PRINTF_BARE(cvm, "%c",
-                                ((float *)&(cvm->initializer[cvm->proc[i].var[j].offset]))[k]);
+                                ((float *)&(cvm->prog->initializer[cvm->prog->proc[i].var[j].offset]))[k]);
                         }
                     }
                     LOG_PRINTF_BARE(cvm, "\n");
                 }
-                if(cvm->proc[i].var[j]->proc != &(cvm->proc[i])) {
+                if(cvm->prog->proc[i].var[j]->proc != &(cvm->prog->proc[i])) {
                     LOG_PRINTF(cvm, "   Improperly pointed procedure!\n");
                 }
             }
         }
-        if(cvm->proc[i].labels > 0) {
+        if(cvm->prog->proc[i].labels > 0) {
             LOG_PRINTF(cvm, " Labels:\n");
-            for(j = 0; j < cvm->proc[i].labels; j++) {
+            for(j = 0; j < cvm->prog->proc[i].labels; j++) {
                 LOG_PRINTF(cvm, "  %s @%u\n",
-                    cvm->proc[i].label[j].name,
-                    cvm->proc[i].label[j].line);
+                    cvm->prog->proc[i].label[j].name,
+                    cvm->prog->proc[i].label[j].line);
             }
         }
     }
@@ -4581,12 +7605,46 @@ CrustyVM *crustyvm_new(const char *name,
         return(NULL);
     }
 
+    if(cvm->flags & CRUSTY_FLAG_OPTIMIZE) {
+        cvm->stage = "inlining";
+#ifdef CRUSTY_TEST
+        LOG_PRINTF(cvm, "Start\n");
+#endif
+
+        if(inline_procedures(cvm) < 0) {
+            LOG_PRINTF(cvm, "Inlining failed.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+
+        cvm->stage = "optimization";
+#ifdef CRUSTY_TEST
+        LOG_PRINTF(cvm, "Start\n");
+#endif
+
+        if(optimize(cvm) < 0) {
+            LOG_PRINTF(cvm, "Optimization failed.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+    }
+
+    cvm->stage = "local initialization";
+#ifdef CRUSTY_TEST
+    LOG_PRINTF(cvm, "Start\n");
+#endif
+
+    if(plan_local_init(cvm) < 0) {
+        crustyvm_free(cvm);
+        return(NULL);
+    }
+
     cvm->stage = "memory allocation";
 #ifdef CRUSTY_TEST
     LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    cvm->stack = malloc(cvm->stacksize);
+    cvm->stack = malloc(cvm->prog->stacksize);
     if(cvm->stack == NULL) {
         LOG_PRINTF(cvm, "Failed to allocate stack memory.\n");
         crustyvm_free(cvm);
@@ -4599,19 +7657,137 @@ CrustyVM *crustyvm_new(const char *name,
         cvm->callstacksize = callstacksize;
     }
 
-    cvm->cstack = malloc(sizeof(CrustyCallStackArg) * cvm->callstacksize);
-    if(cvm->cstack == NULL) {
+    cvm->cstack = malloc(sizeof(CrustyCallStackArg) * cvm->callstacksize);
+    if(cvm->cstack == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate callstack memory.\n");
+        crustyvm_free(cvm);
+        return(NULL);
+    }
+
+    if(crustyvm_reset(cvm) < 0) {
+        crustyvm_free(cvm);
+        return(NULL);
+    }
+
+#ifdef CRUSTY_JIT
+    if((cvm->flags & CRUSTY_FLAG_JIT) &&
+       !(cvm->flags & CRUSTY_FLAG_TRACE)) {
+        cvm->stage = "native code generation";
+#ifdef CRUSTY_TEST
+        LOG_PRINTF(cvm, "Start\n");
+#endif
+
+        /* not fatal, the interpreter can still run everything */
+        if(jit_compile(cvm) < 0) {
+            LOG_PRINTF(cvm, "Falling back to the interpreter.\n");
+        }
+    }
+#endif
+
+    return(cvm);
+}
+
+CrustyVM *crustyvm_instance(CrustyVM *cvm,
+                            const CrustyCallback *cb,
+                            unsigned int cbcount) {
+    CrustyVM *new;
+    unsigned int i;
+    int var;
+    int j;
+
+    new = malloc(sizeof(CrustyVM));
+    if(new == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for instance.\n");
+        return(NULL);
+    }
+    /* everything not filled in below is the same as the original */
+    *new = *cvm;
+    new->stage = "instance";
+    new->cb = NULL;
+    new->stack = NULL;
+    new->cstack = NULL;
+    new->generation = 0;
+    /* each instance records for itself, if asked to */
+    new->record = NULL;
+    new->recordmask = 0;
+    new->recordpos = 0;
+
+    if(cvm->cbs > 0) {
+        new->cb = malloc(sizeof(CrustyCallback) * cvm->cbs);
+        if(new->cb == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for callbacks.\n");
+            free(new);
+            return(NULL);
+        }
+        memcpy(new->cb, cvm->cb, sizeof(CrustyCallback) * cvm->cbs);
+    }
+
+    /* replacements are matched by name and must provide the same kind of
+       access the program was verified against */
+    if(cb != NULL) {
+        for(i = 0; i < cbcount; i++) {
+            var = find_variable(cvm, NULL, cb[i].name);
+            if(var < 0 || !variable_is_callback(&(cvm->prog->var[var]))) {
+                LOG_PRINTF(cvm, "Callback %s isn't used by the program.\n",
+                           cb[i].name);
+                goto error;
+            }
+            j = cvm->prog->var[var].callback;
+
+            if((cb[i].read == NULL) != (new->cb[j].read == NULL) ||
+               (cb[i].write == NULL) != (new->cb[j].write == NULL) ||
+               cb[i].readType != new->cb[j].readType ||
+               cb[i].length != new->cb[j].length) {
+                LOG_PRINTF(cvm, "Callback %s doesn't match the original.\n",
+                           cb[i].name);
+                goto error;
+            }
+
+            new->cb[j] = cb[i];
+        }
+    }
+
+    new->stack = malloc(cvm->prog->stacksize);
+    if(new->stack == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate stack memory.\n");
+        goto error;
+    }
+
+    new->cstack = malloc(sizeof(CrustyCallStackArg) * new->callstacksize);
+    if(new->cstack == NULL) {
         LOG_PRINTF(cvm, "Failed to allocate callstack memory.\n");
-        crustyvm_free(cvm);
-        return(NULL);
+        goto error;
     }
 
-    if(crustyvm_reset(cvm) < 0) {
-        crustyvm_free(cvm);
-        return(NULL);
+    pthread_mutex_lock(&(cvm->prog->lock));
+    cvm->prog->refs++;
+    pthread_mutex_unlock(&(cvm->prog->lock));
+
+    crustyvm_reset(new);
+
+    return(new);
+
+error:
+    if(new->cb != NULL) {
+        free(new->cb);
+    }
+    if(new->stack != NULL) {
+        free(new->stack);
     }
+    free(new);
 
-    return(cvm);
+    return(NULL);
+}
+
+static unsigned int type_size(CrustyType type) {
+    switch(type) {
+        case CRUSTY_TYPE_INT:
+            return(sizeof(int));
+        case CRUSTY_TYPE_FLOAT:
+            return(sizeof(double));
+        default:
+            return(1);
+    }
 }
 
 static int read_var(CrustyVM *cvm,
@@ -4620,16 +7796,17 @@ static int read_var(CrustyVM *cvm,
                     int ptr,
                     CrustyVariable *var,
                     unsigned int index) {
-    if(var->read != NULL) {
+    if(VAR_READ(var) != NULL) {
+        RECORD(cvm, RECORD_CALLBACK(var - cvm->prog->var))
         if(var->type == CRUSTY_TYPE_CHAR) {
             /* the function will assume only 1 byte of storage so make sure it
              * is all clear. */
             *intval = 0;
-            return(var->read(var->readpriv, intval, index));
+            return(VAR_CB(var)->read(VAR_CB(var)->readpriv, intval, index));
         } else if(var->type == CRUSTY_TYPE_FLOAT) {
-            return(var->read(var->readpriv, floatval, index));
+            return(VAR_CB(var)->read(VAR_CB(var)->readpriv, floatval, index));
         } else { /* INT */
-            return(var->read(var->readpriv, intval, index));
+            return(VAR_CB(var)->read(VAR_CB(var)->readpriv, intval, index));
         }
     }
 
@@ -4664,9 +7841,9 @@ static void write_var(CrustyVM *cvm,
                                      (sizeof(CrustyStackArg) * (IDX))])))
 
 #define GET_PTR(VAR, SP) \
-    (variable_is_global(&(cvm->var[VAR])) ? \
-        (cvm->var[VAR].offset) : \
-        ((SP) - cvm->var[VAR].offset))
+    (variable_is_global(&(cvm->prog->var[VAR])) ? \
+        (cvm->prog->var[VAR].offset) : \
+        ((SP) - cvm->prog->var[VAR].offset))
 
 /* see variable permutations.txt for more information on what these do */
 
@@ -4678,16 +7855,16 @@ static int update_src_ref(CrustyVM *cvm,
                           int *index,
                           int *ptr) {
     if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-        if(variable_is_argument(&(cvm->var[*val]))) {
-            if((STACK_ARG(cvm->sp, cvm->var[*val].offset)->flags &
+        if(variable_is_argument(&(cvm->prog->var[*val]))) {
+            if((STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->flags &
                 MOVE_FLAG_TYPE_MASK) ==
                MOVE_FLAG_VAR) {
                 if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                    if(variable_is_argument(&(cvm->var[*index]))) {
-                        if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                    if(variable_is_argument(&(cvm->prog->var[*index]))) {
+                        if((STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->flags &
                            MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                            if(cvm->var[STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->val].type ==
+                            if(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                  cvm->prog->var[*index].offset)->val].type ==
                                CRUSTY_TYPE_FLOAT) {
                                 cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                                 return(-1);
@@ -4696,19 +7873,19 @@ static int update_src_ref(CrustyVM *cvm,
                             if(read_var(cvm,
                                         index,
                                         NULL,
-                                        STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                        &(cvm->var[STACK_ARG(cvm->sp,
-                                                             cvm->var[*index].offset)->val]),
+                                        STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->ptr,
+                                        &(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                             cvm->prog->var[*index].offset)->val]),
                                         STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->index) < 0) {
+                                                  cvm->prog->var[*index].offset)->index) < 0) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(-1);
                             }
                         } else {
-                            *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                            *index = STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->val;
                         }
                     } else {
-                        if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                        if(cvm->prog->var[*index].type == CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
                         }
@@ -4717,7 +7894,7 @@ static int update_src_ref(CrustyVM *cvm,
                                     index,
                                     NULL,
                                     GET_PTR(*index, *ptr),
-                                    &(cvm->var[*index]),
+                                    &(cvm->prog->var[*index]),
                                     0) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
@@ -4731,27 +7908,27 @@ static int update_src_ref(CrustyVM *cvm,
                     return(-1);
                 }
 
-                *index += STACK_ARG(cvm->sp, cvm->var[*val].offset)->index;
+                *index += STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->index;
                 if(*index >
-                   (int)(cvm->var[STACK_ARG(cvm->sp, 
-                                            cvm->var[*val].offset)->val].length -
+                   (int)(cvm->prog->var[STACK_ARG(cvm->sp, 
+                                            cvm->prog->var[*val].offset)->val].length -
                    1)) {
                     cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
                     return(-1);
                 }
 
                 *flags = MOVE_FLAG_VAR;
-                *ptr = STACK_ARG(cvm->sp, cvm->var[*val].offset)->ptr;
-                *val = STACK_ARG(cvm->sp, cvm->var[*val].offset)->val;
+                *ptr = STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->ptr;
+                *val = STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->val;
                 /* index is already updated */
             } else {
                 if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                    if(variable_is_argument(&(cvm->var[*index]))) {
-                        if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                    if(variable_is_argument(&(cvm->prog->var[*index]))) {
+                        if((STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->flags &
                             MOVE_FLAG_TYPE_MASK) ==
                            MOVE_FLAG_VAR) {
-                            if(cvm->var[STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->val].type ==
+                            if(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                  cvm->prog->var[*index].offset)->val].type ==
                                CRUSTY_TYPE_FLOAT) {
                                 cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                                 return(-1);
@@ -4760,19 +7937,19 @@ static int update_src_ref(CrustyVM *cvm,
                             if(read_var(cvm,
                                         index,
                                         NULL,
-                                        STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                        &(cvm->var[STACK_ARG(cvm->sp,
-                                                             cvm->var[*index].offset)->val]),
+                                        STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->ptr,
+                                        &(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                             cvm->prog->var[*index].offset)->val]),
                                         STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->index) < 0) {
+                                                  cvm->prog->var[*index].offset)->index) < 0) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(-1);
                             }
                         } else {
-                            *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                            *index = STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->val;
                         }
                     } else {
-                        if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                        if(cvm->prog->var[*index].type == CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
                         }
@@ -4781,7 +7958,7 @@ static int update_src_ref(CrustyVM *cvm,
                                     index,
                                     NULL,
                                     GET_PTR(*index, *ptr),
-                                    &(cvm->var[*index]),
+                                    &(cvm->prog->var[*index]),
                                     0) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
@@ -4796,15 +7973,15 @@ static int update_src_ref(CrustyVM *cvm,
                 }
 
                 *flags = MOVE_FLAG_IMMEDIATE;
-                *val = STACK_ARG(cvm->sp, cvm->var[*val].offset)->val;
+                *val = STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->val;
             }
         } else {
             if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                if(variable_is_argument(&(cvm->var[*index]))) {
-                    if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                if(variable_is_argument(&(cvm->prog->var[*index]))) {
+                    if((STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->flags &
                        MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                        if(cvm->var[STACK_ARG(cvm->sp,
-                                              cvm->var[*index].offset)->val].type ==
+                        if(cvm->prog->var[STACK_ARG(cvm->sp,
+                                              cvm->prog->var[*index].offset)->val].type ==
                            CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
@@ -4813,19 +7990,19 @@ static int update_src_ref(CrustyVM *cvm,
                         if(read_var(cvm,
                                     index,
                                     NULL,
-                                    STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                    &(cvm->var[STACK_ARG(cvm->sp,
-                                                         cvm->var[*index].offset)->val]),
+                                    STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->ptr,
+                                    &(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                         cvm->prog->var[*index].offset)->val]),
                                     STACK_ARG(cvm->sp,
-                                              cvm->var[*index].offset)->index) < 0) {
+                                              cvm->prog->var[*index].offset)->index) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
                         }
                     } else {
-                        *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                        *index = STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->val;
                     }
                 } else {
-                    if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                    if(cvm->prog->var[*index].type == CRUSTY_TYPE_FLOAT) {
                         cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                         return(-1);
                     }
@@ -4834,7 +8011,7 @@ static int update_src_ref(CrustyVM *cvm,
                                 index,
                                 NULL,
                                 GET_PTR(*index, *ptr),
-                                &(cvm->var[*index]),
+                                &(cvm->prog->var[*index]),
                                 0) < 0) {
                         cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                         return(-1);
@@ -4843,7 +8020,7 @@ static int update_src_ref(CrustyVM *cvm,
             } /* else {
                 do nothing
             } */
-            if(*index < 0 || *index > (int)(cvm->var[*val].length - 1)) {
+            if(*index < 0 || *index > (int)(cvm->prog->var[*val].length - 1)) {
                 cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
                 return(-1);
             }
@@ -4853,14 +8030,14 @@ static int update_src_ref(CrustyVM *cvm,
             *ptr = GET_PTR(*val, *ptr);
         }
     } else if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
-        if(variable_is_argument(&(cvm->var[*val]))) {
-            if((STACK_ARG(cvm->sp, cvm->var[*val].offset)->flags &
+        if(variable_is_argument(&(cvm->prog->var[*val]))) {
+            if((STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->flags &
                 MOVE_FLAG_TYPE_MASK) ==
                MOVE_FLAG_VAR) {
                 *flags = MOVE_FLAG_IMMEDIATE;
-                *index = STACK_ARG(cvm->sp, cvm->var[*val].offset)->index;
-                *val = cvm->var[STACK_ARG(cvm->sp,
-                                          cvm->var[*val].offset)->val].length -
+                *index = STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->index;
+                *val = cvm->prog->var[STACK_ARG(cvm->sp,
+                                          cvm->prog->var[*val].offset)->val].length -
                        *index;
             } else {
                 *flags = MOVE_FLAG_IMMEDIATE;
@@ -4868,7 +8045,7 @@ static int update_src_ref(CrustyVM *cvm,
             }
         } else {
             *flags = MOVE_FLAG_IMMEDIATE;
-            *val = cvm->var[*val].length;
+            *val = cvm->prog->var[*val].length;
         }
     } else if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_IMMEDIATE) {
         *flags = MOVE_FLAG_IMMEDIATE;
@@ -4892,24 +8069,32 @@ static int call(CrustyVM *cvm, unsigned int procindex, unsigned int argsindex) {
         return(-1);
     }
 
-    callee = &(cvm->proc[procindex]);
+    callee = &(cvm->prog->proc[procindex]);
     newsp = cvm->sp + callee->stackneeded;
 
-    if(newsp > cvm->stacksize) {
+    if(newsp > cvm->prog->stacksize) {
         cvm->status = CRUSTY_STATUS_STACK_OVERFLOW;
         return(-1);
     }
 
-    /* initialize local variables */
-    memcpy(&(cvm->stack[cvm->sp]),
-           callee->initializer,
-           callee->stackneeded);
+    /* initialize local variables which may be read before they're set */
+    for(i = 0; i < callee->inits; i++) {
+        if(callee->init[i].zero) {
+            memset(&(cvm->stack[cvm->sp + callee->init[i].start]),
+                   0,
+                   callee->init[i].length);
+        } else {
+            memcpy(&(cvm->stack[cvm->sp + callee->init[i].start]),
+                   &(callee->initializer[callee->init[i].start]),
+                   callee->init[i].length);
+        }
+    }
 
     /* set up procedure arguments */
     for(i = 0; i < callee->args; i++) {
-        flags = cvm->inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_FLAGS];
-        val = cvm->inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_VAL];
-        index = cvm->inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_INDEX];
+        flags = cvm->prog->inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_FLAGS];
+        val = cvm->prog->inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_VAL];
+        index = cvm->prog->inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_INDEX];
         ptr = cvm->sp;
 
         if(update_src_ref(cvm, &flags, &val, &index, &ptr) < 0) {
@@ -4926,8 +8111,14 @@ static int call(CrustyVM *cvm, unsigned int procindex, unsigned int argsindex) {
     cvm->csp++;
     /* make the return ip start at the next instruction */
     cvm->cstack[cvm->csp - 1].ip =
-        argsindex + (cvm->proc[procindex].args * CALL_ARG_SIZE);
+        argsindex + (cvm->prog->proc[procindex].args * CALL_ARG_SIZE);
     cvm->cstack[cvm->csp - 1].proc = procindex;
+    /* 0 is reserved for global memory, which never goes stale */
+    cvm->generation++;
+    if(cvm->generation == 0) {
+        cvm->generation = 1;
+    }
+    cvm->cstack[cvm->csp - 1].generation = cvm->generation;
 
     cvm->sp = newsp;
     cvm->ip = callee->instruction;
@@ -4941,16 +8132,16 @@ static int update_dest_ref(CrustyVM *cvm,
                            int *index,
                            int *ptr) {
     if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-        if(variable_is_argument(&(cvm->var[*val]))) {
-            if((STACK_ARG(cvm->sp, cvm->var[*val].offset)->flags &
+        if(variable_is_argument(&(cvm->prog->var[*val]))) {
+            if((STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->flags &
                 MOVE_FLAG_TYPE_MASK) ==
                MOVE_FLAG_VAR) {
                 if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                    if(variable_is_argument(&(cvm->var[*index]))) {
-                        if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                    if(variable_is_argument(&(cvm->prog->var[*index]))) {
+                        if((STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->flags &
                            MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                            if(cvm->var[STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->val].type ==
+                            if(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                  cvm->prog->var[*index].offset)->val].type ==
                                CRUSTY_TYPE_FLOAT) {
                                 cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                                 return(-1);
@@ -4959,19 +8150,19 @@ static int update_dest_ref(CrustyVM *cvm,
                             if(read_var(cvm,
                                         index,
                                         NULL,
-                                        STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                        &(cvm->var[STACK_ARG(cvm->sp,
-                                                             cvm->var[*index].offset)->val]),
+                                        STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->ptr,
+                                        &(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                             cvm->prog->var[*index].offset)->val]),
                                         STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->index) < 0) {
+                                                  cvm->prog->var[*index].offset)->index) < 0) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(-1);
                             }
                         } else {
-                            *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                            *index = STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->val;
                         }
                     } else {
-                        if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                        if(cvm->prog->var[*index].type == CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
                         }
@@ -4980,7 +8171,7 @@ static int update_dest_ref(CrustyVM *cvm,
                                     index,
                                     NULL,
                                     GET_PTR(*index, *ptr),
-                                    &(cvm->var[*index]),
+                                    &(cvm->prog->var[*index]),
                                     0) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
@@ -4994,26 +8185,26 @@ static int update_dest_ref(CrustyVM *cvm,
                     return(-1);
                 }
 
-                *index += STACK_ARG(cvm->sp, cvm->var[*val].offset)->index;
+                *index += STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->index;
                 if(*index >
-                   (int)(cvm->var[STACK_ARG(cvm->sp, 
-                                            cvm->var[*val].offset)->val].length -
+                   (int)(cvm->prog->var[STACK_ARG(cvm->sp, 
+                                            cvm->prog->var[*val].offset)->val].length -
                    1)) {
                     cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
                     return(-1);
                 }
 
-                *ptr = STACK_ARG(cvm->sp, cvm->var[*val].offset)->ptr;
-                *val = STACK_ARG(cvm->sp, cvm->var[*val].offset)->val;
+                *ptr = STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->ptr;
+                *val = STACK_ARG(cvm->sp, cvm->prog->var[*val].offset)->val;
                 /* index is already updated */
             } else {
                 if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                    if(variable_is_argument(&(cvm->var[*index]))) {
-                        if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                    if(variable_is_argument(&(cvm->prog->var[*index]))) {
+                        if((STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->flags &
                             MOVE_FLAG_TYPE_MASK) ==
                            MOVE_FLAG_VAR) {
-                            if(cvm->var[STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->val].type ==
+                            if(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                  cvm->prog->var[*index].offset)->val].type ==
                                CRUSTY_TYPE_FLOAT) {
                                 cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                                 return(-1);
@@ -5022,19 +8213,19 @@ static int update_dest_ref(CrustyVM *cvm,
                             if(read_var(cvm,
                                         index,
                                         NULL,
-                                        STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                        &(cvm->var[STACK_ARG(cvm->sp,
-                                                             cvm->var[*index].offset)->val]),
+                                        STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->ptr,
+                                        &(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                             cvm->prog->var[*index].offset)->val]),
                                         STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->index) < 0) {
+                                                  cvm->prog->var[*index].offset)->index) < 0) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(-1);
                             }
                         } else {
-                            *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                            *index = STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->val;
                         }
                     } else {
-                        if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                        if(cvm->prog->var[*index].type == CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
                         }
@@ -5043,7 +8234,7 @@ static int update_dest_ref(CrustyVM *cvm,
                                     index,
                                     NULL,
                                     GET_PTR(*index, *ptr),
-                                    &(cvm->var[*index]),
+                                    &(cvm->prog->var[*index]),
                                     0) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
@@ -5067,16 +8258,16 @@ static int update_dest_ref(CrustyVM *cvm,
                 /* do some goofy nonsense to get the pointer (in VM memory) in
                    to the stack of the value referenced by val */
                 *ptr = cvm->sp -
-                       (cvm->var[*val].offset * sizeof(CrustyStackArg)) +
+                       (cvm->prog->var[*val].offset * sizeof(CrustyStackArg)) +
                        offsetof(CrustyStackArg, val);
             }
         } else {
             if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                if(variable_is_argument(&(cvm->var[*index]))) {
-                    if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                if(variable_is_argument(&(cvm->prog->var[*index]))) {
+                    if((STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->flags &
                        MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                        if(cvm->var[STACK_ARG(cvm->sp,
-                                              cvm->var[*index].offset)->val].type ==
+                        if(cvm->prog->var[STACK_ARG(cvm->sp,
+                                              cvm->prog->var[*index].offset)->val].type ==
                            CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
@@ -5085,19 +8276,19 @@ static int update_dest_ref(CrustyVM *cvm,
                         if(read_var(cvm,
                                     index,
                                     NULL,
-                                    STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                    &(cvm->var[STACK_ARG(cvm->sp,
-                                                         cvm->var[*index].offset)->val]),
+                                    STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->ptr,
+                                    &(cvm->prog->var[STACK_ARG(cvm->sp,
+                                                         cvm->prog->var[*index].offset)->val]),
                                     STACK_ARG(cvm->sp,
-                                              cvm->var[*index].offset)->index) < 0) {
+                                              cvm->prog->var[*index].offset)->index) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
                         }
                     } else {
-                        *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                        *index = STACK_ARG(cvm->sp, cvm->prog->var[*index].offset)->val;
                     }
                 } else {
-                    if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                    if(cvm->prog->var[*index].type == CRUSTY_TYPE_FLOAT) {
                         cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                         return(-1);
                     }
@@ -5106,7 +8297,7 @@ static int update_dest_ref(CrustyVM *cvm,
                                 index,
                                 NULL,
                                 GET_PTR(*index, *ptr),
-                                &(cvm->var[*index]),
+                                &(cvm->prog->var[*index]),
                                 0) < 0) {
                         cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                         return(-1);
@@ -5115,7 +8306,7 @@ static int update_dest_ref(CrustyVM *cvm,
             } /* else {
                 do nothing
             } */
-            if(*index < 0 || *index > (int)(cvm->var[*val].length - 1)) {
+            if(*index < 0 || *index > (int)(cvm->prog->var[*val].length - 1)) {
                 cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
                 return(-1);
             }
@@ -5145,7 +8336,7 @@ static int fetch_val(CrustyVM *cvm,
                     intval,
                     floatval,
                     ptr,
-                    &(cvm->var[val]),
+                    &(cvm->prog->var[val]),
                     index) < 0) {
             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
             return(-1);
@@ -5166,18 +8357,323 @@ static void store_result(CrustyVM *cvm,
               cvm->intresult,
               cvm->floatresult,
               ptr,
-              &(cvm->var[val]),
+              &(cvm->prog->var[val]),
               index);
 }
 
+/* bulk array instructions are done 16 bytes at a time.  layout_variables()
+   only aligns arrays to their element size and an instruction can start at
+   any element, so vectors are moved in and out with memcpy(). */
+typedef int CrustyIntVector __attribute__((vector_size(16)));
+typedef unsigned char CrustyCharVector __attribute__((vector_size(16)));
+typedef double CrustyFloatVector __attribute__((vector_size(16)));
+
+/* d OP= s for count elements, s may be NULL to use SCALAR for every one */
+#define BULK_MATH(TYPE, VECTOR, OP, SCALAR) { \
+    VECTOR dv, sv; \
+    TYPE dt, st = (SCALAR); \
+    \
+    sv = ((VECTOR){0}) + st; \
+    for(i = 0; i + (sizeof(VECTOR) / sizeof(TYPE)) <= count; \
+        i += sizeof(VECTOR) / sizeof(TYPE)) { \
+        memcpy(&dv, &(d[i * sizeof(TYPE)]), sizeof(VECTOR)); \
+        if(s != NULL) { \
+            memcpy(&sv, &(s[i * sizeof(TYPE)]), sizeof(VECTOR)); \
+        } \
+        dv = dv OP sv; \
+        memcpy(&(d[i * sizeof(TYPE)]), &dv, sizeof(VECTOR)); \
+    } \
+    for(; i < count; i++) { \
+        memcpy(&dt, &(d[i * sizeof(TYPE)]), sizeof(TYPE)); \
+        if(s != NULL) { \
+            memcpy(&st, &(s[i * sizeof(TYPE)]), sizeof(TYPE)); \
+        } \
+        dt = dt OP st; \
+        memcpy(&(d[i * sizeof(TYPE)]), &dt, sizeof(TYPE)); \
+    } \
+}
+
+#define BULK_FILL(TYPE, VECTOR, SCALAR) { \
+    VECTOR sv; \
+    TYPE st = (SCALAR); \
+    \
+    sv = ((VECTOR){0}) + st; \
+    for(i = 0; i + (sizeof(VECTOR) / sizeof(TYPE)) <= count; \
+        i += sizeof(VECTOR) / sizeof(TYPE)) { \
+        memcpy(&(d[i * sizeof(TYPE)]), &sv, sizeof(VECTOR)); \
+    } \
+    for(; i < count; i++) { \
+        memcpy(&(d[i * sizeof(TYPE)]), &st, sizeof(TYPE)); \
+    } \
+}
+
+/* src and dest the same type in memory, or a scalar converted to the
+   destination type */
+static void bulk_same_type(int type,
+                           CrustyType desttype,
+                           unsigned char *d,
+                           unsigned char *s,
+                           unsigned int count,
+                           int intval,
+                           double floatval) {
+    unsigned int i;
+
+    if(type == CRUSTY_INSTRUCTION_TYPE_COPY ||
+       type == CRUSTY_INSTRUCTION_TYPE_FILL) {
+        if(s != NULL) {
+            memmove(d, s, count * type_size(desttype));
+        } else if(desttype == CRUSTY_TYPE_CHAR) {
+            memset(d, (unsigned char)intval, count);
+        } else if(desttype == CRUSTY_TYPE_FLOAT) {
+            BULK_FILL(double, CrustyFloatVector, floatval)
+        } else { /* INT */
+            BULK_FILL(int, CrustyIntVector, intval)
+        }
+        return;
+    }
+
+    switch(desttype) {
+        case CRUSTY_TYPE_CHAR:
+            switch(type) {
+                case CRUSTY_INSTRUCTION_TYPE_VADD:
+                    BULK_MATH(unsigned char, CrustyCharVector, +, intval)
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_VMUL:
+                    BULK_MATH(unsigned char, CrustyCharVector, *, intval)
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_VAND:
+                    BULK_MATH(unsigned char, CrustyCharVector, &, intval)
+                    break;
+                default: /* VOR */
+                    BULK_MATH(unsigned char, CrustyCharVector, |, intval)
+            }
+            break;
+        case CRUSTY_TYPE_FLOAT:
+            /* logic on floats is refused before getting here */
+            if(type == CRUSTY_INSTRUCTION_TYPE_VADD) {
+                BULK_MATH(double, CrustyFloatVector, +, floatval)
+            } else { /* VMUL */
+                BULK_MATH(double, CrustyFloatVector, *, floatval)
+            }
+            break;
+        default: /* INT */
+            switch(type) {
+                case CRUSTY_INSTRUCTION_TYPE_VADD:
+                    BULK_MATH(int, CrustyIntVector, +, intval)
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_VMUL:
+                    BULK_MATH(int, CrustyIntVector, *, intval)
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_VAND:
+                    BULK_MATH(int, CrustyIntVector, &, intval)
+                    break;
+                default: /* VOR */
+                    BULK_MATH(int, CrustyIntVector, |, intval)
+            }
+    }
+}
+
+#undef BULK_FILL
+#undef BULK_MATH
+
+static int bulk_int_op(int type, int a, int b) {
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_VADD:
+            return(a + b);
+        case CRUSTY_INSTRUCTION_TYPE_VMUL:
+            return(a * b);
+        case CRUSTY_INSTRUCTION_TYPE_VAND:
+            return(a & b);
+        case CRUSTY_INSTRUCTION_TYPE_VOR:
+            return(a | b);
+        default: /* COPY, FILL */
+            return(b);
+    }
+}
+
+static double bulk_float_op(int type, double a, double b) {
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_VADD:
+            return(a + b);
+        case CRUSTY_INSTRUCTION_TYPE_VMUL:
+            return(a * b);
+        default: /* COPY, FILL */
+            return(b);
+    }
+}
+
+/* Copy, fill or do math on count elements of an array at once, checking the
+ * range only once.  A source which is an array is read along with the
+ * destination, a single value is used for every element and fill always
+ * uses a single value.  Conversions follow move and the math instructions,
+ * and the source is read as it was before the instruction even if it
+ * overlaps the destination.  The result isn't changed. */
+static int bulk(CrustyVM *cvm, const int *inst) {
+    int type = inst[0];
+    int destflags, destval, destindex, destptr;
+    int srcflags, srcval, srcindex, srcptr;
+    int countflags, countval, countindex, countptr;
+    int count, intval, destint;
+    double floatval, destfloat;
+    CrustyVariable *dest;
+    CrustyVariable *src = NULL;
+    CrustyType srctype;
+    unsigned int destlength, size;
+    unsigned int i, j;
+    unsigned char *d, *s;
+    int backwards;
+
+    destflags = inst[MOVE_DEST_FLAGS];
+    destval = inst[MOVE_DEST_VAL];
+    destindex = inst[MOVE_DEST_INDEX];
+    destptr = cvm->sp;
+    srcflags = inst[MOVE_SRC_FLAGS];
+    srcval = inst[MOVE_SRC_VAL];
+    srcindex = inst[MOVE_SRC_INDEX];
+    srcptr = cvm->sp;
+    countflags = inst[BULK_COUNT_FLAGS];
+    countval = inst[BULK_COUNT_VAL];
+    countindex = inst[BULK_COUNT_INDEX];
+    countptr = cvm->sp;
+    if(update_dest_ref(cvm, &destflags, &destval, &destindex, &destptr) < 0 ||
+       update_src_ref(cvm, &srcflags, &srcval, &srcindex, &srcptr) < 0 ||
+       update_src_ref(cvm, &countflags, &countval, &countindex, &countptr) < 0) {
+        return(-1);
+    }
+
+    dest = &(cvm->prog->var[destval]);
+    if(VAR_WRITE(dest) != NULL) {
+        cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
+        return(-1);
+    }
+
+    if(countflags == MOVE_FLAG_VAR &&
+       cvm->prog->var[countval].type == CRUSTY_TYPE_FLOAT) {
+        cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
+        return(-1);
+    }
+    if(fetch_val(cvm, countflags, countval, countindex,
+                 &count, &floatval, countptr) < 0) {
+        return(-1);
+    }
+
+    /* an argument passed an immediate is written in place, see
+       update_dest_ref() */
+    destlength = dest->length == 0 ? 1 : dest->length;
+    if(count < 0 ||
+       (unsigned int)count > destlength - (unsigned int)destindex) {
+        cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
+        return(-1);
+    }
+
+    intval = 0;
+    floatval = 0.0;
+    if(srcflags == MOVE_FLAG_VAR &&
+       type != CRUSTY_INSTRUCTION_TYPE_FILL &&
+       cvm->prog->var[srcval].length > 1) {
+        src = &(cvm->prog->var[srcval]);
+        srctype = src->type;
+        if((unsigned int)count > src->length - (unsigned int)srcindex) {
+            cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
+            return(-1);
+        }
+    } else {
+        if(fetch_val(cvm, srcflags, srcval, srcindex,
+                     &intval, &floatval, srcptr) < 0) {
+            return(-1);
+        }
+        srctype = CRUSTY_TYPE_INT;
+        if(srcflags == MOVE_FLAG_VAR) {
+            srctype = cvm->prog->var[srcval].type;
+        }
+    }
+
+    if((type == CRUSTY_INSTRUCTION_TYPE_VAND ||
+        type == CRUSTY_INSTRUCTION_TYPE_VOR) &&
+       (dest->type == CRUSTY_TYPE_FLOAT || srctype == CRUSTY_TYPE_FLOAT)) {
+        cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
+        return(-1);
+    }
+
+    size = type_size(dest->type);
+    d = &(cvm->stack[destptr + (destindex * size)]);
+    s = NULL;
+    backwards = 0;
+    if(src != NULL && VAR_READ(src) == NULL) {
+        s = &(cvm->stack[srcptr + (srcindex * type_size(src->type))]);
+        /* math going forward would read what it had just written */
+        backwards = d > s && d < s + (count * size);
+    }
+
+    if(src == NULL) {
+        if(dest->type == CRUSTY_TYPE_FLOAT) {
+            if(srctype != CRUSTY_TYPE_FLOAT) {
+                floatval = intval;
+            }
+            bulk_same_type(type, dest->type, d, NULL, count, intval, floatval);
+            cvm->ip += BULK_ARGS + 1;
+            return(0);
+        } else if(srctype != CRUSTY_TYPE_FLOAT ||
+                  type == CRUSTY_INSTRUCTION_TYPE_COPY ||
+                  type == CRUSTY_INSTRUCTION_TYPE_FILL) {
+            if(srctype == CRUSTY_TYPE_FLOAT) {
+                intval = floatval;
+            }
+            bulk_same_type(type, dest->type, d, NULL, count, intval, floatval);
+            cvm->ip += BULK_ARGS + 1;
+            return(0);
+        }
+    } else if(s != NULL && src->type == dest->type &&
+              (!backwards || type == CRUSTY_INSTRUCTION_TYPE_COPY)) {
+        bulk_same_type(type, dest->type, d, s, count, intval, floatval);
+        cvm->ip += BULK_ARGS + 1;
+        return(0);
+    }
+
+    /* anything else, mixed types and read callbacks, a value at a time */
+    for(j = 0; j < (unsigned int)count; j++) {
+        i = backwards ? (unsigned int)count - 1 - j : j;
+
+        if(src != NULL) {
+            if(read_var(cvm, &intval, &floatval, srcptr, src, srcindex + i) < 0) {
+                cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
+                return(-1);
+            }
+        }
+
+        destint = 0;
+        destfloat = 0.0;
+        if(type != CRUSTY_INSTRUCTION_TYPE_COPY &&
+           type != CRUSTY_INSTRUCTION_TYPE_FILL) {
+            read_var(cvm, &destint, &destfloat, destptr, dest, destindex + i);
+        }
+
+        if(dest->type == CRUSTY_TYPE_FLOAT) {
+            destfloat = bulk_float_op(type,
+                                      destfloat,
+                                      srctype == CRUSTY_TYPE_FLOAT ?
+                                          floatval : (double)intval);
+        } else if(srctype == CRUSTY_TYPE_FLOAT) {
+            destint = bulk_float_op(type, (double)destint, floatval);
+        } else {
+            destint = bulk_int_op(type, destint, intval);
+        }
+
+        write_var(cvm, destint, destfloat, destptr, dest, destindex + i);
+    }
+
+    cvm->ip += BULK_ARGS + 1;
+    return(0);
+}
+
 #define POPULATE_ARGS \
-    destflags = cvm->inst[cvm->ip + MOVE_DEST_FLAGS]; \
-    destval = cvm->inst[cvm->ip + MOVE_DEST_VAL]; \
-    destindex = cvm->inst[cvm->ip + MOVE_DEST_INDEX]; \
+    destflags = inst[MOVE_DEST_FLAGS]; \
+    destval = inst[MOVE_DEST_VAL]; \
+    destindex = inst[MOVE_DEST_INDEX]; \
     destptr = cvm->sp; \
-    srcflags = cvm->inst[cvm->ip + MOVE_SRC_FLAGS]; \
-    srcval = cvm->inst[cvm->ip + MOVE_SRC_VAL]; \
-    srcindex = cvm->inst[cvm->ip + MOVE_SRC_INDEX]; \
+    srcflags = inst[MOVE_SRC_FLAGS]; \
+    srcval = inst[MOVE_SRC_VAL]; \
+    srcindex = inst[MOVE_SRC_INDEX]; \
     srcptr = cvm->sp; \
     if(update_dest_ref(cvm, \
                        &destflags, \
@@ -5195,7 +8691,7 @@ static void store_result(CrustyVM *cvm,
     }
  
 #define FETCH_VALS \
-    if(cvm->var[destval].write != NULL) { \
+    if(VAR_WRITE(&(cvm->prog->var[destval])) != NULL) { \
         cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION; \
         return(cvm->status); \
     } \
@@ -5225,16 +8721,16 @@ static void store_result(CrustyVM *cvm,
     FETCH_VALS \
     \
     if(srcflags == MOVE_FLAG_VAR) { \
-        if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT && \
-           cvm->var[destval].type != CRUSTY_TYPE_FLOAT) { \
+        if(cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT && \
+           cvm->prog->var[destval].type != CRUSTY_TYPE_FLOAT) { \
             cvm->intresult = ((double)(cvm->intresult)) OP floatoperand; \
             cvm->resulttype = CRUSTY_TYPE_INT; \
-        } else if(cvm->var[srcval].type != CRUSTY_TYPE_FLOAT && \
-                  cvm->var[destval].type == CRUSTY_TYPE_FLOAT) { \
+        } else if(cvm->prog->var[srcval].type != CRUSTY_TYPE_FLOAT && \
+                  cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) { \
             cvm->floatresult = cvm->floatresult OP ((double)intoperand); \
             cvm->resulttype = CRUSTY_TYPE_FLOAT; \
-        } else if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT && \
-                  cvm->var[destval].type == CRUSTY_TYPE_FLOAT) { \
+        } else if(cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT && \
+                  cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) { \
             cvm->floatresult = cvm->floatresult OP floatoperand; \
             cvm->resulttype = CRUSTY_TYPE_FLOAT; \
         } else { /* both not float */ \
@@ -5243,7 +8739,7 @@ static void store_result(CrustyVM *cvm,
         } \
     } else { \
         /* immediates can only be ints */ \
-        if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) { \
+        if(cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) { \
             cvm->floatresult = cvm->floatresult OP ((double)intoperand); \
             cvm->resulttype = CRUSTY_TYPE_FLOAT; \
         } else { \
@@ -5262,8 +8758,8 @@ static void store_result(CrustyVM *cvm,
     FETCH_VALS \
     \
     if(srcflags == MOVE_FLAG_VAR) { \
-        if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT || \
-           cvm->var[destval].type == CRUSTY_TYPE_FLOAT) { \
+        if(cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT || \
+           cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) { \
             cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION; \
             break; \
         } \
@@ -5279,13 +8775,13 @@ static void store_result(CrustyVM *cvm,
 #define JUMP_INSTRUCTION(CMP) \
     if(cvm->resulttype == CRUSTY_TYPE_INT) { \
         if(cvm->intresult CMP 0) { \
-            cvm->ip = (unsigned int)(cvm->inst[cvm->ip + JUMP_LOCATION]); \
+            cvm->ip = (unsigned int)(inst[JUMP_LOCATION]); \
         } else { \
             cvm->ip += JUMP_ARGS + 1; \
         } \
     } else { \
         if(cvm->floatresult CMP 0.0) { \
-            cvm->ip = (unsigned int)(cvm->inst[cvm->ip + JUMP_LOCATION]); \
+            cvm->ip = (unsigned int)(inst[JUMP_LOCATION]); \
         } else { \
             cvm->ip += JUMP_ARGS + 1; \
         } \
@@ -5297,6 +8793,7 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
     double floatoperand;
     int intoperand;
     CrustyVariable *dest, *src;
+    const int *inst;
 
     if(cvm->status != CRUSTY_STATUS_ACTIVE) {
         return(cvm->status);
@@ -5312,7 +8809,11 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
     }
 #endif
 
-    switch(cvm->inst[cvm->ip]) {
+    RECORD(cvm, cvm->cstack[cvm->csp - 1].proc)
+
+    inst = &(cvm->prog->inst[cvm->ip]);
+
+    switch(inst[0]) {
         case CRUSTY_INSTRUCTION_TYPE_MOVE:
             POPULATE_ARGS
 
@@ -5322,47 +8823,49 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
              * as a destination.  All operations can still use "read"
              * callbacks. */
             /* destval should be an index to a variable */
-            dest = &(cvm->var[destval]);
-            if(dest->write != NULL) { /* destination is callback */
+            dest = &(cvm->prog->var[destval]);
+            if(VAR_WRITE(dest) != NULL) { /* destination is callback */
                 if((srcflags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                    src = &(cvm->var[srcval]);
-                    if(src->read != NULL) {
+                    src = &(cvm->prog->var[srcval]);
+                    if(VAR_READ(src) != NULL) {
+                        RECORD(cvm, RECORD_CALLBACK(src - cvm->prog->var))
                         if(src->type == CRUSTY_TYPE_CHAR) {
                             /* the function will assume only 1 byte of storage
                              * so make sure it is all clear. */
                             cvm->intresult = 0;
-                            if(src->read(src->readpriv,
-                                         &(cvm->intresult),
-                                         srcindex)) {
+                            if(VAR_CB(src)->read(VAR_CB(src)->readpriv,
+                                                 &(cvm->intresult),
+                                                 srcindex)) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(cvm->status);
                             }
                             cvm->resulttype = CRUSTY_TYPE_INT;
                         } else if(src->type == CRUSTY_TYPE_FLOAT) {
-                            if(src->read(src->readpriv,
-                                         &(cvm->floatresult),
-                                         srcindex)) {
+                            if(VAR_CB(src)->read(VAR_CB(src)->readpriv,
+                                                 &(cvm->floatresult),
+                                                 srcindex)) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(cvm->status);
                             }
                             cvm->resulttype = CRUSTY_TYPE_FLOAT;
                         } else { /* INT */
-                            if(src->read(src->readpriv,
-                                         &(cvm->intresult),
-                                         srcindex)) {
+                            if(VAR_CB(src)->read(VAR_CB(src)->readpriv,
+                                                 &(cvm->intresult),
+                                                 srcindex)) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(cvm->status);
                             }
                             cvm->resulttype = CRUSTY_TYPE_INT;
                         }
 
-                        if(dest->write(dest->writepriv,
-                                       cvm->resulttype,
-                                       1,
-                                       cvm->resulttype == CRUSTY_TYPE_INT ?
-                                           (void *)&(cvm->intresult) :
-                                           (void *)&(cvm->floatresult),
-                                       destindex) < 0) {
+                        RECORD(cvm, RECORD_CALLBACK(dest - cvm->prog->var))
+                        if(VAR_CB(dest)->write(VAR_CB(dest)->writepriv,
+                                               cvm->resulttype,
+                                               1,
+                                               cvm->resulttype == CRUSTY_TYPE_INT ?
+                                                   (void *)&(cvm->intresult) :
+                                                   (void *)&(cvm->floatresult),
+                                               destindex) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(cvm->status);
                         }
@@ -5381,21 +8884,23 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
                             cvm->resulttype = CRUSTY_TYPE_INT;
                         }
 
-                        if(dest->write(dest->writepriv,
-                                       src->type,
-                                       src->length - srcindex,
-                                       &(cvm->stack[srcptr]),
-                                       destindex) < 0) {
+                        RECORD(cvm, RECORD_CALLBACK(dest - cvm->prog->var))
+                        if(VAR_CB(dest)->write(VAR_CB(dest)->writepriv,
+                                               src->type,
+                                               src->length - srcindex,
+                                               &(cvm->stack[srcptr]),
+                                               destindex) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(cvm->status);
                         }
                     }
                 } else {
-                    if(dest->write(dest->writepriv,
-                                   CRUSTY_TYPE_INT,
-                                   1,
-                                   &srcval,
-                                   destindex) < 0) {
+                    RECORD(cvm, RECORD_CALLBACK(dest - cvm->prog->var))
+                    if(VAR_CB(dest)->write(VAR_CB(dest)->writepriv,
+                                           CRUSTY_TYPE_INT,
+                                           1,
+                                           &srcval,
+                                           destindex) < 0) {
                         cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                         return(cvm->status);
                     }
@@ -5412,13 +8917,13 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
                 }
 
                 if(srcflags == MOVE_FLAG_VAR) {
-                    if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                       cvm->var[destval].type != CRUSTY_TYPE_FLOAT) {
+                    if(cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT &&
+                       cvm->prog->var[destval].type != CRUSTY_TYPE_FLOAT) {
                         cvm->intresult = cvm->floatresult;
                         cvm->resulttype = CRUSTY_TYPE_INT;
-                    } else if((cvm->var[srcval].type !=
+                    } else if((cvm->prog->var[srcval].type !=
                                CRUSTY_TYPE_FLOAT) &&
-                              (cvm->var[destval].type ==
+                              (cvm->prog->var[destval].type ==
                                CRUSTY_TYPE_FLOAT)) {
                         cvm->floatresult = cvm->intresult;
                         cvm->resulttype = CRUSTY_TYPE_FLOAT;
@@ -5427,7 +8932,7 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
                      * conversion is necessary */
                 } else {
                     /* immediates can only be ints */
-                    if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+                    if(cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                         cvm->floatresult = cvm->intresult;
                         cvm->resulttype = CRUSTY_TYPE_FLOAT;
                     }
@@ -5456,16 +8961,16 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
             FETCH_VALS
 
             if(srcflags == MOVE_FLAG_VAR) {
-                if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                   cvm->var[destval].type != CRUSTY_TYPE_FLOAT) {
+                if(cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT &&
+                   cvm->prog->var[destval].type != CRUSTY_TYPE_FLOAT) {
                     cvm->intresult = fmod((double)cvm->intresult, floatoperand);
                     cvm->resulttype = CRUSTY_TYPE_INT;
-                } else if(cvm->var[srcval].type != CRUSTY_TYPE_FLOAT &&
-                          cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+                } else if(cvm->prog->var[srcval].type != CRUSTY_TYPE_FLOAT &&
+                          cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                     cvm->floatresult = fmod(cvm->floatresult, (double)intoperand);
                     cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                } else if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                          cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+                } else if(cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT &&
+                          cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                     cvm->floatresult = fmod(cvm->floatresult, floatoperand);
                     cvm->resulttype = CRUSTY_TYPE_FLOAT;
                 } else { /* both not float */
@@ -5474,7 +8979,7 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
                 }
             } else {
                 /* immediates can only be ints */
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+                if(cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                     cvm->floatresult = fmod(cvm->floatresult, (double)intoperand);
                     cvm->resulttype = CRUSTY_TYPE_FLOAT;
                 } else {
@@ -5504,8 +9009,8 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
             /* make sure we're shifting by an integer, so just truncate the float
                value to an integer */
             if(srcflags == MOVE_FLAG_VAR &&
-               cvm->var[srcval].type == CRUSTY_TYPE_FLOAT) {
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+               cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT) {
+                if(cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                     cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
                     break;
                 } else {
@@ -5513,7 +9018,7 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
                     cvm->resulttype = CRUSTY_TYPE_INT;
                 }
             } else {
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+                if(cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                     cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
                     break;
                 } else {
@@ -5534,8 +9039,8 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
             /* make sure we're shifting by an integer, so just truncate the float
                value to an integer */
             if(srcflags == MOVE_FLAG_VAR &&
-               cvm->var[srcval].type == CRUSTY_TYPE_FLOAT) {
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+               cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT) {
+                if(cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                     cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
                     break;
                 } else {
@@ -5543,7 +9048,7 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
                     cvm->resulttype = CRUSTY_TYPE_INT;
                 }
             } else {
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+                if(cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                     cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
                     break;
                 } else {
@@ -5559,13 +9064,13 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
         case CRUSTY_INSTRUCTION_TYPE_CMP:
             /* this one is a bit special because destination never needs to be
                written to, so treat both as src references */
-            destflags = cvm->inst[cvm->ip + MOVE_DEST_FLAGS]; \
-            destval = cvm->inst[cvm->ip + MOVE_DEST_VAL]; \
-            destindex = cvm->inst[cvm->ip + MOVE_DEST_INDEX]; \
+            destflags = inst[MOVE_DEST_FLAGS]; \
+            destval = inst[MOVE_DEST_VAL]; \
+            destindex = inst[MOVE_DEST_INDEX]; \
             destptr = cvm->sp; \
-            srcflags = cvm->inst[cvm->ip + MOVE_SRC_FLAGS]; \
-            srcval = cvm->inst[cvm->ip + MOVE_SRC_VAL]; \
-            srcindex = cvm->inst[cvm->ip + MOVE_SRC_INDEX]; \
+            srcflags = inst[MOVE_SRC_FLAGS]; \
+            srcval = inst[MOVE_SRC_VAL]; \
+            srcindex = inst[MOVE_SRC_INDEX]; \
             srcptr = cvm->sp; \
 
             if(update_src_ref(cvm, &destflags, &destval, &destindex, &destptr) < 0) {
@@ -5596,16 +9101,16 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
 
             if(srcflags == MOVE_FLAG_VAR) {
                 if(destflags == MOVE_FLAG_VAR) {
-                    if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                       cvm->var[destval].type != CRUSTY_TYPE_FLOAT) {
+                    if(cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT &&
+                       cvm->prog->var[destval].type != CRUSTY_TYPE_FLOAT) {
                         cvm->floatresult = ((double)(cvm->intresult)) - floatoperand;
                         cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                    } else if(cvm->var[srcval].type != CRUSTY_TYPE_FLOAT &&
-                              cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+                    } else if(cvm->prog->var[srcval].type != CRUSTY_TYPE_FLOAT &&
+                              cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                         cvm->floatresult = cvm->floatresult - ((double)intoperand);
                         cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                    } else if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                              cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+                    } else if(cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT &&
+                              cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                         cvm->floatresult -= floatoperand;
                         cvm->resulttype = CRUSTY_TYPE_FLOAT;
                     } else { /* both not float */
@@ -5613,7 +9118,7 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
                         cvm->resulttype = CRUSTY_TYPE_INT;
                     }
                 } else { /* with cmp, destination can be an immediate */
-                    if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT) {
+                    if(cvm->prog->var[srcval].type == CRUSTY_TYPE_FLOAT) {
                         cvm->floatresult = ((double)(cvm->intresult)) - floatoperand;
                         cvm->resulttype = CRUSTY_TYPE_FLOAT;
                     } else {
@@ -5623,7 +9128,7 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
             } else {
                 /* immediates can only be ints */
                 if(destflags == MOVE_FLAG_VAR) {
-                    if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
+                    if(cvm->prog->var[destval].type == CRUSTY_TYPE_FLOAT) {
                         cvm->floatresult -= ((double)intoperand);
                         cvm->resulttype = CRUSTY_TYPE_FLOAT;
                     } else {
@@ -5640,11 +9145,11 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
             break;
         case CRUSTY_INSTRUCTION_TYPE_JUMP:
             /* jump to self means nothing more can happen, so end execution. */
-            if(cvm->ip == (unsigned int)(cvm->inst[cvm->ip + JUMP_LOCATION])) {
+            if(cvm->ip == (unsigned int)(inst[JUMP_LOCATION])) {
                 cvm->status = CRUSTY_STATUS_READY;
                 break;
             }
-            cvm->ip = (unsigned int)(cvm->inst[cvm->ip + JUMP_LOCATION]);
+            cvm->ip = (unsigned int)(inst[JUMP_LOCATION]);
             break;
         case CRUSTY_INSTRUCTION_TYPE_JUMPN:
             JUMP_INSTRUCTION(!=)
@@ -5660,7 +9165,7 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
             break;
         case CRUSTY_INSTRUCTION_TYPE_CALL:
             if(call(cvm,
-                    cvm->inst[cvm->ip + CALL_PROCEDURE],
+                    inst[CALL_PROCEDURE],
                     cvm->ip + CALL_START_ARGS) < 0) {
                 break;
             }
@@ -5676,10 +9181,24 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
             }
 
             cvm->ip = cvm->cstack[cvm->csp - 1].ip;
-            cvm->sp -= cvm->proc[cvm->cstack[cvm->csp - 1].proc].stackneeded;
+            cvm->sp -= cvm->prog->proc[cvm->cstack[cvm->csp - 1].proc].stackneeded;
 
             cvm->csp--;
             break;
+        case CRUSTY_INSTRUCTION_TYPE_YIELD:
+            /* give control back to the host, crustyvm_run() just carries on */
+            cvm->ip += YIELD_ARGS + 1;
+            cvm->budget = 0;
+            cvm->yielded = 1;
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_COPY:
+        case CRUSTY_INSTRUCTION_TYPE_FILL:
+        case CRUSTY_INSTRUCTION_TYPE_VADD:
+        case CRUSTY_INSTRUCTION_TYPE_VMUL:
+        case CRUSTY_INSTRUCTION_TYPE_VAND:
+        case CRUSTY_INSTRUCTION_TYPE_VOR:
+            bulk(cvm, inst);
+            break;
         default:
             cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
     }
@@ -5719,7 +9238,7 @@ int crustyvm_begin(CrustyVM *cvm, const char *procname) {
        even though this will never be used */
     cvm->ip = 0;
 
-    cvm->sp = cvm->initialstack;
+    cvm->sp = cvm->prog->initialstack;
     cvm->csp = 0;
     cvm->intresult = 0;
     cvm->floatresult = 0.0;
@@ -5731,21 +9250,421 @@ int crustyvm_begin(CrustyVM *cvm, const char *procname) {
         cvm->status = CRUSTY_STATUS_NO_PROC;
         return(-1);
     }
-    if(cvm->proc[procnum].args > 0) {
-        LOG_PRINTF(cvm, "Can't enter from procedure with arguments.\n");
-        cvm->status = CRUSTY_STATUS_NO_PROC;
-        return(-1);
+    if(cvm->prog->proc[procnum].args > 0) {
+        LOG_PRINTF(cvm, "Can't enter from procedure with arguments.\n");
+        cvm->status = CRUSTY_STATUS_NO_PROC;
+        return(-1);
+    }
+
+    if(call(cvm, procnum, 0)) {
+        LOG_PRINTF(cvm, "Failed to call procedure %s: %s\n", procname,
+                   crustyvm_statusstr(crustyvm_get_status(cvm)));
+        return(-1);
+    }
+
+    cvm->status = CRUSTY_STATUS_ACTIVE;
+
+    return(0);
+}
+
+unsigned long long crustyvm_get_hash(CrustyVM *cvm) {
+    /* FNV-1a */
+    unsigned long long hash = 14695981039346656037ULL;
+    unsigned int i, j;
+    int val[5];
+
+    for(i = 0; i < cvm->prog->insts; i++) {
+        for(j = 0; j < sizeof(int); j++) {
+            hash ^= (cvm->prog->inst[i] >> (j * 8)) & 0xFF;
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    for(i = 0; i < cvm->prog->vars; i++) {
+        val[0] = cvm->prog->var[i].type;
+        val[1] = cvm->prog->var[i].procIndex;
+        val[2] = cvm->prog->var[i].length;
+        /* callbacks have no memory so their offset is meaningless */
+        val[3] = variable_is_callback(&(cvm->prog->var[i])) ?
+                 -1 : (int)cvm->prog->var[i].offset;
+        val[4] = variable_is_callback(&(cvm->prog->var[i]));
+        for(j = 0; j < sizeof(val); j++) {
+            hash ^= ((unsigned char *)val)[j];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    for(i = 0; i < cvm->prog->procs; i++) {
+        for(j = 0; j < sizeof(unsigned int); j++) {
+            hash ^= (cvm->prog->proc[i].instruction >> (j * 8)) & 0xFF;
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    return(hash);
+}
+
+int crustyvm_set_native(CrustyVM *cvm, const CrustyNativeProgram *native) {
+    if(native->hash != crustyvm_get_hash(cvm) ||
+       native->procs != cvm->prog->procs) {
+        LOG_PRINTF(cvm, "Translated program doesn't match loaded program.\n");
+        return(-1);
+    }
+
+    cvm->native = native;
+
+    return(0);
+}
+
+static void native_run(CrustyVM *cvm) {
+    CrustyNativeContext ctx;
+    unsigned int low, high, mid;
+
+    while(cvm->status == CRUSTY_STATUS_ACTIVE && cvm->budget > 0) {
+        /* find the procedure the ip is in */
+        low = 0;
+        high = cvm->native->procs;
+        while(high - low > 1) {
+            mid = (low + high) / 2;
+            if(cvm->native->proc[mid].start > cvm->ip) {
+                high = mid;
+            } else {
+                low = mid;
+            }
+        }
+
+        ctx.stack = cvm->stack;
+        ctx.sp = cvm->sp;
+        ctx.intresult = cvm->intresult;
+        ctx.resulttype = cvm->resulttype;
+        ctx.budget = cvm->budget;
+        /* only where native code was entered is recorded */
+        RECORD(cvm, cvm->cstack[cvm->csp - 1].proc)
+        cvm->ip = cvm->native->proc[low].func(&ctx, cvm->ip);
+        cvm->intresult = ctx.intresult;
+        cvm->resulttype = ctx.resulttype;
+        cvm->budget = ctx.budget;
+
+        cvm->budget--;
+        crustyvm_step(cvm);
+    }
+}
+
+static void transpile_operand(FILE *out, NativeOperand *op) {
+    if(op->imm) {
+        /* -2147483648 would be parsed as a negated long */
+        if(op->val == INT_MIN) {
+            fprintf(out, "(-%d - 1)", INT_MAX);
+        } else {
+            fprintf(out, "%d", op->val);
+        }
+    } else {
+        fprintf(out, "%s(%c %c %d)",
+                     op->type == CRUSTY_TYPE_CHAR ? "CHR" : "INT",
+                     op->local ? 'l' : 'g',
+                     op->disp < 0 ? '-' : '+',
+                     op->disp < 0 ? -(op->disp) : op->disp);
+    }
+}
+
+/* returns 1 if the instruction is translated */
+static int transpile_instruction(CrustyVM *cvm,
+                                 FILE *out,
+                                 unsigned int ip,
+                                 unsigned int start,
+                                 unsigned int end,
+                                 int write) {
+    NativeOperand dest, src;
+    unsigned int target;
+    const char *op;
+
+    switch(cvm->prog->inst[ip]) {
+        case CRUSTY_INSTRUCTION_TYPE_MOVE:
+        case CRUSTY_INSTRUCTION_TYPE_ADD:
+        case CRUSTY_INSTRUCTION_TYPE_SUB:
+        case CRUSTY_INSTRUCTION_TYPE_MUL:
+        case CRUSTY_INSTRUCTION_TYPE_AND:
+        case CRUSTY_INSTRUCTION_TYPE_OR:
+        case CRUSTY_INSTRUCTION_TYPE_XOR:
+        case CRUSTY_INSTRUCTION_TYPE_SHR:
+        case CRUSTY_INSTRUCTION_TYPE_SHL:
+        case CRUSTY_INSTRUCTION_TYPE_CMP:
+            /* same rules as the JIT */
+            if(native_operand(cvm,
+                              cvm->prog->inst[ip + MOVE_DEST_FLAGS],
+                              cvm->prog->inst[ip + MOVE_DEST_VAL],
+                              cvm->prog->inst[ip + MOVE_DEST_INDEX],
+                              &dest) < 0 ||
+               native_operand(cvm,
+                              cvm->prog->inst[ip + MOVE_SRC_FLAGS],
+                              cvm->prog->inst[ip + MOVE_SRC_VAL],
+                              cvm->prog->inst[ip + MOVE_SRC_INDEX],
+                              &src) < 0 ||
+               dest.imm) {
+                return(0);
+            }
+            if(!write) {
+                return(1);
+            }
+
+            fprintf(out, "    ir = ");
+            if(cvm->prog->inst[ip] == CRUSTY_INSTRUCTION_TYPE_MOVE) {
+                transpile_operand(out, &src);
+                fprintf(out, ";\n    ");
+                transpile_operand(out, &dest);
+                fprintf(out, " = ir;\n");
+                return(1);
+            }
+
+            /* keep to what the interpreter does on x86, wrapping on overflow
+               and masking shift counts */
+            switch(cvm->prog->inst[ip]) {
+                case CRUSTY_INSTRUCTION_TYPE_ADD:
+                    op = "+";
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_MUL:
+                    op = "*";
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_AND:
+                    op = "&";
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_OR:
+                    op = "|";
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_XOR:
+                    op = "^";
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_SHR:
+                    op = ">>";
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_SHL:
+                    op = "<<";
+                    break;
+                default: /* SUB, CMP */
+                    op = "-";
+            }
+            if(cvm->prog->inst[ip] == CRUSTY_INSTRUCTION_TYPE_SHR) {
+                transpile_operand(out, &dest);
+                fprintf(out, " >> (");
+                transpile_operand(out, &src);
+                fprintf(out, " & 31)");
+            } else {
+                fprintf(out, "(int)((unsigned int)");
+                transpile_operand(out, &dest);
+                if(cvm->prog->inst[ip] == CRUSTY_INSTRUCTION_TYPE_SHL) {
+                    fprintf(out, " << (");
+                    transpile_operand(out, &src);
+                    fprintf(out, " & 31))");
+                } else {
+                    fprintf(out, " %s (unsigned int)", op);
+                    transpile_operand(out, &src);
+                    fprintf(out, ")");
+                }
+            }
+            fprintf(out, ";\n    rt = CRUSTY_TYPE_INT;\n");
+            if(cvm->prog->inst[ip] != CRUSTY_INSTRUCTION_TYPE_CMP) {
+                fprintf(out, "    ");
+                transpile_operand(out, &dest);
+                fprintf(out, " = ir;\n");
+            }
+            return(1);
+        case CRUSTY_INSTRUCTION_TYPE_JUMP:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPG:
+            target = cvm->prog->inst[ip + JUMP_LOCATION];
+            /* jump to self ends execution, so let the interpreter do that */
+            if(target == ip || target < start || target >= end) {
+                return(0);
+            }
+            if(!write) {
+                return(1);
+            }
+
+            /* loops are charged against the budget, once it runs out the
+               interpreter takes the jump and returns to the host */
+            if(target < ip) {
+                fprintf(out, "    if((ctx->budget -= %d) <= 0) {\n"
+                             "        ip = %u;\n"
+                             "        goto out;\n"
+                             "    }\n",
+                             loop_cost(cvm, target, ip), ip);
+            }
+
+            switch(cvm->prog->inst[ip]) {
+                case CRUSTY_INSTRUCTION_TYPE_JUMP:
+                    fprintf(out, "    goto i%u;\n", target);
+                    return(1);
+                case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+                    op = "!=";
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+                    op = "==";
+                    break;
+                case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+                    op = "<";
+                    break;
+                default: /* JUMPG */
+                    op = ">";
+            }
+            /* float results go to the interpreter */
+            fprintf(out, "    if(rt != CRUSTY_TYPE_INT) {\n"
+                         "        ip = %u;\n"
+                         "        goto out;\n"
+                         "    }\n"
+                         "    if(ir %s 0) {\n"
+                         "        goto i%u;\n"
+                         "    }\n",
+                         ip, op, target);
+            return(1);
+        default:
+            return(0);
+    }
+}
+
+int crustyvm_transpile(CrustyVM *cvm, FILE *out) {
+    unsigned int i, j;
+    unsigned int start, end;
+    unsigned int next;
+    unsigned int native = 0;
+    unsigned int count = 0;
+    unsigned char *label;
+    int result = -1;
+    const char *temp = cvm->stage;
+
+    cvm->stage = "translate";
+
+    /* 1 if the instruction may be entered from the interpreter, 2 if it's
+       only jumped to from within the translation */
+    label = malloc(cvm->prog->insts);
+    if(label == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for labels.\n");
+        cvm->stage = temp;
+        return(-1);
+    }
+    memset(label, 0, cvm->prog->insts);
+
+    fprintf(out, "/* translated by crustyvm, don't edit. */\n\n"
+                 "#include <stdio.h>\n\n"
+                 "#include \"crustyvm.h\"\n\n"
+                 "#define INT(PTR) (*(int *)(PTR))\n"
+                 "#define CHR(PTR) (*(unsigned char *)(PTR))\n");
+
+    for(i = 0; i < cvm->prog->procs; i++) {
+        start = cvm->prog->proc[i].instruction;
+        end = i + 1 < cvm->prog->procs ? cvm->prog->proc[i + 1].instruction : cvm->prog->insts;
+
+        /* find every place which could be jumped to or resumed at */
+        label[start] = 1;
+        for(j = start; j < end; j += instruction_size(cvm, j)) {
+            next = j + instruction_size(cvm, j);
+            if(transpile_instruction(cvm, out, j, start, end, 0)) {
+                native++;
+                if(cvm->prog->inst[j] >= CRUSTY_INSTRUCTION_TYPE_JUMP &&
+                   cvm->prog->inst[j] <= CRUSTY_INSTRUCTION_TYPE_JUMPG) {
+                    if(label[cvm->prog->inst[j + JUMP_LOCATION]] == 0) {
+                        label[cvm->prog->inst[j + JUMP_LOCATION]] = 2;
+                    }
+                    /* conditional jumps on float results and loops which ran
+                       out of budget are run by the interpreter, which may
+                       then continue at either */
+                    if(cvm->prog->inst[j] != CRUSTY_INSTRUCTION_TYPE_JUMP ||
+                       (unsigned int)cvm->prog->inst[j + JUMP_LOCATION] < j) {
+                        label[cvm->prog->inst[j + JUMP_LOCATION]] = 1;
+                        if(next < end) {
+                            label[next] = 1;
+                        }
+                    }
+                }
+            } else if(next < end) {
+                label[next] = 1;
+            }
+            count++;
+        }
+
+        fprintf(out, "\n/* %s */\n"
+                     "static unsigned int proc_%u(CrustyNativeContext *ctx,"
+                     " unsigned int ip) {\n"
+                     "    unsigned char *g = ctx->stack;\n"
+                     "    unsigned char *l = ctx->stack + ctx->sp;\n"
+                     "    int ir = ctx->intresult;\n"
+                     "    CrustyType rt = ctx->resulttype;\n\n"
+                     "    (void)g;\n"
+                     "    (void)l;\n\n"
+                     "    switch(ip) {\n",
+                     cvm->prog->proc[i].name, i);
+        for(j = start; j < end; j++) {
+            if(label[j] == 1) {
+                fprintf(out, "        case %u: goto i%u;\n", j, j);
+            }
+        }
+        fprintf(out, "        default: goto out;\n"
+                     "    }\n\n");
+
+        for(j = start; j < end; j += instruction_size(cvm, j)) {
+            if(label[j] != 0) {
+                fprintf(out, "i%u:\n", j);
+            }
+            if(!transpile_instruction(cvm, out, j, start, end, 1)) {
+                fprintf(out, "    ip = %u;\n"
+                             "    goto out;\n", j);
+            }
+        }
+
+        fprintf(out, "out:\n"
+                     "    ctx->intresult = ir;\n"
+                     "    ctx->resulttype = rt;\n"
+                     "    return(ip);\n"
+                     "}\n");
+    }
+
+    fprintf(out, "\nstatic const CrustyNativeProc procs[] = {\n");
+    for(i = 0; i < cvm->prog->procs; i++) {
+        fprintf(out, "    {%u, %u, proc_%u}%s\n",
+                     cvm->prog->proc[i].instruction,
+                     i + 1 < cvm->prog->procs ? cvm->prog->proc[i + 1].instruction :
+                                          cvm->prog->insts,
+                     i,
+                     i + 1 < cvm->prog->procs ? "," : "");
+    }
+    fprintf(out, "};\n\n"
+                 "const CrustyNativeProgram crustyvm_native_program = {\n"
+                 "    0x%016llXULL,\n"
+                 "    %u,\n"
+                 "    procs\n"
+                 "};\n",
+                 crustyvm_get_hash(cvm), cvm->prog->procs);
+
+    if(ferror(out)) {
+        LOG_PRINTF(cvm, "Failed to write translation.\n");
+        goto cleanup;
+    }
+
+    LOG_PRINTF(cvm, "%u of %u instructions translated.\n", native, count);
+    result = 0;
+
+cleanup:
+    free(label);
+    cvm->stage = temp;
+
+    return(result);
+}
+
+/* run until the program is done or the budget runs out */
+static void run_budget(CrustyVM *cvm) {
+    if(cvm->native != NULL) {
+        native_run(cvm);
+    }
+#ifdef CRUSTY_JIT
+    else if(cvm->prog->jitmem != NULL) {
+        jit_run(cvm);
     }
+#endif
 
-    if(call(cvm, procnum, 0)) {
-        LOG_PRINTF(cvm, "Failed to call procedure %s: %s\n", procname,
-                   crustyvm_statusstr(crustyvm_get_status(cvm)));
-        return(-1);
+    while(cvm->budget > 0 && crustyvm_step(cvm) == CRUSTY_STATUS_ACTIVE) {
+        cvm->budget--;
     }
-
-    cvm->status = CRUSTY_STATUS_ACTIVE;
-
-    return(0);
 }
 
 int crustyvm_run(CrustyVM *cvm, const char *procname) {
@@ -5758,23 +9677,90 @@ int crustyvm_run(CrustyVM *cvm, const char *procname) {
     LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    while(crustyvm_step(cvm) == CRUSTY_STATUS_ACTIVE);
+    /* yields are ignored */
+    while(cvm->status == CRUSTY_STATUS_ACTIVE) {
+        cvm->budget = INT_MAX;
+        run_budget(cvm);
+    }
 
     if(cvm->status != CRUSTY_STATUS_READY) {
         LOG_PRINTF(cvm, "Execution stopped with error: %s\n",
                    crustyvm_statusstr(crustyvm_get_status(cvm)));
+        if(cvm->record != NULL) {
+            crustyvm_record_dump(cvm);
+        }
         return(-1);
     }
 
     return(0);
 }
 
+CrustyStatus crustyvm_resume(CrustyVM *cvm,
+                             unsigned int insts,
+                             unsigned int usecs) {
+    struct timespec start, now;
+    unsigned int left = insts;
+    unsigned int ran;
+    int slice;
+
+    if(cvm->status != CRUSTY_STATUS_ACTIVE) {
+        LOG_PRINTF(cvm, "Nothing to resume.\n");
+        return(cvm->status);
+    }
+
+    cvm->stage = "running";
+    cvm->yielded = 0;
+    if(usecs > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    while(cvm->status == CRUSTY_STATUS_ACTIVE) {
+        slice = RESUME_SLICE;
+        if(insts > 0 && left < RESUME_SLICE) {
+            slice = left;
+        }
+        cvm->budget = slice;
+        run_budget(cvm);
+
+        if(cvm->yielded) {
+            break;
+        }
+
+        if(insts > 0) {
+            ran = slice - cvm->budget;
+            if(ran >= left) {
+                break;
+            }
+            left -= ran;
+        }
+
+        if(usecs > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if((now.tv_sec - start.tv_sec) * 1000000LL +
+               (now.tv_nsec - start.tv_nsec) / 1000 >= (long long)usecs) {
+                break;
+            }
+        }
+    }
+
+    if(cvm->status != CRUSTY_STATUS_READY &&
+       cvm->status != CRUSTY_STATUS_ACTIVE) {
+        LOG_PRINTF(cvm, "Execution stopped with error: %s\n",
+                   crustyvm_statusstr(crustyvm_get_status(cvm)));
+        if(cvm->record != NULL) {
+            crustyvm_record_dump(cvm);
+        }
+    }
+
+    return(cvm->status);
+}
+
 static CrustyLine *inst_to_line(CrustyVM *cvm, unsigned int inst) {
     unsigned int i;
 
-    for(i = 0; i < cvm->lines; i++) {
-        if(cvm->line[i].instruction == inst) {
-            return(&(cvm->line[i]));
+    for(i = 0; i < cvm->prog->lines; i++) {
+        if(cvm->prog->line[i].instruction == inst) {
+            return(&(cvm->prog->line[i]));
         }
     }
 
@@ -5806,7 +9792,7 @@ void crustyvm_debugtrace(CrustyVM *cvm, int full) {
     ip = cvm->ip;
 
     while(csp > 0) {
-        proc = &(cvm->proc[cvm->cstack[csp - 1].proc]);
+        proc = &(cvm->prog->proc[cvm->cstack[csp - 1].proc]);
         LOG_PRINTF(cvm, "%u: %s@", csp, proc->name);
         line = inst_to_line(cvm, ip);
         if(line == NULL) {
@@ -5819,6 +9805,10 @@ void crustyvm_debugtrace(CrustyVM *cvm, int full) {
                                  csp == startcsp ?
                                  line->line :
                                  line->line - 1);
+            if(line->inlined >= 0) {
+                LOG_PRINTF_BARE(cvm, " (inlined %s)",
+                                     cvm->prog->proc[line->inlined].name);
+            }
         }
         for(i = 0; i < proc->args; i++) {
             LOG_PRINTF_BARE(cvm, " %s", proc->var[i]->name);
@@ -5835,10 +9825,10 @@ void crustyvm_debugtrace(CrustyVM *cvm, int full) {
                     LOG_PRINTF(cvm, " %u: %s -> %s.%s@%u[%u]:%u\n",
                                i,
                                proc->var[i]->name,
-                               cvm->var[val].proc == NULL ? "Global" : cvm->var[val].proc->name,
-                               cvm->var[val].name,
+                               cvm->prog->var[val].proc == NULL ? "Global" : cvm->prog->var[val].proc->name,
+                               cvm->prog->var[val].name,
                                ptr,
-                               cvm->var[val].length,
+                               cvm->prog->var[val].length,
                                index);
                     break;
                 case MOVE_FLAG_IMMEDIATE:
@@ -5896,43 +9886,43 @@ void crustyvm_debugtrace(CrustyVM *cvm, int full) {
         csp--;
     }
     LOG_PRINTF(cvm, "Global:\n");
-    for(i = 0; i < cvm->vars; i++) {
-        if(variable_is_global(&(cvm->var[i]))) {
-            if(variable_is_callback(&(cvm->var[i]))) {
+    for(i = 0; i < cvm->prog->vars; i++) {
+        if(variable_is_global(&(cvm->prog->var[i]))) {
+            if(variable_is_callback(&(cvm->prog->var[i]))) {
                 LOG_PRINTF(cvm, " %u: %s[%u] CB\n",
                            i,
-                           cvm->var[i].name,
-                           cvm->var[i].length);
+                           cvm->prog->var[i].name,
+                           cvm->prog->var[i].length);
             } else {
                 LOG_PRINTF(cvm, " %u: %s@%u[%u]",
                            i,
-                           cvm->var[i].name,
-                           cvm->var[i].offset,
-                           cvm->var[i].length);
+                           cvm->prog->var[i].name,
+                           cvm->prog->var[i].offset,
+                           cvm->prog->var[i].length);
                 if(full) {
-                    if(cvm->var[i].type == CRUSTY_TYPE_INT) {
+                    if(cvm->prog->var[i].type == CRUSTY_TYPE_INT) {
                         for(j = 0;
-                            j < cvm->var[i].length && j < DEBUG_MAX_PRINT;
+                            j < cvm->prog->var[i].length && j < DEBUG_MAX_PRINT;
                             j++) {
                             LOG_PRINTF_BARE(cvm, " %d",
-                                *((int *)(&(cvm->stack[cvm->var[i].offset +
+                                *((int *)(&(cvm->stack[cvm->prog->var[i].offset +
                                                        (j * sizeof(int))]))));
                         }
-                    } else if(cvm->var[i].type == CRUSTY_TYPE_FLOAT) {
+                    } else if(cvm->prog->var[i].type == CRUSTY_TYPE_FLOAT) {
                         for(j = 0;
-                            j < cvm->var[i].length && j < DEBUG_MAX_PRINT;
+                            j < cvm->prog->var[i].length && j < DEBUG_MAX_PRINT;
                             j++) {
                             LOG_PRINTF_BARE(cvm, " %g",
-                                *((int *)(&(cvm->stack[cvm->var[i].offset +
+                                *((int *)(&(cvm->stack[cvm->prog->var[i].offset +
                                                        (j * sizeof(double))]))));
                         }
                     } else { /* CHAR */
                         LOG_PRINTF_BARE(cvm, " \"");
                         for(j = 0;
-                            j < cvm->var[i].length && j < DEBUG_MAX_PRINT;
+                            j < cvm->prog->var[i].length && j < DEBUG_MAX_PRINT;
                             j++) {
                             LOG_PRINTF_BARE(cvm, "%c",
-                                *((int *)(&(cvm->stack[cvm->var[i].offset + j]))));
+                                *((int *)(&(cvm->stack[cvm->prog->var[i].offset + j]))));
                         }
                         LOG_PRINTF_BARE(cvm, "\"");
                     }
@@ -5945,6 +9935,87 @@ void crustyvm_debugtrace(CrustyVM *cvm, int full) {
     cvm->stage = temp;
 }
 
+int crustyvm_record(CrustyVM *cvm, unsigned int entries) {
+    CrustyRecord *record;
+    unsigned int size;
+    unsigned int i;
+
+    if(cvm->record != NULL) {
+        free(cvm->record);
+        cvm->record = NULL;
+    }
+    cvm->recordmask = 0;
+    cvm->recordpos = 0;
+
+    if(entries == 0) {
+        return(0);
+    }
+
+    /* a power of 2 so wrapping around is just a mask */
+    for(size = 1; size < entries; size *= 2) {
+        if(size > UINT_MAX / 2 / sizeof(CrustyRecord)) {
+            LOG_PRINTF(cvm, "Too many flight recorder entries.\n");
+            return(-1);
+        }
+    }
+
+    record = malloc(sizeof(CrustyRecord) * size);
+    if(record == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for flight recorder.\n");
+        return(-1);
+    }
+    for(i = 0; i < size; i++) {
+        record[i].ip = RECORD_EMPTY;
+    }
+
+    cvm->record = record;
+    cvm->recordmask = size - 1;
+
+    return(0);
+}
+
+void crustyvm_record_dump(CrustyVM *cvm) {
+    unsigned int i;
+    CrustyRecord *record;
+    CrustyLine *line;
+    const char *temp;
+
+    temp = cvm->stage;
+    cvm->stage = "flight recorder";
+
+    if(cvm->record == NULL) {
+        LOG_PRINTF(cvm, "Not recording.\n");
+        cvm->stage = temp;
+        return;
+    }
+
+    LOG_PRINTF(cvm, "Oldest first:\n");
+    for(i = 0; i <= cvm->recordmask; i++) {
+        record = &(cvm->record[(cvm->recordpos + i) & cvm->recordmask]);
+        if(record->ip == RECORD_EMPTY) {
+            continue;
+        }
+
+        line = inst_to_line(cvm, record->ip);
+        if(line == NULL) {
+            LOG_PRINTF(cvm, "%u", record->ip);
+        } else {
+            LOG_PRINTF(cvm, "%s:%u",
+                            TOKENVAL(line->moduleOffset),
+                            line->line);
+        }
+        if(record->proc < 0) {
+            LOG_PRINTF_BARE(cvm, " -> %s\n",
+                                 cvm->prog->var[RECORD_CALLBACK(record->proc)].name);
+        } else {
+            LOG_PRINTF_BARE(cvm, " %s\n",
+                                 cvm->prog->proc[record->proc].name);
+        }
+    }
+
+    cvm->stage = temp;
+}
+
 int crustyvm_has_entrypoint(CrustyVM *cvm, const char *name) {
     int procnum;
 
@@ -5953,7 +10024,7 @@ int crustyvm_has_entrypoint(CrustyVM *cvm, const char *name) {
         return(0);
     }
 
-    if(cvm->proc[procnum].args > 0) {
+    if(cvm->prog->proc[procnum].args > 0) {
         return(0);
     }
 
@@ -5961,11 +10032,398 @@ int crustyvm_has_entrypoint(CrustyVM *cvm, const char *name) {
 }
 
 unsigned int crustyvm_get_tokenmem(CrustyVM *cvm) {
-    return(cvm->tokenmemlen);
+    return(cvm->prog->tokenmemlen);
 }
 
 unsigned int crustyvm_get_stackmem(CrustyVM *cvm) {
-    return(cvm->stacksize);
+    return(cvm->prog->stacksize);
+}
+
+unsigned int crustyvm_get_instmem(CrustyVM *cvm) {
+    return(sizeof(int) * cvm->prog->insts);
+}
+
+unsigned int crustyvm_get_procs(CrustyVM *cvm) {
+    return(cvm->prog->procs);
+}
+
+const char *crustyvm_get_procname(CrustyVM *cvm, unsigned int proc) {
+    if(proc >= cvm->prog->procs) {
+        return(NULL);
+    }
+
+    return(cvm->prog->proc[proc].name);
+}
+
+unsigned int crustyvm_get_framemem(CrustyVM *cvm, unsigned int proc) {
+    if(proc >= cvm->prog->procs) {
+        return(0);
+    }
+
+    return(cvm->prog->proc[proc].stackneeded);
+}
+
+unsigned int crustyvm_get_includes(CrustyVM *cvm) {
+    return(cvm->prog->includes);
+}
+
+const char *crustyvm_get_include(CrustyVM *cvm, unsigned int include) {
+    if(include >= cvm->prog->includes) {
+        return(NULL);
+    }
+
+    return(TOKENVAL(cvm->prog->include[include]));
+}
+
+int crustyvm_span_new(CrustyVM *cvm,
+                      CrustySpan *span,
+                      CrustyType type,
+                      unsigned int count,
+                      void *ptr) {
+    unsigned char *start = ptr;
+    unsigned int offset;
+    unsigned int base;
+    unsigned int i;
+
+    span->ptr = NULL;
+
+    /* immediates and callback results are held outside of VM memory and won't
+     * be around after the callback returns */
+    if(start < cvm->stack ||
+       start + (count * type_size(type)) > &(cvm->stack[cvm->sp])) {
+        return(-1);
+    }
+    offset = start - cvm->stack;
+
+    span->type = type;
+    span->count = count;
+    if(offset < cvm->prog->initialstack) {
+        span->depth = 0;
+        span->generation = 0;
+        span->ptr = ptr;
+        return(0);
+    }
+
+    /* find which procedure's memory it's in, walking down from the top */
+    base = cvm->sp;
+    for(i = cvm->csp; i > 0; i--) {
+        base -= cvm->prog->proc[cvm->cstack[i - 1].proc].stackneeded;
+        if(offset >= base) {
+            span->depth = i - 1;
+            span->generation = cvm->cstack[i - 1].generation;
+            span->ptr = ptr;
+            return(0);
+        }
+    }
+
+    return(-1);
+}
+
+void *crustyvm_span_get(CrustyVM *cvm,
+                        const CrustySpan *span,
+                        CrustyType type,
+                        unsigned int *count) {
+    if(span->ptr == NULL) {
+        return(NULL);
+    }
+
+    /* the procedure the memory belonged to has since returned */
+    if(span->generation != 0 &&
+       (span->depth >= cvm->csp ||
+        cvm->cstack[span->depth].generation != span->generation)) {
+        return(NULL);
+    }
+
+    if(type == CRUSTY_TYPE_NONE) {
+        *count = span->count * type_size(span->type);
+    } else if(type == span->type) {
+        *count = span->count;
+    } else {
+        return(NULL);
+    }
+
+    return(span->ptr);
+}
+
+int crustyvm_migrate(CrustyVM *cvm, CrustyVM *from) {
+    CrustyVariable *src, *dst;
+    unsigned int i;
+    unsigned int len;
+    int var;
+    int count = 0;
+
+    for(i = 0; i < from->prog->vars; i++) {
+        src = &(from->prog->var[i]);
+        if(!variable_is_global(src) || variable_is_callback(src)) {
+            continue;
+        }
+
+        var = find_variable(cvm, NULL, src->name);
+        if(var < 0) {
+            continue;
+        }
+        dst = &(cvm->prog->var[var]);
+        if(variable_is_callback(dst) || dst->type != src->type) {
+            continue;
+        }
+
+        len = src->length;
+        if(dst->length < len) {
+            len = dst->length;
+        }
+        len *= type_size(src->type);
+
+        /* an initializer which was changed is probably wanted */
+        if(memcmp(&(cvm->prog->initializer[dst->offset]),
+                  &(from->prog->initializer[src->offset]),
+                  len) != 0) {
+            continue;
+        }
+
+        memcpy(&(cvm->stack[dst->offset]), &(from->stack[src->offset]), len);
+        count++;
+    }
+
+    return(count);
+}
+
+CrustySnapshot *crustyvm_snapshot_new(CrustyVM *cvm, unsigned int count) {
+    CrustySnapshot *snap;
+    unsigned int i;
+
+    if(count == 0) {
+        LOG_PRINTF(cvm, "A snapshot ring must hold at least 1 snapshot.\n");
+        return(NULL);
+    }
+
+    snap = malloc(sizeof(CrustySnapshot));
+    if(snap == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for snapshots.\n");
+        return(NULL);
+    }
+    snap->prog = cvm->prog;
+    snap->callstacksize = cvm->callstacksize;
+    snap->entries = count;
+    snap->first = 0;
+    snap->count = 0;
+    snap->entry = NULL;
+
+    pthread_mutex_lock(&(cvm->prog->lock));
+    cvm->prog->refs++;
+    pthread_mutex_unlock(&(cvm->prog->lock));
+
+    snap->stack = malloc(cvm->prog->stacksize);
+    if(snap->stack == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for snapshots.\n");
+        goto error;
+    }
+
+    snap->entry = malloc(sizeof(CrustySnapshotEntry) * count);
+    if(snap->entry == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for snapshots.\n");
+        goto error;
+    }
+    for(i = 0; i < count; i++) {
+        snap->entry[i].cstack = NULL;
+        snap->entry[i].page = NULL;
+        snap->entry[i].pagemem = NULL;
+        snap->entry[i].pages = 0;
+        snap->entry[i].pagessize = 0;
+    }
+    for(i = 0; i < count; i++) {
+        snap->entry[i].cstack =
+            malloc(sizeof(CrustyCallStackArg) * cvm->callstacksize);
+        if(snap->entry[i].cstack == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for snapshots.\n");
+            goto error;
+        }
+    }
+
+    return(snap);
+
+error:
+    crustyvm_snapshot_free(snap);
+
+    return(NULL);
+}
+
+void crustyvm_snapshot_free(CrustySnapshot *snap) {
+    unsigned int i;
+
+    if(snap->entry != NULL) {
+        for(i = 0; i < snap->entries; i++) {
+            if(snap->entry[i].cstack != NULL) {
+                free(snap->entry[i].cstack);
+            }
+            if(snap->entry[i].page != NULL) {
+                free(snap->entry[i].page);
+            }
+            if(snap->entry[i].pagemem != NULL) {
+                free(snap->entry[i].pagemem);
+            }
+        }
+        free(snap->entry);
+    }
+
+    if(snap->stack != NULL) {
+        free(snap->stack);
+    }
+
+    release_program(snap->prog);
+    free(snap);
+}
+
+static unsigned int snapshot_page_len(CrustySnapshot *snap,
+                                      unsigned int page) {
+    if(page + SNAPSHOT_PAGE_SIZE > snap->prog->stacksize) {
+        return(snap->prog->stacksize - page);
+    }
+
+    return(SNAPSHOT_PAGE_SIZE);
+}
+
+/* keep a page of memory from the newest snapshot before it's overwritten */
+static int keep_page(CrustySnapshot *snap,
+                     CrustySnapshotEntry *entry,
+                     unsigned int page) {
+    unsigned int *temp;
+    unsigned char *tempmem;
+    unsigned int newsize;
+
+    if(entry->pages == entry->pagessize) {
+        if(entry->pagessize == 0) {
+            newsize = SNAPSHOT_PAGES_INITIAL_SIZE;
+        } else {
+            newsize = entry->pagessize * 2;
+        }
+
+        temp = realloc(entry->page, sizeof(unsigned int) * newsize);
+        if(temp == NULL) {
+            return(-1);
+        }
+        entry->page = temp;
+
+        tempmem = realloc(entry->pagemem, SNAPSHOT_PAGE_SIZE * newsize);
+        if(tempmem == NULL) {
+            return(-1);
+        }
+        entry->pagemem = tempmem;
+
+        entry->pagessize = newsize;
+    }
+
+    entry->page[entry->pages] = page;
+    memcpy(&(entry->pagemem[entry->pages * SNAPSHOT_PAGE_SIZE]),
+           &(snap->stack[page]),
+           snapshot_page_len(snap, page));
+    entry->pages++;
+
+    return(0);
+}
+
+/* put back pages kept by an entry, so memory is as it was at that snapshot */
+static void restore_pages(CrustySnapshot *snap, CrustySnapshotEntry *entry) {
+    unsigned int i;
+
+    for(i = 0; i < entry->pages; i++) {
+        memcpy(&(snap->stack[entry->page[i]]),
+               &(entry->pagemem[i * SNAPSHOT_PAGE_SIZE]),
+               snapshot_page_len(snap, entry->page[i]));
+    }
+    entry->pages = 0;
+}
+
+int crustyvm_snapshot(CrustyVM *cvm, CrustySnapshot *snap) {
+    CrustySnapshotEntry *entry;
+    unsigned int i;
+    unsigned int len;
+
+    if(snap->prog != cvm->prog || snap->callstacksize != cvm->callstacksize) {
+        LOG_PRINTF(cvm, "Snapshots weren't made from this program.\n");
+        return(-1);
+    }
+
+    /* make room */
+    if(snap->count == snap->entries) {
+        SNAPSHOT_ENTRY(snap, 0)->pages = 0;
+        snap->first = (snap->first + 1) % snap->entries;
+        snap->count--;
+    }
+
+    if(snap->count == 0) {
+        memcpy(snap->stack, cvm->stack, cvm->prog->stacksize);
+    } else {
+        /* the previous snapshot only needs to keep what is about to change */
+        entry = SNAPSHOT_ENTRY(snap, snap->count - 1);
+        for(i = 0; i < cvm->prog->stacksize; i += SNAPSHOT_PAGE_SIZE) {
+            len = snapshot_page_len(snap, i);
+            if(memcmp(&(snap->stack[i]), &(cvm->stack[i]), len) == 0) {
+                continue;
+            }
+
+            if(keep_page(snap, entry, i) < 0) {
+                LOG_PRINTF(cvm, "Failed to allocate memory for snapshot.\n");
+                /* leave the previous snapshot as it was */
+                restore_pages(snap, entry);
+                return(-1);
+            }
+            memcpy(&(snap->stack[i]), &(cvm->stack[i]), len);
+        }
+    }
+
+    entry = SNAPSHOT_ENTRY(snap, snap->count);
+    entry->sp = cvm->sp;
+    entry->csp = cvm->csp;
+    entry->ip = cvm->ip;
+    entry->resulttype = cvm->resulttype;
+    entry->floatresult = cvm->floatresult;
+    entry->intresult = cvm->intresult;
+    entry->status = cvm->status;
+    memcpy(entry->cstack, cvm->cstack, sizeof(CrustyCallStackArg) * cvm->csp);
+    entry->pages = 0;
+    snap->count++;
+
+    return(0);
+}
+
+int crustyvm_restore(CrustyVM *cvm, CrustySnapshot *snap, unsigned int back) {
+    CrustySnapshotEntry *entry;
+
+    if(snap->prog != cvm->prog || snap->callstacksize != cvm->callstacksize) {
+        LOG_PRINTF(cvm, "Snapshots weren't made from this program.\n");
+        return(-1);
+    }
+
+    if(back >= snap->count) {
+        LOG_PRINTF(cvm, "Can't go back %u snapshots, only %u are held.\n",
+                   back, snap->count);
+        return(-1);
+    }
+
+    /* walk memory back from the newest snapshot, dropping newer ones */
+    for(; back > 0; back--) {
+        restore_pages(snap, SNAPSHOT_ENTRY(snap, snap->count - 2));
+        snap->count--;
+    }
+    memcpy(cvm->stack, snap->stack, cvm->prog->stacksize);
+
+    entry = SNAPSHOT_ENTRY(snap, snap->count - 1);
+    cvm->sp = entry->sp;
+    cvm->csp = entry->csp;
+    cvm->ip = entry->ip;
+    cvm->resulttype = entry->resulttype;
+    cvm->floatresult = entry->floatresult;
+    cvm->intresult = entry->intresult;
+    cvm->status = entry->status;
+    memcpy(cvm->cstack, entry->cstack, sizeof(CrustyCallStackArg) * cvm->csp);
+    /* generation keeps counting up, so spans made after the snapshot won't be
+       mistaken for ones made by calls after restoring it */
+
+    return(0);
+}
+
+unsigned int crustyvm_snapshot_count(CrustySnapshot *snap) {
+    return(snap->count);
 }
 
 #ifdef CRUSTY_TEST
@@ -6217,8 +10675,14 @@ int main(int argc, char **argv) {
     CLEAN_ARGS
     fprintf(stderr, "Program loaded.\n");
 
-    fprintf(stderr, "Token memory size: %u\n", cvm->tokenmemlen);
-    fprintf(stderr, "Stack size: %u\n", cvm->stacksize);
+    fprintf(stderr, "Token memory size: %u\n", cvm->prog->tokenmemlen);
+    fprintf(stderr, "Stack size: %u\n", cvm->prog->stacksize);
+    fprintf(stderr, "Code size: %u\n", crustyvm_get_instmem(cvm));
+    for(i = 0; i < crustyvm_get_procs(cvm); i++) {
+        fprintf(stderr, "Frame size: %s %u\n",
+                        crustyvm_get_procname(cvm, i),
+                        crustyvm_get_framemem(cvm, i));
+    }
 
     result = crustyvm_run(cvm, "init");
     fprintf(stderr, "\n");
@@ -25,6 +25,14 @@
 #define CRUSTY_FLAG_OUTPUT_PASSES (1<<0)
 #endif
 #define CRUSTY_FLAG_TRACE (1<<1)
+#define CRUSTY_FLAG_JIT (1<<2)
+#define CRUSTY_FLAG_OPTIMIZE (1<<3)
+
+/* the native code generator only knows x86-64 System V, elsewhere the flag is
+ * accepted but everything runs through the interpreter */
+#if defined(__x86_64__) && defined(__linux__)
+#define CRUSTY_JIT
+#endif
 
 typedef enum {
     CRUSTY_STATUS_READY = 0,
@@ -68,6 +76,53 @@ typedef struct {
 } CrustyCallback;
 
 typedef struct CrustyVM_s CrustyVM;
+typedef struct CrustySnapshot_s CrustySnapshot;
+
+/* interface between the VM and a program translated to C by
+ * crustyvm_transpile() */
+typedef struct {
+    unsigned char *stack;
+    unsigned int sp;
+    int intresult;
+    CrustyType resulttype;
+    int budget; /* charged for each loop, return when it runs out */
+} CrustyNativeContext;
+
+/* run from ip until an instruction the translation doesn't handle, which is
+ * returned to be run by the interpreter */
+typedef unsigned int (*crusty_native_func_t)(CrustyNativeContext *ctx,
+                                             unsigned int ip);
+
+typedef struct {
+    unsigned int start;
+    unsigned int end;
+    crusty_native_func_t func;
+} CrustyNativeProc;
+
+typedef struct {
+    unsigned long long hash;
+    unsigned int procs;
+    const CrustyNativeProc *proc;
+} CrustyNativeProgram;
+
+/*
+ * A typed view of VM memory, made from an array passed to a write callback,
+ * which may be held on to and used by later callbacks.
+ *
+ * ptr          Start of the memory.
+ * type         Type of each element.
+ * count        Number of elements.
+ * generation   Identifies the procedure call the memory belongs to, or 0 for
+ *              global memory.
+ * depth        Depth in the call stack of that procedure call.
+ */
+typedef struct {
+    void *ptr;
+    CrustyType type;
+    unsigned int count;
+    unsigned int generation;
+    unsigned int depth;
+} CrustySpan;
 
 /*
  * Convenience function to open a file and set/check safepath.
@@ -96,6 +151,15 @@ FILE *crustyvm_open_file(const char *filename,
  *                  happen:
  *                  CRUSTY_FLAG_OUTPUT_PASSES - Output each pass to file to help
  *                                              in debugging and development.
+ *                  CRUSTY_FLAG_TRACE - Verify each instruction before it's
+ *                                      run.
+ *                  CRUSTY_FLAG_JIT - Translate the program to native code
+ *                                    after verification.  Ignored where
+ *                                    unsupported or when tracing.
+ *                  CRUSTY_FLAG_OPTIMIZE - Optimize the program after
+ *                                         verification, inlining small
+ *                                         procedures and reporting how much
+ *                                         each procedure shrank.
  * callstacksize    Specify the callstack size.  This isn't the memory size but
  *                  the depth of procedures which could be called.
  * cb               Array of callbacks described by struct CrustyCallback.
@@ -143,7 +207,39 @@ CrustyVM *crustyvm_new(const char *name,
                        void (*log_cb)(void *priv, const char *fmt, ...),
                        void *log_priv);
 /*
- * Free memory allocated by cvm.
+ * Make another VM for the program loaded in to cvm.  The loaded program is
+ * shared, and only memory and the call stack are allocated for the new VM, so
+ * it's much cheaper than loading the program again.  Different VMs may be run
+ * on different threads at the same time.
+ *
+ * cvm      CrustyVM to make another of.
+ * cb       Callbacks to use in place of ones cvm was made with, matched by
+ *          name.  They must have the same length, read type and non-NULL
+ *          read and write functions as the originals.  NULL to use the same
+ *          callbacks as cvm.
+ * cbcount  Number of callbacks in the array.
+ * returns  The new CrustyVM, or NULL on failure.
+ */
+CrustyVM *crustyvm_instance(CrustyVM *cvm,
+                            const CrustyCallback *cb,
+                            unsigned int cbcount);
+
+/*
+ * Copy the values of global variables from a VM running an older version of a
+ * program, so a program may be reloaded without losing its state.  Variables
+ * are matched by name and must be of the same type, arrays which changed
+ * length have as much copied as fits.  Variables whose initializers were
+ * changed in the new version are left as they were initialized.
+ *
+ * cvm      CrustyVM to copy values in to, usually freshly loaded.
+ * from     CrustyVM to copy values from.
+ * returns  The number of variables copied.
+ */
+int crustyvm_migrate(CrustyVM *cvm, CrustyVM *from);
+
+/*
+ * Free memory allocated by cvm.  The program is freed along with the last VM
+ * using it.
  *
  * cvm  CrustyVM to free memory from.
  */
@@ -175,7 +271,7 @@ int crustyvm_begin(CrustyVM *cvm, const char *procname);
 CrustyStatus crustyvm_step(CrustyVM *cvm);
 
 /*
- * Run a procedure until it is done or there is an error.
+ * Run a procedure until it is done or there is an error.  yield does nothing.
  *
  * cvm      CrustyVM to run.
  * procname Procedure to run.
@@ -183,6 +279,22 @@ CrustyStatus crustyvm_step(CrustyVM *cvm);
  */
 int crustyvm_run(CrustyVM *cvm, const char *procname);
 
+/*
+ * Continue running a procedure started with crustyvm_begin() until it's done,
+ * it yields or it has run for long enough, so long work can be spread out.
+ * Translated code only checks when going back around a loop, so it may run a
+ * little over.  Nothing else may be begun until the procedure is done.
+ *
+ * cvm      CrustyVM to run.
+ * insts    Most instructions to run, 0 for no limit.
+ * usecs    Most microseconds to run for, 0 for no limit.
+ * returns  CRUSTY_STATUS_ACTIVE if there's more to do, CRUSTY_STATUS_READY
+ *          once the procedure is done or the error status on failure.
+ */
+CrustyStatus crustyvm_resume(CrustyVM *cvm,
+                             unsigned int insts,
+                             unsigned int usecs);
+
 /*
  * Get status of CrustyVM.
  *
@@ -207,6 +319,25 @@ const char *crustyvm_statusstr(CrustyStatus status);
  */
 void crustyvm_debugtrace(CrustyVM *cvm, int full);
 
+/*
+ * Keep a ring of the last instructions run and callbacks called, logged by
+ * crustyvm_record_dump() and whenever execution stops with an error.  Cheap
+ * enough to leave on.  Native code only records where it was entered.
+ *
+ * cvm      CrustyVM to record.
+ * entries  Entries to keep, rounded up to a power of 2, or 0 to stop.
+ * returns  0 on success, -1 on failure.
+ */
+int crustyvm_record(CrustyVM *cvm, unsigned int entries);
+
+/*
+ * Log what the flight recorder has, oldest first, with the source line of
+ * each.
+ *
+ * cvm      CrustyVM to log the flight recorder of.
+ */
+void crustyvm_record_dump(CrustyVM *cvm);
+
 /*
  * Check to see if a VM has a particular entry point.
  *
@@ -217,5 +348,130 @@ int crustyvm_has_entrypoint(CrustyVM *cvm, const char *name);
 
 unsigned int crustyvm_get_tokenmem(CrustyVM *cvm);
 unsigned int crustyvm_get_stackmem(CrustyVM *cvm);
+/* bytes the program's instructions take */
+unsigned int crustyvm_get_instmem(CrustyVM *cvm);
+/* procedures and the size of each of their stack frames, including
+   arguments and alignment padding */
+unsigned int crustyvm_get_procs(CrustyVM *cvm);
+const char *crustyvm_get_procname(CrustyVM *cvm, unsigned int proc);
+unsigned int crustyvm_get_framemem(CrustyVM *cvm, unsigned int proc);
+/* files the program included, each once, by the name they were included
+   with, which is relative to the working directory */
+unsigned int crustyvm_get_includes(CrustyVM *cvm);
+const char *crustyvm_get_include(CrustyVM *cvm, unsigned int include);
+
+/*
+ * Make a span from the arguments passed in to a write callback.  Must be
+ * called from within the callback.
+ *
+ * cvm      CrustyVM the callback was called from.
+ * span     Span to fill in.
+ * type     Type passed to the callback.
+ * count    Size passed to the callback.
+ * ptr      Pointer passed to the callback.
+ * returns  Negative if ptr doesn't point to variable memory, such as when an
+ *          immediate value is passed.
+ */
+int crustyvm_span_new(CrustyVM *cvm,
+                      CrustySpan *span,
+                      CrustyType type,
+                      unsigned int count,
+                      void *ptr);
+
+/*
+ * Get the memory a span refers to, if it's still valid.  Memory belonging to a
+ * procedure is no longer valid once that procedure returns.
+ *
+ * cvm      CrustyVM the span was made from.
+ * span     Span to get.
+ * type     Type the memory is expected to be, or CRUSTY_TYPE_NONE to accept
+ *          any type.
+ * count    Set to the number of elements of type, or bytes for
+ *          CRUSTY_TYPE_NONE.
+ * returns  Pointer to the memory or NULL if the span is stale or isn't of
+ *          type.
+ */
+void *crustyvm_span_get(CrustyVM *cvm,
+                        const CrustySpan *span,
+                        CrustyType type,
+                        unsigned int *count);
+
+/*
+ * Get a hash of the compiled program, which changes whenever the instructions
+ * or memory layout of the program would.
+ *
+ * cvm      CrustyVM to get the hash of.
+ * returns  The hash.
+ */
+unsigned long long crustyvm_get_hash(CrustyVM *cvm);
+
+/*
+ * Write out the loaded program as a C translation unit defining
+ * crustyvm_native_program, to be built in and passed to crustyvm_set_native().
+ * Integer and char moves, math and jumps are translated, everything else is
+ * left to the interpreter.
+ *
+ * cvm      CrustyVM to translate.
+ * out      File to write to.
+ * returns  Negative on failure to write.
+ */
+int crustyvm_transpile(CrustyVM *cvm, FILE *out);
+
+/*
+ * Run the program using a translation from crustyvm_transpile().
+ *
+ * cvm      CrustyVM to use the translation with.
+ * native   The translated program.
+ * returns  Negative if the translation wasn't made from this program.
+ */
+int crustyvm_set_native(CrustyVM *cvm, const CrustyNativeProgram *native);
+
+/*
+ * Make a ring of snapshots of a VM's runtime state for saving and rolling
+ * back to.  Only memory pages which changed between snapshots are kept for
+ * all but the newest, so keeping several is cheap.
+ *
+ * cvm      CrustyVM to take snapshots of.  Snapshots may be restored to any
+ *          instance of the same program.
+ * count    Most snapshots to keep, the oldest are dropped to make room.
+ * returns  The new, empty snapshot ring or NULL on failure.
+ */
+CrustySnapshot *crustyvm_snapshot_new(CrustyVM *cvm, unsigned int count);
+
+/*
+ * Free a snapshot ring.
+ *
+ * snap     Snapshot ring to free.
+ */
+void crustyvm_snapshot_free(CrustySnapshot *snap);
+
+/*
+ * Take a snapshot of memory, the call stack, registers and status.  Shouldn't
+ * be called from within a callback.
+ *
+ * cvm      CrustyVM to take a snapshot of.
+ * snap     Ring to add the snapshot to.
+ * returns  Negative on failure.
+ */
+int crustyvm_snapshot(CrustyVM *cvm, CrustySnapshot *snap);
+
+/*
+ * Restore a snapshot.  Snapshots newer than the one restored are dropped, so
+ * it becomes the newest.  Shouldn't be called from within a callback.
+ *
+ * cvm      CrustyVM to restore state to.
+ * snap     Ring to restore from.
+ * back     How many snapshots back to go, 0 for the newest.
+ * returns  Negative on failure.
+ */
+int crustyvm_restore(CrustyVM *cvm, CrustySnapshot *snap, unsigned int back);
+
+/*
+ * Get how many snapshots a ring holds.
+ *
+ * snap     Snapshot ring.
+ * returns  Number of snapshots which may be restored.
+ */
+unsigned int crustyvm_snapshot_count(CrustySnapshot *snap);
 
 #endif
@@ -19,18 +19,28 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <time.h>
+#include <signal.h>
+#include <sched.h>
 #include <SDL.h>
 
 #include "crustygame.h"
 #include "crustyvm.h"
 #include "tilemap.h"
+#include "perf.h"
 #include "callbacks.h"
 #include "xdg.h"
+#include "reload.h"
+#include "plugin.h"
 
 /* initial settings */
 #define WINDOW_TITLE    "CrustyGame"
@@ -39,15 +49,67 @@
 
 const char META_PREFIX[] = ";crustygame ";
 const char SAVE_SIZE_PREFIX[] = "save:";
+const char RATE_PREFIX[] = "rate:";
+const char PLUGIN_PREFIX[] = "plugin:";
 const char SAVE_PATH_DIR[] = "/crustygame saves/";
 const char SAVE_PATH_SUFFIX[] = ".sav";
+const char SAVE_TEMP_SUFFIX[] = ".tmp";
 #define SAVE_FILL_BUFFER_SIZE (64 * 1024)
 
+/* most logic ticks which will be run to catch up before giving up on them */
+#define MAX_CATCHUP_TICKS (4)
+/* SDL_Delay() may oversleep by a bit, so wake up this early and yield out the
+ * rest while watching the performance counter */
+#define SLEEP_MARGIN_MS (1)
+/* longest init or frame may run for at once before events and presenting get
+ * a turn, when there's no logic rate to go by */
+#define FRAME_SLICE_US (8000)
+/* instructions and callbacks kept for when the program faults or SIGUSR1 is
+ * received */
+#define FLIGHT_RECORDER_ENTRIES (256)
+
 CrustyGame state;
+volatile sig_atomic_t dump_requested = 0;
+
+/* a shipping build may have its script translated by crustyvm_transpile()
+ * linked in, see the Makefile */
+extern const CrustyNativeProgram crustyvm_native_program __attribute__((weak));
+
+void request_dump(int sig) {
+    dump_requested = 1;
+}
+
+/* one line of JSON for bench/, stats are from the last PERF_SAMPLES frames */
+void print_bench(const char *filename, unsigned int frames, Uint64 elapsed) {
+    const char *phasename[PERF_PHASES] = {
+        "event", "frame", "tilemap", "present", "total"
+    };
+    double seconds = (double)elapsed / (double)SDL_GetPerformanceFrequency();
+    unsigned int i;
+
+    printf("{\"script\": \"");
+    for(i = 0; filename[i] != '\0'; i++) {
+        if(filename[i] == '"' || filename[i] == '\\') {
+            putchar('\\');
+        }
+        putchar(filename[i]);
+    }
+    printf("\", \"frames\": %u, \"seconds\": %f, \"fps\": %f",
+           frames, seconds, seconds > 0.0 ? frames / seconds : 0.0);
+    for(i = 0; i < PERF_PHASES; i++) {
+        printf(", \"%s_us\": {\"min\": %u, \"avg\": %u, \"p99\": %u}",
+               phasename[i],
+               perf_get_stat(&(state.perf), i, PERF_STAT_MIN),
+               perf_get_stat(&(state.perf), i, PERF_STAT_AVG),
+               perf_get_stat(&(state.perf), i, PERF_STAT_P99));
+    }
+    printf("}\n");
+}
 
 int initialize_SDL(SDL_Window **win,
                    SDL_Renderer **renderer,
-                   Uint32 *format) {
+                   Uint32 *format,
+                   int vsync) {
     unsigned int drivers;
     int nameddrv, bestdrv, softdrv, selectdrv;
     int selectfmt;
@@ -191,7 +253,8 @@ int initialize_SDL(SDL_Window **win,
         selectdrv = bestdrv;
     }
 
-    *renderer = SDL_CreateRenderer(*win, selectdrv, SDL_RENDERER_PRESENTVSYNC);
+    *renderer = SDL_CreateRenderer(*win, selectdrv,
+                                   vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
     if(*renderer == NULL) {
         fprintf(stderr, "Failed to create SDL renderer.\n");
         goto error1;
@@ -215,14 +278,23 @@ void vprintf_cb(void *priv, const char *fmt, ...) {
     vfprintf(out, fmt, ap);
 }
 
-int update_settings(char *program, unsigned long len, unsigned int *savesize) {
+int update_settings(char *program,
+                    unsigned long len,
+                    unsigned int *savesize,
+                    unsigned int *rate,
+                    PluginList *plugins,
+                    const char *fullpath) {
     unsigned long i;
     unsigned long linelen;
     char held;
+    char heldname;
+    int result;
     char *end;
     unsigned int value;
+    long rateval;
 
     *savesize = 0;
+    *rate = 0;
 
     if(len > sizeof(META_PREFIX) - 1 &&
        strncmp(program, META_PREFIX, sizeof(META_PREFIX) - 1) == 0) {
@@ -259,6 +331,55 @@ int update_settings(char *program, unsigned long len, unsigned int *savesize) {
                 *savesize = value;
 
                 i += end - &(program[i]);
+            } else if(linelen - i >= sizeof(RATE_PREFIX) - 1 &&
+                      strncmp(&(program[i]),
+                              RATE_PREFIX,
+                              sizeof(RATE_PREFIX) - 1) == 0) {
+                i += sizeof(RATE_PREFIX) - 1;
+
+                rateval = strtol(&(program[i]), &end, 0);
+                if(end == &(program[i]) ||
+                   (*end != ' ' &&
+                    *end != '\t' &&
+                    *end != '\0')) {
+                    fprintf(stderr, "Logic rate was not a number.\n");
+                    goto failure;
+                }
+                /* any faster and there'd be less than a counter tick per
+                 * logic tick */
+                if(rateval <= 0 ||
+                   (Uint64)rateval > SDL_GetPerformanceFrequency()) {
+                    fprintf(stderr, "Logic rate was out of range.\n");
+                    goto failure;
+                }
+                *rate = rateval;
+
+                i += end - &(program[i]);
+            } else if(linelen - i >= sizeof(PLUGIN_PREFIX) - 1 &&
+                      strncmp(&(program[i]),
+                              PLUGIN_PREFIX,
+                              sizeof(PLUGIN_PREFIX) - 1) == 0) {
+                i += sizeof(PLUGIN_PREFIX) - 1;
+
+                for(value = i; value < linelen; value++) {
+                    if(program[value] == ' ' ||
+                       program[value] == '\t') {
+                        break;
+                    }
+                }
+                if(value == i) {
+                    fprintf(stderr, "Plugin name was empty.\n");
+                    goto failure;
+                }
+                heldname = program[value];
+                program[value] = '\0';
+                result = plugins_load(plugins, fullpath, &(program[i]));
+                program[value] = heldname;
+                if(result < 0) {
+                    goto failure;
+                }
+
+                i = value;
             } else if(program[i] == ' ' ||
                       program[i] == '\t') {
                 continue;
@@ -369,7 +490,11 @@ int is_existing_dir(const char *dir) {
     return(1);
 }
 
-FILE *create_save_file(const char *fullpath, unsigned int size) {
+/* outname will be set to an allocated string with the full path to the save
+ * file which needs to be freed */
+FILE *create_save_file(const char *fullpath,
+                       unsigned int size,
+                       char **outname) {
     char *path;
     char *filename;
     char *xdgdirs;
@@ -438,7 +563,7 @@ FILE *create_save_file(const char *fullpath, unsigned int size) {
             }
 
             memset(buffer, 0, SAVE_FILL_BUFFER_SIZE);
-            for(need_fill = filesize - size;
+            for(need_fill = size - filesize;
                 need_fill > 0;
                 need_fill -= SAVE_FILL_BUFFER_SIZE) {
 
@@ -465,6 +590,12 @@ FILE *create_save_file(const char *fullpath, unsigned int size) {
             continue;
         }
         fprintf(stderr, "Save file found at: %s\n", savename);
+        *outname = strdup(savename);
+        if(*outname == NULL) {
+            fprintf(stderr, "Failed to allocate memory for save path.\n");
+            fclose(savefile);
+            savefile = NULL;
+        }
 
         free(xdgdirs);
         free(path);
@@ -513,6 +644,12 @@ FILE *create_save_file(const char *fullpath, unsigned int size) {
         }
         rewind(savefile);
         fprintf(stderr, "Save file createed at: %s\n", savename);
+        *outname = strdup(savename);
+        if(*outname == NULL) {
+            fprintf(stderr, "Failed to allocate memory for save path.\n");
+            fclose(savefile);
+            savefile = NULL;
+        }
 
         free(xdgdirs);
         free(path);
@@ -526,6 +663,152 @@ FILE *create_save_file(const char *fullpath, unsigned int size) {
     return(NULL);
 }
 
+/* map the save file in to memory.  The mapping is private so nothing written
+ * by the program reaches the file until it's committed, the file stays
+ * consistent if the program crashes part way through updating its save data.
+ * savefile may be closed after. */
+unsigned char *map_save_file(FILE *savefile, size_t *size) {
+    struct stat filestat;
+    unsigned char *data;
+
+    if(fflush(savefile) != 0) {
+        fprintf(stderr, "Failed to flush save file: %s\n", strerror(errno));
+        return(NULL);
+    }
+
+    if(fstat(fileno(savefile), &filestat) < 0) {
+        fprintf(stderr, "Failed to get save file size: %s\n",
+                        strerror(errno));
+        return(NULL);
+    }
+    if(filestat.st_size < 0 || (unsigned long long)filestat.st_size < *size) {
+        fprintf(stderr, "Save file is smaller than save size.\n");
+        return(NULL);
+    }
+    if((unsigned long long)filestat.st_size > SIZE_MAX) {
+        fprintf(stderr, "Save file is too large to map.\n");
+        return(NULL);
+    }
+    /* keep any excess data in a larger file intact */
+    *size = filestat.st_size;
+
+    data = mmap(NULL, *size,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                fileno(savefile), 0);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map save file: %s\n", strerror(errno));
+        return(NULL);
+    }
+
+    return(data);
+}
+
+/* write out the whole save data to a temporary file next to the save file,
+ * then replace the save file with it so it's always either entirely the old
+ * or entirely the new data */
+int commit_save_file(CrustyGame *state) {
+    char tempname[PATH_MAX];
+    char *slash;
+    struct stat savestat;
+    mode_t mode;
+    int fd;
+    size_t written;
+    ssize_t ret;
+
+    /* no save file for a benchmark */
+    if(state->savedata == NULL || state->savename == NULL ||
+       !state->savedirty) {
+        return(0);
+    }
+
+    if(snprintf(tempname, PATH_MAX, "%s%s",
+                state->savename, SAVE_TEMP_SUFFIX) >= PATH_MAX) {
+        fprintf(stderr, "Path too long! %s%s\n",
+                        state->savename, SAVE_TEMP_SUFFIX);
+        return(-1);
+    }
+
+    /* the replacement gets the same permissions as the save it replaces */
+    mode = 0644;
+    if(stat(state->savename, &savestat) == 0) {
+        mode = savestat.st_mode & 07777;
+    }
+
+    fd = open(tempname, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if(fd < 0) {
+        fprintf(stderr, "Failed to open temporary save file %s: %s\n",
+                        tempname, strerror(errno));
+        return(-1);
+    }
+    /* not masked by the umask like open() is */
+    if(fchmod(fd, mode) < 0) {
+        fprintf(stderr, "Failed to set temporary save file mode: %s\n",
+                        strerror(errno));
+        goto error;
+    }
+
+    for(written = 0; written < state->savemapsize; written += ret) {
+        ret = write(fd,
+                    &(state->savedata[written]),
+                    state->savemapsize - written);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            fprintf(stderr, "Failed to write temporary save file: %s\n",
+                            strerror(errno));
+            goto error;
+        }
+    }
+
+    if(fsync(fd) < 0) {
+        fprintf(stderr, "Failed to sync temporary save file: %s\n",
+                        strerror(errno));
+        goto error;
+    }
+    close(fd);
+
+    if(rename(tempname, state->savename) < 0) {
+        fprintf(stderr, "Failed to replace save file: %s\n",
+                        strerror(errno));
+        unlink(tempname);
+        return(-1);
+    }
+
+    /* make sure the rename itself has reached the disk */
+    slash = strrchr(tempname, '/');
+    if(slash != NULL) {
+        *slash = '\0';
+        fd = open(tempname, O_RDONLY);
+        if(fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    state->savedirty = 0;
+
+    return(0);
+
+error:
+    close(fd);
+    unlink(tempname);
+
+    return(-1);
+}
+
+void free_save_data(CrustyGame *state) {
+    if(state->savedata != NULL) {
+        munmap(state->savedata, state->savemapsize);
+        state->savedata = NULL;
+    }
+    if(state->savename != NULL) {
+        free(state->savename);
+        state->savename = NULL;
+    }
+}
+
 int audio_frame_cb(void *priv) {
     CrustyGame *state = priv;
 
@@ -540,6 +823,56 @@ int audio_frame_cb(void *priv) {
     return(0);
 }
 
+/* sleep until the performance counter reaches deadline */
+void sleep_until(Uint64 deadline) {
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 ms;
+
+    if(now >= deadline) {
+        return;
+    }
+
+    ms = (deadline - now) * 1000 / SDL_GetPerformanceFrequency();
+    if(ms > SLEEP_MARGIN_MS) {
+        SDL_Delay(ms - SLEEP_MARGIN_MS);
+    }
+
+    /* give up the CPU rather than spin on it for what's left */
+    while(SDL_GetPerformanceCounter() < deadline) {
+        sched_yield();
+    }
+}
+
+/* move the deadline on by ticks periods, carrying the fractional part */
+void advance_deadline(CrustyGame *s, Uint64 ticks) {
+    s->deadline += ticks * s->period;
+    s->deadlineFrac += ticks * s->periodRem;
+    s->deadline += s->deadlineFrac / s->rate;
+    s->deadlineFrac %= s->rate;
+}
+
+int clear_frame(SDL_Renderer *renderer) {
+    if(SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE) < 0) {
+        fprintf(stderr, "Failed to set render draw color.\n");
+        return(-1);
+    } 
+
+    if(SDL_RenderClear(renderer) < 0) {
+        fprintf(stderr, "Failed to clear screen.\n");
+        return(-1);
+    }
+
+    /* needs to be transparent so tilemap updates work */
+    if(SDL_SetRenderDrawColor(renderer,
+                              0, 0, 0,
+                              SDL_ALPHA_TRANSPARENT) < 0) {
+        fprintf(stderr, "Failed to set render draw color.\n");
+        return(-1);
+    } 
+
+    return(0);
+}
+
 int notify_event(CrustyVM *cvm) {
     int result = crustyvm_run(cvm, "event");
     if(result < 0) {
@@ -567,15 +900,27 @@ int notify_event(CrustyVM *cvm) {
 int main(int argc, char **argv) {
     /* SDL and CrustyGame stuff */
     Uint32 format;
-    state.buffer = NULL;
-    state.size = 0;
+    state.buffer.ptr = NULL;
     state.ret = 0;
     state.mouseCaptured = 0;
     state.savesize = 0;
-    state.savefile = NULL;
+    state.savename = NULL;
+    state.savedata = NULL;
+    state.savemapsize = 0;
+    state.savepos = 0;
+    state.savedirty = 0;
+    state.rate = 0;
+    state.framePending = 0;
+    state.frameLag = 0.0;
+    state.ticks = 0;
+    state.lateTicks = 0;
+    state.droppedTicks = 0;
+    state.suspended = 0;
+    state.collide = NULL;
 
     /* CrustyVM stuff */
     unsigned int i;
+    unsigned int frame;
     const char *filename = NULL;
     char *fullpath;
     unsigned int arglen;
@@ -585,11 +930,26 @@ int main(int argc, char **argv) {
     char **var = NULL;
     char **value = NULL;
     unsigned int vars = 0;
+    unsigned int vmflags = CRUSTY_FLAG_DEFAULTS;
+    const char *nativename = NULL;
+    FILE *nativefile;
+    int watch = 0;
+    unsigned int bench = 0;
+    unsigned int frames = 0;
+    Uint64 benchstart;
+    Reloader *reload = NULL;
+    PluginList *plugins = NULL;
+    CrustyVM *newcvm;
+    CrustyStatus status;
+    SDL_Event quitEvent;
 
     FILE *in = NULL;
+    FILE *savefile;
     char *program = NULL;
     long len;
     int result;
+    Uint64 now;
+    unsigned int steps;
 
     /* CrustyVM stuff */
 
@@ -659,6 +1019,30 @@ int main(int argc, char **argv) {
                     temp[arglen - (equals - argv[i] - 2) - 1] = '\0';
                     value[vars] = temp;
                     vars++;
+                } else if(argv[i][1] == 'j' && arglen == 2) {
+                    vmflags |= CRUSTY_FLAG_JIT;
+                } else if(argv[i][1] == 'O' && arglen == 2) {
+                    vmflags |= CRUSTY_FLAG_OPTIMIZE;
+                } else if(argv[i][1] == 'w' && arglen == 2) {
+                    watch = 1;
+                } else if(argv[i][1] == 'c' && arglen == 2) {
+                    if(i + 1 == (unsigned int)argc) {
+                        filename = NULL;
+                        break;
+                    }
+                    i++;
+                    nativename = argv[i];
+                } else if(argv[i][1] == 'b' && arglen == 2) {
+                    if(i + 1 == (unsigned int)argc) {
+                        filename = NULL;
+                        break;
+                    }
+                    i++;
+                    bench = strtoul(argv[i], &temp, 10);
+                    if(temp == argv[i] || *temp != '\0' || bench == 0) {
+                        filename = NULL;
+                        break;
+                    }
                 } else {
                     filename = NULL;
                     break;
@@ -674,7 +1058,7 @@ int main(int argc, char **argv) {
     }
 
     if(filename == NULL) {
-        fprintf(stderr, "USAGE: %s [(<filename>|-D<var>=<value>) ...] [-- <filename>]\n", argv[0]);
+        fprintf(stderr, "USAGE: %s [(<filename>|-D<var>=<value>|-j|-O|-w|-c <out.c>|-b <frames>) ...] [-- <filename>]\n", argv[0]);
         goto error_arglist;
     }
 
@@ -709,24 +1093,56 @@ int main(int argc, char **argv) {
 
     fclose(in);
     in = NULL;
-    if(update_settings(program, len, &(state.savesize)) < 0) {
+    plugins = plugins_new(cb, CRUSTYGAME_CALLBACKS, vprintf_cb, stderr);
+    if(plugins == NULL) {
         goto error_infile;
     }
-    if(state.savesize > 0) {
-        state.savefile = create_save_file(fullpath, state.savesize);
-        if(state.savefile == NULL) {
+    if(update_settings(program, len,
+                       &(state.savesize), &(state.rate),
+                       plugins, fullpath) < 0) {
+        goto error_infile;
+    }
+    /* a benchmark runs frames back to back as fast as they'll go */
+    if(bench > 0) {
+        state.rate = 0;
+    }
+    /* nothing is run when only translating the script, and a benchmark gets
+       blank save data which is never written out, so it can't change the real
+       save */
+    if(state.savesize > 0 && nativename == NULL && bench > 0) {
+        state.savemapsize = state.savesize;
+        state.savedata = mmap(NULL, state.savemapsize,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS,
+                              -1, 0);
+        if(state.savedata == MAP_FAILED) {
+            state.savedata = NULL;
+            fprintf(stderr, "Couldn't allocate save data.\n");
+            goto error_infile;
+        }
+    } else if(state.savesize > 0 && nativename == NULL) {
+        savefile = create_save_file(fullpath,
+                                    state.savesize,
+                                    &(state.savename));
+        if(savefile == NULL) {
             fprintf(stderr, "Couldn't create save file.\n");
             goto error_infile;
         }
-    } else {
-        state.savefile = NULL;
+        state.savemapsize = state.savesize;
+        state.savedata = map_save_file(savefile, &(state.savemapsize));
+        fclose(savefile);
+        if(state.savedata == NULL) {
+            fprintf(stderr, "Couldn't load save file.\n");
+            goto error_infile;
+        }
     }
 
     state.cvm = crustyvm_new(filename, fullpath, 
                        program, len,
-                       CRUSTY_FLAG_DEFAULTS,
+                       vmflags,
                        0,
-                       cb, CRUSTYGAME_CALLBACKS,
+                       plugins_get_callbacks(plugins),
+                       plugins_get_callback_count(plugins),
                        (const char **)var, (const char **)value, vars,
                        vprintf_cb, stderr);
     if(state.cvm == NULL) {
@@ -736,17 +1152,71 @@ int main(int argc, char **argv) {
     /* some early cleanup of things we're done with */
     free(program);
     program = NULL;
-    CLEAN_ARGS
+    /* reloading needs the same arguments again */
+    if(!watch || nativename != NULL) {
+        CLEAN_ARGS
+    }
     fprintf(stderr, "Program loaded.\n");
+    if(crustyvm_record(state.cvm, FLIGHT_RECORDER_ENTRIES) < 0) {
+        fprintf(stderr, "Failed to start flight recorder.\n");
+    }
+    signal(SIGUSR1, request_dump);
 
     fprintf(stderr, "Token memory size: %u\n",
                     crustyvm_get_tokenmem(state.cvm));
     fprintf(stderr, "Stack size: %u\n",
                     crustyvm_get_stackmem(state.cvm));
+    fprintf(stderr, "Code size: %u\n",
+                    crustyvm_get_instmem(state.cvm));
+    frame = 0;
+    for(i = 1; i < crustyvm_get_procs(state.cvm); i++) {
+        if(crustyvm_get_framemem(state.cvm, i) >
+           crustyvm_get_framemem(state.cvm, frame)) {
+            frame = i;
+        }
+    }
+    if(crustyvm_get_procs(state.cvm) > 0) {
+        fprintf(stderr, "Largest frame: %s %u\n",
+                        crustyvm_get_procname(state.cvm, frame),
+                        crustyvm_get_framemem(state.cvm, frame));
+    }
+
+    if(nativename != NULL) {
+        nativefile = fopen(nativename, "wb");
+        if(nativefile == NULL) {
+            fprintf(stderr, "Failed to open %s for writing.\n", nativename);
+            goto error_cvm;
+        }
+        if(crustyvm_transpile(state.cvm, nativefile) < 0) {
+            fclose(nativefile);
+            goto error_cvm;
+        }
+        if(fclose(nativefile) != 0) {
+            fprintf(stderr, "Failed to write %s.\n", nativename);
+            goto error_cvm;
+        }
+        fprintf(stderr, "Wrote %s.\n", nativename);
+
+        crustyvm_free(state.cvm);
+        plugins_free(plugins);
+        free(fullpath);
+        exit(EXIT_SUCCESS);
+    }
 
+    if(&crustyvm_native_program != NULL) {
+        if(crustyvm_set_native(state.cvm, &crustyvm_native_program) < 0) {
+            fprintf(stderr, "Built in script doesn't match %s, it'll be "
+                            "interpreted.\n", filename);
+        } else {
+            fprintf(stderr, "Using built in script.\n");
+        }
+    }
+
+    /* with a fixed logic rate, the scheduler paces presentation itself */
     if(initialize_SDL(&(state.win),
                       &(state.renderer),
-                      &format) < 0) {
+                      &format,
+                      state.rate == 0 && bench == 0) < 0) {
         fprintf(stderr, "Failed to initialize SDL.\n");
         goto error_cvm;
     }
@@ -761,6 +1231,8 @@ int main(int argc, char **argv) {
         goto error_sdl;
     }
 
+    perf_init(&(state.perf));
+
 #if 0
     /* initialize the audio */
     state.s = synth_new(audio_frame_cb,
@@ -776,38 +1248,101 @@ int main(int argc, char **argv) {
     /* seed random */
     srand(time(NULL));
 
+    /* a long init or frame is run a slice at a time, half a logic tick */
+    if(state.rate > 0) {
+        state.slice = 500000 / state.rate;
+    } else {
+        state.slice = FRAME_SLICE_US;
+    }
+
     /* init may flag program quit due to error */
     state.running = 1;
-    /* call program init */
-    result = crustyvm_run(state.cvm, "init");
-    if(result < 0) {
+    /* call program init, keeping the window responsive while it runs */
+    if(crustyvm_begin(state.cvm, "init") < 0) {
+        goto error_synth;
+    }
+    do {
+        status = crustyvm_resume(state.cvm, 0, state.slice);
+        SDL_PumpEvents();
+    } while(status == CRUSTY_STATUS_ACTIVE);
+    if(status != CRUSTY_STATUS_READY) {
         fprintf(stderr, "Program reached an exception while running: "
                         "%s\n",
-                crustyvm_statusstr(crustyvm_get_status(state.cvm)));
+                crustyvm_statusstr(status));
         crustyvm_debugtrace(state.cvm, 1);
         goto error_synth;
     }
 
-    while(state.running) {
-        if(SDL_SetRenderDrawColor(state.renderer, 0, 0, 0, SDL_ALPHA_OPAQUE) < 0) {
-            fprintf(stderr, "Failed to set render draw color.\n");
+    if(watch) {
+        reload = reloader_new(state.cvm, filename, fullpath,
+                              vmflags,
+                              plugins_get_callbacks(plugins),
+                              plugins_get_callback_count(plugins),
+                              (const char **)var, (const char **)value, vars,
+                              vprintf_cb, stderr);
+        if(reload == NULL) {
+            fprintf(stderr, "Failed to watch for changes to %s.\n", filename);
             goto error_synth;
-        } 
+        }
+        fprintf(stderr, "Watching for changes to %s.\n", filename);
+    }
 
-        if(SDL_RenderClear(state.renderer) < 0) {
-            fprintf(stderr, "Failed to clear screen.\n");
-            goto error_synth;
+    if(state.rate > 0) {
+        fprintf(stderr, "Logic rate: %u Hz\n", state.rate);
+        state.period = SDL_GetPerformanceFrequency() / state.rate;
+        state.periodRem = SDL_GetPerformanceFrequency() % state.rate;
+        if(state.period == 0) {
+            state.period = 1;
+            state.periodRem = 0;
         }
+        state.deadline = SDL_GetPerformanceCounter();
+        state.deadlineFrac = 0;
+    }
 
-        /* needs to be transparent so tilemap updates work */
-        if(SDL_SetRenderDrawColor(state.renderer,
-                                  0, 0, 0,
-                                  SDL_ALPHA_TRANSPARENT) < 0) {
-            fprintf(stderr, "Failed to set render draw color.\n");
-            goto error_synth;
-        } 
+    benchstart = SDL_GetPerformanceCounter();
+    while(state.running) {
+        if(state.rate > 0) {
+            sleep_until(state.deadline);
+        }
+
+        if(dump_requested) {
+            dump_requested = 0;
+            crustyvm_record_dump(state.cvm);
+        }
+
+        /* swap in a reloaded script between frames, keeping whatever state
+         * still fits in it.  init isn't run again, so anything it set up
+         * stays as it was. */
+        if(reload != NULL && !state.suspended) {
+            newcvm = reloader_get(reload);
+            if(newcvm != NULL) {
+                if(crustyvm_record(newcvm, FLIGHT_RECORDER_ENTRIES) < 0) {
+                    fprintf(stderr, "Failed to start flight recorder.\n");
+                }
+                result = crustyvm_migrate(newcvm, state.cvm);
+                fprintf(stderr, "Reloaded %s, %d globals kept.\n",
+                                filename, result);
+                crustyvm_free(state.cvm);
+                state.cvm = newcvm;
+                /* it pointed in to the old VM's memory */
+                state.buffer.ptr = NULL;
+            }
+        }
+
+        /* events wait in the queue until an unfinished frame is done, except
+         * for quitting, which shouldn't have to wait for a long frame */
+        if(state.suspended) {
+            SDL_PumpEvents();
+            if(SDL_PeepEvents(&quitEvent, 1, SDL_GETEVENT,
+                              SDL_QUIT, SDL_QUIT) > 0) {
+                state.running = 0;
+                break;
+            }
+        }
 
-        while(state.running && SDL_PollEvent(&(state.lastEvent))) {
+        perf_begin(&(state.perf), PERF_EVENT);
+        while(state.running && !state.suspended &&
+              SDL_PollEvent(&(state.lastEvent))) {
             /* allow the user to press CTRL+F10 (like DOSBOX) to uncapture a
              * captured mouse, and also enforce disallowing recapture until
              * reallowed by pressing the same combo again. */
@@ -875,6 +1410,7 @@ int main(int argc, char **argv) {
                     break;
             }
         }
+        perf_end(&(state.perf), PERF_EVENT);
 
 #if 0
         if(synth_frame(state.s) < 0) {
@@ -883,28 +1419,121 @@ int main(int argc, char **argv) {
         }
 #endif
 
-        result = crustyvm_run(state.cvm, "frame");
-        if(result < 0) {
-            fprintf(stderr, "Program reached an exception while "
-                            "running: %s\n",
-                    crustyvm_statusstr(crustyvm_get_status(state.cvm)));
-            crustyvm_debugtrace(state.cvm, 0);
-            goto error_synth;
+        if(state.rate > 0) {
+            /* figure out how many ticks are due, and if it's more than can
+             * reasonably be caught up on, drop the oldest ones */
+            now = SDL_GetPerformanceCounter();
+            steps = (now - state.deadline) / state.period + 1;
+            if(steps > MAX_CATCHUP_TICKS) {
+                state.droppedTicks += steps - MAX_CATCHUP_TICKS;
+                advance_deadline(&state, steps - MAX_CATCHUP_TICKS);
+                steps = MAX_CATCHUP_TICKS;
+            }
+            state.lateTicks += steps - 1;
+        } else {
+            now = 0;
+            steps = 1;
+        }
+
+        for(; steps > 0; steps--) {
+            state.framePending = steps - 1;
+            if(state.rate > 0) {
+                state.frameLag = (double)(now - state.deadline) /
+                                 (double)state.period;
+                advance_deadline(&state, 1);
+            }
+
+            /* every tick fully redraws the frame, so only the last one run
+             * before presenting will be seen */
+            if(!state.suspended) {
+                if(clear_frame(state.renderer) < 0) {
+                    goto error_synth;
+                }
+                if(crustyvm_begin(state.cvm, "frame") < 0) {
+                    goto error_synth;
+                }
+            }
+
+            perf_begin(&(state.perf), PERF_FRAME);
+            status = crustyvm_resume(state.cvm, 0, state.slice);
+            perf_end(&(state.perf), PERF_FRAME);
+            /* yielded or out of time, carry on next tick */
+            if(status == CRUSTY_STATUS_ACTIVE) {
+                state.suspended = 1;
+                break;
+            }
+            state.suspended = 0;
+            if(status != CRUSTY_STATUS_READY) {
+                fprintf(stderr, "Program reached an exception while "
+                                "running: %s\n",
+                        crustyvm_statusstr(status));
+                crustyvm_debugtrace(state.cvm, 0);
+                goto error_synth;
+            }
+            state.ticks++;
+
+            if(!state.running) {
+                break;
+            }
+        }
+
+        perf_add(&(state.perf), PERF_TILEMAP,
+                 layerlist_get_update_time(state.ll));
+
+        /* a half drawn frame isn't presented */
+        if(!state.suspended) {
+            if(perf_overlay_draw(&(state.perf)) < 0) {
+                fprintf(stderr, "Failed to draw performance overlay.\n");
+                goto error_synth;
+            }
+
+            perf_begin(&(state.perf), PERF_PRESENT);
+            SDL_RenderPresent(state.renderer);
+            perf_end(&(state.perf), PERF_PRESENT);
+
+            frames++;
+            if(bench > 0 && frames == bench) {
+                state.running = 0;
+            }
+
+            /* slices of an unfinished frame add up in to the frame they're
+             * presented with */
+            perf_commit(&(state.perf));
         }
+    }
 
-        SDL_RenderPresent(state.renderer);
+    if(commit_save_file(&state) < 0) {
+        fprintf(stderr, "Failed to save data.\n");
     }
+    free_save_data(&state);
 
     fprintf(stderr, "Program completed successfully.\n");
+    if(bench > 0) {
+        print_bench(filename, frames,
+                    SDL_GetPerformanceCounter() - benchstart);
+    }
+    if(state.rate > 0) {
+        fprintf(stderr, "Logic ticks: %lu  Late: %lu  Dropped: %lu\n",
+                        state.ticks, state.lateTicks, state.droppedTicks);
+    }
 /*
     synth_free(state.s);
 */
+    if(reload != NULL) {
+        reloader_free(reload);
+    }
+    if(state.collide != NULL) {
+        collide_free(state.collide);
+    }
     layerlist_free(state.ll);
 
     SDL_DestroyWindow(state.win);
     SDL_Quit();
 
     crustyvm_free(state.cvm);
+    plugins_free(plugins);
+    free(fullpath);
+    CLEAN_ARGS
 
     exit(EXIT_SUCCESS);
 
@@ -912,6 +1541,12 @@ error_synth:
 /*
     synth_free(state.s);
 */
+    if(reload != NULL) {
+        reloader_free(reload);
+    }
+    if(state.collide != NULL) {
+        collide_free(state.collide);
+    }
 error_ll:
     layerlist_free(state.ll);
 error_sdl:
@@ -923,11 +1558,13 @@ error_infile:
     if(program != NULL) {
         free(program);
     }
-
-    if(state.savefile != NULL) {
-        fclose(state.savefile);
+    if(plugins != NULL) {
+        plugins_free(plugins);
     }
 
+    /* don't commit anything from a program which failed */
+    free_save_data(&state);
+
     if(in != NULL) {
         fclose(in);
     }
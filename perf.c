@@ -0,0 +1,298 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL.h>
+
+#include "tilemap.h"
+#include "perf.h"
+
+/* frames between redrawing the overlay text so it's actually readable */
+#define PERF_OVERLAY_REFRESH (15)
+#define PERF_OVERLAY_SCALE   (2.0)
+#define PERF_OVERLAY_X       (4)
+#define PERF_OVERLAY_Y       (4)
+/* label, then min, avg and p99 as 5 digits each */
+#define PERF_OVERLAY_W       (2 + (PERF_STATS * 6))
+#define PERF_OVERLAY_H       (PERF_PHASES)
+#define PERF_OVERLAY_MAX     (99999)
+
+/* tiny 3x5 font, each row is 3 bits with the MSB being the leftmost pixel,
+ * drawn in 4x6 tiles to leave a gap between characters */
+#define PERF_FONT_W  (3)
+#define PERF_FONT_H  (5)
+#define PERF_TILE_W  (4)
+#define PERF_TILE_H  (6)
+static const char PERF_FONT_CHARS[] = " 0123456789EFMPRTV";
+#define PERF_FONT_COUNT (sizeof(PERF_FONT_CHARS) - 1)
+static const unsigned char PERF_FONT[PERF_FONT_COUNT][PERF_FONT_H] = {
+    {0, 0, 0, 0, 0}, /* space */
+    {7, 5, 5, 5, 7}, /* 0 */
+    {2, 6, 2, 2, 7}, /* 1 */
+    {7, 1, 7, 4, 7}, /* 2 */
+    {7, 1, 3, 1, 7}, /* 3 */
+    {5, 5, 7, 1, 1}, /* 4 */
+    {7, 4, 7, 1, 7}, /* 5 */
+    {7, 4, 7, 5, 7}, /* 6 */
+    {7, 1, 1, 1, 1}, /* 7 */
+    {7, 5, 7, 5, 7}, /* 8 */
+    {7, 5, 7, 1, 7}, /* 9 */
+    {7, 4, 6, 4, 7}, /* E */
+    {7, 4, 6, 4, 4}, /* F */
+    {5, 7, 7, 5, 5}, /* M */
+    {7, 5, 7, 4, 4}, /* P */
+    {6, 5, 6, 5, 5}, /* R */
+    {7, 2, 2, 2, 2}, /* T */
+    {5, 5, 5, 5, 2}  /* V */
+};
+
+static const char *PERF_LABELS[PERF_PHASES] = {
+    "EV", "FR", "TM", "PR", "TT"
+};
+
+void perf_init(Perf *p) {
+    memset(p, 0, sizeof(Perf));
+    p->freq = SDL_GetPerformanceFrequency();
+    p->ll = NULL;
+}
+
+void perf_begin(Perf *p, PerfPhase phase) {
+    p->start[phase] = SDL_GetPerformanceCounter();
+}
+
+void perf_end(Perf *p, PerfPhase phase) {
+    p->elapsed[phase] += SDL_GetPerformanceCounter() - p->start[phase];
+}
+
+void perf_add(Perf *p, PerfPhase phase, Uint64 ticks) {
+    p->elapsed[phase] += ticks;
+}
+
+void perf_commit(Perf *p) {
+    unsigned int i;
+    Uint64 now;
+
+    now = SDL_GetPerformanceCounter();
+    /* nothing to measure the first frame against */
+    if(p->lastCommit != 0) {
+        p->elapsed[PERF_TOTAL] = now - p->lastCommit;
+    }
+    p->lastCommit = now;
+
+    for(i = 0; i < PERF_PHASES; i++) {
+        p->sample[i][p->next] = p->elapsed[i] * 1000000 / p->freq;
+        p->elapsed[i] = 0;
+    }
+
+    p->next = (p->next + 1) % PERF_SAMPLES;
+    if(p->samples < PERF_SAMPLES) {
+        p->samples++;
+    }
+    p->statsValid = 0;
+}
+
+static int compare_uint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+
+    return((x > y) - (x < y));
+}
+
+static void update_stats(Perf *p) {
+    unsigned int i, j;
+    unsigned long long sum;
+    unsigned int sorted[PERF_SAMPLES];
+
+    for(i = 0; i < PERF_PHASES; i++) {
+        if(p->samples == 0) {
+            p->stat[i][PERF_STAT_MIN] = 0;
+            p->stat[i][PERF_STAT_AVG] = 0;
+            p->stat[i][PERF_STAT_P99] = 0;
+            continue;
+        }
+
+        /* samples only fill from the start, so the first samples entries are
+         * always the valid ones */
+        sum = 0;
+        for(j = 0; j < p->samples; j++) {
+            sum += p->sample[i][j];
+        }
+        memcpy(sorted, p->sample[i], sizeof(unsigned int) * p->samples);
+        qsort(sorted, p->samples, sizeof(unsigned int), compare_uint);
+
+        p->stat[i][PERF_STAT_MIN] = sorted[0];
+        p->stat[i][PERF_STAT_AVG] = sum / p->samples;
+        p->stat[i][PERF_STAT_P99] = sorted[(p->samples - 1) * 99 / 100];
+    }
+
+    p->statsValid = 1;
+}
+
+unsigned int perf_get_stat(Perf *p, PerfPhase phase, unsigned int stat) {
+    if(!p->statsValid) {
+        update_stats(p);
+    }
+
+    return(p->stat[phase][stat]);
+}
+
+static unsigned int font_tile(char c) {
+    const char *pos = strchr(PERF_FONT_CHARS, c);
+
+    if(pos == NULL || c == '\0') {
+        return(0);
+    }
+
+    return(pos - PERF_FONT_CHARS);
+}
+
+int perf_overlay_enable(Perf *p, LayerList *ll) {
+    Uint32 pixels[PERF_FONT_COUNT * PERF_TILE_W * PERF_TILE_H];
+    unsigned int pitch = PERF_FONT_COUNT * PERF_TILE_W;
+    unsigned int i, x, y;
+
+    if(p->ll != NULL) {
+        return(0);
+    }
+
+    /* dark translucent background so the text is visible over anything */
+    for(i = 0; i < PERF_FONT_COUNT * PERF_TILE_W * PERF_TILE_H; i++) {
+        pixels[i] = TILEMAP_COLOR(0, 0, 0, 192);
+    }
+    for(i = 0; i < PERF_FONT_COUNT; i++) {
+        for(y = 0; y < PERF_FONT_H; y++) {
+            for(x = 0; x < PERF_FONT_W; x++) {
+                if(PERF_FONT[i][y] & (1 << (PERF_FONT_W - 1 - x))) {
+                    pixels[(y * pitch) + (i * PERF_TILE_W) + x] =
+                        TILEMAP_COLOR(255, 255, 255, 255);
+                }
+            }
+        }
+    }
+
+    p->tileset = tilemap_add_tileset(ll, pixels,
+                                     pitch, PERF_TILE_H,
+                                     pitch * sizeof(Uint32),
+                                     PERF_TILE_W, PERF_TILE_H);
+    if(p->tileset < 0) {
+        return(-1);
+    }
+
+    p->tilemap = tilemap_add_tilemap(ll, p->tileset,
+                                     PERF_OVERLAY_W, PERF_OVERLAY_H);
+    if(p->tilemap < 0) {
+        goto error_tileset;
+    }
+
+    /* the tilemap needs to be drawn once before a layer can be drawn */
+    if(tilemap_update_tilemap(ll, p->tilemap, 0, 0, 0, 0) < 0) {
+        goto error_tilemap;
+    }
+
+    p->layer = tilemap_add_layer(ll, p->tilemap);
+    if(p->layer < 0) {
+        goto error_tilemap;
+    }
+
+    if(tilemap_set_layer_pos(ll, p->layer,
+                             PERF_OVERLAY_X, PERF_OVERLAY_Y) < 0 ||
+       tilemap_set_layer_scale(ll, p->layer,
+                               PERF_OVERLAY_SCALE, PERF_OVERLAY_SCALE) < 0) {
+        goto error_layer;
+    }
+
+    p->ll = ll;
+    p->refresh = 0;
+
+    return(0);
+
+error_layer:
+    tilemap_free_layer(ll, p->layer);
+error_tilemap:
+    tilemap_free_tilemap(ll, p->tilemap);
+error_tileset:
+    tilemap_free_tileset(ll, p->tileset);
+
+    return(-1);
+}
+
+void perf_overlay_disable(Perf *p) {
+    if(p->ll == NULL) {
+        return;
+    }
+
+    tilemap_free_layer(p->ll, p->layer);
+    tilemap_free_tilemap(p->ll, p->tilemap);
+    tilemap_free_tileset(p->ll, p->tileset);
+    p->ll = NULL;
+}
+
+int perf_overlay_draw(Perf *p) {
+    unsigned int map[PERF_OVERLAY_W * PERF_OVERLAY_H];
+    char text[PERF_OVERLAY_W + 1];
+    unsigned int i, j;
+    unsigned int val;
+    unsigned int len;
+
+    if(p->ll == NULL) {
+        return(0);
+    }
+
+    if(p->refresh == 0) {
+        for(i = 0; i < PERF_PHASES; i++) {
+            len = snprintf(text, sizeof(text), "%s", PERF_LABELS[i]);
+            for(j = 0; j < PERF_STATS; j++) {
+                val = perf_get_stat(p, i, j);
+                if(val > PERF_OVERLAY_MAX) {
+                    val = PERF_OVERLAY_MAX;
+                }
+                len += snprintf(&(text[len]), sizeof(text) - len,
+                                " %5u", val);
+            }
+            for(j = 0; j < PERF_OVERLAY_W; j++) {
+                map[(i * PERF_OVERLAY_W) + j] = font_tile(text[j]);
+            }
+        }
+
+        if(tilemap_set_tilemap_map(p->ll, p->tilemap,
+                                   0, 0,
+                                   PERF_OVERLAY_W,
+                                   PERF_OVERLAY_W, PERF_OVERLAY_H,
+                                   map, PERF_OVERLAY_W * PERF_OVERLAY_H) < 0) {
+            return(-1);
+        }
+        if(tilemap_update_tilemap(p->ll, p->tilemap, 0, 0, 0, 0) < 0) {
+            return(-1);
+        }
+        /* don't count the overlay against the program's tilemap time */
+        layerlist_get_update_time(p->ll);
+
+        p->refresh = PERF_OVERLAY_REFRESH;
+    }
+    p->refresh--;
+
+    if(tilemap_draw_layer(p->ll, p->layer) < 0) {
+        return(-1);
+    }
+
+    return(0);
+}
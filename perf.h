@@ -0,0 +1,79 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PERF_H
+#define _PERF_H
+
+#include <SDL.h>
+#include "tilemap.h"
+
+/* number of frames kept for the rolling statistics */
+#define PERF_SAMPLES (128)
+
+typedef enum {
+    PERF_EVENT = 0, /* event polling and the event procedure */
+    PERF_FRAME,     /* the frame procedure, including tilemap updates */
+    PERF_TILEMAP,   /* tilemap updates */
+    PERF_PRESENT,   /* SDL_RenderPresent */
+    PERF_TOTAL,     /* time between presented frames */
+    PERF_PHASES
+} PerfPhase;
+
+#define PERF_STAT_MIN (0)
+#define PERF_STAT_AVG (1)
+#define PERF_STAT_P99 (2)
+#define PERF_STATS    (3)
+
+typedef struct {
+    Uint64 freq;
+    Uint64 start[PERF_PHASES];
+    Uint64 elapsed[PERF_PHASES];
+    Uint64 lastCommit;
+
+    /* microseconds per frame for each phase */
+    unsigned int sample[PERF_PHASES][PERF_SAMPLES];
+    unsigned int samples;
+    unsigned int next;
+
+    unsigned int stat[PERF_PHASES][PERF_STATS];
+    int statsValid;
+
+    LayerList *ll;
+    int tileset;
+    int tilemap;
+    int layer;
+    unsigned int refresh;
+} Perf;
+
+void perf_init(Perf *p);
+/* time a phase of the current frame, a phase may be timed more than once per
+ * frame and the times will be added together */
+void perf_begin(Perf *p, PerfPhase phase);
+void perf_end(Perf *p, PerfPhase phase);
+void perf_add(Perf *p, PerfPhase phase, Uint64 ticks);
+/* finish the current frame and add its times to the statistics */
+void perf_commit(Perf *p);
+unsigned int perf_get_stat(Perf *p, PerfPhase phase, unsigned int stat);
+
+/* the overlay is drawn with the same LayerList the program uses */
+int perf_overlay_enable(Perf *p, LayerList *ll);
+void perf_overlay_disable(Perf *p);
+int perf_overlay_draw(Perf *p);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crustyvm.h"
+#include "crustyplugin.h"
+#include "plugin.h"
+
+typedef struct {
+    void *handle;
+    const CrustyPlugin *plugin;
+} LoadedPlugin;
+
+struct PluginList_s {
+    CrustyCallback *cb;
+    unsigned int cbcount;
+
+    LoadedPlugin *plugin;
+    unsigned int plugins;
+
+    CrustyPluginHost host;
+};
+
+#define LOG_PRINTF(PL, FMT, ...) \
+    (PL)->host.log_cb((PL)->host.log_priv, FMT, ##__VA_ARGS__)
+
+PluginList *plugins_new(const CrustyCallback *cb,
+                        unsigned int cbcount,
+                        void (*log_cb)(void *priv, const char *fmt, ...),
+                        void *log_priv) {
+    PluginList *pl;
+
+    pl = malloc(sizeof(PluginList));
+    if(pl == NULL) {
+        log_cb(log_priv, "Failed to allocate memory for plugin list.\n");
+        return(NULL);
+    }
+
+    pl->cb = malloc(sizeof(CrustyCallback) * (cbcount > 0 ? cbcount : 1));
+    if(pl->cb == NULL) {
+        log_cb(log_priv, "Failed to allocate memory for callbacks.\n");
+        free(pl);
+        return(NULL);
+    }
+    memcpy(pl->cb, cb, sizeof(CrustyCallback) * cbcount);
+    pl->cbcount = cbcount;
+    pl->plugin = NULL;
+    pl->plugins = 0;
+    pl->host.abi = CRUSTY_PLUGIN_ABI;
+    pl->host.size = sizeof(CrustyPluginHost);
+    pl->host.log_cb = log_cb;
+    pl->host.log_priv = log_priv;
+
+    return(pl);
+}
+
+/* a plugin is native code, so it's kept to the script's directory at least.
+ * fullpath is the script's real path from crustyvm_open_file(), and the
+ * plugin's path is resolved the same way so neither .. nor a symlink can lead
+ * out of it. */
+static char *plugin_path(PluginList *pl,
+                         const char *fullpath,
+                         const char *name) {
+    const char *slash;
+    char *path;
+    char *realname;
+    unsigned int dirlen;
+
+    slash = strrchr(fullpath, '/');
+    dirlen = slash == NULL ? 0 : slash - fullpath + 1;
+    path = malloc(dirlen + strlen(name) + 1);
+    if(path == NULL) {
+        LOG_PRINTF(pl, "Failed to allocate memory for plugin path.\n");
+        return(NULL);
+    }
+    memcpy(path, fullpath, dirlen);
+    strcpy(&(path[dirlen]), name);
+
+    realname = realpath(path, NULL);
+    free(path);
+    if(realname == NULL) {
+        LOG_PRINTF(pl, "Failed to find plugin %s.\n", name);
+        return(NULL);
+    }
+    if(strncmp(realname, fullpath, dirlen) != 0) {
+        LOG_PRINTF(pl, "Plugin %s is outside of the script's directory.\n",
+                   name);
+        free(realname);
+        return(NULL);
+    }
+
+    return(realname);
+}
+
+int plugins_load(PluginList *pl, const char *fullpath, const char *name) {
+    char *path;
+    void *handle;
+    crusty_plugin_init_func_t init;
+    const CrustyPlugin *plugin;
+    LoadedPlugin *temp;
+    CrustyCallback *tempcb;
+    unsigned int i, j;
+
+    path = plugin_path(pl, fullpath, name);
+    if(path == NULL) {
+        return(-1);
+    }
+
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    free(path);
+    if(handle == NULL) {
+        LOG_PRINTF(pl, "Failed to load plugin %s: %s\n", name, dlerror());
+        return(-1);
+    }
+
+    /* ISO C doesn't allow converting from a void * to a function pointer, but
+     * POSIX requires it to work */
+    *(void **)(&init) = dlsym(handle, CRUSTY_PLUGIN_ENTRY);
+    if(init == NULL) {
+        LOG_PRINTF(pl, "%s isn't a plugin, it has no %s.\n",
+                   name, CRUSTY_PLUGIN_ENTRY);
+        goto error;
+    }
+
+    plugin = init(&(pl->host));
+    if(plugin == NULL) {
+        LOG_PRINTF(pl, "Plugin %s failed to initialize.\n", name);
+        goto error;
+    }
+    /* it's too late to call free if it isn't the same ABI */
+    if(plugin->abi != CRUSTY_PLUGIN_ABI) {
+        LOG_PRINTF(pl, "Plugin %s is for ABI %u, but this is %u.\n",
+                   name, plugin->abi, CRUSTY_PLUGIN_ABI);
+        goto error;
+    }
+
+    for(i = 0; i < plugin->cbcount; i++) {
+        for(j = 0; j < pl->cbcount; j++) {
+            if(strcmp(plugin->cb[i].name, pl->cb[j].name) == 0) {
+                LOG_PRINTF(pl, "Plugin %s callback %s is already defined.\n",
+                           name, plugin->cb[i].name);
+                goto error_free;
+            }
+        }
+    }
+
+    temp = realloc(pl->plugin, sizeof(LoadedPlugin) * (pl->plugins + 1));
+    if(temp == NULL) {
+        LOG_PRINTF(pl, "Failed to allocate memory for plugin list.\n");
+        goto error_free;
+    }
+    pl->plugin = temp;
+    tempcb = realloc(pl->cb,
+                     sizeof(CrustyCallback) *
+                     (pl->cbcount + plugin->cbcount + 1));
+    if(tempcb == NULL) {
+        LOG_PRINTF(pl, "Failed to allocate memory for callbacks.\n");
+        goto error_free;
+    }
+    pl->cb = tempcb;
+
+    memcpy(&(pl->cb[pl->cbcount]), plugin->cb,
+           sizeof(CrustyCallback) * plugin->cbcount);
+    pl->cbcount += plugin->cbcount;
+    pl->plugin[pl->plugins].handle = handle;
+    pl->plugin[pl->plugins].plugin = plugin;
+    pl->plugins++;
+
+    LOG_PRINTF(pl, "Loaded plugin %s (%s), %u callbacks.\n",
+               name, plugin->name, plugin->cbcount);
+
+    return(0);
+
+error_free:
+    if(plugin->free != NULL) {
+        plugin->free();
+    }
+error:
+    dlclose(handle);
+
+    return(-1);
+}
+
+const CrustyCallback *plugins_get_callbacks(PluginList *pl) {
+    return(pl->cb);
+}
+
+unsigned int plugins_get_callback_count(PluginList *pl) {
+    return(pl->cbcount);
+}
+
+void plugins_free(PluginList *pl) {
+    unsigned int i;
+
+    /* unload in the reverse order, in case later ones used earlier ones */
+    for(i = pl->plugins; i > 0; i--) {
+        if(pl->plugin[i - 1].plugin->free != NULL) {
+            pl->plugin[i - 1].plugin->free();
+        }
+        dlclose(pl->plugin[i - 1].handle);
+    }
+
+    free(pl->plugin);
+    free(pl->cb);
+    free(pl);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PLUGIN_H
+#define _PLUGIN_H
+
+#include "crustyvm.h"
+
+/* loads plugins, see crustyplugin.h, and keeps a list of the callbacks from
+ * them all along with the game's own */
+typedef struct PluginList_s PluginList;
+
+/* cb is copied, so needn't remain valid */
+PluginList *plugins_new(const CrustyCallback *cb,
+                        unsigned int cbcount,
+                        void (*log_cb)(void *priv, const char *fmt, ...),
+                        void *log_priv);
+/* load a plugin named in a script's metadata, which is relative to the
+ * directory the script at fullpath is in */
+int plugins_load(PluginList *pl, const char *fullpath, const char *name);
+/* every callback, the game's first.  these are only valid until another
+ * plugin is loaded. */
+const CrustyCallback *plugins_get_callbacks(PluginList *pl);
+unsigned int plugins_get_callback_count(PluginList *pl);
+/* anything using the callbacks must be freed first */
+void plugins_free(PluginList *pl);
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crustyvm.h"
+#include "reload.h"
+
+/* editors may write a file in a few steps, so wait for things to settle */
+#define RELOAD_SETTLE_MS (50)
+
+struct Reloader_s {
+    const char *filename;
+    char *fullpath;
+    unsigned int flags;
+    const CrustyCallback *cb;
+    unsigned int cbcount;
+    const char **var;
+    const char **value;
+    unsigned int vars;
+    void (*log_cb)(void *priv, const char *fmt, ...);
+    void *log_priv;
+
+    int inotify;
+    int quit[2]; /* pipe written to to stop the thread */
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    CrustyVM *cvm; /* loaded and waiting to be picked up */
+};
+
+static CrustyVM *load(Reloader *r) {
+    FILE *in;
+    char *program;
+    long len;
+    CrustyVM *cvm;
+
+    in = fopen(r->fullpath, "rb");
+    if(in == NULL) {
+        r->log_cb(r->log_priv, "Failed to open %s.\n", r->fullpath);
+        return(NULL);
+    }
+
+    if(fseek(in, 0, SEEK_END) < 0) {
+        r->log_cb(r->log_priv, "Failed to seek to end of file.\n");
+        fclose(in);
+        return(NULL);
+    }
+
+    len = ftell(in);
+    if(len < 0) {
+        r->log_cb(r->log_priv, "Failed to get file length.\n");
+        fclose(in);
+        return(NULL);
+    }
+    rewind(in);
+
+    program = malloc(len);
+    if(program == NULL) {
+        r->log_cb(r->log_priv, "Failed to allocate memory for program.\n");
+        fclose(in);
+        return(NULL);
+    }
+
+    if(fread(program, 1, len, in) < (unsigned long)len) {
+        r->log_cb(r->log_priv, "Failed to read file.\n");
+        free(program);
+        fclose(in);
+        return(NULL);
+    }
+    fclose(in);
+
+    cvm = crustyvm_new(r->filename, r->fullpath,
+                       program, len,
+                       r->flags,
+                       0,
+                       r->cb, r->cbcount,
+                       r->var, r->value, r->vars,
+                       r->log_cb, r->log_priv);
+    free(program);
+
+    return(cvm);
+}
+
+/* editors often replace a file rather than writing to it, so watch the
+ * directory a file is in instead of the file.  Watching a directory which is
+ * already watched just gets the same watch back. */
+static int watch_dir(Reloader *r, const char *path) {
+    char *dir;
+    char *slash;
+
+    dir = strdup(path);
+    if(dir == NULL) {
+        r->log_cb(r->log_priv, "Failed to allocate memory for path.\n");
+        return(-1);
+    }
+    slash = strrchr(dir, '/');
+    if(slash == dir) {
+        slash[1] = '\0';
+    } else {
+        slash[0] = '\0';
+    }
+    if(inotify_add_watch(r->inotify, dir,
+                         IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        r->log_cb(r->log_priv, "Failed to watch %s.\n", dir);
+        free(dir);
+        return(-1);
+    }
+    free(dir);
+
+    return(0);
+}
+
+/* includes may be in other directories, and may have changed since the last
+ * load, so watch wherever each one the VM loaded is */
+static int watch_includes(Reloader *r, CrustyVM *cvm) {
+    unsigned int i;
+    char *path;
+    int ret = 0;
+
+    for(i = 0; i < crustyvm_get_includes(cvm); i++) {
+        path = realpath(crustyvm_get_include(cvm, i), NULL);
+        if(path == NULL) {
+            r->log_cb(r->log_priv, "Failed to get full path of %s.\n",
+                      crustyvm_get_include(cvm, i));
+            ret = -1;
+            continue;
+        }
+        if(watch_dir(r, path) < 0) {
+            ret = -1;
+        }
+        free(path);
+    }
+
+    return(ret);
+}
+
+/* temporary and backup files editors leave around aren't interesting */
+static int is_interesting(const struct inotify_event *event) {
+    if(event->len == 0 || event->name[0] == '\0') {
+        return(0);
+    }
+
+    if(event->name[0] == '.' ||
+       event->name[strlen(event->name) - 1] == '~') {
+        return(0);
+    }
+
+    return(1);
+}
+
+/* read all pending events, returns whether any were interesting */
+static int read_events(Reloader *r) {
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *pos;
+    int changed = 0;
+
+    for(;;) {
+        len = read(r->inotify, buf, sizeof(buf));
+        if(len <= 0) {
+            break;
+        }
+
+        for(pos = buf; pos < buf + len;
+            pos += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)pos;
+            if(is_interesting(event)) {
+                changed = 1;
+            }
+        }
+    }
+
+    return(changed);
+}
+
+static void *reload_thread(void *priv) {
+    Reloader *r = priv;
+    struct pollfd fds[2];
+    int changed = 0;
+    CrustyVM *cvm;
+
+    fds[0].fd = r->inotify;
+    fds[0].events = POLLIN;
+    fds[1].fd = r->quit[0];
+    fds[1].events = POLLIN;
+
+    for(;;) {
+        /* once something changed, load after nothing has for a bit */
+        if(poll(fds, 2, changed ? RELOAD_SETTLE_MS : -1) < 0) {
+            continue;
+        }
+
+        if(fds[1].revents != 0) {
+            break;
+        }
+
+        if(fds[0].revents != 0) {
+            if(read_events(r)) {
+                changed = 1;
+            }
+            continue;
+        }
+
+        if(!changed) {
+            continue;
+        }
+        changed = 0;
+
+        r->log_cb(r->log_priv, "Reloading %s...\n", r->filename);
+        cvm = load(r);
+        if(cvm == NULL) {
+            r->log_cb(r->log_priv, "Failed to reload %s, continuing with "
+                                   "what was loaded before.\n", r->filename);
+            continue;
+        }
+        /* a file which can't be watched still gets picked up along with a
+         * change to one which is */
+        watch_includes(r, cvm);
+
+        pthread_mutex_lock(&(r->lock));
+        /* a newer one replaces one which wasn't picked up yet */
+        if(r->cvm != NULL) {
+            crustyvm_free(r->cvm);
+        }
+        r->cvm = cvm;
+        pthread_mutex_unlock(&(r->lock));
+    }
+
+    return(NULL);
+}
+
+Reloader *reloader_new(CrustyVM *cvm,
+                       const char *filename,
+                       char *fullpath,
+                       unsigned int flags,
+                       const CrustyCallback *cb,
+                       unsigned int cbcount,
+                       const char **var,
+                       const char **value,
+                       unsigned int vars,
+                       void (*log_cb)(void *priv, const char *fmt, ...),
+                       void *log_priv) {
+    Reloader *r;
+
+    r = malloc(sizeof(Reloader));
+    if(r == NULL) {
+        log_cb(log_priv, "Failed to allocate memory for reloader.\n");
+        return(NULL);
+    }
+    r->filename = filename;
+    r->fullpath = fullpath;
+    r->flags = flags;
+    r->cb = cb;
+    r->cbcount = cbcount;
+    r->var = var;
+    r->value = value;
+    r->vars = vars;
+    r->log_cb = log_cb;
+    r->log_priv = log_priv;
+    r->cvm = NULL;
+
+    r->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(r->inotify < 0) {
+        log_cb(log_priv, "Failed to initialize inotify.\n");
+        goto error0;
+    }
+
+    if(watch_dir(r, fullpath) < 0 ||
+       watch_includes(r, cvm) < 0) {
+        goto error1;
+    }
+
+    if(pipe(r->quit) < 0) {
+        log_cb(log_priv, "Failed to create pipe.\n");
+        goto error1;
+    }
+
+    if(pthread_mutex_init(&(r->lock), NULL) != 0) {
+        log_cb(log_priv, "Failed to create mutex.\n");
+        goto error2;
+    }
+
+    if(pthread_create(&(r->thread), NULL, reload_thread, r) != 0) {
+        log_cb(log_priv, "Failed to start reload thread.\n");
+        goto error3;
+    }
+
+    return(r);
+
+error3:
+    pthread_mutex_destroy(&(r->lock));
+error2:
+    close(r->quit[0]);
+    close(r->quit[1]);
+error1:
+    close(r->inotify);
+error0:
+    free(r);
+
+    return(NULL);
+}
+
+CrustyVM *reloader_get(Reloader *r) {
+    CrustyVM *cvm;
+
+    pthread_mutex_lock(&(r->lock));
+    cvm = r->cvm;
+    r->cvm = NULL;
+    pthread_mutex_unlock(&(r->lock));
+
+    return(cvm);
+}
+
+void reloader_free(Reloader *r) {
+    char c = 0;
+
+    /* a load in progress is finished before the thread sees this */
+    if(write(r->quit[1], &c, 1) < 1) {
+        r->log_cb(r->log_priv, "Failed to signal reload thread, it'll be "
+                               "cancelled.\n");
+        pthread_cancel(r->thread);
+    }
+    pthread_join(r->thread, NULL);
+
+    if(r->cvm != NULL) {
+        crustyvm_free(r->cvm);
+    }
+
+    pthread_mutex_destroy(&(r->lock));
+    close(r->quit[0]);
+    close(r->quit[1]);
+    close(r->inotify);
+    free(r);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RELOAD_H
+#define _RELOAD_H
+
+#include "crustyvm.h"
+
+/* watches the directories of a script and everything it includes and loads
+ * the script again in the background whenever something in them changes */
+typedef struct Reloader_s Reloader;
+
+/* cvm is the one already loaded, for what it included.  The rest of the
+ * arguments are the same as were given to crustyvm_new() and must remain
+ * valid until the reloader is freed */
+Reloader *reloader_new(CrustyVM *cvm,
+                       const char *filename,
+                       char *fullpath,
+                       unsigned int flags,
+                       const CrustyCallback *cb,
+                       unsigned int cbcount,
+                       const char **var,
+                       const char **value,
+                       unsigned int vars,
+                       void (*log_cb)(void *priv, const char *fmt, ...),
+                       void *log_priv);
+/* get the newest loaded VM if there's been one since the last call, or NULL */
+CrustyVM *reloader_get(Reloader *r);
+void reloader_free(Reloader *r);
+
+#endif
@@ -0,0 +1,226 @@
+#include "unity/unity.h"
+
+#include "../collide.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OBJECTS (300)
+#define ROUNDS (20)
+#define QUERIES (20)
+
+static int obj[OBJECTS * COLLIDE_OBJECT_SIZE];
+static int out[OBJECTS * OBJECTS * 2];
+static int ref[OBJECTS * OBJECTS * 2];
+
+static void log_cb(void *priv, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static int active(const int *a)
+{
+    return a[COLLIDE_OBJECT_GROUPS] != 0 &&
+           a[COLLIDE_OBJECT_W] > 0 && a[COLLIDE_OBJECT_H] > 0;
+}
+
+static int overlaps(const int *a, const int *b)
+{
+    return (long long)a[0] < (long long)b[0] + b[2] &&
+           (long long)b[0] < (long long)a[0] + a[2] &&
+           (long long)a[1] < (long long)b[1] + b[3] &&
+           (long long)b[1] < (long long)a[1] + a[3];
+}
+
+static int compare_pairs(const void *a, const void *b)
+{
+    const int *x = a;
+    const int *y = b;
+
+    if (x[0] != y[0])
+        return x[0] < y[0] ? -1 : 1;
+    if (x[1] != y[1])
+        return x[1] < y[1] ? -1 : 1;
+    return 0;
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    const int *x = a;
+    const int *y = b;
+
+    return *x < *y ? -1 : *x > *y;
+}
+
+/* mostly small objects with the odd big one, so some go on the large list */
+static void random_objects(void)
+{
+    int *o;
+    int i;
+
+    for (i = 0; i < OBJECTS; i++) {
+        o = &obj[i * COLLIDE_OBJECT_SIZE];
+        o[COLLIDE_OBJECT_X] = rand() % 400 - 200;
+        o[COLLIDE_OBJECT_Y] = rand() % 400 - 200;
+        o[COLLIDE_OBJECT_W] = rand() % 10 == 0 ? rand() % 300 : rand() % 20;
+        o[COLLIDE_OBJECT_H] = rand() % 20 - 1;
+        o[COLLIDE_OBJECT_GROUPS] = rand() % 4;
+    }
+}
+
+static int brute_pairs(unsigned int groups1, unsigned int groups2)
+{
+    unsigned int ga, gb;
+    int *a, *b;
+    int found = 0;
+    int i, j;
+
+    for (i = 0; i < OBJECTS; i++) {
+        for (j = i + 1; j < OBJECTS; j++) {
+            a = &obj[i * COLLIDE_OBJECT_SIZE];
+            b = &obj[j * COLLIDE_OBJECT_SIZE];
+            if (!active(a) || !active(b) || !overlaps(a, b))
+                continue;
+            ga = a[COLLIDE_OBJECT_GROUPS];
+            gb = b[COLLIDE_OBJECT_GROUPS];
+            if ((ga & groups1) && (gb & groups2)) {
+                ref[found * 2] = i;
+                ref[found * 2 + 1] = j;
+                found++;
+            } else if ((gb & groups1) && (ga & groups2)) {
+                ref[found * 2] = j;
+                ref[found * 2 + 1] = i;
+                found++;
+            }
+        }
+    }
+
+    return found;
+}
+
+static int brute_area(const int *area, unsigned int groups)
+{
+    int *a;
+    int found = 0;
+    int i;
+
+    if (area[2] <= 0 || area[3] <= 0)
+        return 0;
+    for (i = 0; i < OBJECTS; i++) {
+        a = &obj[i * COLLIDE_OBJECT_SIZE];
+        if (active(a) && (a[COLLIDE_OBJECT_GROUPS] & groups) &&
+            overlaps(a, area)) {
+            ref[found] = i;
+            found++;
+        }
+    }
+
+    return found;
+}
+
+void setUp(void)
+{
+    srand(1);
+}
+
+void tearDown(void)
+{
+}
+
+void test_pairs_match_brute_force(void)
+{
+    Collide *c;
+    unsigned int groups1, groups2;
+    int found, expected;
+    int round;
+
+    c = collide_new(OBJECTS, 16, log_cb, NULL);
+    TEST_ASSERT_TRUE(c != NULL);
+    for (round = 0; round < ROUNDS; round++) {
+        random_objects();
+        TEST_ASSERT_TRUE(collide_update(c, 0, obj, OBJECTS) == 0);
+        groups1 = 1 + rand() % 3;
+        groups2 = 1 + rand() % 3;
+        found = collide_pairs(c, groups1, groups2, out, sizeof(out) / sizeof(int));
+        expected = brute_pairs(groups1, groups2);
+        TEST_ASSERT_TRUE(found == expected);
+        qsort(out, found, sizeof(int) * 2, compare_pairs);
+        qsort(ref, expected, sizeof(int) * 2, compare_pairs);
+        TEST_ASSERT_TRUE(memcmp(out, ref, sizeof(int) * 2 * found) == 0);
+    }
+    collide_free(c);
+}
+
+void test_area_matches_brute_force(void)
+{
+    Collide *c;
+    unsigned int groups;
+    int area[4];
+    int found, expected;
+    int round, query, size;
+
+    c = collide_new(OBJECTS, 16, log_cb, NULL);
+    TEST_ASSERT_TRUE(c != NULL);
+    for (round = 0; round < ROUNDS; round++) {
+        random_objects();
+        TEST_ASSERT_TRUE(collide_update(c, 0, obj, OBJECTS) == 0);
+        /* small areas use the grid, big ones check everything */
+        for (query = 0; query < QUERIES; query++) {
+            size = query < QUERIES / 2 ? 40 : 600;
+            area[0] = rand() % 500 - 250;
+            area[1] = rand() % 500 - 250;
+            area[2] = rand() % size;
+            area[3] = rand() % size;
+            groups = 1 + rand() % 3;
+            found = collide_query(c, area[0], area[1], area[2], area[3],
+                                  groups, out, OBJECTS);
+            expected = brute_area(area, groups);
+            TEST_ASSERT_TRUE(found == expected);
+            qsort(out, found, sizeof(int), compare_ints);
+            TEST_ASSERT_TRUE(memcmp(out, ref, sizeof(int) * found) == 0);
+        }
+    }
+    collide_free(c);
+}
+
+void test_edges_of_int_range(void)
+{
+    int edge[] = {
+        INT_MAX, INT_MAX, 1, 1, 1,
+        INT_MAX - 1, INT_MAX - 1, 2, 2, 1,
+        INT_MAX - 3, 0, INT_MAX, 4, 1,
+        INT_MIN, INT_MIN, 3, 3, 1,
+        INT_MIN, INT_MIN, INT_MAX, INT_MAX, 1
+    };
+    Collide *c;
+
+    c = collide_new(5, 1, log_cb, NULL);
+    TEST_ASSERT_TRUE(c != NULL);
+    TEST_ASSERT_TRUE(collide_update(c, 0, edge, 5) == 0);
+    /* with both in the same groups either order is right */
+    TEST_ASSERT_TRUE(collide_pairs(c, 1, 1, out, 10) == 2);
+    TEST_ASSERT_TRUE(out[0] + out[1] == 1 || out[0] + out[1] == 7);
+    TEST_ASSERT_TRUE(out[2] + out[3] == 1 || out[2] + out[3] == 7);
+    TEST_ASSERT_TRUE(out[0] + out[1] != out[2] + out[3]);
+    TEST_ASSERT_TRUE(collide_query(c, INT_MAX, INT_MAX, 1, 1, 1, out, 5) == 2);
+    TEST_ASSERT_TRUE(collide_query(c, INT_MAX - 2, INT_MAX - 2,
+                                   INT_MAX, INT_MAX, 1, out, 5) == 2);
+    TEST_ASSERT_TRUE(collide_query(c, INT_MIN, INT_MIN, 2, 2, 1, out, 5) == 2);
+    collide_free(c);
+}
+
+int main(int argc, char *argv[])
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_pairs_match_brute_force);
+    RUN_TEST(test_area_matches_brute_force);
+    RUN_TEST(test_edges_of_int_range);
+    return UNITY_END();
+}
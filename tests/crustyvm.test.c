@@ -0,0 +1,1153 @@
+#include "unity/unity.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../crustyvm.h"
+
+#define FRAMES (30)
+#define KEEP (8)
+#define WORDS (4096)
+#define OUTS (256)
+#define BULK (37)
+#define NAMES (1500)
+#define INCLUDES (8)
+
+/* scatters writes over a few pages each frame, so snapshots only keep some */
+static const char program[] =
+    "static arr ints 4096\n"
+    "static seed 12345\n"
+    "static frames 0\n"
+    "proc frame\n"
+    "  local i 0\n"
+    "  local j 0\n"
+    "  label top\n"
+    "    mul seed 1103515245\n"
+    "    add seed 12345\n"
+    "    and seed 2147483647\n"
+    "    move j seed\n"
+    "    mod j 4096\n"
+    "    add arr:j i\n"
+    "    add i 1\n"
+    "    cmp i 20\n"
+    "    jumpl top\n"
+    "  add frames 1\n"
+    "ret\n"
+    "proc dump\n"
+    "  move state arr\n"
+    "  move state seed\n"
+    "  move state frames\n"
+    "ret\n";
+
+/* the same program edited: a new variable, a shorter array and a changed
+ * initializer */
+static const char edited[] =
+    "static extra 7\n"
+    "static frames 0\n"
+    "static arr ints 2048\n"
+    "static seed 999\n"
+    "proc dump\n"
+    "  move state arr\n"
+    "  move state seed\n"
+    "  move state frames\n"
+    "  move state extra\n"
+    "ret\n";
+
+/* moves are folded across the jump over dead code but not past the labels
+ * which are jumped to, and the loop still counts */
+static const char folded[] =
+    "proc init\n"
+    "  local a 0\n"
+    "  local b 0\n"
+    "  local unread 0\n"
+    "  move a 5\n"
+    "  move b a\n"
+    "  jump skip\n"
+    "  move b 100\n"
+    "  move out b\n"
+    "  label skip\n"
+    "  move unread 3\n"
+    "  add b a\n"
+    "  move out b\n"
+    "  move a 7\n"
+    "  label again\n"
+    "    move out a\n"
+    "    add a 1\n"
+    "    cmp a 10\n"
+    "    jumpl again\n"
+    "  move out a\n"
+    "  jump next\n"
+    "  label next\n"
+    "  move b a\n"
+    "  mul b 2\n"
+    "  move out b\n"
+    "ret\n";
+
+/* small enough to be inlined, writing back through both arguments */
+static const char inlined[] =
+    "static g ints \"1 2 3\"\n"
+    "proc bump x amount\n"
+    "  local twice 0\n"
+    "  move twice amount\n"
+    "  mul twice 2\n"
+    "  add x twice\n"
+    "  move amount x\n"
+    "ret\n"
+    "proc init\n"
+    "  local v 3\n"
+    "  local n 4\n"
+    "  call bump v n\n"
+    "  move out v\n"
+    "  move out n\n"
+    "  call bump g:1 v\n"
+    "  move out g:1\n"
+    "  move out v\n"
+    "  call bump v n\n"
+    "  move out v\n"
+    "ret\n";
+
+/* sums n down to 0 in to total, calling itself so it can't be inlined */
+static const char recursive[] =
+    "stack 256\n"
+    "proc sum n total\n"
+    "  local m 0\n"
+    "  cmp n 0\n"
+    "  jumpz done\n"
+    "  add total n\n"
+    "  move m n\n"
+    "  sub m 1\n"
+    "  call sum m total\n"
+    "  label done\n"
+    "ret\n"
+    "proc init\n"
+    "  local n 5\n"
+    "  local total 0\n"
+    "  call sum n total\n"
+    "  move out total\n"
+    "  move out n\n"
+    "ret\n";
+
+/* macros calling macros, a macro defining a static, if with expressions and
+ * macro arguments and expressions made from other expressions */
+static const char macros[] =
+    "expr THREE 3\n"
+    "macro EMIT VAL\n"
+    "  move out VAL\n"
+    "endmacro EMIT\n"
+    "macro TWICE FIRST SECOND\n"
+    "  EMIT FIRST\n"
+    "  EMIT SECOND\n"
+    "  EMIT FIRST\n"
+    "endmacro TWICE\n"
+    "macro DEF NAME INIT\n"
+    "  static NAME INIT\n"
+    "endmacro DEF\n"
+    "DEF later 42\n"
+    "macro MAYBE COND WHAT\n"
+    "  if COND EMIT WHAT\n"
+    "endmacro MAYBE\n"
+    "proc init\n"
+    "  TWICE 1 2\n"
+    "  if THREE EMIT 5\n"
+    "  if 0 EMIT 6\n"
+    "  expr SEVEN THREE*2+1\n"
+    "  EMIT SEVEN\n"
+    "  TWICE THREE SEVEN\n"
+    "  MAYBE 0 8\n"
+    "  MAYBE 1 9\n"
+    "  move out later\n"
+    "ret\n";
+
+/* files for the include cases, written out in a temporary directory since
+ * includes are opened relative to where the program is run from */
+static const struct {
+    const char *name;
+    const char *text;
+} includes[] = {
+    { "sub/a.inc",
+      "include sub/b.inc\n"
+      "macro EMIT2 V\n"
+      "  EMITB V\n"
+      "  EMITB V\n"
+      "endmacro EMIT2\n" },
+    { "sub/b.inc",
+      "static fromb 9\n"
+      "macro EMITB V\n"
+      "  move out V\n"
+      "endmacro EMITB\n" },
+    { "sub/c.inc", "include sub/d.inc\n" },
+    { "sub/d.inc", "include sub/c.inc\n" },
+    { "sub/e.inc",
+      "static ok 1\n"
+      "bogus line here\n" }
+};
+
+/* chars, ints and floats declared in an order which would leave them
+ * misaligned if laid out as declared, each passed to "where" */
+static const char mixed[] =
+    "static c1 string \"abc\"\n"
+    "static i1 5\n"
+    "static fa floats 3\n"
+    "static c2 string \"de\"\n"
+    "static f1 floats \"1.5\"\n"
+    "static ia ints 3\n"
+    "proc inner\n"
+    "  local lc string \"xyz\"\n"
+    "  local lf floats \"2.5\"\n"
+    "  local li 7\n"
+    "  local lfa floats 5\n"
+    "  move where lc\n"
+    "  move where lf\n"
+    "  move where li\n"
+    "  move where lfa\n"
+    "ret\n"
+    "proc outer\n"
+    "  local oc string \"q\"\n"
+    "  local oi 1\n"
+    "  local of floats \"0.5\"\n"
+    "  move where oc\n"
+    "  move where oi\n"
+    "  move where of\n"
+    "  call inner\n"
+    "ret\n"
+    "proc init\n"
+    "  local ic string \"12345\"\n"
+    "  local iff floats \"3.5\"\n"
+    "  move where c1\n"
+    "  move where i1\n"
+    "  move where fa\n"
+    "  move where c2\n"
+    "  move where f1\n"
+    "  move where ia\n"
+    "  move where ic\n"
+    "  move where iff\n"
+    "  call outer\n"
+    "ret\n";
+
+/* goes around a loop calling a procedure which calls a callback, then
+ * indexes past the end of arr */
+static const char recorded[] =
+    "static arr ints 2\n"
+    "proc put v\n"
+    "  move out v\n"
+    "ret\n"
+    "proc init\n"
+    "  local i 0\n"
+    "  label again\n"
+    "    call put i\n"
+    "    add i 1\n"
+    "    cmp i 3\n"
+    "    jumpl again\n"
+    "  move arr:i 1\n"
+    "ret\n";
+
+#define RECORDED_LOOP \
+    "flight recorder: rec:8 init\n" \
+    "flight recorder: rec:3 put\n" \
+    "flight recorder: rec:3 -> out\n" \
+    "flight recorder: rec:4 put\n" \
+    "flight recorder: rec:9 init\n" \
+    "flight recorder: rec:10 init\n" \
+    "flight recorder: rec:11 init\n"
+
+/* dirty leaves other values where fresh's frame goes, fresh reads its locals
+ * before setting them, and c only on the path where flag is 0 */
+static const char uninitialized[] =
+    "proc dirty\n"
+    "  local d1 111\n"
+    "  local d2 222\n"
+    "  local d3 333\n"
+    "  local d4 444\n"
+    "  local darr ints 8\n"
+    "  fill darr 99 8\n"
+    "  move d1 555\n"
+    "ret\n"
+    "proc fresh flag\n"
+    "  local a 7\n"
+    "  local b 0\n"
+    "  local c 0\n"
+    "  local set 0\n"
+    "  local arr ints 4\n"
+    "  local part ints \"1 2 3 4\"\n"
+    "  move out a\n"
+    "  move out b\n"
+    "  move out arr:2\n"
+    "  move out part:3\n"
+    "  cmp flag 0\n"
+    "  jumpz skip\n"
+    "  move c 5\n"
+    "  label skip\n"
+    "  move out c\n"
+    "  move set 9\n"
+    "  move out set\n"
+    "  move a 1\n"
+    "  move b 2\n"
+    "  move arr:2 3\n"
+    "  move part:3 8\n"
+    "ret\n"
+    "proc init\n"
+    "  local one 1\n"
+    "  local zero 0\n"
+    "  call dirty\n"
+    "  call fresh zero\n"
+    "  call dirty\n"
+    "  call fresh one\n"
+    "  call fresh zero\n"
+    "ret\n";
+
+/* bulk instructions on lengths which aren't a whole number of vectors and
+ * with the source overlapping the destination either way */
+static const char bulkops[] =
+    "static ia ints 37\n"
+    "static ca string \"0123456789012345678901234567890123456\"\n"
+    "static fa floats 37\n"
+    "proc reset\n"
+    "  local i 0\n"
+    "  label again\n"
+    "    move ia:i i\n"
+    "    mul ia:i 3\n"
+    "    add ia:i 1\n"
+    "    move ca:i ia:i\n"
+    "    move fa:i ia:i\n"
+    "    div fa:i 4\n"
+    "    add i 1\n"
+    "    cmp i 37\n"
+    "    jumpl again\n"
+    "ret\n"
+    "proc dump\n"
+    "  move arrays ia\n"
+    "  move arrays ca\n"
+    "  move arrays fa\n"
+    "ret\n"
+    "proc copyup\n"
+    "  copy ia:1 ia 35\n"
+    "ret\n"
+    "proc copydown\n"
+    "  copy ia ia:3 33\n"
+    "ret\n"
+    "proc addup\n"
+    "  vadd ia:2 ia 33\n"
+    "ret\n"
+    "proc adddown\n"
+    "  vadd ia ia:1 35\n"
+    "ret\n"
+    "proc andints\n"
+    "  vand ia ia:4 15\n"
+    "ret\n"
+    "proc fillints\n"
+    "  fill ia:1 5 9\n"
+    "ret\n"
+    "proc mulchars\n"
+    "  vmul ca ca:5 31\n"
+    "ret\n"
+    "proc orchars\n"
+    "  vor ca:3 7 17\n"
+    "ret\n"
+    "proc addfloatsup\n"
+    "  vadd fa:1 fa 35\n"
+    "ret\n"
+    "proc addfloats\n"
+    "  vadd fa 3 13\n"
+    "ret\n"
+    "proc convert\n"
+    "  copy fa ia:2 7\n"
+    "ret\n";
+
+/* everything the program keeps, as dumped after each frame */
+typedef struct {
+    int arr[WORDS];
+    int seed;
+    int frames;
+    int extra;
+} State;
+
+static State seen[FRAMES];
+static State now;
+static unsigned int dumped;
+
+/* what's written to "out" and logged while loading */
+static int outs[OUTS];
+static unsigned int outcount;
+static char logged[8192];
+static size_t loggedlen;
+
+static void log_cb(void *priv, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    va_start(ap, fmt);
+    len = vsnprintf(&(logged[loggedlen]), sizeof(logged) - loggedlen, fmt, ap);
+    va_end(ap);
+    if (len > 0) {
+        loggedlen += len;
+        if (loggedlen >= sizeof(logged))
+            loggedlen = sizeof(logged) - 1;
+    }
+}
+
+static void clear_log(void)
+{
+    loggedlen = 0;
+    logged[0] = '\0';
+}
+
+static int out_write(void *priv,
+                     CrustyType type,
+                     unsigned int size,
+                     void *ptr,
+                     unsigned int index)
+{
+    /* an array element comes with the rest of the array, only take the one */
+    if (type != CRUSTY_TYPE_INT || outcount == OUTS)
+        return(-1);
+
+    outs[outcount] = *(int *)ptr;
+    outcount++;
+
+    return(0);
+}
+
+static int state_write(void *priv,
+                       CrustyType type,
+                       unsigned int size,
+                       void *ptr,
+                       unsigned int index)
+{
+    if (type != CRUSTY_TYPE_INT)
+        return(-1);
+
+    if (dumped == 0) {
+        if (size > WORDS)
+            return(-1);
+        memset(&now, 0, sizeof(now));
+        memcpy(now.arr, ptr, sizeof(int) * size);
+    } else if (dumped == 1) {
+        now.seed = *(int *)ptr;
+    } else if (dumped == 2) {
+        now.frames = *(int *)ptr;
+    } else {
+        now.extra = *(int *)ptr;
+    }
+    dumped++;
+
+    return(0);
+}
+
+static const CrustyCallback cb[] = {
+    {
+        .name = "state", .length = WORDS, .readType = CRUSTY_TYPE_INT,
+        .read = NULL, .readpriv = NULL,
+        .write = state_write, .writepriv = NULL
+    }
+};
+
+/* the arrays dumped by the bulk program */
+static int ia[BULK];
+static unsigned char ca[BULK];
+static double fa[BULK];
+
+static int arrays_write(void *priv,
+                        CrustyType type,
+                        unsigned int size,
+                        void *ptr,
+                        unsigned int index)
+{
+    if (size != BULK)
+        return(-1);
+
+    if (type == CRUSTY_TYPE_INT)
+        memcpy(ia, ptr, sizeof(ia));
+    else if (type == CRUSTY_TYPE_CHAR)
+        memcpy(ca, ptr, sizeof(ca));
+    else
+        memcpy(fa, ptr, sizeof(fa));
+
+    return(0);
+}
+
+/* variables passed to "where" and how many weren't naturally aligned */
+static unsigned int placed;
+static unsigned int misaligned;
+
+static int where_write(void *priv,
+                       CrustyType type,
+                       unsigned int size,
+                       void *ptr,
+                       unsigned int index)
+{
+    size_t align = 1;
+
+    if (type == CRUSTY_TYPE_INT)
+        align = sizeof(int);
+    else if (type == CRUSTY_TYPE_FLOAT)
+        align = sizeof(double);
+    if ((uintptr_t)ptr % align != 0)
+        misaligned++;
+    placed++;
+
+    return(0);
+}
+
+static const CrustyCallback outcb[] = {
+    {
+        .name = "out", .length = 1, .readType = CRUSTY_TYPE_INT,
+        .read = NULL, .readpriv = NULL,
+        .write = out_write, .writepriv = NULL
+    },
+    {
+        .name = "arrays", .length = BULK, .readType = CRUSTY_TYPE_INT,
+        .read = NULL, .readpriv = NULL,
+        .write = arrays_write, .writepriv = NULL
+    },
+    {
+        .name = "where", .length = 1, .readType = CRUSTY_TYPE_INT,
+        .read = NULL, .readpriv = NULL,
+        .write = where_write, .writepriv = NULL
+    }
+};
+#define OUTCBS (sizeof(outcb) / sizeof(outcb[0]))
+
+static CrustyVM *load(unsigned int flags)
+{
+    return(crustyvm_new("snapshot", NULL, program, sizeof(program) - 1,
+                        flags, 0, cb, 1, NULL, NULL, 0, log_cb, NULL));
+}
+
+static void dump(CrustyVM *cvm)
+{
+    dumped = 0;
+    TEST_ASSERT_TRUE(crustyvm_run(cvm, "dump") == 0);
+}
+
+static int matches(CrustyVM *cvm, unsigned int frame)
+{
+    dump(cvm);
+    return(memcmp(&now, &seen[frame], sizeof(State)) == 0);
+}
+
+/* run frames, snapshotting after each, then go back and run them again */
+static void round_trip(unsigned int flags)
+{
+    CrustyVM *cvm;
+    CrustyVM *other;
+    CrustySnapshot *snap;
+    unsigned int f;
+
+    cvm = load(flags);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    snap = crustyvm_snapshot_new(cvm, KEEP);
+    TEST_ASSERT_TRUE(snap != NULL);
+
+    for (f = 0; f < FRAMES; f++) {
+        TEST_ASSERT_TRUE(crustyvm_run(cvm, "frame") == 0);
+        dump(cvm);
+        seen[f] = now;
+        TEST_ASSERT_TRUE(crustyvm_snapshot(cvm, snap) == 0);
+    }
+    TEST_ASSERT_TRUE(seen[FRAMES - 1].frames == FRAMES);
+    TEST_ASSERT_TRUE(crustyvm_snapshot_count(snap) == KEEP);
+
+    /* older ones than were kept can't be had */
+    TEST_ASSERT_TRUE(crustyvm_restore(cvm, snap, KEEP) < 0);
+    TEST_ASSERT_TRUE(crustyvm_restore(cvm, snap, 5) == 0);
+    TEST_ASSERT_TRUE(matches(cvm, FRAMES - 6));
+    TEST_ASSERT_TRUE(crustyvm_snapshot_count(snap) == KEEP - 5);
+
+    /* running again from there gives the same frames */
+    for (f = FRAMES - 5; f < FRAMES; f++) {
+        TEST_ASSERT_TRUE(crustyvm_run(cvm, "frame") == 0);
+        TEST_ASSERT_TRUE(matches(cvm, f));
+        TEST_ASSERT_TRUE(crustyvm_snapshot(cvm, snap) == 0);
+    }
+
+    /* back past the frames which were run again */
+    TEST_ASSERT_TRUE(crustyvm_restore(cvm, snap, KEEP - 1) == 0);
+    TEST_ASSERT_TRUE(matches(cvm, FRAMES - KEEP));
+
+    /* and on to another instance of the same program */
+    other = crustyvm_instance(cvm, NULL, 0);
+    TEST_ASSERT_TRUE(other != NULL);
+    TEST_ASSERT_TRUE(crustyvm_restore(other, snap, 0) == 0);
+    TEST_ASSERT_TRUE(matches(other, FRAMES - KEEP));
+
+    crustyvm_free(other);
+    crustyvm_snapshot_free(snap);
+    crustyvm_free(cvm);
+}
+
+/* load a program and run its init, collecting what it outputs and logs */
+static void run_init(const char *text, unsigned int flags)
+{
+    CrustyVM *cvm;
+
+    outcount = 0;
+    clear_log();
+    cvm = crustyvm_new("test", NULL, text, strlen(text), flags, 0,
+                       outcb, OUTCBS, NULL, NULL, 0, log_cb, NULL);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    TEST_ASSERT_TRUE(crustyvm_run(cvm, "init") == 0);
+    crustyvm_free(cvm);
+}
+
+/* run a program's init with and without optimization and check both output
+ * what's expected */
+static void optimized_matches(const char *text,
+                              const int *expected,
+                              unsigned int count)
+{
+    run_init(text, 0);
+    TEST_ASSERT_TRUE(outcount == count);
+    TEST_ASSERT_TRUE(memcmp(outs, expected, sizeof(int) * count) == 0);
+
+    run_init(text, CRUSTY_FLAG_OPTIMIZE);
+    TEST_ASSERT_TRUE(outcount == count);
+    TEST_ASSERT_TRUE(memcmp(outs, expected, sizeof(int) * count) == 0);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_snapshot_round_trip(void)
+{
+    round_trip(0);
+}
+
+void test_snapshot_round_trip_optimized(void)
+{
+    round_trip(CRUSTY_FLAG_OPTIMIZE);
+}
+
+void test_snapshot_other_program(void)
+{
+    CrustyVM *cvm;
+    CrustyVM *other;
+    CrustySnapshot *snap;
+
+    cvm = load(0);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    other = load(0);
+    TEST_ASSERT_TRUE(other != NULL);
+    snap = crustyvm_snapshot_new(cvm, KEEP);
+    TEST_ASSERT_TRUE(snap != NULL);
+    TEST_ASSERT_TRUE(crustyvm_snapshot(cvm, snap) == 0);
+    /* a separately loaded program isn't an instance of the same one */
+    TEST_ASSERT_TRUE(crustyvm_restore(other, snap, 0) < 0);
+
+    crustyvm_snapshot_free(snap);
+    crustyvm_free(other);
+    crustyvm_free(cvm);
+}
+
+void test_migrate_to_edited_program(void)
+{
+    CrustyVM *cvm;
+    CrustyVM *reloaded;
+    unsigned int f;
+
+    cvm = load(0);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    for (f = 0; f < 10; f++)
+        TEST_ASSERT_TRUE(crustyvm_run(cvm, "frame") == 0);
+    dump(cvm);
+    seen[0] = now;
+
+    reloaded = crustyvm_new("edited", NULL, edited, sizeof(edited) - 1,
+                            0, 0, cb, 1, NULL, NULL, 0, log_cb, NULL);
+    TEST_ASSERT_TRUE(reloaded != NULL);
+    /* arr and frames, seed's initializer changed */
+    TEST_ASSERT_TRUE(crustyvm_migrate(reloaded, cvm) == 2);
+    dump(reloaded);
+    TEST_ASSERT_TRUE(memcmp(now.arr, seen[0].arr, sizeof(int) * 2048) == 0);
+    TEST_ASSERT_TRUE(now.arr[2048] == 0);
+    TEST_ASSERT_TRUE(now.frames == 10);
+    TEST_ASSERT_TRUE(now.seed == 999);
+    TEST_ASSERT_TRUE(now.extra == 7);
+
+    crustyvm_free(reloaded);
+    crustyvm_free(cvm);
+}
+
+void test_optimize_folds_across_jumps(void)
+{
+    static const int expected[] = { 10, 7, 8, 9, 10, 20 };
+
+    optimized_matches(folded, expected, sizeof(expected) / sizeof(int));
+    /* the code after the jumps and the unread store are gone */
+    TEST_ASSERT_TRUE(strstr(logged, "init: 19 -> 14 instructions") != NULL);
+}
+
+void test_optimize_inlines_reference_writes(void)
+{
+    static const int expected[] = { 11, 11, 24, 24, 46 };
+
+    optimized_matches(inlined, expected, sizeof(expected) / sizeof(int));
+    TEST_ASSERT_TRUE(strstr(logged, "init: 3 calls inlined") != NULL);
+}
+
+void test_optimize_keeps_recursion(void)
+{
+    static const int expected[] = { 15, 5 };
+
+    optimized_matches(recursive, expected, sizeof(expected) / sizeof(int));
+    TEST_ASSERT_TRUE(strstr(logged, "calls inlined") == NULL);
+}
+
+void test_locals_read_before_set(void)
+{
+    static const int expected[] = {
+        7, 0, 0, 4, 0, 9,
+        7, 0, 0, 4, 5, 9,
+        7, 0, 0, 4, 0, 9
+    };
+
+    optimized_matches(uninitialized, expected, sizeof(expected) / sizeof(int));
+}
+
+void test_interned_names(void)
+{
+    static const int expected[] = { 0, 1001, 10, 100, 1023, 1024, 1499 };
+    char *text;
+    size_t len = 0;
+    unsigned int i;
+
+    /* enough names that the intern table and token memory grow, names which
+       are prefixes of others and a name passed through a macro */
+    text = malloc(NAMES * 32 + 1024);
+    TEST_ASSERT_TRUE(text != NULL);
+    for (i = 0; i < NAMES; i++)
+        len += sprintf(&(text[len]), "static v%u %u\n", i, i);
+    sprintf(&(text[len]),
+            "macro SET NAME VAL\n"
+            "  move NAME VAL\n"
+            "endmacro SET\n"
+            "proc init\n"
+            "  SET v1 1001\n"
+            "  move out v0\n"
+            "  move out v1\n"
+            "  move out v10\n"
+            "  move out v100\n"
+            "  move out v1023\n"
+            "  move out v1024\n"
+            "  move out v1499\n"
+            "ret\n");
+
+    run_init(text, 0);
+    TEST_ASSERT_TRUE(outcount == sizeof(expected) / sizeof(int));
+    TEST_ASSERT_TRUE(memcmp(outs, expected, sizeof(expected)) == 0);
+    free(text);
+}
+
+static void write_file(const char *name, const char *text)
+{
+    FILE *out;
+
+    out = fopen(name, "w");
+    TEST_ASSERT_TRUE(out != NULL);
+    fputs(text, out);
+    TEST_ASSERT_TRUE(fclose(out) == 0);
+}
+
+/* loading fails and logs message */
+static void fails_with(const char *text, const char *message)
+{
+    CrustyVM *cvm;
+
+    clear_log();
+    cvm = crustyvm_new("test", NULL, text, strlen(text), 0, 0,
+                       outcb, OUTCBS, NULL, NULL, 0, log_cb, NULL);
+    TEST_ASSERT_TRUE(cvm == NULL);
+    TEST_ASSERT_TRUE(strstr(logged, message) != NULL);
+}
+
+void test_preprocess_macros(void)
+{
+    static const int expected[] = { 1, 2, 1, 5, 7, 3, 7, 3, 9, 42 };
+    char deep[4096];
+    size_t len = 0;
+    unsigned int i;
+
+    run_init(macros, 0);
+    TEST_ASSERT_TRUE(outcount == sizeof(expected) / sizeof(int));
+    TEST_ASSERT_TRUE(memcmp(outs, expected, sizeof(expected)) == 0);
+
+    fails_with("macro LOOP A\n"
+               "  LOOP A\n"
+               "endmacro LOOP\n"
+               "proc init\n"
+               "  LOOP 1\n"
+               "ret\n",
+               "test:2: Macro called recursively: LOOP.");
+    fails_with("macro PING A\n"
+               "  PONG A\n"
+               "endmacro PING\n"
+               "macro PONG A\n"
+               "  PING A\n"
+               "endmacro PONG\n"
+               "proc init\n"
+               "  PING 1\n"
+               "ret\n",
+               "test:5: Macro called recursively: PING.");
+    fails_with("macro TWO A B\n"
+               "  move out A\n"
+               "endmacro TWO\n"
+               "proc init\n"
+               "  TWO 1\n"
+               "ret\n",
+               "test:5: Wrong number of arguments to macro: got 1, expected 2.");
+
+    /* more macros deep than the macro stack holds */
+    for (i = 0; i < 40; i++) {
+        len += sprintf(&(deep[len]),
+                       "macro DEEP%u\n  DEEP%u\nendmacro DEEP%u\n",
+                       i, i + 1, i);
+    }
+    sprintf(&(deep[len]),
+            "macro DEEP40\n"
+            "  move out 1\n"
+            "endmacro DEEP40\n"
+            "proc init\n"
+            "  DEEP0\n"
+            "ret\n");
+    fails_with(deep, "Macro stack filled.");
+}
+
+void test_preprocess_includes(void)
+{
+    static const int expected[] = { 7, 7, 9 };
+    char dir[] = "/tmp/crustyvm.test.XXXXXX";
+    char here[PATH_MAX];
+    unsigned int i;
+
+    TEST_ASSERT_TRUE(getcwd(here, sizeof(here)) != NULL);
+    TEST_ASSERT_TRUE(mkdtemp(dir) != NULL);
+    TEST_ASSERT_TRUE(chdir(dir) == 0);
+    TEST_ASSERT_TRUE(mkdir("sub", 0755) == 0);
+    for (i = 0; i < sizeof(includes) / sizeof(includes[0]); i++)
+        write_file(includes[i].name, includes[i].text);
+
+    /* nested includes with macros calling macros from a further include */
+    run_init("include sub/a.inc\n"
+             "proc init\n"
+             "  EMIT2 7\n"
+             "  move out fromb\n"
+             "ret\n", 0);
+    TEST_ASSERT_TRUE(outcount == sizeof(expected) / sizeof(int));
+    TEST_ASSERT_TRUE(memcmp(outs, expected, sizeof(expected)) == 0);
+
+    fails_with("include sub/c.inc\n"
+               "proc init\n"
+               "ret\n",
+               "Circular includes.");
+    /* errors point at the line in the included file */
+    fails_with("include sub/e.inc\n"
+               "proc init\n"
+               "ret\n",
+               "sub/e.inc:2: Invalid keyword or macro not found: bogus.");
+
+    for (i = 0; i < sizeof(includes) / sizeof(includes[0]); i++)
+        unlink(includes[i].name);
+    rmdir("sub");
+    TEST_ASSERT_TRUE(chdir(here) == 0);
+    TEST_ASSERT_TRUE(rmdir(dir) == 0);
+}
+
+/* each of bulkops' procedures done in C, on the arrays as reset */
+static void bulk_expected(const char *name,
+                          int *ei,
+                          unsigned char *ec,
+                          double *ef)
+{
+    int oi[BULK];
+    unsigned char oc[BULK];
+    double of[BULK];
+    unsigned int i;
+
+    for (i = 0; i < BULK; i++) {
+        oi[i] = (i * 3) + 1;
+        oc[i] = oi[i];
+        of[i] = oi[i] / 4.0;
+    }
+    memcpy(ei, oi, sizeof(oi));
+    memcpy(ec, oc, sizeof(oc));
+    memcpy(ef, of, sizeof(of));
+
+    if (strcmp(name, "copyup") == 0) {
+        for (i = 0; i < 35; i++)
+            ei[i + 1] = oi[i];
+    } else if (strcmp(name, "copydown") == 0) {
+        for (i = 0; i < 33; i++)
+            ei[i] = oi[i + 3];
+    } else if (strcmp(name, "addup") == 0) {
+        for (i = 0; i < 33; i++)
+            ei[i + 2] = oi[i + 2] + oi[i];
+    } else if (strcmp(name, "adddown") == 0) {
+        for (i = 0; i < 35; i++)
+            ei[i] = oi[i] + oi[i + 1];
+    } else if (strcmp(name, "andints") == 0) {
+        for (i = 0; i < 15; i++)
+            ei[i] = oi[i] & oi[i + 4];
+    } else if (strcmp(name, "fillints") == 0) {
+        for (i = 0; i < 9; i++)
+            ei[i + 1] = 5;
+    } else if (strcmp(name, "mulchars") == 0) {
+        for (i = 0; i < 31; i++)
+            ec[i] = oc[i] * oc[i + 5];
+    } else if (strcmp(name, "orchars") == 0) {
+        for (i = 0; i < 17; i++)
+            ec[i + 3] = oc[i + 3] | 7;
+    } else if (strcmp(name, "addfloatsup") == 0) {
+        for (i = 0; i < 35; i++)
+            ef[i + 1] = of[i + 1] + of[i];
+    } else if (strcmp(name, "addfloats") == 0) {
+        for (i = 0; i < 13; i++)
+            ef[i] = of[i] + 3;
+    } else { /* convert */
+        for (i = 0; i < 7; i++)
+            ef[i] = oi[i + 2];
+    }
+}
+
+void test_bulk_partial_and_overlapping(void)
+{
+    static const char *procs[] = {
+        "copyup", "copydown", "addup", "adddown", "andints", "fillints",
+        "mulchars", "orchars", "addfloatsup", "addfloats", "convert"
+    };
+    int ei[BULK];
+    unsigned char ec[BULK];
+    double ef[BULK];
+    CrustyVM *cvm;
+    unsigned int i;
+
+    cvm = crustyvm_new("bulk", NULL, bulkops, sizeof(bulkops) - 1, 0, 0,
+                       outcb, OUTCBS, NULL, NULL, 0, log_cb, NULL);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    for (i = 0; i < sizeof(procs) / sizeof(procs[0]); i++) {
+        TEST_ASSERT_TRUE(crustyvm_run(cvm, "reset") == 0);
+        TEST_ASSERT_TRUE(crustyvm_run(cvm, procs[i]) == 0);
+        TEST_ASSERT_TRUE(crustyvm_run(cvm, "dump") == 0);
+        bulk_expected(procs[i], ei, ec, ef);
+        TEST_ASSERT_TRUE(memcmp(ia, ei, sizeof(ia)) == 0);
+        TEST_ASSERT_TRUE(memcmp(ca, ec, sizeof(ca)) == 0);
+        TEST_ASSERT_TRUE(memcmp(fa, ef, sizeof(fa)) == 0);
+    }
+    crustyvm_free(cvm);
+}
+
+/* load text from the current directory, with includes loaded ahead on
+ * threads if safepath is given, and run its init recording each instruction.
+ * returns what was logged. */
+static char *load_recorded(const char *text,
+                           char *safepath,
+                           unsigned long long *hash)
+{
+    CrustyVM *cvm;
+    char *copy;
+
+    outcount = 0;
+    clear_log();
+    cvm = crustyvm_new("main.cvm", safepath, text, strlen(text), 0, 0,
+                       outcb, OUTCBS, NULL, NULL, 0, log_cb, NULL);
+    if (cvm != NULL) {
+        *hash = crustyvm_get_hash(cvm);
+        TEST_ASSERT_TRUE(crustyvm_record(cvm, 256) == 0);
+        TEST_ASSERT_TRUE(crustyvm_run(cvm, "init") == 0);
+        crustyvm_record_dump(cvm);
+        crustyvm_free(cvm);
+    }
+
+    copy = strdup(logged);
+    TEST_ASSERT_TRUE(copy != NULL);
+    return(copy);
+}
+
+void test_threaded_tokenize(void)
+{
+    char dir[] = "/tmp/crustyvm.test.XXXXXX";
+    char here[PATH_MAX];
+    char safepath[PATH_MAX * 2];
+    char name[32];
+    char file[512];
+    char text[1024];
+    char *plain, *threaded;
+    unsigned long long plainhash = 0, threadedhash = 1;
+    size_t len;
+    unsigned int i;
+
+    TEST_ASSERT_TRUE(getcwd(here, sizeof(here)) != NULL);
+    TEST_ASSERT_TRUE(mkdtemp(dir) != NULL);
+    TEST_ASSERT_TRUE(chdir(dir) == 0);
+    TEST_ASSERT_TRUE(mkdir("sub", 0755) == 0);
+
+    /* enough files for all the threads, each with comments, blank lines and
+       a string running over lines to throw off line counts, a file included
+       twice and one included from another */
+    write_file("shared.inc", "; nothing but comments\n\n; here\n");
+    write_file("sub/deep.inc",
+               "proc deep\n"
+               "  move out 100\n"
+               "ret\n");
+    len = 0;
+    for (i = 0; i < INCLUDES; i++) {
+        snprintf(name, sizeof(name), "t%u.inc", i);
+        snprintf(file, sizeof(file),
+                 "; file %u%.*s\n"
+                 "static s%u string \"a ; b \\\n"
+                 "c\"\n"
+                 "include shared.inc\n"
+                 "%s"
+                 "proc f%u\n"
+                 "  move out %u ; out\n"
+                 "ret\n",
+                 i, i, "\n\n\n\n\n\n\n\n", i,
+                 i == 0 ? "include sub/deep.inc\n" : "",
+                 i, i);
+        write_file(name, file);
+        len += sprintf(&(text[len]), "include %s\n", name);
+    }
+    len += sprintf(&(text[len]), "proc init\n");
+    for (i = 0; i < INCLUDES; i++)
+        len += sprintf(&(text[len]), "  call f%u\n", i);
+    sprintf(&(text[len]), "  call deep\nret\n");
+
+    /* every instruction run is logged with its file and line */
+    snprintf(safepath, sizeof(safepath), "%s/main.cvm", dir);
+    plain = load_recorded(text, NULL, &plainhash);
+    TEST_ASSERT_TRUE(outcount == INCLUDES + 1);
+    threaded = load_recorded(text, safepath, &threadedhash);
+    TEST_ASSERT_TRUE(outcount == INCLUDES + 1);
+    TEST_ASSERT_TRUE(plainhash == threadedhash);
+    TEST_ASSERT_TRUE(strstr(plain, "t7.inc:13 f7") != NULL);
+    TEST_ASSERT_TRUE(strstr(plain, "sub/deep.inc:2 deep") != NULL);
+    TEST_ASSERT_TRUE(strcmp(plain, threaded) == 0);
+    free(plain);
+    free(threaded);
+
+    /* and errors in a file loaded ahead come out the same */
+    write_file("t5.inc", "static ok 1\n\nbogus\n");
+    plain = load_recorded(text, NULL, &plainhash);
+    threaded = load_recorded(text, safepath, &threadedhash);
+    TEST_ASSERT_TRUE(strstr(plain, "t5.inc:3: Invalid keyword") != NULL);
+    TEST_ASSERT_TRUE(strcmp(plain, threaded) == 0);
+    free(plain);
+    free(threaded);
+
+    for (i = 0; i < INCLUDES; i++) {
+        snprintf(name, sizeof(name), "t%u.inc", i);
+        unlink(name);
+    }
+    unlink("shared.inc");
+    unlink("sub/deep.inc");
+    rmdir("sub");
+    TEST_ASSERT_TRUE(chdir(here) == 0);
+    TEST_ASSERT_TRUE(rmdir(dir) == 0);
+}
+
+static void check_alignment(unsigned int flags)
+{
+    CrustyVM *cvm;
+    unsigned int p;
+
+    cvm = crustyvm_new("mixed", NULL, mixed, sizeof(mixed) - 1, flags, 0,
+                       outcb, OUTCBS, NULL, NULL, 0, log_cb, NULL);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    placed = 0;
+    misaligned = 0;
+    TEST_ASSERT_TRUE(crustyvm_run(cvm, "init") == 0);
+    TEST_ASSERT_TRUE(placed == 15);
+    TEST_ASSERT_TRUE(misaligned == 0);
+
+    /* frames are padded so the next one starts aligned too */
+    for (p = 0; p < crustyvm_get_procs(cvm); p++)
+        TEST_ASSERT_TRUE(crustyvm_get_framemem(cvm, p) % sizeof(double) == 0);
+    crustyvm_free(cvm);
+}
+
+void test_aligned_layout(void)
+{
+    check_alignment(0);
+    /* inlined procedures' locals are laid out again in their callers */
+    check_alignment(CRUSTY_FLAG_OPTIMIZE);
+}
+
+/* run recorded keeping entries, which fails and logs what was recorded */
+static void record_failure(CrustyVM **cvm, unsigned int entries)
+{
+    *cvm = crustyvm_new("rec", NULL, recorded, sizeof(recorded) - 1, 0, 0,
+                        outcb, OUTCBS, NULL, NULL, 0, log_cb, NULL);
+    TEST_ASSERT_TRUE(*cvm != NULL);
+    TEST_ASSERT_TRUE(crustyvm_record(*cvm, entries) == 0);
+    clear_log();
+    TEST_ASSERT_TRUE(crustyvm_run(*cvm, "init") < 0);
+}
+
+void test_record_dump(void)
+{
+    static const char all[] =
+        "flight recorder: Oldest first:\n"
+        RECORDED_LOOP RECORDED_LOOP RECORDED_LOOP
+        "flight recorder: rec:12 init\n";
+    static const char last[] =
+        "flight recorder: Oldest first:\n"
+        RECORDED_LOOP
+        "flight recorder: rec:12 init\n";
+    CrustyVM *cvm;
+
+    /* dumped when it fails and again when asked */
+    record_failure(&cvm, 64);
+    TEST_ASSERT_TRUE(strstr(logged, all) != NULL);
+    clear_log();
+    crustyvm_record_dump(cvm);
+    TEST_ASSERT_TRUE(strcmp(logged, all) == 0);
+    crustyvm_free(cvm);
+
+    /* 5 is rounded up to 8, only the last 8 are kept */
+    record_failure(&cvm, 5);
+    clear_log();
+    crustyvm_record_dump(cvm);
+    TEST_ASSERT_TRUE(strcmp(logged, last) == 0);
+
+    /* and it can be turned off */
+    TEST_ASSERT_TRUE(crustyvm_record(cvm, 0) == 0);
+    clear_log();
+    crustyvm_record_dump(cvm);
+    TEST_ASSERT_TRUE(strcmp(logged, "flight recorder: Not recording.\n") == 0);
+    crustyvm_free(cvm);
+}
+
+int main(int argc, char *argv[])
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_snapshot_round_trip);
+    RUN_TEST(test_snapshot_round_trip_optimized);
+    RUN_TEST(test_snapshot_other_program);
+    RUN_TEST(test_migrate_to_edited_program);
+    RUN_TEST(test_optimize_folds_across_jumps);
+    RUN_TEST(test_optimize_inlines_reference_writes);
+    RUN_TEST(test_optimize_keeps_recursion);
+    RUN_TEST(test_bulk_partial_and_overlapping);
+    RUN_TEST(test_locals_read_before_set);
+    RUN_TEST(test_interned_names);
+    RUN_TEST(test_preprocess_macros);
+    RUN_TEST(test_preprocess_includes);
+    RUN_TEST(test_threaded_tokenize);
+    RUN_TEST(test_aligned_layout);
+    RUN_TEST(test_record_dump);
+    return UNITY_END();
+}
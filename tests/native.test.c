@@ -0,0 +1,770 @@
+#include "unity/unity.h"
+
+#include <dlfcn.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../crustyvm.h"
+
+/* compares the JIT and programs translated to C against the interpreter,
+ * running the examples with callbacks standing in for the game's which record
+ * everything written to them and give back made up values */
+
+#define MAX_CALLBACKS (256)
+#define MAX_NAME (64)
+#define FRAMES (120)
+/* an event every this many frames */
+#define EVENT_EVERY (10)
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} Trace;
+
+typedef enum {
+    RUN_PLAIN,
+    RUN_JIT,
+    RUN_TRANSLATED
+} RunMode;
+
+/* every instruction the JIT translates itself, with locals, globals, chars
+ * and immediates, over some awkward values */
+static const char ops[] =
+    "static vs ints \"0 1 -1 7 -13 31 1000000 -2147483647\"\n"
+    "static cs string \"ab\"\n"
+    "static last 0\n"
+    "proc init\n"
+    "  local i 0\n"
+    "  local j 0\n"
+    "  local a 0\n"
+    "  local b 0\n"
+    "  move cs:0 -100\n"
+    "  move cs:1 9\n"
+    "  label outer\n"
+    "    move j 0\n"
+    "    label inner\n"
+    "      move a vs:i\n"
+    "      add a vs:j\n"
+    "      move out a\n"
+    "      move last vs:i\n"
+    "      add last j\n"
+    "      move out last\n"
+    "      move b vs:j\n"
+    "      add b 12345\n"
+    "      move out b\n"
+    "      move cs:0 vs:i\n"
+    "      add cs:0 cs:1\n"
+    "      move out cs:0\n"
+    "      move a vs:i\n"
+    "      sub a vs:j\n"
+    "      move out a\n"
+    "      move last vs:i\n"
+    "      sub last j\n"
+    "      move out last\n"
+    "      move b vs:j\n"
+    "      sub b 12345\n"
+    "      move out b\n"
+    "      move cs:0 vs:i\n"
+    "      sub cs:0 cs:1\n"
+    "      move out cs:0\n"
+    "      move a vs:i\n"
+    "      mul a vs:j\n"
+    "      move out a\n"
+    "      move last vs:i\n"
+    "      mul last j\n"
+    "      move out last\n"
+    "      move b vs:j\n"
+    "      mul b 12345\n"
+    "      move out b\n"
+    "      move cs:0 vs:i\n"
+    "      mul cs:0 cs:1\n"
+    "      move out cs:0\n"
+    "      move a vs:i\n"
+    "      and a vs:j\n"
+    "      move out a\n"
+    "      move last vs:i\n"
+    "      and last j\n"
+    "      move out last\n"
+    "      move b vs:j\n"
+    "      and b 12345\n"
+    "      move out b\n"
+    "      move cs:0 vs:i\n"
+    "      and cs:0 cs:1\n"
+    "      move out cs:0\n"
+    "      move a vs:i\n"
+    "      or a vs:j\n"
+    "      move out a\n"
+    "      move last vs:i\n"
+    "      or last j\n"
+    "      move out last\n"
+    "      move b vs:j\n"
+    "      or b 12345\n"
+    "      move out b\n"
+    "      move cs:0 vs:i\n"
+    "      or cs:0 cs:1\n"
+    "      move out cs:0\n"
+    "      move a vs:i\n"
+    "      xor a vs:j\n"
+    "      move out a\n"
+    "      move last vs:i\n"
+    "      xor last j\n"
+    "      move out last\n"
+    "      move b vs:j\n"
+    "      xor b 12345\n"
+    "      move out b\n"
+    "      move cs:0 vs:i\n"
+    "      xor cs:0 cs:1\n"
+    "      move out cs:0\n"
+    "      move a vs:i\n"
+    "      move b j\n"
+    "      shl a b\n"
+    "      move out a\n"
+    "      move last vs:j\n"
+    "      shl last 3\n"
+    "      move out last\n"
+    "      move a vs:i\n"
+    "      move b j\n"
+    "      shr a b\n"
+    "      move out a\n"
+    "      move last vs:j\n"
+    "      shr last 3\n"
+    "      move out last\n"
+    "      cmp vs:i vs:j\n"
+    "      jumpz jumpz_yes\n"
+    "      move out 0\n"
+    "      jump jumpz_done\n"
+    "      label jumpz_yes\n"
+    "      move out 1\n"
+    "      label jumpz_done\n"
+    "      cmp vs:i vs:j\n"
+    "      jumpn jumpn_yes\n"
+    "      move out 0\n"
+    "      jump jumpn_done\n"
+    "      label jumpn_yes\n"
+    "      move out 1\n"
+    "      label jumpn_done\n"
+    "      cmp vs:i vs:j\n"
+    "      jumpl jumpl_yes\n"
+    "      move out 0\n"
+    "      jump jumpl_done\n"
+    "      label jumpl_yes\n"
+    "      move out 1\n"
+    "      label jumpl_done\n"
+    "      cmp vs:i vs:j\n"
+    "      jumpg jumpg_yes\n"
+    "      move out 0\n"
+    "      jump jumpg_done\n"
+    "      label jumpg_yes\n"
+    "      move out 1\n"
+    "      label jumpg_done\n"
+    "      add j 1\n"
+    "      cmp j 8\n"
+    "      jumpl inner\n"
+    "    add i 1\n"
+    "    cmp i 8\n"
+    "    jumpl outer\n"
+    "ret\n";
+
+/* division by every mix of types, which the JIT hands to the interpreter */
+static const char divmod[] =
+    "static is ints \"-7 7 3 -3 0 100000\"\n"
+    "static fs floats \"2.5 -0.75\"\n"
+    "static cs string \"ab\"\n"
+    "proc init\n"
+    "  local i 0\n"
+    "  local j 0\n"
+    "  local a 0\n"
+    "  local f floats 0.0\n"
+    "  local c string \"c\"\n"
+    "  move cs:0 -100\n"
+    "  move cs:1 9\n"
+    "  label outer\n"
+    "    move j 0\n"
+    "    label inner\n"
+    "      move a is:i\n"
+    "      div a is:j\n"
+    "      move out a\n"
+    "      move a is:i\n"
+    "      mod a is:j\n"
+    "      move out a\n"
+    "      add j 1\n"
+    "      cmp j 4\n"
+    "      jumpl inner\n"
+    "    move f fs:0\n"
+    "    div f is:i\n"
+    "    move out f\n"
+    "    move f fs:1\n"
+    "    mod f is:i\n"
+    "    move out f\n"
+    "    move a is:i\n"
+    "    div a fs:0\n"
+    "    move out a\n"
+    "    move a is:i\n"
+    "    mod a fs:1\n"
+    "    move out a\n"
+    "    move c cs:0\n"
+    "    div c is:i\n"
+    "    move out c\n"
+    "    move c cs:1\n"
+    "    mod c 4\n"
+    "    move out c\n"
+    "    move a is:5\n"
+    "    div a -3\n"
+    "    move out a\n"
+    "    move f fs:0\n"
+    "    div f 2\n"
+    "    move out f\n"
+    "    add i 1\n"
+    "    cmp i 4\n"
+    "    jumpl outer\n"
+    "ret\n";
+
+/* loops which are entirely native, so only the backward jumps charge them
+ * against the budget */
+#define LONGEST_LOOP (8)
+static const char loops[] =
+    "static total 0\n"
+    "proc init\n"
+    "  local i 0\n"
+    "  local j 0\n"
+    "  label outer\n"
+    "    move j 0\n"
+    "    label inner\n"
+    "      add total j\n"
+    "      add j 1\n"
+    "      cmp j 300\n"
+    "      jumpl inner\n"
+    "    add i 1\n"
+    "    cmp i 200\n"
+    "    jumpl outer\n"
+    "  label forever\n"
+    "    add total 1\n"
+    "    cmp total 1000000\n"
+    "    jumpl forever\n"
+    "  move out total\n"
+    "ret\n";
+
+static CrustyCallback cb[MAX_CALLBACKS];
+static char cbname[MAX_CALLBACKS][MAX_NAME];
+static unsigned int cbcount;
+static unsigned int reads[MAX_CALLBACKS];
+static Trace *trace;
+static int translated;
+/* where translations are built, the examples are run from elsewhere */
+static char here[PATH_MAX];
+static void *translation;
+static const CrustyNativeProgram *native;
+
+static void log_cb(void *priv, const char *fmt, ...)
+{
+    va_list ap;
+    char line[256];
+
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (strstr(line, "instructions translated") != NULL)
+        translated = 1;
+    fputs(line, stderr);
+}
+
+static void trace_add(const void *data, size_t len)
+{
+    if (trace->len + len > trace->size) {
+        trace->size = (trace->len + len) * 2;
+        trace->data = realloc(trace->data, trace->size);
+        TEST_ASSERT_TRUE(trace->data != NULL);
+    }
+    memcpy(&trace->data[trace->len], data, len);
+    trace->len += len;
+}
+
+static void trace_int(int val)
+{
+    trace_add(&val, sizeof(int));
+}
+
+static size_t type_size(CrustyType type)
+{
+    switch (type) {
+        case CRUSTY_TYPE_CHAR:
+            return(1);
+        case CRUSTY_TYPE_FLOAT:
+            return(sizeof(double));
+        default:
+            return(sizeof(int));
+    }
+}
+
+static int stub_read(void *priv, void *val, unsigned int index)
+{
+    unsigned int i = (uintptr_t)priv;
+    int made_up = (reads[i] + i) % 5;
+
+    reads[i]++;
+    trace_int(i);
+    trace_int(index);
+    switch (cb[i].readType) {
+        case CRUSTY_TYPE_CHAR:
+            *(char *)val = made_up;
+            break;
+        case CRUSTY_TYPE_FLOAT:
+            *(double *)val = made_up;
+            break;
+        default:
+            *(int *)val = made_up;
+            break;
+    }
+
+    return(0);
+}
+
+static int stub_write(void *priv,
+                      CrustyType type,
+                      unsigned int size,
+                      void *ptr,
+                      unsigned int index)
+{
+    trace_int((uintptr_t)priv);
+    trace_int(index);
+    trace_int(type);
+    trace_int(size);
+    trace_add(ptr, type_size(type) * (size == 0 ? 1 : size));
+
+    return(0);
+}
+
+static const char *field(const char *entry, const char *end, const char *name)
+{
+    const char *found;
+
+    found = strstr(entry, name);
+    if (found == NULL || found > end)
+        return(NULL);
+
+    return(found + strlen(name));
+}
+
+/* stand ins for every callback the game defines, found in its source */
+static void load_game_callbacks(void)
+{
+    FILE *in;
+    char *src;
+    long len;
+    const char *entry, *end, *val;
+    unsigned int i;
+
+    in = fopen("../callbacks.c", "rb");
+    TEST_ASSERT_TRUE(in != NULL);
+    fseek(in, 0, SEEK_END);
+    len = ftell(in);
+    rewind(in);
+    src = malloc(len + 1);
+    TEST_ASSERT_TRUE(src != NULL);
+    TEST_ASSERT_TRUE(fread(src, 1, len, in) == (size_t)len);
+    src[len] = '\0';
+    fclose(in);
+
+    cbcount = 0;
+    for (entry = strstr(src, ".name = \""); entry != NULL;
+         entry = strstr(end, ".name = \"")) {
+        TEST_ASSERT_TRUE(cbcount < MAX_CALLBACKS);
+        end = strchr(entry, '}');
+        TEST_ASSERT_TRUE(end != NULL);
+        i = cbcount;
+
+        entry += strlen(".name = \"");
+        len = strchr(entry, '"') - entry;
+        TEST_ASSERT_TRUE(len < MAX_NAME);
+        memcpy(cbname[i], entry, len);
+        cbname[i][len] = '\0';
+        cb[i].name = cbname[i];
+
+        /* lengths which aren't plain numbers are given as much as they like */
+        val = field(entry, end, ".length = ");
+        TEST_ASSERT_TRUE(val != NULL);
+        cb[i].length = atoi(val);
+        if (cb[i].length == 0)
+            cb[i].length = INT_MAX;
+
+        val = field(entry, end, ".readType = CRUSTY_TYPE_");
+        TEST_ASSERT_TRUE(val != NULL);
+        if (strncmp(val, "CHAR", 4) == 0)
+            cb[i].readType = CRUSTY_TYPE_CHAR;
+        else if (strncmp(val, "INT", 3) == 0)
+            cb[i].readType = CRUSTY_TYPE_INT;
+        else if (strncmp(val, "FLOAT", 5) == 0)
+            cb[i].readType = CRUSTY_TYPE_FLOAT;
+        else
+            cb[i].readType = CRUSTY_TYPE_NONE;
+
+        val = field(entry, end, ".read = ");
+        TEST_ASSERT_TRUE(val != NULL);
+        cb[i].read = strncmp(val, "NULL", 4) == 0 ? NULL : stub_read;
+        cb[i].readpriv = (void *)(uintptr_t)i;
+
+        val = field(entry, end, ".write = ");
+        TEST_ASSERT_TRUE(val != NULL);
+        cb[i].write = strncmp(val, "NULL", 4) == 0 ? NULL : stub_write;
+        cb[i].writepriv = (void *)(uintptr_t)i;
+
+        cbcount++;
+    }
+    free(src);
+    TEST_ASSERT_TRUE(cbcount > 0);
+}
+
+/* translate a program to C, build it with warnings as errors and set it to
+ * run the program */
+static void translate(CrustyVM *cvm, const char *name)
+{
+    char source[PATH_MAX * 2];
+    char object[PATH_MAX * 2];
+    char command[PATH_MAX * 6];
+    const char *cc;
+    FILE *out;
+
+    snprintf(source, sizeof(source), "%s/translated_%s.c", here, name);
+    snprintf(object, sizeof(object), "%s/translated_%s.so", here, name);
+    out = fopen(source, "w");
+    TEST_ASSERT_TRUE(out != NULL);
+    TEST_ASSERT_TRUE(crustyvm_transpile(cvm, out) == 0);
+    TEST_ASSERT_TRUE(fclose(out) == 0);
+
+    cc = getenv("CC");
+    if (cc == NULL)
+        cc = "cc";
+    snprintf(command, sizeof(command),
+             "%s -Wall -Werror -fPIC -shared -I'%s/..' -o '%s' '%s'",
+             cc, here, object, source);
+    TEST_ASSERT_TRUE(system(command) == 0);
+
+    translation = dlopen(object, RTLD_NOW | RTLD_LOCAL);
+    TEST_ASSERT_TRUE(translation != NULL);
+    native = dlsym(translation, "crustyvm_native_program");
+    TEST_ASSERT_TRUE(native != NULL);
+    TEST_ASSERT_TRUE(crustyvm_set_native(cvm, native) == 0);
+}
+
+/* free a VM and any translation it was running */
+static void done(CrustyVM *cvm)
+{
+    crustyvm_free(cvm);
+    if (translation != NULL) {
+        dlclose(translation);
+        translation = NULL;
+        native = NULL;
+    }
+}
+
+static const CrustyCallback outcb[] = {
+    {
+        .name = "out", .length = 1, .readType = CRUSTY_TYPE_NONE,
+        .read = NULL, .readpriv = NULL,
+        .write = stub_write, .writepriv = NULL
+    }
+};
+
+static CrustyVM *load_text(const char *name,
+                           const char *program,
+                           RunMode mode)
+{
+    CrustyVM *cvm;
+
+    translated = 0;
+    cvm = crustyvm_new(name, NULL, program, strlen(program),
+                       mode == RUN_JIT ? CRUSTY_FLAG_JIT : 0, 0,
+                       outcb, 1, NULL, NULL, 0, log_cb, NULL);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    if (mode == RUN_TRANSLATED)
+        translate(cvm, name);
+
+    return(cvm);
+}
+
+static CrustyVM *load(const char *filename, RunMode mode)
+{
+    FILE *in;
+    char *safepath = NULL;
+    char *program;
+    long len;
+    CrustyVM *cvm;
+
+    in = crustyvm_open_file(filename, &safepath, log_cb, NULL);
+    TEST_ASSERT_TRUE(in != NULL);
+    fseek(in, 0, SEEK_END);
+    len = ftell(in);
+    rewind(in);
+    program = malloc(len);
+    TEST_ASSERT_TRUE(program != NULL);
+    TEST_ASSERT_TRUE(fread(program, 1, len, in) == (size_t)len);
+    fclose(in);
+
+    translated = 0;
+    cvm = crustyvm_new(filename, safepath, program, len,
+                       mode == RUN_JIT ? CRUSTY_FLAG_JIT : 0, 0,
+                       cb, cbcount, NULL, NULL, 0, log_cb, NULL);
+    free(program);
+    free(safepath);
+    if (cvm != NULL && mode == RUN_TRANSLATED)
+        translate(cvm, "example");
+
+    return(cvm);
+}
+
+/* run a procedure if the program has it, and note how it ended */
+static int run(CrustyVM *cvm, const char *procname)
+{
+    if (!crustyvm_has_entrypoint(cvm, procname))
+        return(0);
+
+    crustyvm_run(cvm, procname);
+    trace_int(crustyvm_get_status(cvm));
+
+    return(crustyvm_get_status(cvm) != CRUSTY_STATUS_READY);
+}
+
+/* run the entry procedures like the game would, until one fails */
+static unsigned int run_game(CrustyVM *cvm)
+{
+    unsigned int frame;
+
+    if (run(cvm, "init"))
+        return(0);
+    for (frame = 0; frame < FRAMES; frame++) {
+        if (frame % EVENT_EVERY == 0 && run(cvm, "event"))
+            break;
+        if (run(cvm, "frame") || run(cvm, "audio"))
+            break;
+    }
+
+    return(frame);
+}
+
+/* returns -1 if it didn't load */
+static int run_example(const char *filename, RunMode mode, Trace *out)
+{
+    CrustyVM *cvm;
+    unsigned int frames;
+
+    memset(reads, 0, sizeof(reads));
+    memset(out, 0, sizeof(Trace));
+    trace = out;
+    cvm = load(filename, mode);
+    if (cvm == NULL)
+        return(-1);
+    frames = run_game(cvm);
+    done(cvm);
+
+    return(frames);
+}
+
+static int same(const Trace *a, const Trace *b)
+{
+    return(a->len == b->len && memcmp(a->data, b->data, a->len) == 0);
+}
+
+void setUp(void)
+{
+    TEST_ASSERT_TRUE(getcwd(here, sizeof(here)) != NULL);
+}
+
+void tearDown(void)
+{
+}
+
+/* run every example which loads and compare it against the interpreter */
+static void compare_examples(RunMode mode)
+{
+    Trace plain, other;
+    glob_t found;
+    int plainframes, otherframes;
+    unsigned int ran = 0;
+    unsigned int i;
+
+    load_game_callbacks();
+    /* they include files relative to where they're run from */
+    TEST_ASSERT_TRUE(chdir("../examples") == 0);
+    TEST_ASSERT_TRUE(glob("*.cvm", 0, NULL, &found) == 0);
+    for (i = 0; i < found.gl_pathc; i++) {
+        plainframes = run_example(found.gl_pathv[i], RUN_PLAIN, &plain);
+        otherframes = run_example(found.gl_pathv[i], mode, &other);
+        TEST_ASSERT_TRUE(plainframes == otherframes);
+        TEST_ASSERT_TRUE(same(&plain, &other));
+        if (plainframes < 0) {
+            fprintf(stderr, "%s doesn't load, only checked that it fails "
+                            "the same way.\n", found.gl_pathv[i]);
+        } else {
+#ifdef CRUSTY_JIT
+            TEST_ASSERT_TRUE(mode != RUN_JIT || translated);
+#endif
+            ran++;
+        }
+        free(plain.data);
+        free(other.data);
+    }
+    globfree(&found);
+    TEST_ASSERT_TRUE(chdir(here) == 0);
+    TEST_ASSERT_TRUE(ran > 0);
+}
+
+void test_jit_matches_interpreter_on_examples(void)
+{
+    compare_examples(RUN_JIT);
+}
+
+/* run a program's init and compare what it output against the interpreter */
+static void compare(const char *name, const char *program, RunMode mode)
+{
+    Trace plain, other;
+    CrustyVM *cvm;
+
+    memset(&plain, 0, sizeof(plain));
+    memset(&other, 0, sizeof(other));
+
+    trace = &plain;
+    cvm = load_text(name, program, RUN_PLAIN);
+    TEST_ASSERT_TRUE(crustyvm_run(cvm, "init") == 0);
+    done(cvm);
+
+    trace = &other;
+    cvm = load_text(name, program, mode);
+#ifdef CRUSTY_JIT
+    TEST_ASSERT_TRUE(mode != RUN_JIT || translated);
+#endif
+    TEST_ASSERT_TRUE(crustyvm_run(cvm, "init") == 0);
+    done(cvm);
+
+    TEST_ASSERT_TRUE(plain.len > 0);
+    TEST_ASSERT_TRUE(same(&plain, &other));
+    free(plain.data);
+    free(other.data);
+}
+
+void test_jit_ops(void)
+{
+    compare("ops", ops, RUN_JIT);
+}
+
+void test_jit_div_mod(void)
+{
+    compare("divmod", divmod, RUN_JIT);
+}
+
+/* how many times the loops have to be resumed with a budget of insts */
+static unsigned int resumes(RunMode mode, unsigned int insts, Trace *out)
+{
+    CrustyVM *cvm;
+    unsigned int count = 0;
+
+    memset(out, 0, sizeof(Trace));
+    trace = out;
+    cvm = load_text("loops", loops, mode);
+    TEST_ASSERT_TRUE(crustyvm_begin(cvm, "init") == 0);
+    while (crustyvm_resume(cvm, insts, 0) == CRUSTY_STATUS_ACTIVE) {
+        count++;
+        TEST_ASSERT_TRUE(count < 1000000);
+    }
+    TEST_ASSERT_TRUE(crustyvm_get_status(cvm) == CRUSTY_STATUS_READY);
+    done(cvm);
+
+    return(count);
+}
+
+/* native code only checks at the end of each time around a loop, so each
+ * resume may go over by up to the longest loop, but it mustn't just run to the
+ * end.  the jump which runs out the budget is charged again when the
+ * interpreter takes it, so it may also stop 1 early. */
+static void charges_loops(RunMode mode)
+{
+    static const unsigned int budget[] = { 1, 7, 1000, 100000 };
+    Trace plain, other;
+    unsigned int plaincount, count;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(budget) / sizeof(budget[0]); i++) {
+        plaincount = resumes(RUN_PLAIN, budget[i], &plain);
+        count = resumes(mode, budget[i], &other);
+        TEST_ASSERT_TRUE(plaincount > 0);
+        TEST_ASSERT_TRUE(count <= plaincount + 1);
+        TEST_ASSERT_TRUE((unsigned long long)count *
+                         (budget[i] + LONGEST_LOOP) >=
+                         (unsigned long long)plaincount * budget[i]);
+        TEST_ASSERT_TRUE(same(&plain, &other));
+        free(plain.data);
+        free(other.data);
+    }
+}
+
+void test_jit_charges_loops(void)
+{
+    charges_loops(RUN_JIT);
+}
+
+void test_translation_matches_interpreter_on_examples(void)
+{
+    compare_examples(RUN_TRANSLATED);
+}
+
+void test_translation_ops(void)
+{
+    compare("ops", ops, RUN_TRANSLATED);
+    compare("divmod", divmod, RUN_TRANSLATED);
+}
+
+void test_translation_charges_loops(void)
+{
+    charges_loops(RUN_TRANSLATED);
+}
+
+void test_translation_of_other_program(void)
+{
+    CrustyVM *cvm;
+    CrustyVM *other;
+    char *edited;
+    char *imm;
+
+    cvm = load_text("ops", ops, RUN_TRANSLATED);
+
+    /* a different program, and the same one with one immediate changed */
+    other = load_text("divmod", divmod, RUN_PLAIN);
+    TEST_ASSERT_TRUE(crustyvm_set_native(other, native) < 0);
+    crustyvm_free(other);
+    edited = strdup(ops);
+    TEST_ASSERT_TRUE(edited != NULL);
+    imm = strstr(edited, "12345");
+    TEST_ASSERT_TRUE(imm != NULL);
+    imm[4] = '6';
+    other = load_text("edited", edited, RUN_PLAIN);
+    TEST_ASSERT_TRUE(crustyvm_set_native(other, native) < 0);
+    crustyvm_free(other);
+    free(edited);
+
+    /* but another load of the same program is fine */
+    other = load_text("ops", ops, RUN_PLAIN);
+    TEST_ASSERT_TRUE(crustyvm_set_native(other, native) == 0);
+    crustyvm_free(other);
+
+    done(cvm);
+}
+
+int main(int argc, char *argv[])
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_jit_matches_interpreter_on_examples);
+    RUN_TEST(test_jit_ops);
+    RUN_TEST(test_jit_div_mod);
+    RUN_TEST(test_jit_charges_loops);
+    RUN_TEST(test_translation_matches_interpreter_on_examples);
+    RUN_TEST(test_translation_ops);
+    RUN_TEST(test_translation_charges_loops);
+    RUN_TEST(test_translation_of_other_program);
+    return UNITY_END();
+}
@@ -0,0 +1,140 @@
+#include "unity/unity.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../crustyplugin.h"
+#include "../plugin.h"
+
+/* built next to this by the Makefile */
+#define PLUGIN "testplugin.so"
+
+static char here[PATH_MAX];
+static char script[PATH_MAX * 2];
+static PluginList *pl;
+
+static void log_cb(void *priv, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static int game_read(void *priv, void *val, unsigned int index)
+{
+    *(int *)val = 0;
+
+    return(0);
+}
+
+static const CrustyCallback game[] = {
+    {
+        .name = "game", .length = 1, .readType = CRUSTY_TYPE_INT,
+        .read = game_read, .readpriv = NULL,
+        .write = NULL, .writepriv = NULL
+    }
+};
+
+void setUp(void)
+{
+    /* plugins are found from the script's real path */
+    TEST_ASSERT_TRUE(realpath(".", here) != NULL);
+    snprintf(script, sizeof(script), "%s/script.cvm", here);
+    pl = plugins_new(game, 1, log_cb, NULL);
+    TEST_ASSERT_TRUE(pl != NULL);
+}
+
+void tearDown(void)
+{
+    plugins_free(pl);
+}
+
+void test_load(void)
+{
+    const CrustyCallback *cb;
+    int val;
+
+    TEST_ASSERT_TRUE(plugins_load(pl, script, PLUGIN) == 0);
+    TEST_ASSERT_TRUE(plugins_get_callback_count(pl) == 2);
+    cb = plugins_get_callbacks(pl);
+    TEST_ASSERT_TRUE(strcmp(cb[0].name, "game") == 0);
+    TEST_ASSERT_TRUE(strcmp(cb[1].name, "host") == 0);
+    /* the plugin was told what this was built with */
+    TEST_ASSERT_TRUE(cb[1].read(cb[1].readpriv, &val, 0) == 0);
+    TEST_ASSERT_TRUE(val == CRUSTY_PLUGIN_ABI);
+    TEST_ASSERT_TRUE(cb[1].read(cb[1].readpriv, &val, 1) == 0);
+    TEST_ASSERT_TRUE(val == sizeof(CrustyPluginHost));
+}
+
+void test_same_callbacks_twice(void)
+{
+    TEST_ASSERT_TRUE(plugins_load(pl, script, PLUGIN) == 0);
+    TEST_ASSERT_TRUE(plugins_load(pl, script, PLUGIN) < 0);
+    TEST_ASSERT_TRUE(plugins_get_callback_count(pl) == 2);
+}
+
+void test_missing(void)
+{
+    TEST_ASSERT_TRUE(plugins_load(pl, script, "missing.so") < 0);
+    TEST_ASSERT_TRUE(plugins_get_callback_count(pl) == 1);
+}
+
+void test_dotdot_inside(void)
+{
+    char name[PATH_MAX * 2];
+    const char *dir;
+
+    dir = strrchr(here, '/') + 1;
+    snprintf(name, sizeof(name), "../%s/%s", dir, PLUGIN);
+    TEST_ASSERT_TRUE(plugins_load(pl, script, name) == 0);
+}
+
+void test_dotdot_outside(void)
+{
+    char inner[PATH_MAX * 2];
+
+    /* as if the script were a directory down */
+    snprintf(inner, sizeof(inner), "%s/unity/script.cvm", here);
+    TEST_ASSERT_TRUE(plugins_load(pl, inner, "../" PLUGIN) < 0);
+    TEST_ASSERT_TRUE(plugins_get_callback_count(pl) == 1);
+}
+
+void test_symlink_outside(void)
+{
+    char dir[] = "/tmp/plugin.test.XXXXXX";
+    char real[PATH_MAX];
+    char link[PATH_MAX * 2];
+    char target[PATH_MAX * 2];
+    char inner[PATH_MAX * 2];
+
+    TEST_ASSERT_TRUE(mkdtemp(dir) != NULL);
+    TEST_ASSERT_TRUE(realpath(dir, real) != NULL);
+    snprintf(link, sizeof(link), "%s/%s", real, PLUGIN);
+    snprintf(target, sizeof(target), "%s/%s", here, PLUGIN);
+    snprintf(inner, sizeof(inner), "%s/script.cvm", real);
+    TEST_ASSERT_TRUE(symlink(target, link) == 0);
+
+    TEST_ASSERT_TRUE(plugins_load(pl, inner, PLUGIN) < 0);
+    TEST_ASSERT_TRUE(plugins_get_callback_count(pl) == 1);
+
+    unlink(link);
+    rmdir(real);
+}
+
+int main(int argc, char *argv[])
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_load);
+    RUN_TEST(test_same_callbacks_twice);
+    RUN_TEST(test_missing);
+    RUN_TEST(test_dotdot_inside);
+    RUN_TEST(test_dotdot_outside);
+    RUN_TEST(test_symlink_outside);
+    return UNITY_END();
+}
@@ -0,0 +1,187 @@
+#include "unity/unity.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../crustyvm.h"
+#include "../reload.h"
+
+/* how long to wait for a reload, in 10ms steps */
+#define TRIES (300)
+
+static char here[PATH_MAX];
+static char dir[] = "/tmp/reload.test.XXXXXX";
+static char fullpath[PATH_MAX];
+static int out;
+
+static void log_cb(void *priv, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static int out_write(void *priv, CrustyType type, unsigned int size,
+                     void *ptr, unsigned int index)
+{
+    out = *(int *)ptr;
+
+    return(0);
+}
+
+static const CrustyCallback outcb[] = {
+    {
+        .name = "out", .length = 1, .readType = CRUSTY_TYPE_INT,
+        .read = NULL, .readpriv = NULL,
+        .write = out_write, .writepriv = NULL
+    }
+};
+
+static void write_file(const char *name, const char *text)
+{
+    FILE *f;
+
+    f = fopen(name, "w");
+    TEST_ASSERT_TRUE(f != NULL);
+    fputs(text, f);
+    TEST_ASSERT_TRUE(fclose(f) == 0);
+}
+
+static CrustyVM *load(void)
+{
+    FILE *f;
+    char text[4096];
+    size_t len;
+    CrustyVM *cvm;
+
+    f = fopen("main.cvm", "rb");
+    TEST_ASSERT_TRUE(f != NULL);
+    len = fread(text, 1, sizeof(text), f);
+    fclose(f);
+
+    cvm = crustyvm_new("main.cvm", fullpath, text, len, 0, 0,
+                       outcb, 1, NULL, NULL, 0, log_cb, NULL);
+    TEST_ASSERT_TRUE(cvm != NULL);
+
+    return(cvm);
+}
+
+/* what init of a VM gives out */
+static int run(CrustyVM *cvm)
+{
+    out = -1;
+    TEST_ASSERT_TRUE(crustyvm_run(cvm, "init") == 0);
+    crustyvm_free(cvm);
+
+    return(out);
+}
+
+static CrustyVM *wait_reload(Reloader *r)
+{
+    CrustyVM *cvm;
+    unsigned int i;
+
+    for (i = 0; i < TRIES; i++) {
+        cvm = reloader_get(r);
+        if (cvm != NULL)
+            return(cvm);
+        usleep(10000);
+    }
+
+    return(NULL);
+}
+
+void setUp(void)
+{
+    TEST_ASSERT_TRUE(getcwd(here, sizeof(here)) != NULL);
+    strcpy(dir, "/tmp/reload.test.XXXXXX");
+    TEST_ASSERT_TRUE(mkdtemp(dir) != NULL);
+    /* includes are opened relative to where it's run from */
+    TEST_ASSERT_TRUE(chdir(dir) == 0);
+    TEST_ASSERT_TRUE(mkdir("sub", 0755) == 0);
+    TEST_ASSERT_TRUE(mkdir("other", 0755) == 0);
+    write_file("main.cvm",
+               "include sub/value.inc\n"
+               "proc init\n"
+               "  move out value\n"
+               "ret\n");
+    write_file("sub/value.inc", "static value 1\n");
+    TEST_ASSERT_TRUE(realpath("main.cvm", fullpath) != NULL);
+}
+
+void tearDown(void)
+{
+    unlink("main.cvm");
+    unlink("sub/value.inc");
+    unlink("other/more.inc");
+    rmdir("sub");
+    rmdir("other");
+    TEST_ASSERT_TRUE(chdir(here) == 0);
+    TEST_ASSERT_TRUE(rmdir(dir) == 0);
+}
+
+void test_includes_listed(void)
+{
+    CrustyVM *cvm;
+
+    write_file("sub/value.inc",
+               "include other/more.inc\n"
+               "static value more\n");
+    write_file("other/more.inc", "expr more 3\n");
+    cvm = load();
+    TEST_ASSERT_TRUE(crustyvm_get_includes(cvm) == 2);
+    TEST_ASSERT_TRUE(strcmp(crustyvm_get_include(cvm, 0),
+                            "sub/value.inc") == 0);
+    TEST_ASSERT_TRUE(strcmp(crustyvm_get_include(cvm, 1),
+                            "other/more.inc") == 0);
+    TEST_ASSERT_TRUE(crustyvm_get_include(cvm, 2) == NULL);
+    TEST_ASSERT_TRUE(run(cvm) == 3);
+}
+
+void test_reload_on_include_in_subdirectory(void)
+{
+    CrustyVM *cvm;
+    Reloader *r;
+
+    cvm = load();
+    r = reloader_new(cvm, "main.cvm", fullpath, 0, outcb, 1,
+                     NULL, NULL, 0, log_cb, NULL);
+    TEST_ASSERT_TRUE(r != NULL);
+    TEST_ASSERT_TRUE(run(cvm) == 1);
+
+    write_file("sub/value.inc", "static value 2\n");
+    cvm = wait_reload(r);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    TEST_ASSERT_TRUE(run(cvm) == 2);
+
+    /* an include added by the edit is watched from then on */
+    write_file("other/more.inc", "expr more 4\n");
+    write_file("sub/value.inc",
+               "include other/more.inc\n"
+               "static value more\n");
+    cvm = wait_reload(r);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    TEST_ASSERT_TRUE(run(cvm) == 4);
+
+    write_file("other/more.inc", "expr more 5\n");
+    cvm = wait_reload(r);
+    TEST_ASSERT_TRUE(cvm != NULL);
+    TEST_ASSERT_TRUE(run(cvm) == 5);
+
+    reloader_free(r);
+}
+
+int main(int argc, char *argv[])
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_includes_listed);
+    RUN_TEST(test_reload_on_include_in_subdirectory);
+    return UNITY_END();
+}
@@ -0,0 +1,42 @@
+#include <stddef.h>
+#include <stdio.h>
+
+#include "../crustyplugin.h"
+
+/* a plugin for plugin.test, which gives back what it was told about the host */
+
+static CrustyPluginHost seen;
+
+static int host_read(void *priv, void *val, unsigned int index)
+{
+    *(int *)val = index == 0 ? seen.abi : seen.size;
+
+    return(0);
+}
+
+static const CrustyCallback cb[] = {
+    {
+        .name = "host", .length = 2, .readType = CRUSTY_TYPE_INT,
+        .read = host_read, .readpriv = NULL,
+        .write = NULL, .writepriv = NULL
+    }
+};
+
+static const CrustyPlugin plugin = {
+    .abi = CRUSTY_PLUGIN_ABI,
+    .name = "test",
+    .cb = cb,
+    .cbcount = 1,
+    .free = NULL
+};
+
+const CrustyPlugin *crusty_plugin_init(const CrustyPluginHost *host)
+{
+    if (host->abi != CRUSTY_PLUGIN_ABI ||
+        host->size < offsetof(CrustyPluginHost, log_priv) +
+                     sizeof(host->log_priv))
+        return(NULL);
+    seen = *host;
+
+    return(&plugin);
+}
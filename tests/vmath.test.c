@@ -0,0 +1,185 @@
+#include "unity/unity.h"
+
+#include "../vmath.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+
+#define COUNT (100000)
+/* what vmath.h promises for the approximations */
+#define MAX_ULP (2.0)
+
+static double buf[COUNT];
+static double in[COUNT];
+
+/* how many units in the last place got is from want */
+static double ulp(double got, double want)
+{
+    double unit;
+
+    if (got == want || (isnan(got) && isnan(want)))
+        return 0.0;
+    if (isnan(got) || isnan(want) || isinf(got) || isinf(want))
+        return INFINITY;
+    unit = nextafter(fabs(want), INFINITY) - fabs(want);
+    if (fabs(want) < DBL_MIN)
+        unit = nextafter(0.0, 1.0);
+    return fabs(got - want) / unit;
+}
+
+/* random values from start to end, with the odd awkward one mixed in */
+static void fill(double start, double end)
+{
+    static const double special[] = {
+        0.0, -0.0, 1.0, -1.0, INFINITY, -INFINITY, NAN, DBL_MIN, DBL_MAX
+    };
+    int i;
+
+    for (i = 0; i < COUNT; i++) {
+        if (i % 1000 < sizeof(special) / sizeof(special[0]))
+            in[i] = special[i % 1000];
+        else
+            in[i] = start + (end - start) * ((double)rand() / RAND_MAX);
+        buf[i] = in[i];
+    }
+}
+
+static double worst(double (*ref)(double))
+{
+    double most = 0.0;
+    double err;
+    int i;
+
+    for (i = 0; i < COUNT; i++) {
+        err = ulp(buf[i], ref(in[i]));
+        if (err > most)
+            most = err;
+    }
+
+    return most;
+}
+
+void setUp(void)
+{
+    srand(1);
+}
+
+void tearDown(void)
+{
+}
+
+void test_sin(void)
+{
+    fill(-1000.0, 1000.0);
+    vmath_sin(buf, COUNT);
+    TEST_ASSERT_TRUE(worst(sin) <= MAX_ULP);
+    /* beyond where the approximation's range reduction holds */
+    fill(-1e12, 1e12);
+    vmath_sin(buf, COUNT);
+    TEST_ASSERT_TRUE(worst(sin) <= MAX_ULP);
+}
+
+void test_sin_keeps_sign_of_zero(void)
+{
+    double zero[2] = { -0.0, 0.0 };
+
+    vmath_sin(zero, 2);
+    TEST_ASSERT_TRUE(zero[0] == 0.0 && signbit(zero[0]));
+    TEST_ASSERT_TRUE(zero[1] == 0.0 && !signbit(zero[1]));
+}
+
+void test_cos(void)
+{
+    fill(-1000.0, 1000.0);
+    vmath_cos(buf, COUNT);
+    TEST_ASSERT_TRUE(worst(cos) <= MAX_ULP);
+    fill(-1e12, 1e12);
+    vmath_cos(buf, COUNT);
+    TEST_ASSERT_TRUE(worst(cos) <= MAX_ULP);
+}
+
+void test_exp(void)
+{
+    /* on through overflow and underflow */
+    fill(-760.0, 720.0);
+    vmath_exp(buf, COUNT);
+    TEST_ASSERT_TRUE(worst(exp) <= MAX_ULP);
+}
+
+void test_log(void)
+{
+    fill(-1.0, 1000.0);
+    vmath_log(buf, COUNT);
+    TEST_ASSERT_TRUE(worst(log) <= MAX_ULP);
+    /* subnormals and values close to 1 */
+    fill(0.0, 1e-300);
+    vmath_log(buf, COUNT);
+    TEST_ASSERT_TRUE(worst(log) <= MAX_ULP);
+    fill(0.999, 1.001);
+    vmath_log(buf, COUNT);
+    TEST_ASSERT_TRUE(worst(log) <= MAX_ULP);
+}
+
+void test_sqrt_is_libm(void)
+{
+    fill(-1.0, 1e6);
+    vmath_sqrt(buf, COUNT);
+    TEST_ASSERT_TRUE(worst(sqrt) == 0.0);
+}
+
+void test_pow_is_libm(void)
+{
+    static const double exponents[] = {
+        2.0, 0.5, -3.0, 1.0 / 3.0, 7.3, 5000.0, -0.5, 0.0
+    };
+    double most = 0.0;
+    double err;
+    unsigned int e;
+    int i;
+
+    for (e = 0; e < sizeof(exponents) / sizeof(exponents[0]); e++) {
+        fill(-10.0, 1000.0);
+        vmath_pow(buf, COUNT, exponents[e]);
+        for (i = 0; i < COUNT; i++) {
+            err = ulp(buf[i], pow(in[i], exponents[e]));
+            if (err > most)
+                most = err;
+        }
+    }
+    TEST_ASSERT_TRUE(most == 0.0);
+}
+
+void test_lerp(void)
+{
+    double t[3] = { 0.0, 0.5, 1.0 };
+
+    vmath_lerp(t, 3, -2.0, 6.0);
+    TEST_ASSERT_TRUE(t[0] == -2.0 && t[1] == 2.0 && t[2] == 6.0);
+}
+
+void test_curve_ends(void)
+{
+    double c[16];
+
+    vmath_curve(c, 16, 10.0, 20.0, 2.0);
+    TEST_ASSERT_TRUE(fabs(c[0] - 10.0) < 1e-12);
+    TEST_ASSERT_TRUE(fabs(c[15] - 20.0) < 1e-12);
+    /* slowest near the lower value */
+    TEST_ASSERT_TRUE(c[1] - c[0] < c[15] - c[14]);
+}
+
+int main(int argc, char *argv[])
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_sin);
+    RUN_TEST(test_sin_keeps_sign_of_zero);
+    RUN_TEST(test_cos);
+    RUN_TEST(test_exp);
+    RUN_TEST(test_log);
+    RUN_TEST(test_sqrt_is_libm);
+    RUN_TEST(test_pow_is_libm);
+    RUN_TEST(test_lerp);
+    RUN_TEST(test_curve_ends);
+    return UNITY_END();
+}
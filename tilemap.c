@@ -88,6 +88,8 @@ typedef struct LayerList_t {
     unsigned int layersmem;
 
     int blendWarned;
+
+    Uint64 updateTime; /* performance counter ticks spent updating tilemaps */
 } LayerList;
 
 static unsigned int find_power_of_two(unsigned int val) {
@@ -166,6 +168,7 @@ LayerList *layerlist_new(SDL_Renderer *renderer,
     ll->tilemapsmem = 0;
     ll->layersmem = 0;
     ll->blendWarned = 0;
+    ll->updateTime = 0;
 
     return(ll);
 }
@@ -207,6 +210,14 @@ void layerlist_free(LayerList *ll) {
     free(ll);
 }
 
+Uint64 layerlist_get_update_time(LayerList *ll) {
+    Uint64 time = ll->updateTime;
+
+    ll->updateTime = 0;
+
+    return(time);
+}
+
 static void init_tileset(Tileset *t,
                          SDL_Texture *tex,
                          unsigned int tw, unsigned int th,
@@ -627,6 +638,33 @@ int tilemap_set_tilemap_map(LayerList *ll,
     return(0);
 }
 
+int tilemap_get_tilemap_map(LayerList *ll,
+                            unsigned int index,
+                            const unsigned int **map,
+                            const unsigned int **attr_flags,
+                            unsigned int *w,
+                            unsigned int *h,
+                            unsigned int *tw,
+                            unsigned int *th) {
+    Tilemap *tm = get_tilemap(ll, index);
+    if(tm == NULL) {
+        return(-1);
+    }
+    Tileset *ts = get_tileset(ll, tm->tileset);
+    if(ts == NULL) {
+        return(-1);
+    }
+
+    *map = tm->map;
+    *attr_flags = tm->attr_flags;
+    *w = tm->w;
+    *h = tm->h;
+    *tw = ts->tw;
+    *th = ts->th;
+
+    return(0);
+}
+
 int tilemap_set_tilemap_attr_flags(LayerList *ll,
                                    unsigned int index,
                                    unsigned int x,
@@ -751,12 +789,12 @@ int tilemap_set_tilemap_attr_colormod(LayerList *ll,
     return(0);
 }
 
-int tilemap_update_tilemap(LayerList *ll,
-                           unsigned int index,
-                           unsigned int x,
-                           unsigned int y,
-                           unsigned int w,
-                           unsigned int h) {
+static int update_tilemap(LayerList *ll,
+                          unsigned int index,
+                          unsigned int x,
+                          unsigned int y,
+                          unsigned int w,
+                          unsigned int h) {
     unsigned int i, j;
     SDL_Rect dest, src, finaldest;
     unsigned int attr;
@@ -939,6 +977,22 @@ int tilemap_update_tilemap(LayerList *ll,
     return(0);
 }
 
+int tilemap_update_tilemap(LayerList *ll,
+                           unsigned int index,
+                           unsigned int x,
+                           unsigned int y,
+                           unsigned int w,
+                           unsigned int h) {
+    Uint64 start;
+    int retval;
+
+    start = SDL_GetPerformanceCounter();
+    retval = update_tilemap(ll, index, x, y, w, h);
+    ll->updateTime += SDL_GetPerformanceCounter() - start;
+
+    return(retval);
+}
+
 static void init_layer(Layer *l,
                        Tilemap *tm,
                        Tileset *ts,
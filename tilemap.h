@@ -61,6 +61,9 @@ LayerList *layerlist_new(SDL_Renderer *renderer,
                          layerlist_log_cb_t log_cb,
                          void *log_priv);
 void layerlist_free(LayerList *ll);
+/* get the performance counter ticks spent in tilemap_update_tilemap() since
+ * the last call */
+Uint64 layerlist_get_update_time(LayerList *ll);
 
 int tilemap_add_tileset(LayerList *ll,
                         void *pixels,
@@ -106,6 +109,17 @@ int tilemap_set_tilemap_attr_colormod(LayerList *ll,
                                       int h,
                                       const Uint32 *value,
                                       unsigned int size);
+/* get at a tilemap's map and flags directly, for collision.  attr_flags is
+ * NULL if none have been set, tw and th are the size of its tileset's tiles.
+ * these are only valid until the tilemap is freed. */
+int tilemap_get_tilemap_map(LayerList *ll,
+                            unsigned int index,
+                            const unsigned int **map,
+                            const unsigned int **attr_flags,
+                            unsigned int *w,
+                            unsigned int *h,
+                            unsigned int *tw,
+                            unsigned int *th);
 int tilemap_update_tilemap(LayerList *ll,
                            unsigned int index,
                            unsigned int x,
@@ -0,0 +1,375 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+
+#include "vmath.h"
+
+/* GCC vector extensions rather than intrinsics so it builds everywhere, the
+   compiler picks SSE2/NEON/whatever or splits it up if there's nothing. */
+typedef double VMathVec __attribute__((vector_size(16)));
+typedef long long VMathInt __attribute__((vector_size(16)));
+typedef unsigned long long VMathBits __attribute__((vector_size(16)));
+
+#define LANES (sizeof(VMathVec) / sizeof(double))
+
+/* adding 1.5 * 2^52 rounds to the nearest integer and leaves it in the low
+   bits of the mantissa, which is a lot cheaper than converting on hardware
+   without 64 bit integer conversions */
+#define ROUND_MAGIC (6755399441055744.0)
+#define ROUND_MAGIC_BITS (0x4338000000000000LL)
+
+/* pi/2 in 2 parts, the first with enough trailing zeros that k * PIO2_HI is
+   exact for the range handled here */
+#define INV_PIO2 (6.36619772367581382433e-01)
+#define PIO2_HI  (1.57079632673412561417e+00)
+#define PIO2_LO  (6.07710050650619224932e-11)
+/* past this the 2 part reduction loses precision, let libm deal with it */
+#define SINCOS_MAX (823550.0)
+
+/* sin and cos kernels on [-pi/4, pi/4], from fdlibm */
+#define S1 (-1.66666666666666324348e-01)
+#define S2 ( 8.33333333332248946124e-03)
+#define S3 (-1.98412698298579493134e-04)
+#define S4 ( 2.75573137070700676789e-06)
+#define S5 (-2.50507602534068634195e-08)
+#define S6 ( 1.58969099521155010221e-10)
+#define C1 ( 4.16666666666666019037e-02)
+#define C2 (-1.38888888888741095749e-03)
+#define C3 ( 2.48015872894767294178e-05)
+#define C4 (-2.75573143513906633035e-07)
+#define C5 ( 2.08757232129817482790e-09)
+#define C6 (-1.13596475577881948265e-11)
+
+#define INV_LN2 (1.44269504088896338700e+00)
+#define LN2_HI  (6.93147180369123816490e-01)
+#define LN2_LO  (1.90821492927058770002e-10)
+/* exp() of anything outside of this is either denormal or overflows */
+#define EXP_MIN (-708.0)
+#define EXP_MAX (709.0)
+
+/* log kernel, from fdlibm */
+#define LG1 (6.666666666666735130e-01)
+#define LG2 (3.999999999940941908e-01)
+#define LG3 (2.857142874366239149e-01)
+#define LG4 (2.222219843214978396e-01)
+#define LG5 (1.818357216161805012e-01)
+#define LG6 (1.531383769920937332e-01)
+#define LG7 (1.479819860511658591e-01)
+#define SQRT2 (1.41421356237309514547e+00)
+
+#define MANTISSA_MASK (0x000fffffffffffffLL)
+#define EXPONENT_ONE  (0x3ff0000000000000LL)
+
+typedef VMathVec (*VMathFunc)(VMathVec x, double arg);
+
+static int all_set(VMathInt mask) {
+    unsigned int i;
+
+    for(i = 0; i < LANES; i++) {
+        if(!mask[i]) {
+            return(0);
+        }
+    }
+
+    return(1);
+}
+
+/* lanes from a where mask is set, b elsewhere */
+static VMathVec select_vec(VMathInt mask, VMathVec a, VMathVec b) {
+    return((VMathVec)(((VMathInt)a & mask) | ((VMathInt)b & ~mask)));
+}
+
+/* lanes from x where mask is set, 0.0 elsewhere.  keeps anything out of range
+   from reaching the integer conversions. */
+static VMathVec mask_vec(VMathInt mask, VMathVec x) {
+    return((VMathVec)((VMathInt)x & mask));
+}
+
+static VMathVec v_sincos(VMathVec x, long long quadrant) {
+    VMathInt in = (x >= -SINCOS_MAX) & (x <= SINCOS_MAX);
+    VMathVec xc = mask_vec(in, x);
+    VMathVec k, r, z, s, c;
+    VMathInt n, odd, ret;
+
+    k = xc * INV_PIO2 + ROUND_MAGIC;
+    n = (VMathInt)k - ROUND_MAGIC_BITS + quadrant;
+    k -= ROUND_MAGIC;
+    r = xc - k * PIO2_HI;
+    r -= k * PIO2_LO;
+
+    z = r * r;
+    s = r + r * z * (S1 + z * (S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)))));
+    c = 1.0 - 0.5 * z +
+        z * z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+
+    /* quadrant 0: sin, 1: cos, 2: -sin, 3: -cos */
+    odd = -(n & 1);
+    ret = ((VMathInt)c & odd) | ((VMathInt)s & ~odd);
+    ret ^= -((n >> 1) & 1) & LLONG_MIN;
+
+    return((VMathVec)ret);
+}
+
+static VMathVec v_sin(VMathVec x, double arg) {
+    VMathVec ret = v_sincos(x, 0);
+    unsigned int i;
+
+    /* the kernel gives +0 for -0 */
+    ret = select_vec(x == 0.0, x, ret);
+
+    if(all_set((x >= -SINCOS_MAX) & (x <= SINCOS_MAX))) {
+        return(ret);
+    }
+
+    for(i = 0; i < LANES; i++) {
+        if(!(x[i] >= -SINCOS_MAX && x[i] <= SINCOS_MAX)) {
+            ret[i] = sin(x[i]);
+        }
+    }
+
+    return(ret);
+}
+
+static VMathVec v_cos(VMathVec x, double arg) {
+    /* cos(x) = sin(x + pi/2) */
+    VMathVec ret = v_sincos(x, 1);
+    unsigned int i;
+
+    if(all_set((x >= -SINCOS_MAX) & (x <= SINCOS_MAX))) {
+        return(ret);
+    }
+
+    for(i = 0; i < LANES; i++) {
+        if(!(x[i] >= -SINCOS_MAX && x[i] <= SINCOS_MAX)) {
+            ret[i] = cos(x[i]);
+        }
+    }
+
+    return(ret);
+}
+
+static VMathVec v_sqrt(VMathVec x, double arg) {
+    unsigned int i;
+
+    /* just a single instruction most places, nothing to approximate */
+    for(i = 0; i < LANES; i++) {
+        x[i] = sqrt(x[i]);
+    }
+
+    return(x);
+}
+
+static VMathVec v_exp(VMathVec x, double arg) {
+    VMathInt in = (x >= EXP_MIN) & (x <= EXP_MAX);
+    VMathVec xc = mask_vec(in, x);
+    VMathVec k, r, p;
+    VMathInt n;
+    unsigned int i;
+
+    /* x = k * ln2 + r, exp(x) = 2^k * exp(r) */
+    k = xc * INV_LN2 + ROUND_MAGIC;
+    n = (VMathInt)k - ROUND_MAGIC_BITS;
+    k -= ROUND_MAGIC;
+    r = xc - k * LN2_HI;
+    r -= k * LN2_LO;
+
+    /* |r| <= ln2/2, taylor series out to r^13 is enough for full precision */
+    p = r * (1.0 / 6227020800.0) + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+
+    p *= (VMathVec)((n + 1023) << 52);
+
+    if(all_set(in)) {
+        return(p);
+    }
+
+    for(i = 0; i < LANES; i++) {
+        if(!in[i]) {
+            p[i] = exp(x[i]);
+        }
+    }
+
+    return(p);
+}
+
+static VMathVec v_log(VMathVec x, double arg) {
+    VMathInt in = (x >= DBL_MIN) & (x <= DBL_MAX);
+    VMathVec xc = select_vec(in, x, (VMathVec){1.0, 1.0});
+    VMathInt bits = (VMathInt)xc;
+    VMathInt e, big;
+    VMathVec m, f, s, z, w, t1, t2, hfsq, k;
+    unsigned int i;
+
+    /* x = 2^e * m, m in [sqrt(2)/2, sqrt(2)).  x is positive so the shift
+       doesn't need to care about the sign. */
+    e = (VMathInt)((VMathBits)bits >> 52) - 1023;
+    m = (VMathVec)((bits & MANTISSA_MASK) | EXPONENT_ONE);
+    big = m > SQRT2;
+    m = select_vec(big, m * 0.5, m);
+    e -= big;
+    k = (VMathVec)(e + ROUND_MAGIC_BITS) - ROUND_MAGIC;
+
+    f = m - 1.0;
+    s = f / (2.0 + f);
+    z = s * s;
+    w = z * z;
+    t1 = w * (LG2 + w * (LG4 + w * LG6));
+    t2 = z * (LG1 + w * (LG3 + w * (LG5 + w * LG7)));
+    hfsq = 0.5 * f * f;
+    m = k * LN2_HI - ((hfsq - (s * (hfsq + t1 + t2) + k * LN2_LO)) - f);
+
+    if(all_set(in)) {
+        return(m);
+    }
+
+    for(i = 0; i < LANES; i++) {
+        if(!in[i]) {
+            m[i] = log(x[i]);
+        }
+    }
+
+    return(m);
+}
+
+static VMathVec v_pow(VMathVec x, double y) {
+    unsigned int i;
+
+    /* exp(y * log(x)) loses about |y * log(x)| ulp, and keeping the extra
+       precision to avoid that ends up slower than libm's pow */
+    for(i = 0; i < LANES; i++) {
+        x[i] = pow(x[i], y);
+    }
+
+    return(x);
+}
+
+static void apply(double *buf, unsigned int count, VMathFunc func, double arg) {
+    VMathVec x;
+    unsigned int i;
+
+    /* buffers come from the VM so they can't be assumed to be aligned */
+    for(i = 0; i + LANES <= count; i += LANES) {
+        memcpy(&x, &(buf[i]), sizeof(VMathVec));
+        x = func(x, arg);
+        memcpy(&(buf[i]), &x, sizeof(VMathVec));
+    }
+
+    if(i < count) {
+        /* pad the last one out with something harmless */
+        x = (VMathVec){1.0, 1.0};
+        memcpy(&x, &(buf[i]), sizeof(double) * (count - i));
+        x = func(x, arg);
+        memcpy(&(buf[i]), &x, sizeof(double) * (count - i));
+    }
+}
+
+void vmath_sin(double *buf, unsigned int count) {
+    apply(buf, count, v_sin, 0.0);
+}
+
+void vmath_cos(double *buf, unsigned int count) {
+    apply(buf, count, v_cos, 0.0);
+}
+
+void vmath_sqrt(double *buf, unsigned int count) {
+    apply(buf, count, v_sqrt, 0.0);
+}
+
+void vmath_exp(double *buf, unsigned int count) {
+    apply(buf, count, v_exp, 0.0);
+}
+
+void vmath_log(double *buf, unsigned int count) {
+    apply(buf, count, v_log, 0.0);
+}
+
+void vmath_pow(double *buf, unsigned int count, double exponent) {
+    apply(buf, count, v_pow, exponent);
+}
+
+void vmath_lerp(double *buf, unsigned int count, double start, double end) {
+    double diff = end - start;
+    VMathVec x;
+    unsigned int i;
+
+    for(i = 0; i + LANES <= count; i += LANES) {
+        memcpy(&x, &(buf[i]), sizeof(VMathVec));
+        x = start + diff * x;
+        memcpy(&(buf[i]), &x, sizeof(VMathVec));
+    }
+
+    for(; i < count; i++) {
+        buf[i] = start + diff * buf[i];
+    }
+}
+
+void vmath_curve(double *buf, unsigned int count,
+                 double start, double end, double power) {
+    double diff = end - start;
+    double step;
+    VMathVec t;
+    unsigned int i;
+
+    if(count == 0) {
+        return;
+    } else if(count == 1) {
+        buf[0] = end;
+        return;
+    }
+
+    step = 1.0 / (double)(count - 1);
+    for(i = 0; i < count; i += LANES) {
+        t = ((VMathVec){0.0, 1.0} + (double)i) * step;
+        /* going down, run the curve backwards from the end so it's always
+           slowest near the lower value */
+        if(diff < 0.0) {
+            t = 1.0 - t;
+        }
+        if(power != 1.0) {
+            t = v_pow(t, power);
+        }
+        if(diff < 0.0) {
+            t = end - diff * t;
+        } else {
+            t = start + diff * t;
+        }
+
+        if(i + LANES <= count) {
+            memcpy(&(buf[i]), &t, sizeof(VMathVec));
+        } else {
+            memcpy(&(buf[i]), &t, sizeof(double) * (count - i));
+        }
+    }
+}
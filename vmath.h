@@ -0,0 +1,41 @@
+/*
+ * Copyright 2020 paulguy <paulguy119@gmail.com>
+ *
+ * This file is part of crustygame.
+ *
+ * crustygame is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * crustygame is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crustygame.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _VMATH_H
+#define _VMATH_H
+
+/* array math, done a vector at a time.  sin, cos, exp and log are within 2 ulp
+   of libm, pow and sqrt are libm's.  anything outside of the range the
+   approximations handle falls back to libm for that element. */
+
+void vmath_sin(double *buf, unsigned int count);
+void vmath_cos(double *buf, unsigned int count);
+void vmath_sqrt(double *buf, unsigned int count);
+void vmath_exp(double *buf, unsigned int count);
+void vmath_log(double *buf, unsigned int count);
+void vmath_pow(double *buf, unsigned int count, double exponent);
+/* buf = start + (end - start) * buf */
+void vmath_lerp(double *buf, unsigned int count, double start, double end);
+/* fill buf with count points from start to end, following t^power, same as
+   paramgen.py's curves so the change is always slowest near the lower value */
+void vmath_curve(double *buf, unsigned int count,
+                 double start, double end, double power);
+
+#endif